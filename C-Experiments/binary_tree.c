@@ -1,4 +1,12 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef MAP_BENCH
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#endif
 /**
  * @brief Node structure representing a single node in a binary tree.
  *
@@ -6,11 +14,27 @@
  */
 typedef struct Node {
     int data;           /**< Data stored at this node. */
+    unsigned priority;  /**< Heap priority in a bst_t treap; unused by hand-wired trees. */
     struct Node *left;  /**< Pointer to the left child of this node. */
     struct Node *right; /**< Pointer to the right child of this node. */
 } Node;
 
+#ifdef MAP_BENCH
+#ifndef MAP_BENCH_MIN_N
+#define MAP_BENCH_MIN_N 1000
+#endif
+#ifndef MAP_BENCH_MAX_N
+#define MAP_BENCH_MAX_N 1000000
+#endif
+#endif
+
+#ifndef MAX_NUM_NODES
+#ifdef MAP_BENCH
+#define MAX_NUM_NODES (2 * MAP_BENCH_MAX_N) /* the benchmark's keys are [0, 2n) */
+#else
 #define MAX_NUM_NODES 7
+#endif
+#endif
 Node nodes[MAX_NUM_NODES];
 int count = 0;
 /**
@@ -29,6 +53,7 @@ Node *NewNode(int data)
         Node *temp = &nodes[count++]; // Allocate memory for new node
 
         temp->data = data;  // Assign given data to the node's data field
+        temp->priority = 0;
         temp->left = NULL;  // Set left and right children to NULL
         temp->right = NULL; // Set left and right children to NULL
         return temp;
@@ -61,6 +86,854 @@ Node *search(Node *root, int key)
         return search(root->left, key);
 }
 
+/**
+ * @brief Inserts a key into the binary search tree without rebalancing.
+ *
+ * Walks down iteratively, so a degenerate (sorted-input) tree cannot
+ * overflow the stack.
+ *
+ * @param[in,out] root Address of the root pointer; set when the tree is empty.
+ * @param[in] key The integer value to insert.
+ *
+ * @return 1 if inserted, 0 if the key was already present, -1 if the node pool is full.
+ */
+int insert(Node **root, int key)
+{
+    Node **link = root;
+    while (*link != NULL) // Descend to the empty link where key belongs
+    {
+        if ((*link)->data == key)
+            return 0;
+        link = ((*link)->data < key) ? &(*link)->right : &(*link)->left;
+    }
+    *link = NewNode(key);
+    return *link != NULL ? 1 : -1;
+}
+
+/* ---- balanced trees: treap over a growable per-tree node pool ---- */
+
+#ifndef BST_POOL_FIRST
+#define BST_POOL_FIRST 64 /* nodes in a tree's first pool chunk; each later chunk doubles */
+#endif
+
+/**
+ * @brief One block of pool nodes; a tree's chunks form a list, newest first.
+ */
+typedef struct BstChunk {
+    struct BstChunk *next; /**< Previously allocated chunk. */
+    size_t cap;            /**< Nodes in this chunk. */
+    size_t used;           /**< Nodes handed out so far. */
+    Node nodes[];          /**< The nodes themselves. */
+} BstChunk;
+
+/**
+ * @brief A balanced binary search tree of distinct ints (a treap).
+ *
+ * Keys are in search-tree order and random priorities in heap order, which
+ * keeps the expected depth O(log n) whatever the insertion order. The root
+ * is an ordinary Node tree, so search() and inOrder() work on it too. Every
+ * tree owns its nodes, so any number of trees can live side by side.
+ */
+typedef struct {
+    Node *root;       /**< Root of the tree, NULL when empty. */
+    size_t size;      /**< Number of keys stored. */
+    Node *free;       /**< Deleted nodes for reuse, linked through left. */
+    BstChunk *chunks; /**< Pool chunks, newest first. */
+    size_t grows;     /**< Chunks ever added (pool malloc calls). */
+    uint64_t rng;     /**< xorshift64 state for priorities. */
+} bst_t;
+
+/**
+ * @brief Initializes an empty tree; no memory is allocated until the first insert.
+ *
+ * @param[out] t The tree to initialize.
+ */
+void bst_init(bst_t *t)
+{
+    t->root = NULL;
+    t->size = 0;
+    t->free = NULL;
+    t->chunks = NULL;
+    t->grows = 0;
+    t->rng = 0x9E3779B97F4A7C15ull;
+}
+
+/**
+ * @brief Frees every node of the tree and leaves it empty and reusable.
+ *
+ * @param[in,out] t The tree to destroy.
+ */
+void bst_destroy(bst_t *t)
+{
+    BstChunk *c = t->chunks;
+    while (c != NULL)
+    {
+        BstChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    t->root = NULL;
+    t->size = 0;
+    t->free = NULL;
+    t->chunks = NULL;
+}
+
+/**
+ * @brief Takes a node from the tree's pool, adding a chunk twice the size of the last when it is used up.
+ *
+ * @return The node, or NULL if malloc failed.
+ */
+static Node *bst_alloc(bst_t *t)
+{
+    Node *n = t->free;
+    if (n != NULL)
+    {
+        t->free = n->left;
+        return n;
+    }
+    BstChunk *c = t->chunks;
+    if (c == NULL || c->used == c->cap)
+    {
+        size_t cap = c != NULL ? 2 * c->cap : BST_POOL_FIRST;
+        BstChunk *fresh = malloc(sizeof(BstChunk) + cap * sizeof(Node));
+        if (fresh == NULL)
+            return NULL;
+        fresh->next = c;
+        fresh->cap = cap;
+        fresh->used = 0;
+        t->chunks = c = fresh;
+        t->grows++;
+    }
+    return &c->nodes[c->used++];
+}
+
+/**
+ * @brief Splits a treap into the keys below key and the keys above it (key itself must be absent).
+ *
+ * @param[in] node Root of the treap to split.
+ * @param[in] key The split point.
+ * @param[out] lo Receives the treap of keys < key.
+ * @param[out] hi Receives the treap of keys > key.
+ */
+static void bst_split(Node *node, int key, Node **lo, Node **hi)
+{
+    while (node != NULL) // Peel the search path into the two sides
+    {
+        if (node->data < key)
+        {
+            *lo = node;
+            lo = &node->right;
+            node = node->right;
+        }
+        else
+        {
+            *hi = node;
+            hi = &node->left;
+            node = node->left;
+        }
+    }
+    *lo = NULL;
+    *hi = NULL;
+}
+
+/**
+ * @brief Joins two treaps where every key of a is below every key of b.
+ *
+ * @return Root of the joined treap.
+ */
+static Node *bst_merge(Node *a, Node *b)
+{
+    Node *root = NULL;
+    Node **link = &root;
+    while (a != NULL && b != NULL) // The higher priority becomes the parent
+    {
+        if (a->priority > b->priority)
+        {
+            *link = a;
+            link = &a->right;
+            a = a->right;
+        }
+        else
+        {
+            *link = b;
+            link = &b->left;
+            b = b->left;
+        }
+    }
+    *link = a != NULL ? a : b;
+    return root;
+}
+
+/**
+ * @brief Finds a key in a balanced tree.
+ *
+ * @param[in] t The tree to search.
+ * @param[in] key The integer value to find.
+ *
+ * @return The node holding key, or NULL if it is absent.
+ */
+Node *bst_search(const bst_t *t, int key)
+{
+    Node *node = t->root;
+    while (node != NULL && node->data != key)
+        node = node->data < key ? node->right : node->left;
+    return node;
+}
+
+/**
+ * @brief Inserts a key into a balanced tree.
+ *
+ * The new node goes where its random priority puts it on the key's search
+ * path, and the subtree it displaces is split around the key.
+ *
+ * @param[in,out] t The tree to insert into.
+ * @param[in] key The integer value to insert.
+ *
+ * @return 1 if inserted, 0 if the key was already present, -1 if no node could be allocated.
+ */
+int bst_insert(bst_t *t, int key)
+{
+    if (bst_search(t, key) != NULL)
+        return 0;
+    Node *n = bst_alloc(t);
+    if (n == NULL)
+        return -1;
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    n->data = key;
+    n->priority = (unsigned)(t->rng >> 32);
+
+    Node **link = &t->root;
+    while (*link != NULL && (*link)->priority >= n->priority)
+        link = (*link)->data < key ? &(*link)->right : &(*link)->left;
+    bst_split(*link, key, &n->left, &n->right);
+    *link = n;
+    t->size++;
+    return 1;
+}
+
+/**
+ * @brief Deletes a key from a balanced tree; its node goes back to the tree's pool.
+ *
+ * @param[in,out] t The tree to delete from.
+ * @param[in] key The integer value to delete.
+ *
+ * @return 1 if deleted, 0 if the key was not present.
+ */
+int bst_delete(bst_t *t, int key)
+{
+    Node **link = &t->root;
+    while (*link != NULL && (*link)->data != key)
+        link = (*link)->data < key ? &(*link)->right : &(*link)->left;
+    Node *n = *link;
+    if (n == NULL)
+        return 0;
+    *link = bst_merge(n->left, n->right);
+    n->left = t->free;
+    t->free = n;
+    t->size--;
+    return 1;
+}
+
+/**
+ * @brief Returns the number of keys in a balanced tree.
+ */
+size_t bst_size(const bst_t *t) { return t->size; }
+
+/* ---- iterative kernels: search, in-order visitors, Eytzinger snapshot ---- */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BST_PREFETCH(p) ((void)(p))
+#endif
+
+#ifndef BST_STACK_LOCAL
+#define BST_STACK_LOCAL 64 /* in_order_iter's stack lives in its frame up to this depth, then on the heap */
+#endif
+
+/**
+ * @brief Visitor for the in-order kernels: called once per node, in ascending key order.
+ *
+ * It must not change the tree; in_order_morris relinks nodes while it runs.
+ */
+typedef void (*visit_fn)(int data, void *ctx);
+
+/**
+ * @brief Iterative search: same result as search() without a call per level.
+ *
+ * @param[in] root Root of the tree to search.
+ * @param[in] key The integer value to find.
+ *
+ * @return The node holding key, or NULL if it is absent.
+ */
+Node *search_iter(Node *root, int key)
+{
+    while (root != NULL && root->data != key)
+        root = root->data < key ? root->right : root->left;
+    return root;
+}
+
+/**
+ * @brief In-order traversal with an explicit stack, so depth costs memory rather than call frames.
+ *
+ * @param[in] root Root of the tree to walk.
+ * @param[in] fn Visitor called for each node.
+ * @param[in] ctx Passed through to fn.
+ *
+ * @return Number of nodes visited, or (size_t)-1 if a tree deeper than BST_STACK_LOCAL could not get a heap stack.
+ */
+size_t in_order_iter(Node *root, visit_fn fn, void *ctx)
+{
+    Node *local[BST_STACK_LOCAL];
+    Node **stack = local;
+    size_t cap = BST_STACK_LOCAL, depth = 0, seen = 0;
+    Node *node = root;
+    while (node != NULL || depth > 0)
+    {
+        while (node != NULL) // Push the left spine
+        {
+            if (depth == cap)
+            {
+                size_t bytes = 2 * cap * sizeof(Node *);
+                Node **grown = stack == local ? malloc(bytes) : realloc(stack, bytes);
+                if (grown == NULL)
+                {
+                    if (stack != local)
+                        free(stack);
+                    return (size_t)-1;
+                }
+                if (stack == local)
+                    memcpy(grown, local, sizeof(local));
+                stack = grown;
+                cap *= 2;
+            }
+            stack[depth++] = node;
+            node = node->left;
+        }
+        node = stack[--depth];
+        fn(node->data, ctx);
+        seen++;
+        node = node->right;
+    }
+    if (stack != local)
+        free(stack);
+    return seen;
+}
+
+/**
+ * @brief Morris in-order traversal: O(1) extra memory at any depth.
+ *
+ * Each left subtree's rightmost node is threaded back to its ancestor on
+ * the way down and unthreaded on the way back, so the tree is restored
+ * when the call returns (but must not be read by others meanwhile).
+ *
+ * @param[in,out] root Root of the tree to walk.
+ * @param[in] fn Visitor called for each node.
+ * @param[in] ctx Passed through to fn.
+ *
+ * @return Number of nodes visited.
+ */
+size_t in_order_morris(Node *root, visit_fn fn, void *ctx)
+{
+    size_t seen = 0;
+    Node *node = root;
+    while (node != NULL)
+    {
+        if (node->left == NULL)
+        {
+            fn(node->data, ctx);
+            seen++;
+            node = node->right;
+            continue;
+        }
+        Node *pred = node->left; // Rightmost node of the left subtree
+        while (pred->right != NULL && pred->right != node)
+            pred = pred->right;
+        if (pred->right == NULL) // First visit: thread and go left
+        {
+            pred->right = node;
+            node = node->left;
+        }
+        else // Back from the left subtree: unthread and visit
+        {
+            pred->right = NULL;
+            fn(node->data, ctx);
+            seen++;
+            node = node->right;
+        }
+    }
+    return seen;
+}
+
+/**
+ * @brief Output buffer state for in_order_fill.
+ */
+typedef struct {
+    int *out;
+    size_t cap, n;
+} FillCtx;
+
+/**
+ * @brief Visitor that appends to a FillCtx while it has room.
+ */
+static void fill_visit(int data, void *ctx)
+{
+    FillCtx *f = ctx;
+    if (f->n < f->cap)
+        f->out[f->n] = data;
+    f->n++;
+}
+
+/**
+ * @brief Copies the keys in ascending order into out (Morris walk, no I/O, no allocation).
+ *
+ * @param[in,out] root Root of the tree to walk.
+ * @param[out] out Receives the first cap keys; may be NULL when cap is 0.
+ * @param[in] cap Room in out.
+ *
+ * @return Number of nodes in the tree (more than cap means out was truncated).
+ */
+size_t in_order_fill(Node *root, int *out, size_t cap)
+{
+    FillCtx f = {out, cap, 0};
+    in_order_morris(root, fill_visit, &f);
+    return f.n;
+}
+
+/**
+ * @brief Read-only copy of a tree's keys in Eytzinger (BFS) order for branchless search.
+ *
+ * keys[1] is the root, the children of keys[i] are keys[2i] and keys[2i+1];
+ * keys[0] is unused. A search touches one cache line per four levels once
+ * the prefetches are in flight.
+ */
+typedef struct {
+    int *keys; /**< n + 1 ints, NULL when n == 0. */
+    size_t n;  /**< Number of keys. */
+} EytSnapshot;
+
+/**
+ * @brief Eytzinger index of the first key in order (leftmost), 0 if n == 0.
+ */
+static size_t eyt_first(size_t n)
+{
+    size_t i = n ? 1 : 0;
+    while (i && 2 * i <= n)
+        i *= 2;
+    return i;
+}
+
+/**
+ * @brief Eytzinger index of the in-order successor of i, 0 past the last.
+ */
+static size_t eyt_next(size_t i, size_t n)
+{
+    if (2 * i + 1 <= n)
+    {
+        i = 2 * i + 1;
+        while (2 * i <= n)
+            i *= 2;
+        return i;
+    }
+    while (i & 1) // Climb while i is a right child
+        i >>= 1;
+    return i >> 1;
+}
+
+/**
+ * @brief Visitor that stores keys at successive Eytzinger positions.
+ */
+typedef struct {
+    int *keys;
+    size_t i, n;
+} EytCtx;
+
+static void eyt_visit(int data, void *ctx)
+{
+    EytCtx *e = ctx;
+    e->keys[e->i] = data;
+    e->i = eyt_next(e->i, e->n);
+}
+
+/**
+ * @brief Builds an Eytzinger snapshot of a search tree; the tree is not referenced afterwards.
+ *
+ * @param[out] e The snapshot to fill; release it with eyt_free.
+ * @param[in,out] root Root of the tree (walked twice with in_order_morris).
+ *
+ * @return 0 on success, -1 if the key array could not be allocated.
+ */
+int eyt_build(EytSnapshot *e, Node *root)
+{
+    e->n = in_order_fill(root, NULL, 0);
+    e->keys = NULL;
+    if (e->n == 0)
+        return 0;
+    e->keys = malloc((e->n + 1) * sizeof(int));
+    if (e->keys == NULL)
+    {
+        e->n = 0;
+        return -1;
+    }
+    e->keys[0] = 0;
+    EytCtx c = {e->keys, eyt_first(e->n), e->n};
+    in_order_morris(root, eyt_visit, &c);
+    return 0;
+}
+
+/**
+ * @brief Frees a snapshot's keys and leaves it empty.
+ */
+void eyt_free(EytSnapshot *e)
+{
+    free(e->keys);
+    e->keys = NULL;
+    e->n = 0;
+}
+
+/**
+ * @brief Branchless search of an Eytzinger snapshot.
+ *
+ * The descent is i = 2i + (keys[i] < key) for every level, with no
+ * data-dependent branch to mispredict; afterwards the trailing right turns
+ * are shifted off, which leaves the first key >= key.
+ *
+ * @param[in] e The snapshot to search.
+ * @param[in] key The integer value to find.
+ *
+ * @return Pointer to the matching key in the snapshot, or NULL if it is absent.
+ */
+const int *eyt_search(const EytSnapshot *e, int key)
+{
+    const int *keys = e->keys;
+    size_t n = e->n, i = 1;
+    while (i <= n)
+    {
+        BST_PREFETCH(keys + (16 * i <= n ? 16 * i : 0)); // Four levels down: 16 ints, one cache line
+        i = 2 * i + (keys[i] < key);
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    i >>= __builtin_ctzll(~(unsigned long long)i) + 1;
+#else
+    while (i & 1)
+        i >>= 1;
+    i >>= 1;
+#endif
+    return i != 0 && keys[i] == key ? &keys[i] : NULL;
+}
+
+#ifdef MAP_BENCH
+/* ---- workload suite: same workloads and CSV columns as the map benchmarks ---- */
+
+#ifndef MAP_BENCH_MIN_OPS
+#define MAP_BENCH_MIN_OPS 1000000 /* lookup/mixed/iterate rows repeat to at least this */
+#endif
+#define MAP_BENCH_SEED 0x2545F4914F6CDD1Dull
+#define MAP_BENCH_ZIPF_THETA 0.99
+#define BST_BENCH_SEQ_MAX 16384 /* sorted inserts are O(n^2) here: larger n skip that row */
+
+/**
+ * @brief Advances a xorshift64 state and returns it.
+ */
+static uint64_t bench_rand(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/**
+ * @brief Zipf(theta) sampler over ranks [0, n), rank 0 the most popular (Gray et al.).
+ */
+typedef struct
+{
+    size_t n;
+    double zetan, alpha, eta, half_pow;
+} bench_zipf_t;
+
+/**
+ * @brief Precomputes the Zipf constants for n ranks.
+ */
+static void bench_zipf_init(bench_zipf_t *z, size_t n)
+{
+    double zetan = 0.0;
+    for (size_t i = 1; i <= n; ++i)
+        zetan += pow((double)i, -MAP_BENCH_ZIPF_THETA);
+    z->n = n;
+    z->zetan = zetan;
+    z->half_pow = pow(0.5, MAP_BENCH_ZIPF_THETA);
+    z->alpha = 1.0 / (1.0 - MAP_BENCH_ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - MAP_BENCH_ZIPF_THETA)) / (1.0 - (1.0 + z->half_pow) / zetan);
+}
+
+/**
+ * @brief Draws one Zipf-distributed rank.
+ */
+static size_t bench_zipf_next(const bench_zipf_t *z, uint64_t *x)
+{
+    double u = (double)(bench_rand(x) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + z->half_pow)
+        return 1;
+    size_t r = (size_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+/**
+ * @brief Writes one CSV row; allocs counts pool chunks added by the workload (0 for the static pool).
+ */
+static void bench_row(FILE *out, const char *impl, const char *workload, size_t n, size_t ops, clock_t t0,
+                      size_t allocs)
+{
+    struct rusage ru;
+    double secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+    fprintf(out, "%s,%s,%zu,%.1f,%zu,%ld\n", impl, workload, n, ops ? secs * 1e9 / (double)ops : 0.0, allocs,
+            getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1L);
+}
+
+/**
+ * @brief Sums the data of every node in order (the iteration workload).
+ */
+static size_t bench_visit(Node *node, size_t *sum)
+{
+    if (node == NULL)
+        return 0;
+    size_t c = bench_visit(node->left, sum);
+    *sum += (size_t)node->data;
+    return c + 1 + bench_visit(node->right, sum);
+}
+
+/**
+ * @brief Runs every workload the BST supports at size n.
+ *
+ * The loaded set is the even keys of [0, 2n), inserted in ord order; odd
+ * keys are misses. There is no delete, so the erase-heavy row is absent
+ * and "mixed" only inserts. Resetting count frees the whole pool.
+ */
+static void bench_suite_bst(FILE *out, const int *ord, const bench_zipf_t *z, size_t n)
+{
+    uint64_t x = MAP_BENCH_SEED;
+    size_t ops = n < MAP_BENCH_MIN_OPS ? MAP_BENCH_MIN_OPS : n;
+    size_t sum = 0;
+    Node *root = NULL;
+    clock_t t0;
+
+    if (n <= BST_BENCH_SEQ_MAX)
+    {
+        count = 0;
+        t0 = clock();
+        for (size_t i = 0; i < n; ++i)
+            insert(&root, (int)(2 * i));
+        bench_row(out, "bst", "seq_insert", n, n, t0, 0);
+    }
+
+    count = 0;
+    root = NULL;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        insert(&root, ord[i]);
+    bench_row(out, "bst", "rand_insert", n, n, t0, 0);
+
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sum += search(root, (int)(2 * (bench_rand(&x) % n))) == NULL;
+    bench_row(out, "bst", "find_hit", n, ops, t0, 0);
+
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sum += search(root, (int)(2 * (bench_rand(&x) % n) + 1)) == NULL;
+    bench_row(out, "bst", "find_miss", n, ops, t0, 0);
+
+    t0 = clock();
+    size_t seen = 0;
+    while (seen < ops)
+        seen += bench_visit(root, &sum);
+    bench_row(out, "bst", "iterate", n, seen, t0, 0);
+
+    /* 90% search / 10% insert over [0, 2n) */
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        int k = (int)(r % (2 * n));
+        if ((r >> 40) % 10 == 0)
+            insert(&root, k);
+        else
+            sum += search(root, k) == NULL;
+    }
+    bench_row(out, "bst", "mixed", n, ops, t0, 0);
+
+    /* n insert attempts of Zipf-popular keys; repeats are rejected */
+    count = 0;
+    root = NULL;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        insert(&root, ord[bench_zipf_next(z, &x)]);
+    bench_row(out, "bst", "zipf_insert", n, n, t0, 0);
+    if (sum == 1) // Keeps the lookups from being optimised away
+        putchar('\n');
+}
+
+/**
+ * @brief Visitor for the treap's iteration workload: adds data to *(size_t *)ctx.
+ */
+static void bench_sum_visit(int data, void *ctx) { *(size_t *)ctx += (size_t)data; }
+
+/**
+ * @brief Runs every workload against the balanced tree at size n.
+ *
+ * Same key sets as bench_suite_bst, plus the erase-heavy row that the
+ * plain BST cannot run.
+ */
+static void bench_suite_treap(FILE *out, const int *ord, const bench_zipf_t *z, size_t n)
+{
+    uint64_t x = MAP_BENCH_SEED;
+    size_t ops = n < MAP_BENCH_MIN_OPS ? MAP_BENCH_MIN_OPS : n;
+    size_t sum = 0, g0;
+    bst_t t;
+    clock_t t0;
+
+    bst_init(&t);
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        bst_insert(&t, (int)(2 * i));
+    bench_row(out, "bst_treap", "seq_insert", n, n, t0, t.grows - g0);
+    bst_destroy(&t);
+
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        bst_insert(&t, ord[i]);
+    bench_row(out, "bst_treap", "rand_insert", n, n, t0, t.grows - g0);
+
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sum += bst_search(&t, (int)(2 * (bench_rand(&x) % n))) == NULL;
+    bench_row(out, "bst_treap", "find_hit", n, ops, t0, t.grows - g0);
+
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sum += bst_search(&t, (int)(2 * (bench_rand(&x) % n) + 1)) == NULL;
+    bench_row(out, "bst_treap", "find_miss", n, ops, t0, t.grows - g0);
+
+    g0 = t.grows;
+    t0 = clock();
+    size_t seen = 0;
+    while (seen < ops)
+        seen += in_order_iter(t.root, bench_sum_visit, &sum);
+    bench_row(out, "bst_treap", "iterate", n, seen, t0, t.grows - g0);
+
+    /* read-mostly path: Eytzinger snapshot of the loaded treap */
+    EytSnapshot snap;
+    t0 = clock();
+    if (eyt_build(&snap, t.root) == 0)
+    {
+        bench_row(out, "bst_eyt", "snapshot", n, n, t0, 1);
+        t0 = clock();
+        for (size_t i = 0; i < ops; ++i)
+            sum += eyt_search(&snap, (int)(2 * (bench_rand(&x) % n))) == NULL;
+        bench_row(out, "bst_eyt", "find_hit", n, ops, t0, 0);
+        t0 = clock();
+        for (size_t i = 0; i < ops; ++i)
+            sum += eyt_search(&snap, (int)(2 * (bench_rand(&x) % n) + 1)) == NULL;
+        bench_row(out, "bst_eyt", "find_miss", n, ops, t0, 0);
+        eyt_free(&snap);
+    }
+    t0 = clock();
+    seen = 0;
+    while (seen < ops)
+        seen += in_order_morris(t.root, bench_sum_visit, &sum);
+    bench_row(out, "bst_treap", "iterate_morris", n, seen, t0, 0);
+
+    /* 90% search / 10% insert over [0, 2n) */
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        int k = (int)(r % (2 * n));
+        if ((r >> 40) % 10 == 0)
+            bst_insert(&t, k);
+        else
+            sum += bst_search(&t, k) == NULL;
+    }
+    bench_row(out, "bst_treap", "mixed", n, ops, t0, t.grows - g0);
+
+    /* 75% delete / 25% insert over [0, 2n) */
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        int k = (int)(r % (2 * n));
+        if ((r >> 40) % 4 == 0)
+            bst_insert(&t, k);
+        else
+            bst_delete(&t, k);
+    }
+    bench_row(out, "bst_treap", "erase_heavy", n, ops, t0, t.grows - g0);
+    bst_destroy(&t);
+
+    /* n insert attempts of Zipf-popular keys; repeats are rejected */
+    g0 = t.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        bst_insert(&t, ord[bench_zipf_next(z, &x)]);
+    bench_row(out, "bst_treap", "zipf_insert", n, n, t0, t.grows - g0);
+    bst_destroy(&t);
+    if (sum == 1) // Keeps the lookups from being optimised away
+        putchar('\n');
+}
+
+/**
+ * @brief Runs the workload suite for sizes MAP_BENCH_MIN_N..MAP_BENCH_MAX_N (x10 steps).
+ *
+ * Rows are appended to $MAP_BENCH_CSV (the header only when it is empty),
+ * else written to stdout.
+ */
+static void bench_suite(void)
+{
+    const char *path = getenv("MAP_BENCH_CSV");
+    FILE *out = path ? fopen(path, "a") : stdout;
+    if (!out)
+        return;
+    if (!path || (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0))
+        fprintf(out, "impl,workload,n,ns_per_op,allocs,peak_rss_kb\n");
+    for (size_t n = MAP_BENCH_MIN_N; n <= MAP_BENCH_MAX_N; n *= 10)
+    {
+        int *ord = malloc(n * sizeof(int));
+        if (!ord)
+            break;
+        for (size_t i = 0; i < n; ++i)
+            ord[i] = (int)(2 * i);
+        uint64_t x = MAP_BENCH_SEED ^ n;
+        for (size_t i = n - 1; i > 0; --i)
+        {
+            size_t j = (size_t)(bench_rand(&x) % (i + 1));
+            int t = ord[i];
+            ord[i] = ord[j];
+            ord[j] = t;
+        }
+        bench_zipf_t z;
+        bench_zipf_init(&z, n);
+        bench_suite_bst(out, ord, &z, n);
+        bench_suite_treap(out, ord, &z, n);
+        fflush(out);
+        free(ord);
+    }
+    if (out != stdout)
+        fclose(out);
+}
+#endif
+
 int main()
 {
     Node *root = NULL; // Initialize root as NULL for an empty tree
@@ -82,5 +955,37 @@ int main()
     else
         printf("\nElement not found in the tree\n"); // Node is null meaning that key wasn't found in tree
 
+    /* the same walk without recursion or printf per node */
+    int keys[MAX_NUM_NODES];
+    size_t n = in_order_fill(root, keys, MAX_NUM_NODES);
+    EytSnapshot snap;
+    if (eyt_build(&snap, root) == 0)
+    {
+        printf("in_order_fill: %zu keys, first %d last %d; eyt_search 40: %s, 45: %s\n", n, keys[0], keys[n - 1],
+               eyt_search(&snap, 40) ? "found" : "not found", eyt_search(&snap, 45) ? "found" : "not found");
+        eyt_free(&snap);
+    }
+
+    /* two balanced trees side by side, each with its own node pool */
+    bst_t evens, odds;
+    bst_init(&evens);
+    bst_init(&odds);
+    for (int k = 1; k <= 20; ++k) // Sorted input would make a plain BST a list
+        if (bst_insert(k % 2 ? &odds : &evens, k) < 0)
+            return 1;
+    bst_delete(&evens, 10);
+    bst_delete(&odds, 7);
+    printf("Evens (%zu): ", bst_size(&evens));
+    inOrder(evens.root);
+    printf("\nOdds (%zu): ", bst_size(&odds));
+    inOrder(odds.root);
+    printf("\nbst_search 12: %s, 10: %s\n", bst_search(&evens, 12) ? "found" : "not found",
+           bst_search(&evens, 10) ? "found" : "not found");
+    bst_destroy(&evens);
+    bst_destroy(&odds);
+
+#ifdef MAP_BENCH
+    bench_suite(); // Build with -DMAP_BENCH -lm for the CSV workload suite
+#endif
     return 0;
 }
@@ -0,0 +1,582 @@
+/*
+  Compact, statically allocated map: uint32_t -> function pointer (fp_t).
+  Same API as the pointer-linked static map in map_with_function_pointers.c,
+  but with an index-based structure-of-arrays node layout:
+
+    - left/right/parent are pool indices (16-bit, or 32-bit when
+      MAX_NODES does not fit), NIL marks "no node"
+    - height and the in-use flag share one byte
+    - hot data touched by every lookup step (key + child links) lives in
+      its own array; parent/meta and the fp_t values live in cold arrays
+
+  With 16-bit links a hot entry is 8 bytes, so a 64-byte cache line holds
+  8 nodes instead of one and a third 48-byte pointer-linked node_t.
+
+  Iterators are pool indices, so map_next takes the map as well.
+
+  Compile:
+      gcc -std=c99 -O2 compact_u32map.c -o compact_u32map
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef void (*fp_t)(void);
+
+#ifndef MAX_NODES
+#define MAX_NODES 256
+#endif
+
+#if MAX_NODES < 0xFFFF
+typedef uint16_t idx_t;
+#define NIL ((idx_t)0xFFFF)
+#else
+typedef uint32_t idx_t;
+#define NIL ((idx_t)0xFFFFFFFF)
+#endif
+
+#define META_IN_USE 0x80u  /* meta bit 7: slot is in use */
+#define META_HEIGHT 0x7Fu  /* meta bits 0..6: AVL height */
+
+/* hot part of a node: everything find_node reads */
+typedef struct
+{
+    uint32_t key;
+    idx_t left, right; /* for free slots, left links the free list */
+} hot_t;
+
+/* cold part of a node: only touched by insert/erase/iteration */
+typedef struct
+{
+    idx_t parent;
+    uint8_t meta; /* in-use flag | height */
+} cold_t;
+
+typedef struct
+{
+    hot_t hot[MAX_NODES];
+    cold_t cold[MAX_NODES];
+    fp_t value[MAX_NODES];
+    size_t size;
+    idx_t root;
+    idx_t free_list;
+} u32map_t;
+
+/* helpers */
+
+/**
+ * @brief Return the height of a node index (0 if NIL).
+ *
+ * @param m Pointer to u32map_t.
+ * @param n Node index or NIL.
+ * @return int Height (>=0).
+ */
+static int node_height(const u32map_t *m, idx_t n)
+{
+    return n == NIL ? 0 : (int)(m->cold[n].meta & META_HEIGHT);
+}
+
+/**
+ * @brief Update height for a node based on its children, keeping the in-use bit.
+ *
+ * @param m Pointer to u32map_t.
+ * @param n Node index (may be NIL).
+ */
+static void update_height(u32map_t *m, idx_t n)
+{
+    if (n != NIL)
+    {
+        int hl = node_height(m, m->hot[n].left);
+        int hr = node_height(m, m->hot[n].right);
+        int h = (hl > hr ? hl : hr) + 1;
+        m->cold[n].meta = (uint8_t)((m->cold[n].meta & META_IN_USE) | (unsigned)h);
+    }
+}
+
+/* pool management (no malloc/free) */
+
+/**
+ * @brief Initialize the pool, threading every slot onto the free list.
+ *
+ * @param m Pointer to u32map_t to initialize.
+ */
+static void pool_init(u32map_t *m)
+{
+    m->size = 0;
+    m->root = NIL;
+    m->free_list = NIL;
+    for (long i = MAX_NODES - 1; i >= 0; --i)
+    {
+        m->hot[i].key = 0;
+        m->hot[i].right = NIL;
+        m->hot[i].left = m->free_list;
+        m->cold[i].parent = NIL;
+        m->cold[i].meta = 0;
+        m->value[i] = NULL;
+        m->free_list = (idx_t)i;
+    }
+}
+
+/**
+ * @brief Allocate a node index from the pool in O(1).
+ *
+ * @param m Pointer to u32map_t.
+ * @return idx_t Allocated node index or NIL if the pool is exhausted.
+ */
+static idx_t node_alloc(u32map_t *m)
+{
+    idx_t n = m->free_list;
+    if (n == NIL)
+        return NIL; /* pool exhausted */
+    m->free_list = m->hot[n].left;
+    m->hot[n].left = m->hot[n].right = NIL;
+    m->cold[n].parent = NIL;
+    m->cold[n].meta = META_IN_USE | 1u;
+    m->value[n] = NULL;
+    return n;
+}
+
+/**
+ * @brief Return a node index to the pool free list.
+ *
+ * @param m Pointer to u32map_t.
+ * @param n Node index to free.
+ */
+static void node_free(u32map_t *m, idx_t n)
+{
+    if (n == NIL)
+        return;
+    m->hot[n].right = NIL;
+    m->hot[n].left = m->free_list;
+    m->cold[n].parent = NIL;
+    m->cold[n].meta = 0;
+    m->value[n] = NULL;
+    m->free_list = n;
+}
+
+/* rotations */
+
+/**
+ * @brief Right rotation on index-linked subtree.
+ *
+ * @param m Pointer to u32map_t.
+ * @param y Root of subtree to rotate.
+ * @return idx_t New root after rotation.
+ */
+static idx_t rotate_right(u32map_t *m, idx_t y)
+{
+    idx_t x = m->hot[y].left;
+    idx_t T2 = m->hot[x].right;
+
+    m->hot[x].right = y;
+    m->hot[y].left = T2;
+
+    if (T2 != NIL)
+        m->cold[T2].parent = y;
+
+    m->cold[x].parent = m->cold[y].parent;
+    m->cold[y].parent = x;
+
+    update_height(m, y);
+    update_height(m, x);
+    return x;
+}
+
+/**
+ * @brief Left rotation on index-linked subtree.
+ *
+ * @param m Pointer to u32map_t.
+ * @param x Root of subtree to rotate.
+ * @return idx_t New root after rotation.
+ */
+static idx_t rotate_left(u32map_t *m, idx_t x)
+{
+    idx_t y = m->hot[x].right;
+    idx_t T2 = m->hot[y].left;
+
+    m->hot[y].left = x;
+    m->hot[x].right = T2;
+
+    if (T2 != NIL)
+        m->cold[T2].parent = x;
+
+    m->cold[y].parent = m->cold[x].parent;
+    m->cold[x].parent = y;
+
+    update_height(m, x);
+    update_height(m, y);
+    return y;
+}
+
+/**
+ * @brief Replace parent's child link with new_child (or set root if parent is NIL).
+ *
+ * @param m Pointer to u32map_t.
+ * @param parent Parent index (may be NIL).
+ * @param old_child Old child index to be replaced.
+ * @param new_child New child index.
+ */
+static void set_child(u32map_t *m, idx_t parent, idx_t old_child, idx_t new_child)
+{
+    if (parent == NIL)
+    {
+        m->root = new_child;
+        if (new_child != NIL)
+            m->cold[new_child].parent = NIL;
+    }
+    else
+    {
+        if (m->hot[parent].left == old_child)
+            m->hot[parent].left = new_child;
+        else
+            m->hot[parent].right = new_child;
+        if (new_child != NIL)
+            m->cold[new_child].parent = parent;
+    }
+}
+
+/**
+ * @brief Rebalance subtree rooted at node and return the new subroot.
+ *
+ * @param m Pointer to u32map_t.
+ * @param node Node index to rebalance (may be NIL).
+ * @return idx_t New root of subtree or NIL.
+ */
+static idx_t rebalance_at(u32map_t *m, idx_t node)
+{
+    if (node == NIL)
+        return NIL;
+    update_height(m, node);
+    idx_t l = m->hot[node].left;
+    idx_t r = m->hot[node].right;
+    int balance = node_height(m, l) - node_height(m, r);
+
+    if (balance > 1)
+    {
+        if (node_height(m, m->hot[l].left) < node_height(m, m->hot[l].right))
+        {
+            m->hot[node].left = rotate_left(m, l);
+            m->cold[m->hot[node].left].parent = node;
+        }
+        return rotate_right(m, node);
+    }
+    else if (balance < -1)
+    {
+        if (node_height(m, m->hot[r].right) < node_height(m, m->hot[r].left))
+        {
+            m->hot[node].right = rotate_right(m, r);
+            m->cold[m->hot[node].right].parent = node;
+        }
+        return rotate_left(m, node);
+    }
+    return node;
+}
+
+/**
+ * @brief Walk from p up to the root, rebalancing every ancestor.
+ *
+ * @param m Pointer to u32map_t.
+ * @param p First node index to rebalance (may be NIL).
+ */
+static void rebalance_up(u32map_t *m, idx_t p)
+{
+    while (p != NIL)
+    {
+        idx_t old_p = p;
+        idx_t new_subroot = rebalance_at(m, p);
+        set_child(m, m->cold[new_subroot].parent, old_p, new_subroot);
+        p = m->cold[new_subroot].parent;
+    }
+}
+
+/* API */
+
+/**
+ * @brief Initialize a compact uint32_t->fp_t map.
+ *
+ * Must be called before using the map.
+ *
+ * @param m Pointer to u32map_t to initialize.
+ */
+static void map_init(u32map_t *m)
+{
+    pool_init(m);
+}
+
+/**
+ * @brief Find a node index by key. Only the hot array is touched.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to search for.
+ * @return idx_t Node index containing key or NIL if not found.
+ */
+static idx_t find_node(const u32map_t *m, uint32_t key)
+{
+    idx_t cur = m->root;
+    while (cur != NIL)
+    {
+        const hot_t *h = &m->hot[cur];
+        if (key == h->key)
+            return cur;
+        cur = (key < h->key) ? h->left : h->right;
+    }
+    return NIL;
+}
+
+/**
+ * @brief Insert a key/value without overwriting.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to insert.
+ * @param value Function pointer value to store.
+ * @return int 1 if inserted, 0 if existed, -1 if pool exhausted.
+ */
+static int map_insert(u32map_t *m, uint32_t key, fp_t value)
+{
+    idx_t parent = NIL;
+    idx_t cur = m->root;
+    int cmpv = 0;
+    while (cur != NIL)
+    {
+        if (key == m->hot[cur].key)
+            return 0;
+        parent = cur;
+        if (key < m->hot[cur].key)
+        {
+            cur = m->hot[cur].left;
+            cmpv = -1;
+        }
+        else
+        {
+            cur = m->hot[cur].right;
+            cmpv = 1;
+        }
+    }
+
+    idx_t n = node_alloc(m);
+    if (n == NIL)
+        return -1;
+    m->hot[n].key = key;
+    m->value[n] = value;
+    m->size++;
+    if (parent == NIL)
+    {
+        m->root = n;
+        return 1;
+    }
+    m->cold[n].parent = parent;
+    if (cmpv < 0)
+        m->hot[parent].left = n;
+    else
+        m->hot[parent].right = n;
+
+    rebalance_up(m, parent);
+    return 1;
+}
+
+/**
+ * @brief Insert or replace a value.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to insert or replace.
+ * @param value Function pointer value.
+ * @return int 1 if inserted, 2 if replaced, -1 if pool exhausted.
+ */
+static int map_put(u32map_t *m, uint32_t key, fp_t value)
+{
+    idx_t ex = find_node(m, key);
+    if (ex != NIL)
+    {
+        m->value[ex] = value;
+        return 2;
+    }
+    return map_insert(m, key, value);
+}
+
+/**
+ * @brief Find a function pointer value by key.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to find.
+ * @return fp_t Function pointer stored or NULL if not found.
+ */
+static fp_t map_find(const u32map_t *m, uint32_t key)
+{
+    idx_t n = find_node(m, key);
+    return n != NIL ? m->value[n] : NULL;
+}
+
+/**
+ * @brief Return leftmost node index in a subtree.
+ *
+ * @param m Pointer to u32map_t.
+ * @param n Subtree root.
+ * @return idx_t Minimum node index or NIL.
+ */
+static idx_t subtree_min(const u32map_t *m, idx_t n)
+{
+    if (n == NIL)
+        return NIL;
+    while (m->hot[n].left != NIL)
+        n = m->hot[n].left;
+    return n;
+}
+
+/**
+ * @brief Erase a node and return the parent index for rebalancing.
+ *
+ * @param m Pointer to u32map_t.
+ * @param n Node index to erase.
+ * @return idx_t Parent to continue rebalancing from.
+ */
+static idx_t erase_node(u32map_t *m, idx_t n)
+{
+    if (m->hot[n].left != NIL && m->hot[n].right != NIL)
+    {
+        idx_t suc = subtree_min(m, m->hot[n].right);
+        uint32_t tkey = m->hot[n].key;
+        m->hot[n].key = m->hot[suc].key;
+        m->hot[suc].key = tkey;
+        fp_t tval = m->value[n];
+        m->value[n] = m->value[suc];
+        m->value[suc] = tval;
+        return erase_node(m, suc);
+    }
+
+    idx_t child = m->hot[n].left != NIL ? m->hot[n].left : m->hot[n].right;
+    idx_t parent = m->cold[n].parent;
+    set_child(m, parent, n, child);
+    node_free(m, n);
+    if (m->size > 0)
+        m->size--;
+    return parent;
+}
+
+/**
+ * @brief Erase a key from the map.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to erase.
+ * @return int 1 if erased, 0 if not found.
+ */
+static int map_erase(u32map_t *m, uint32_t key)
+{
+    idx_t n = find_node(m, key);
+    if (n == NIL)
+        return 0;
+    rebalance_up(m, erase_node(m, n));
+    return 1;
+}
+
+/**
+ * @brief Return number of elements in the map.
+ *
+ * @param m Pointer to u32map_t.
+ * @return size_t Number of stored elements.
+ */
+static size_t map_size(const u32map_t *m) { return m ? m->size : 0; }
+
+/**
+ * @brief Return iterator (node index) to the first element.
+ *
+ * @param m Pointer to u32map_t.
+ * @return idx_t First node index or NIL.
+ */
+static idx_t map_begin(const u32map_t *m) { return m ? subtree_min(m, m->root) : NIL; }
+
+/**
+ * @brief Return next node index in-order.
+ *
+ * @param m Pointer to u32map_t owning the iterator.
+ * @param it Current node index.
+ * @return idx_t Next node index or NIL.
+ */
+static idx_t map_next(const u32map_t *m, idx_t it)
+{
+    if (it == NIL)
+        return NIL;
+    if (m->hot[it].right != NIL)
+        return subtree_min(m, m->hot[it].right);
+
+    idx_t p = m->cold[it].parent;
+    idx_t cur = it;
+    while (p != NIL && m->hot[p].right == cur)
+    {
+        cur = p;
+        p = m->cold[p].parent;
+    }
+    return p;
+}
+
+/**
+ * @brief Return key stored at an iterator.
+ *
+ * @param m Pointer to u32map_t.
+ * @param it Node index (must not be NIL).
+ * @return uint32_t Stored key.
+ */
+static uint32_t map_iter_key(const u32map_t *m, idx_t it) { return m->hot[it].key; }
+
+/**
+ * @brief Return value stored at an iterator.
+ *
+ * @param m Pointer to u32map_t.
+ * @param it Node index (may be NIL).
+ * @return fp_t Stored function pointer or NULL if it is NIL.
+ */
+static fp_t map_iter_value(const u32map_t *m, idx_t it) { return it != NIL ? m->value[it] : NULL; }
+
+/* sample functions */
+
+/**
+ * @brief Example function for map values: prints "hello".
+ */
+static void say_hello(void) { puts("hello"); }
+
+/**
+ * @brief Example function for map values: prints "goodbye".
+ */
+static void say_goodbye(void) { puts("goodbye"); }
+
+int main(void)
+{
+    static u32map_t map;
+    map_init(&map);
+
+    printf("bytes per node: hot %zu, cold %zu, value %zu\n",
+           sizeof(hot_t), sizeof(cold_t), sizeof(fp_t));
+
+    /* insert two entries */
+    if (map_insert(&map, 10, say_hello) < 0 || map_insert(&map, 20, say_goodbye) < 0)
+    {
+        puts("pool full");
+        return 1;
+    }
+    map_put(&map, 20, say_goodbye);
+
+    printf("map size: %zu\n", map_size(&map));
+
+    /* lookup and call */
+    fp_t f = map_find(&map, 10);
+    if (f)
+        f();
+
+    /* iterate in order and call each function */
+    printf("in-order traversal (key -> call value):\n");
+    for (idx_t it = map_begin(&map); it != NIL; it = map_next(&map, it))
+    {
+        printf("  %" PRIu32 " -> ", map_iter_key(&map, it));
+        fp_t v = map_iter_value(&map, it);
+        if (v)
+            v();
+        else
+            puts("(null)");
+    }
+
+    /* erase an element */
+    map_erase(&map, 20);
+    printf("after erase 20, size=%zu\n", map_size(&map));
+
+    return 0;
+}
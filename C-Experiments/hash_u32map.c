@@ -0,0 +1,372 @@
+/*
+  Hashed, statically allocated map: uint32_t -> function pointer (fp_t).
+  Same map_init/map_insert/map_put/map_find/map_erase API as the static
+  AVL map in map_with_function_pointers.c, for dispatch tables that never
+  need key order on the hot path:
+
+    - open addressing with linear probing over HASH_SLOTS slots
+    - Robin Hood insertion: an entry far from its home slot takes the
+      place of one nearer to home, which keeps probe lengths short and
+      lets a lookup stop as soon as it meets an entry closer to home
+      than its own distance
+    - backward-shift deletion, so there are no tombstones
+    - a slot's distance, key and value live in separate arrays; a lookup
+      reads the distance and key arrays only and touches one value
+
+  Iteration (map_begin/map_next) walks slots in table order. Sorted key
+  order is available from map_sorted_keys at O(n log n).
+
+  Compile:
+      gcc -std=c99 -O2 hash_u32map.c -o hash_u32map
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef void (*fp_t)(void);
+
+#ifndef MAX_NODES
+#define MAX_NODES 256
+#endif
+
+/* Table size: a power of two with some headroom over MAX_NODES */
+#ifndef HASH_SLOTS
+#define HASH_SLOTS 512
+#endif
+
+#if (HASH_SLOTS & (HASH_SLOTS - 1)) != 0
+#error "HASH_SLOTS must be a power of two"
+#endif
+#if HASH_SLOTS < MAX_NODES + MAX_NODES / 8
+#error "HASH_SLOTS must leave at least 1/8 of MAX_NODES free"
+#endif
+#if HASH_SLOTS > 0x8000
+#error "HASH_SLOTS must fit a 16-bit probe distance"
+#endif
+
+#define HASH_MASK (HASH_SLOTS - 1u)
+#define NIL ((size_t)HASH_SLOTS) /* iterator past the last slot */
+
+typedef struct
+{
+    uint16_t dist[HASH_SLOTS]; /* 0: empty, else 1 + distance from home slot */
+    uint32_t key[HASH_SLOTS];
+    fp_t value[HASH_SLOTS];
+    size_t size;
+} u32map_t;
+
+/* helpers */
+
+/**
+ * @brief Home slot of a key (Fibonacci hashing: top bits of key * 2^32/phi).
+ *
+ * @param key Key to hash.
+ * @return size_t Slot index in [0, HASH_SLOTS).
+ */
+static size_t home_slot(uint32_t key)
+{
+    return (size_t)(((uint64_t)(uint32_t)(key * 0x9E3779B1u) * HASH_SLOTS) >> 32);
+}
+
+/**
+ * @brief Find the slot holding key.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to search for.
+ * @return size_t Slot index or NIL if not found.
+ */
+static size_t find_slot(const u32map_t *m, uint32_t key)
+{
+    size_t i = home_slot(key);
+    for (unsigned d = 1; m->dist[i] >= d; ++d)
+    {
+        if (m->key[i] == key)
+            return i;
+        i = (i + 1) & HASH_MASK;
+    }
+    return NIL;
+}
+
+/* public API (static in this example) */
+
+/**
+ * @brief Initialize a hashed uint32_t->fp_t map.
+ *
+ * Must be called before using the map.
+ *
+ * @param m Pointer to u32map_t to initialize.
+ */
+static void map_init(u32map_t *m)
+{
+    for (size_t i = 0; i < HASH_SLOTS; ++i)
+    {
+        m->dist[i] = 0;
+        m->key[i] = 0;
+        m->value[i] = NULL;
+    }
+    m->size = 0;
+}
+
+/**
+ * @brief Insert a key/value without overwriting.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to insert.
+ * @param value Function pointer value to store.
+ * @return int 1 if inserted, 0 if existed, -1 if MAX_NODES entries are stored.
+ */
+static int map_insert(u32map_t *m, uint32_t key, fp_t value)
+{
+    if (find_slot(m, key) != NIL)
+        return 0;
+    if (m->size >= MAX_NODES)
+        return -1;
+
+    size_t i = home_slot(key);
+    unsigned d = 1;
+    for (;;)
+    {
+        if (m->dist[i] == 0)
+        {
+            m->dist[i] = (uint16_t)d;
+            m->key[i] = key;
+            m->value[i] = value;
+            m->size++;
+            return 1;
+        }
+        if (m->dist[i] < d)
+        {
+            /* resident is nearer its home: it moves on instead of us */
+            unsigned td = m->dist[i];
+            uint32_t tk = m->key[i];
+            fp_t tv = m->value[i];
+            m->dist[i] = (uint16_t)d;
+            m->key[i] = key;
+            m->value[i] = value;
+            d = td;
+            key = tk;
+            value = tv;
+        }
+        i = (i + 1) & HASH_MASK;
+        d++;
+    }
+}
+
+/**
+ * @brief Insert or replace a key/value.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key.
+ * @param value Value.
+ * @return int 1 if inserted, 2 if replaced, -1 if MAX_NODES entries are stored.
+ */
+static int map_put(u32map_t *m, uint32_t key, fp_t value)
+{
+    size_t i = find_slot(m, key);
+    if (i != NIL)
+    {
+        m->value[i] = value;
+        return 2;
+    }
+    return map_insert(m, key, value);
+}
+
+/**
+ * @brief Find a function pointer value by key.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to find.
+ * @return fp_t Function pointer stored or NULL if not found.
+ */
+static fp_t map_find(const u32map_t *m, uint32_t key)
+{
+    size_t i = find_slot(m, key);
+    return i != NIL ? m->value[i] : NULL;
+}
+
+/**
+ * @brief Erase a key from the map.
+ *
+ * Later entries of the probe run shift back one slot, so lookups never
+ * have to skip deleted slots.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to erase.
+ * @return int 1 if erased, 0 if not found.
+ */
+static int map_erase(u32map_t *m, uint32_t key)
+{
+    size_t i = find_slot(m, key);
+    if (i == NIL)
+        return 0;
+    for (;;)
+    {
+        size_t next = (i + 1) & HASH_MASK;
+        if (m->dist[next] <= 1)
+            break; /* empty, or already in its home slot */
+        m->dist[i] = (uint16_t)(m->dist[next] - 1);
+        m->key[i] = m->key[next];
+        m->value[i] = m->value[next];
+        i = next;
+    }
+    m->dist[i] = 0;
+    m->key[i] = 0;
+    m->value[i] = NULL;
+    m->size--;
+    return 1;
+}
+
+/**
+ * @brief Return number of elements in the map.
+ *
+ * @param m Pointer to u32map_t.
+ * @return size_t Number of stored elements.
+ */
+static size_t map_size(const u32map_t *m) { return m ? m->size : 0; }
+
+/**
+ * @brief Return the first occupied slot at or after i, or NIL.
+ */
+static size_t next_used(const u32map_t *m, size_t i)
+{
+    while (i < HASH_SLOTS && m->dist[i] == 0)
+        i++;
+    return i;
+}
+
+/**
+ * @brief Return iterator (slot index) to the first element in table order.
+ *
+ * @param m Pointer to u32map_t.
+ * @return size_t First occupied slot or NIL.
+ */
+static size_t map_begin(const u32map_t *m) { return m ? next_used(m, 0) : NIL; }
+
+/**
+ * @brief Return the next element in table order (not key order).
+ *
+ * @param m Pointer to u32map_t owning the iterator.
+ * @param it Current slot index.
+ * @return size_t Next occupied slot or NIL.
+ */
+static size_t map_next(const u32map_t *m, size_t it) { return it == NIL ? NIL : next_used(m, it + 1); }
+
+/**
+ * @brief Return key stored at an iterator.
+ *
+ * @param m Pointer to u32map_t.
+ * @param it Slot index (must not be NIL).
+ * @return uint32_t Stored key.
+ */
+static uint32_t map_iter_key(const u32map_t *m, size_t it) { return m->key[it]; }
+
+/**
+ * @brief Return value stored at an iterator.
+ *
+ * @param m Pointer to u32map_t.
+ * @param it Slot index (may be NIL).
+ * @return fp_t Stored function pointer or NULL if it is NIL.
+ */
+static fp_t map_iter_value(const u32map_t *m, size_t it) { return it != NIL ? m->value[it] : NULL; }
+
+/**
+ * @brief qsort comparator for uint32_t.
+ */
+static int u32_cmp(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return (va > vb) - (va < vb);
+}
+
+/**
+ * @brief Copy all keys in ascending order (the slow, ordered path).
+ *
+ * @param m Pointer to u32map_t.
+ * @param out Receives map_size(m) keys; room for MAX_NODES always suffices.
+ * @return size_t Number of keys written.
+ */
+static size_t map_sorted_keys(const u32map_t *m, uint32_t *out)
+{
+    size_t n = 0;
+    for (size_t it = map_begin(m); it != NIL; it = map_next(m, it))
+        out[n++] = map_iter_key(m, it);
+    qsort(out, n, sizeof(uint32_t), u32_cmp);
+    return n;
+}
+
+/**
+ * @brief Longest probe a lookup of a present key needs (1 = home slot).
+ *
+ * @param m Pointer to u32map_t.
+ * @return unsigned Largest stored distance, 0 for an empty map.
+ */
+static unsigned map_max_probe(const u32map_t *m)
+{
+    unsigned d = 0;
+    for (size_t i = 0; i < HASH_SLOTS; ++i)
+        if (m->dist[i] > d)
+            d = m->dist[i];
+    return d;
+}
+
+/* sample functions */
+
+/**
+ * @brief Example function for map values: prints "hello".
+ */
+static void say_hello(void) { puts("hello"); }
+
+/**
+ * @brief Example function for map values: prints "goodbye".
+ */
+static void say_goodbye(void) { puts("goodbye"); }
+
+int main(void)
+{
+    static u32map_t map;
+    map_init(&map);
+
+    /* insert two entries */
+    if (map_insert(&map, 10, say_hello) < 0 || map_insert(&map, 20, say_goodbye) < 0)
+    {
+        puts("pool full");
+        return 1;
+    }
+    map_put(&map, 20, say_goodbye);
+
+    printf("map size: %zu\n", map_size(&map));
+
+    /* lookup and call */
+    fp_t f = map_find(&map, 10);
+    if (f)
+        f();
+
+    /* iterate in table order and call each function */
+    printf("table-order traversal (key -> call value):\n");
+    for (size_t it = map_begin(&map); it != NIL; it = map_next(&map, it))
+    {
+        printf("  %" PRIu32 " -> ", map_iter_key(&map, it));
+        fp_t v = map_iter_value(&map, it);
+        if (v)
+            v();
+        else
+            puts("(null)");
+    }
+
+    /* erase an element */
+    map_erase(&map, 20);
+    printf("after erase 20, size=%zu\n", map_size(&map));
+
+    /* fill to capacity and report the worst probe */
+    for (uint32_t k = 100; map_insert(&map, k, say_hello) >= 0; k += 7)
+        ;
+    uint32_t sorted[MAX_NODES];
+    size_t n = map_sorted_keys(&map, sorted);
+    printf("full table: %zu of %d slots, longest probe %u, smallest key %" PRIu32 "\n",
+           n, HASH_SLOTS, map_max_probe(&map), sorted[0]);
+
+    return 0;
+}
@@ -6,29 +6,240 @@
     - User supplies: compare function, optional dup/free functions for keys and values
     - Provides: create, destroy, insert (no overwrite), put (insert or assign), find, erase,
         size, begin/end iteration, next/prev iteration.
+    - map_create_ex selects the storage backend: the AVL tree, or a B+tree
+      holding MAP_BTREE_KEYS keys per node for large, lookup-heavy maps.
+    - Optional arena mode (MAP_ARENA): nodes and key/value copies come from
+      slab pages owned by the map; clear/destroy release whole pages.
+      MAP_HUGE_PAGES backs those pages with 2 MiB / 1 GiB huge pages and
+      opts.numa binds or interleaves them across NUMA nodes.
+    - Optional reader-concurrent mode (MAP_CONCURRENT): any number of threads
+      may call map_find inside map_read_begin/map_read_end without locking
+      while writers serialise on a mutex; see "Concurrent readers" below.
+    - map_save writes a position-independent snapshot file; map_open_mmap
+      maps it read-only and queries it in place, without rebuilding.
+    - map_freeze moves a map that is done changing into a read-only
+      Eytzinger array (frozen_find, frozen_begin/next): branch-free
+      lookups, 16 bytes per entry.
+    - map_rank / map_select / map_count_range answer order-statistics
+      queries; -DMAP_ORDER_STATS keeps subtree counts in the AVL nodes
+      and makes them O(log n).
+    - map_batch_begin / map_batch_apply / map_batch_commit apply a batch
+      of puts and erases in one sorted split-and-join pass.
+    - map_insert_take / map_put_take store caller-allocated keys and values
+      without key_dup/val_dup; map_extract unlinks an entry and returns
+      its key and value without key_free/val_free.
+    - map_snapshot returns an O(1) immutable version of the map
+      (version_find, version_scan); later updates copy the O(log n)
+      nodes on their path instead of writing to shared ones.
+    - map_sharded_create spreads keys over N maps by hash or by split
+      keys, each shard with its own lock, so writers to different shards
+      run in parallel; map_sharded_iter_* merges the shards in key order.
+    - map_union / map_intersect / map_difference combine two maps by AVL
+      split and join in O(m log(n/m + 1)).
+    - With opts.threads > 1, bulk loads, set operations, map_for_each and
+      clearing a large AVL map run on several threads; see "Parallel work".
 
     Compile:
-        gcc -std=c99 -O2 main.c -o main
+        gcc -std=c11 -O2 main.c -o main -pthread
 
     Example usage in main(): string keys, int values.
 */
 
+#define _POSIX_C_SOURCE 200809L /* clock_gettime, sched_yield, mmap, fseeko */
+#define _DEFAULT_SOURCE         /* MAP_ANONYMOUS, madvise, syscall */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef MAP_STATS
+#include <time.h>
+#endif
 
 /* map types and callbacks */
 typedef int (*map_cmp_fn)(const void *a, const void *b);
 typedef void *(*map_dup_fn)(const void *x);
 typedef void (*map_free_fn)(void *x);
+typedef size_t (*map_len_fn)(const void *x);
 
 /* Forward declarations */
 struct map_node;
 
-/* Iterator type is just a node pointer */
+/* Iterator type is just a node pointer (tagged for B+tree leaves and snapshots, see below) */
 typedef struct map_node *map_iter_t;
 
+/* Keys per B+tree node; iterators pack the slot into the low pointer bits */
+#ifndef MAP_BTREE_KEYS
+#define MAP_BTREE_KEYS 32
+#endif
+#if MAP_BTREE_KEYS < 4 || MAP_BTREE_KEYS > 64
+#error "MAP_BTREE_KEYS must be in [4, 64]"
+#endif
+#define BT_LEAF_ALIGN (MAP_BTREE_KEYS > 32 ? 128 : 64)
+
+/* Storage backend selected at creation */
+typedef enum map_backend
+{
+    MAP_BACKEND_AVL = 0,  /* pointer-linked AVL tree (default) */
+    MAP_BACKEND_BTREE,    /* B+tree, MAP_BTREE_KEYS keys per node, chained leaves */
+    MAP_BACKEND_SNAPSHOT  /* read-only mapped file from map_open_mmap; not for map_create_ex */
+} map_backend_t;
+
+/* map_opts_t flags */
+#define MAP_ARENA 0x1u      /* allocate nodes and key/value copies from map-owned slab pages */
+#define MAP_CONCURRENT 0x2u /* lock-free readers alongside one writer at a time (AVL only) */
+#define MAP_STRING_KEYS 0x4u /* C string keys copied into the node, length/prefix-aware compare (AVL only) */
+#define MAP_HUGE_PAGES 0x8u  /* MAP_ARENA with pages mapped as huge pages, see opts.arena_page */
+
+/* map_opts_t numa: placement of mapped arena pages */
+#define MAP_NUMA_DEFAULT 0u    /* first touch */
+#define MAP_NUMA_BIND 1u       /* only the nodes in opts.numa_nodes */
+#define MAP_NUMA_INTERLEAVE 2u /* pages spread round-robin over opts.numa_nodes */
+
+/* Per-map counters, kept when built with -DMAP_STATS; see map_stats */
+#define MAP_STATS_BUCKETS 32 /* latency bucket b: [2^b, 2^(b+1)) ns */
+#ifndef MAP_STATS_SAMPLE
+#define MAP_STATS_SAMPLE 64 /* time one public operation in this many (power of two) */
+#endif
+
+typedef struct map_stats
+{
+    uint64_t lookups;   /* map_find calls and map_find_many keys */
+    uint64_t misses;    /* lookups that found nothing */
+    uint64_t inserts;   /* entries added by insert/put/bulk load */
+    uint64_t erases;    /* entries removed by map_erase */
+    uint64_t cmp_calls; /* key comparisons, callback or inlined */
+    uint64_t rotations; /* AVL single rotations */
+    uint64_t splits;    /* B+tree node splits */
+    uint64_t allocs;    /* node allocations */
+    uint64_t frees;     /* node releases */
+    size_t live_bytes;  /* node memory currently allocated */
+    unsigned max_depth; /* deepest lookup path seen, in nodes */
+    uint64_t samples;   /* timed operations */
+    uint64_t latency[MAP_STATS_BUCKETS];
+} map_stats_t;
+
+/* Optional creation parameters for map_create_ex; zero-initialise for defaults */
+typedef struct map_opts
+{
+    map_backend_t backend;
+    unsigned flags;     /* MAP_* flags */
+    map_len_fn key_len; /* arena mode: byte size of a key, copied instead of key_dup */
+    map_len_fn val_len; /* arena mode: byte size of a value, copied instead of val_dup */
+    unsigned threads;   /* >1: large bulk operations may use this many threads */
+    size_t arena_page;  /* MAP_HUGE_PAGES: bytes per page, a power of two; 0 for MAP_HUGE_PAGE */
+    unsigned numa;      /* MAP_NUMA_* placement of arena pages (Linux) */
+    unsigned long numa_nodes; /* node mask for MAP_NUMA_BIND / MAP_NUMA_INTERLEAVE */
+} map_opts_t;
+
+/* Parallel work: fewest entries for which an operation uses opts.threads,
+   and the most threads a map accepts */
+#ifndef MAP_PAR_MIN
+#define MAP_PAR_MIN 65536
+#endif
+#ifndef MAP_PAR_MAX_THREADS
+#define MAP_PAR_MAX_THREADS 64
+#endif
+
+/* Slab page size for arena mode; larger requests get a page of their own */
+#ifndef MAP_ARENA_PAGE
+#define MAP_ARENA_PAGE (64 * 1024)
+#endif
+#define MAP_ARENA_ALIGN 16
+
+/* Default arena page with MAP_HUGE_PAGES: one 2 MiB huge page (1 << 30 for 1 GiB pages) */
+#ifndef MAP_HUGE_PAGE
+#define MAP_HUGE_PAGE (2u * 1024 * 1024)
+#endif
+
+/* Arena pages can come from mmap (huge pages, NUMA placement) */
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+#define MAP_ARENA_MMAP 1
+#else
+#define MAP_ARENA_MMAP 0
+#endif
+
+/* Recycled block kinds in an arena */
+enum
+{
+    ARENA_AVL_NODE,
+    ARENA_STR_NODE,
+    ARENA_BT_LEAF,
+    ARENA_BT_INNER,
+    ARENA_KINDS
+};
+
+typedef struct map_arena_page
+{
+    struct map_arena_page *next;
+    size_t used; /* bytes used from the start of the page, header included */
+    size_t cap;  /* total page bytes */
+} map_arena_page_t;
+
+typedef struct map_arena
+{
+    map_arena_page_t *pages;
+    void *free_list[ARENA_KINDS]; /* erased nodes waiting for reuse, per kind */
+    size_t page;                  /* bytes per page: MAP_ARENA_PAGE, or the huge page size */
+    int mapped;                   /* pages come from mmap rather than malloc */
+    int huge;                     /* mapped as huge pages */
+    unsigned numa;                /* MAP_NUMA_* */
+    unsigned long numa_nodes;
+} map_arena_t;
+
+/* Reader slots for MAP_CONCURRENT grace periods; threads hash onto them */
+#ifndef MAP_READ_STRIPES
+#define MAP_READ_STRIPES 16
+#endif
+#define MAP_CACHE_LINE 64
+
+/* Unlinked nodes and replaced values are freed in batches of this many */
+#ifndef MAP_RETIRE_BATCH
+#define MAP_RETIRE_BATCH 64
+#endif
+
+typedef struct map_read_stripe
+{
+    _Alignas(MAP_CACHE_LINE) atomic_size_t active[2]; /* readers inside a section, per epoch parity */
+} map_read_stripe_t;
+
+typedef struct map_retired_value
+{
+    struct map_retired_value *next;
+    void *value;
+} map_retired_value_t;
+
+typedef struct map_sync
+{
+    map_read_stripe_t stripe[MAP_READ_STRIPES];
+    pthread_mutex_t write_lock; /* serialises writers and locked iteration */
+    atomic_uint seq;            /* odd while a writer is changing the tree */
+    atomic_uint epoch;          /* grace-period counter; parity selects active[] */
+    struct map_node *retired;   /* unlinked nodes, chained through parent */
+    map_retired_value_t *retired_vals;
+    size_t nretired;
+} map_sync_t;
+
+/* map_t taking: which caller pointers map_store_key/map_store_value keep as-is */
+#define MAP_TAKE_KEY 0x1u
+#define MAP_TAKE_VALUE 0x2u
+
+/* Sharing state of a map and its map_snapshot versions */
+typedef struct map_vctl
+{
+    atomic_uint refs; /* 1 while the map lives, plus one per live version */
+} map_vctl_t;
+
 typedef struct map
 {
     struct map_node *root;
@@ -38,6 +249,23 @@ typedef struct map
     map_free_fn key_free;
     map_dup_fn val_dup;
     map_free_fn val_free;
+    map_backend_t backend;
+    void *bt_root;   /* B+tree root; a leaf when bt_levels == 0 */
+    int bt_levels;   /* number of inner levels above the leaves */
+    unsigned flags;  /* MAP_* flags from map_opts_t */
+    unsigned threads; /* opts.threads, at least 1 */
+    map_len_fn key_len;
+    map_len_fn val_len;
+    map_arena_t arena; /* used when flags & MAP_ARENA */
+    map_sync_t *sync;  /* MAP_CONCURRENT state, NULL otherwise */
+    const unsigned char *snap; /* MAP_BACKEND_SNAPSHOT: the mapped file */
+    size_t snap_len;
+    map_vctl_t *versions; /* set by the first map_snapshot */
+    unsigned taking;      /* MAP_TAKE_* while caller pointers are stored as-is */
+#ifdef MAP_STATS
+    map_stats_t stats;
+    uint64_t stats_ops; /* public operations, for sampling */
+#endif
 } map_t;
 
 typedef struct map_node
@@ -48,8 +276,107 @@ typedef struct map_node
     struct map_node *right;
     struct map_node *parent;
     int height;
+    atomic_uint refs; /* links to this node from the map, versions and nodes; see "Versions" */
+#ifdef MAP_ORDER_STATS
+    uint32_t count; /* entries in this subtree, see "Order statistics" */
+#endif
 } map_node_t;
 
+/* Key bytes (NUL included) a MAP_STRING_KEYS node holds without a separate copy */
+#ifndef MAP_STR_INLINE
+#define MAP_STR_INLINE 24
+#endif
+
+/* MAP_STRING_KEYS node: base.key points at text, or at a heap copy for long keys */
+typedef struct map_str_node
+{
+    map_node_t base;
+    uint64_t prefix; /* first 8 key bytes, big-endian, zero padded */
+    size_t len;      /* strlen of the key */
+    char text[MAP_STR_INLINE];
+} map_str_node_t;
+
+/* Node sizes on 64-bit targets, as documented in "Order statistics" */
+#if UINTPTR_MAX == UINT64_MAX && MAP_STR_INLINE == 24
+#ifdef MAP_ORDER_STATS
+_Static_assert(sizeof(map_node_t) == 56, "map_node_t: 5 links, height, refs, count");
+_Static_assert(sizeof(map_str_node_t) == 96, "map_str_node_t: node, prefix, len, inline text");
+#else
+_Static_assert(sizeof(map_node_t) == 48, "map_node_t: 5 links, height, refs");
+_Static_assert(sizeof(map_str_node_t) == 88, "map_str_node_t: node, prefix, len, inline text");
+#endif
+#endif
+
+/* Statistics (MAP_STATS): every hook compiles to nothing without it.
+   Lock-free lookups on MAP_CONCURRENT maps are not counted, so counters
+   are only ever written by one thread at a time. */
+
+#ifdef MAP_STATS
+#define MAP_STAT_INC(m, field) ((void)((m)->stats.field++))
+#define MAP_STAT_ADD(m, field, v) ((void)((m)->stats.field += (v)))
+#define MAP_STAT_SUB(m, field, v) ((void)((m)->stats.field -= (v)))
+#define MAP_STAT_DEPTH(m, d) ((void)((unsigned)(d) > (m)->stats.max_depth ? (m)->stats.max_depth = (unsigned)(d) : 0))
+#define MAP_OP_BEGIN(m) uint64_t map_op_t0_ = map_op_begin(m)
+#define MAP_OP_END(m) map_op_end((m), map_op_t0_)
+#else
+#define MAP_STAT_INC(m, field) ((void)0)
+#define MAP_STAT_ADD(m, field, v) ((void)0)
+#define MAP_STAT_SUB(m, field, v) ((void)0)
+#define MAP_STAT_DEPTH(m, d) ((void)(d))
+#define MAP_OP_BEGIN(m) ((void)0)
+#define MAP_OP_END(m) ((void)0)
+#endif
+
+/* Compare through the map's callback, counted as one comparison */
+#define MAP_CMP(m, a, b) (MAP_STAT_INC(m, cmp_calls), (m)->cmp((a), (b)))
+
+#ifdef MAP_STATS
+/**
+ * @brief Start timing a public operation if it is the sampled one; 0 otherwise.
+ */
+static uint64_t map_op_begin(map_t *m)
+{
+    if (!m || m->sync || (++m->stats_ops & (MAP_STATS_SAMPLE - 1)) != 0)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec + 1; /* never 0 */
+}
+
+/**
+ * @brief Record the latency of a sampled operation in its log2 bucket.
+ */
+static void map_op_end(map_t *m, uint64_t t0)
+{
+    if (!t0)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec + 1 - t0;
+    unsigned b = 0;
+    while (ns > 1 && b < MAP_STATS_BUCKETS - 1)
+    {
+        ns >>= 1;
+        b++;
+    }
+    m->stats.latency[b]++;
+    m->stats.samples++;
+}
+#endif
+
+/* Stores to the root, tree links and entry pointers of nodes that
+   MAP_CONCURRENT readers may be loading at the same moment (see
+   sync_find). They are release stores, as the matching loads are
+   acquire: a reader that reaches a node or value through one has also
+   seen its initialisation, so the optimistic walk is no data race. Both
+   are plain moves on x86. Nodes not yet linked in are filled with plain
+   stores. */
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_LINK_STORE(lv, v) __atomic_store_n(&(lv), (v), __ATOMIC_RELEASE)
+#else
+#define MAP_LINK_STORE(lv, v) ((void)((lv) = (v)))
+#endif
+
 /* Utility helpers */
 
 /**
@@ -60,10 +387,18 @@ typedef struct map_node
  */
 static int node_height(map_node_t *n) { return n ? n->height : 0; }
 
+#ifdef MAP_ORDER_STATS
+/**
+ * @brief Return the number of entries in the subtree rooted at n (0 if NULL).
+ */
+static size_t node_count(map_node_t *n) { return n ? n->count : 0; }
+#endif
+
 /**
  * @brief Recompute and set the height field for node n based on children.
  *
- * If n is NULL the function does nothing.
+ * With MAP_ORDER_STATS the subtree count is recomputed as well. If n is
+ * NULL the function does nothing.
  *
  * @param n Pointer to map_node_t whose height is updated.
  */
@@ -74,843 +409,7827 @@ static void update_height(map_node_t *n)
         int hl = node_height(n->left);
         int hr = node_height(n->right);
         n->height = (hl > hr ? hl : hr) + 1;
+#ifdef MAP_ORDER_STATS
+        n->count = (uint32_t)(node_count(n->left) + node_count(n->right) + 1);
+#endif
     }
 }
 
-/* Create and destroy nodes */
+/* Arena (slab) storage */
 
 /**
- * @brief Allocate and initialize a new map node.
+ * @brief Map fresh memory for an arena page of at least *cap bytes.
  *
- * The function uses the map's key_dup/val_dup callbacks if provided to
- * duplicate the key and value; otherwise it stores the pointers as-is.
+ * With huge pages, explicit ones (MAP_HUGETLB, from the pool reserved in
+ * vm.nr_hugepages) are tried first; without a reservation the page is
+ * mapped aligned to the huge page size and advised for transparent huge
+ * pages instead. NUMA placement is applied with mbind before the first
+ * touch and is best effort: on kernels without NUMA it is ignored.
  *
- * @param m Pointer to the owning map_t.
- * @param key Pointer to the key to store (may be NULL depending on usage).
- * @param value Pointer to the value to store (may be NULL).
- * @return map_node_t* Pointer to the newly allocated node, or NULL on OOM.
+ * @param a Arena with a->mapped set.
+ * @param cap In: bytes needed. Out: bytes mapped, a multiple of a->page.
+ * @return map_arena_page_t* Start of the mapping, or NULL on failure.
  */
-static map_node_t *node_new(map_t *m, void *key, void *value)
+static map_arena_page_t *arena_map_page(map_arena_t *a, size_t *cap)
 {
-    map_node_t *n = (map_node_t *)malloc(sizeof(map_node_t));
-    if (!n)
+#if MAP_ARENA_MMAP
+    size_t len = (*cap + a->page - 1) & ~(a->page - 1);
+    char *p = (char *)MAP_FAILED;
+    if (a->huge)
+    {
+#ifdef MAP_HUGETLB
+        int fl = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+        fl |= __builtin_ctzll(a->page) << MAP_HUGE_SHIFT;
+#endif
+        p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, fl, -1, 0);
+#endif
+        if (p == (char *)MAP_FAILED)
+        {
+            /* transparent huge pages only back aligned ranges: over-map, trim */
+            size_t over = len + a->page;
+            char *raw = (char *)mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == (char *)MAP_FAILED)
+                return NULL;
+            p = (char *)(((uintptr_t)raw + a->page - 1) & ~(uintptr_t)(a->page - 1));
+            if (p > raw)
+                munmap(raw, (size_t)(p - raw));
+            if (raw + over > p + len)
+                munmap(p + len, (size_t)(raw + over - (p + len)));
+#ifdef MADV_HUGEPAGE
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+        }
+    }
+    else
+        p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (char *)MAP_FAILED)
         return NULL;
-    n->left = n->right = n->parent = NULL;
-    n->height = 1;
-    /* store duplicated key/value if dup functions provided, else store pointers as-is */
-    n->key = (m->key_dup ? m->key_dup(key) : key);
-    n->value = (m->val_dup ? m->val_dup(value) : value);
-    return n;
+#ifdef SYS_mbind
+    if (a->numa != MAP_NUMA_DEFAULT && a->numa_nodes)
+    {
+        int mode = a->numa == MAP_NUMA_BIND ? 2 : 3; /* MPOL_BIND, MPOL_INTERLEAVE */
+        unsigned long mask = a->numa_nodes;
+        syscall(SYS_mbind, p, len, mode, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+    *cap = len;
+    return (map_arena_page_t *)p;
+#else
+    (void)a;
+    (void)cap;
+    return NULL;
+#endif
 }
 
 /**
- * @brief Free a node and its stored key/value resources (via callbacks).
+ * @brief Return one arena page to where it came from.
+ */
+static void arena_unmap_page(const map_arena_t *a, map_arena_page_t *pg)
+{
+#if MAP_ARENA_MMAP
+    if (a->mapped)
+    {
+        munmap(pg, pg->cap);
+        return;
+    }
+#else
+    (void)a;
+#endif
+    free(pg);
+}
+
+/**
+ * @brief Bump-allocate size bytes with the given alignment from the arena.
  *
- * This frees the memory for the key and value using the map's key_free/val_free
- * callbacks if they are non-NULL, then frees the node itself.
+ * Requests that do not fit the current page start a new a->page sized
+ * page; requests larger than a quarter page get a dedicated page linked
+ * behind the current one so its free space is not abandoned.
  *
- * @param m Pointer to owning map_t.
- * @param n Pointer to node to free (NULL safe).
+ * @param a Arena to allocate from.
+ * @param size Number of bytes.
+ * @param align Power-of-two alignment.
+ * @return void* Allocated block or NULL on OOM.
  */
-static void node_free(map_t *m, map_node_t *n)
+static void *arena_alloc(map_arena_t *a, size_t size, size_t align)
 {
-    if (!n)
-        return;
-    if (m->key_free && n->key)
-        m->key_free(n->key);
-    if (m->val_free && n->value)
-        m->val_free(n->value);
-    free(n);
+    map_arena_page_t *pg = a->pages;
+    if (pg)
+    {
+        uintptr_t base = (uintptr_t)pg;
+        uintptr_t p = (base + pg->used + align - 1) & ~(uintptr_t)(align - 1);
+        if (p + size <= base + pg->cap)
+        {
+            pg->used = (size_t)(p + size - base);
+            return (void *)p;
+        }
+    }
+
+    size_t cap = sizeof(map_arena_page_t) + size + align;
+    int dedicated = cap > a->page / 4;
+    if (cap < a->page)
+        cap = a->page;
+    map_arena_page_t *np = a->mapped ? arena_map_page(a, &cap) : (map_arena_page_t *)malloc(cap);
+    if (!np)
+        return NULL;
+    np->cap = cap;
+    if (dedicated && a->pages)
+    {
+        np->next = a->pages->next;
+        a->pages->next = np;
+    }
+    else
+    {
+        np->next = a->pages;
+        a->pages = np;
+    }
+    uintptr_t base = (uintptr_t)np;
+    uintptr_t p = (base + sizeof(map_arena_page_t) + align - 1) & ~(uintptr_t)(align - 1);
+    np->used = (size_t)(p + size - base);
+    return (void *)p;
 }
 
-/* Rotate helpers return new subtree root and maintain parent pointers */
+/**
+ * @brief Get a fixed-size block of a given kind, reusing erased ones first.
+ *
+ * @param a Arena to allocate from.
+ * @param kind ARENA_* block kind.
+ * @param size Block size for that kind.
+ * @param align Block alignment for that kind.
+ * @return void* Block or NULL on OOM.
+ */
+static void *arena_get(map_arena_t *a, int kind, size_t size, size_t align)
+{
+    void *p = a->free_list[kind];
+    if (p)
+    {
+        a->free_list[kind] = *(void **)p;
+        return p;
+    }
+    return arena_alloc(a, size, align);
+}
 
 /**
- * @brief Perform a right rotation on subtree rooted at y.
+ * @brief Return a fixed-size block to its per-kind free list.
  *
- * After rotation this function returns the new root (x). Parent pointers
- * and heights are adjusted appropriately.
+ * @param a Arena owning the block.
+ * @param kind ARENA_* block kind.
+ * @param p Block to recycle.
+ */
+static void arena_put(map_arena_t *a, int kind, void *p)
+{
+    *(void **)p = a->free_list[kind];
+    a->free_list[kind] = p;
+}
+
+/**
+ * @brief Release every page of the arena in O(pages).
  *
- * @param y Root of subtree to rotate (must be non-NULL and have left child).
- * @return map_node_t* New root of the rotated subtree.
+ * @param a Arena to release; left empty and reusable.
  */
-static map_node_t *rotate_right(map_node_t *y)
+static void arena_release(map_arena_t *a)
 {
-    map_node_t *x = y->left;
-    map_node_t *T2 = x->right;
+    map_arena_page_t *pg = a->pages;
+    while (pg)
+    {
+        map_arena_page_t *next = pg->next;
+        arena_unmap_page(a, pg);
+        pg = next;
+    }
+    a->pages = NULL;
+    for (int k = 0; k < ARENA_KINDS; ++k)
+        a->free_list[k] = NULL;
+}
 
-    x->right = y;
-    y->left = T2;
+/* Key/value ownership: the one place deciding dup vs. arena copy vs. as-is */
 
-    if (T2)
-        T2->parent = y;
+/**
+ * @brief Return non-zero if keys are copied into the map's arena.
+ */
+static int map_arena_keys(const map_t *m) { return (m->flags & MAP_ARENA) && m->key_len; }
 
-    x->parent = y->parent;
-    y->parent = x;
+/**
+ * @brief Return non-zero if values are copied into the map's arena.
+ */
+static int map_arena_vals(const map_t *m) { return (m->flags & MAP_ARENA) && m->val_len; }
 
-    update_height(y);
-    update_height(x);
-    return x;
+/**
+ * @brief Copy len bytes of x into the arena.
+ *
+ * @return void* Arena copy, or NULL on OOM or NULL input.
+ */
+static void *arena_copy(map_t *m, const void *x, size_t len)
+{
+    if (!x)
+        return NULL;
+    void *d = arena_alloc(&m->arena, len ? len : 1, MAP_ARENA_ALIGN);
+    if (d)
+        memcpy(d, x, len);
+    return d;
 }
 
 /**
- * @brief Perform a left rotation on subtree rooted at x.
- *
- * After rotation this function returns the new root (y). Parent pointers
- * and heights are adjusted appropriately.
- *
- * @param x Root of subtree to rotate (must be non-NULL and have right child).
- * @return map_node_t* New root of the rotated subtree.
+ * @brief Produce the key pointer the map stores for a caller key.
  */
-static map_node_t *rotate_left(map_node_t *x)
+static void *map_store_key(map_t *m, void *key)
 {
-    map_node_t *y = x->right;
-    map_node_t *T2 = y->left;
+    if (m->taking & MAP_TAKE_KEY)
+        return key;
+    if (map_arena_keys(m))
+        return arena_copy(m, key, m->key_len(key));
+    return m->key_dup ? m->key_dup(key) : key;
+}
 
-    y->left = x;
-    x->right = T2;
+/**
+ * @brief Produce the value pointer the map stores for a caller value.
+ */
+static void *map_store_value(map_t *m, void *value)
+{
+    if (m->taking & MAP_TAKE_VALUE)
+        return value;
+    if (map_arena_vals(m))
+        return arena_copy(m, value, m->val_len(value));
+    return m->val_dup ? m->val_dup(value) : value;
+}
 
-    if (T2)
-        T2->parent = x;
+/**
+ * @brief Release a stored key (arena copies are reclaimed with their page).
+ */
+static void map_drop_key(map_t *m, void *key)
+{
+    if (m->key_free && key && !map_arena_keys(m))
+        m->key_free(key);
+}
 
-    y->parent = x->parent;
-    x->parent = y;
+/**
+ * @brief Release a stored value (arena copies are reclaimed with their page).
+ */
+static void map_drop_value(map_t *m, void *value)
+{
+    if (m->val_free && value && !map_arena_vals(m))
+        m->val_free(value);
+}
 
-    update_height(x);
-    update_height(y);
-    return y;
+/**
+ * @brief Return non-zero if clearing the map must visit every entry.
+ *
+ * False in arena mode when nothing stored needs a free callback, which is
+ * what makes map_clear O(pages).
+ */
+static int map_needs_entry_walk(const map_t *m)
+{
+    return (m->key_free && !map_arena_keys(m)) || (m->val_free && !map_arena_vals(m));
 }
 
-/* Helper to replace parent's child pointer with new child (or set root if parent NULL) */
+/* Concurrent readers (MAP_CONCURRENT)
+
+   Writers serialise on write_lock and keep seq odd while they change the
+   tree. Readers never lock: inside a map_read_begin/map_read_end section
+   they walk the tree with plain single loads and retry when seq was odd or
+   moved meanwhile (a seqlock). Unlinked nodes and replaced values are only
+   freed once every section that might still see them has ended (an epoch
+   grace period), so a reader racing a writer can see a half-rotated path
+   but never freed memory. Writers never wait for readers while seq is odd:
+   readers spin there without leaving their section. */
+
+static atomic_uint map_stripe_next;
+static _Thread_local unsigned map_stripe_id = (unsigned)-1;
 
 /**
- * @brief Replace parent's pointer from old_child to new_child.
- *
- * If parent is NULL, new_child becomes the map root. Parent pointers are
- * updated for new_child if non-NULL.
+ * @brief Return the calling thread's reader stripe, assigning one on first use.
+ */
+static map_read_stripe_t *sync_stripe(map_sync_t *s)
+{
+    if (map_stripe_id == (unsigned)-1)
+        map_stripe_id = atomic_fetch_add_explicit(&map_stripe_next, 1, memory_order_relaxed) % MAP_READ_STRIPES;
+    return &s->stripe[map_stripe_id];
+}
+
+/**
+ * @brief Allocate and initialise the MAP_CONCURRENT state.
  *
- * @param m Pointer to the map owning the tree.
- * @param parent Parent node whose child pointer should be updated (may be NULL).
- * @param old_child The previous child pointer (used to decide left/right).
- * @param new_child The new child to attach (may be NULL).
+ * @return map_sync_t* New state or NULL on OOM.
  */
-static void set_child(map_t *m, map_node_t *parent, map_node_t *old_child, map_node_t *new_child)
+static map_sync_t *sync_new(void)
 {
-    if (!parent)
+    map_sync_t *s = (map_sync_t *)aligned_alloc(MAP_CACHE_LINE, sizeof(map_sync_t));
+    if (!s)
+        return NULL;
+    if (pthread_mutex_init(&s->write_lock, NULL) != 0)
     {
-        m->root = new_child;
-        if (new_child)
-            new_child->parent = NULL;
+        free(s);
+        return NULL;
     }
-    else
+    for (int i = 0; i < MAP_READ_STRIPES; ++i)
     {
-        if (parent->left == old_child)
-            parent->left = new_child;
-        else
-            parent->right = new_child;
-        if (new_child)
-            new_child->parent = parent;
+        atomic_init(&s->stripe[i].active[0], 0);
+        atomic_init(&s->stripe[i].active[1], 0);
     }
+    atomic_init(&s->seq, 0);
+    atomic_init(&s->epoch, 0);
+    s->retired = NULL;
+    s->retired_vals = NULL;
+    s->nretired = 0;
+    return s;
 }
 
-/* Rebalance at node and return the node that occupies this position after rebalancing */
-
 /**
- * @brief Rebalance the subtree rooted at node if needed and return new subroot.
+ * @brief Wait until every read section that began before the call has ended.
  *
- * This function computes the AVL balance factor, performs the necessary
- * single/double rotations (LL, LR, RR, RL), updates heights and parent
- * pointers, and returns the node that should occupy the original node's
- * position after rebalancing.
+ * Flips the epoch and waits for the previous parity's counters to drain;
+ * sections begun afterwards count against the new parity and cannot reach
+ * anything unlinked before the flip. Caller holds write_lock with seq even.
  *
- * @param m Pointer to the map (unused for logic but kept for symmetry).
- * @param node Root of subtree to rebalance (must be non-NULL).
- * @return map_node_t* New root of the rebalanced subtree (may be same as node).
+ * @param s MAP_CONCURRENT state.
  */
-static map_node_t *rebalance_at(map_t *m, map_node_t *node)
+static void sync_wait_readers(map_sync_t *s)
 {
-    update_height(node);
-    int balance = node_height(node->left) - node_height(node->right);
-
-    if (balance > 1)
-    {
-        /* left heavy */
-        if (node_height(node->left->left) >= node_height(node->left->right))
-        {
-            /* LL case */
-            map_node_t *new_root = rotate_right(node);
-            return new_root;
-        }
-        else
-        {
-            /* LR case */
-            node->left = rotate_left(node->left);
-            if (node->left)
-                node->left->parent = node;
-            map_node_t *new_root = rotate_right(node);
-            return new_root;
-        }
-    }
-    else if (balance < -1)
+    unsigned e = atomic_load_explicit(&s->epoch, memory_order_relaxed);
+    atomic_store_explicit(&s->epoch, e + 1, memory_order_seq_cst);
+    for (int i = 0; i < MAP_READ_STRIPES; ++i)
     {
-        /* right heavy */
-        if (node_height(node->right->right) >= node_height(node->right->left))
-        {
-            /* RR case */
-            map_node_t *new_root = rotate_left(node);
-            return new_root;
-        }
-        else
-        {
-            /* RL case */
-            node->right = rotate_right(node->right);
-            if (node->right)
-                node->right->parent = node;
-            map_node_t *new_root = rotate_left(node);
-            return new_root;
-        }
+        while (atomic_load_explicit(&s->stripe[i].active[e & 1], memory_order_acquire) != 0)
+            sched_yield();
     }
-    return node;
 }
 
-/* Public API */
+/**
+ * @brief Mark the tree as changing (seq becomes odd).
+ */
+static void sync_open(map_sync_t *s)
+{
+    unsigned q = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, q + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); /* seq is odd before any tree store */
+}
 
 /**
- * @brief Create a new map instance.
- *
- * The caller must provide a compare function. Optional key/value duplicate
- * and free callbacks may be supplied; if NULL, keys/values are stored as
- * provided and not freed by the map.
+ * @brief Mark the tree as consistent again (seq becomes even).
+ */
+static void sync_publish(map_sync_t *s)
+{
+    unsigned q = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, q + 1, memory_order_release);
+}
+
+/**
+ * @brief Order a new node's or value's initialisation before the store that publishes it.
+ *
+ * Readers may dereference what they load before validating seq, so a
+ * pointer they can reach must never lead to uninitialised memory.
+ */
+static void map_publish_fence(const map_t *m)
+{
+    if (m->sync)
+        atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief Enter a writer section: take write_lock and make seq odd.
+ */
+static void map_write_begin(map_t *m)
+{
+    pthread_mutex_lock(&m->sync->write_lock);
+    sync_open(m->sync);
+}
+
+/* String keys (MAP_STRING_KEYS) */
+
+/**
+ * @brief First 8 bytes of a string as a big-endian integer, zero padded.
+ *
+ * Comparing two prefixes as integers orders them like strcmp orders the
+ * strings' first 8 bytes.
+ */
+static uint64_t str_prefix(const char *s, size_t len)
+{
+    uint64_t p = 0;
+    for (size_t i = 0; i < 8; ++i)
+        p = (p << 8) | (i < len ? (unsigned char)s[i] : 0u);
+    return p;
+}
+
+/* A search key with its length and prefix computed once per operation */
+typedef struct map_str_probe
+{
+    const char *s;
+    size_t len;
+    uint64_t prefix;
+} map_str_probe_t;
+
+static void str_probe_init(map_str_probe_t *k, const char *s)
+{
+    k->s = s;
+    k->len = strlen(s);
+    k->prefix = str_prefix(s, k->len);
+}
+
+/**
+ * @brief strcmp-order comparison of a probe with a string-key node.
+ *
+ * Decided by the inline prefix unless the first 8 bytes are equal; only
+ * then are the remaining bytes (inline or on the heap) touched.
+ */
+static int str_cmp_node(const map_str_probe_t *k, const map_str_node_t *n)
+{
+    if (k->prefix != n->prefix)
+        return k->prefix < n->prefix ? -1 : 1;
+    size_t ml = k->len < n->len ? k->len : n->len;
+    if (ml > 8)
+    {
+        int c = memcmp(k->s + 8, (const char *)n->base.key + 8, ml - 8);
+        if (c)
+            return c;
+    }
+    return (k->len > n->len) - (k->len < n->len);
+}
+
+/**
+ * @brief Compare callback installed on MAP_STRING_KEYS maps for the generic paths.
+ */
+static int str_key_cmp(const void *a, const void *b) { return strcmp((const char *)a, (const char *)b); }
+
+/**
+ * @brief Copy a key into a string-key node (inline if short enough).
+ *
+ * @return int 0 on success, -1 on OOM.
+ */
+static int str_node_set_key(map_t *m, map_str_node_t *sn, const char *key)
+{
+    size_t len = strlen(key);
+    sn->len = len;
+    sn->prefix = str_prefix(key, len);
+    if (len < MAP_STR_INLINE)
+    {
+        memcpy(sn->text, key, len + 1);
+        sn->base.key = sn->text;
+        return 0;
+    }
+    char *copy = (m->flags & MAP_ARENA) ? (char *)arena_alloc(&m->arena, len + 1, 1) : (char *)malloc(len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, key, len + 1);
+    sn->base.key = copy;
+    return 0;
+}
+
+/* Create and destroy nodes */
+
+/**
+ * @brief Allocate and initialize a new map node.
+ *
+ * The function uses the map's key_dup/val_dup callbacks if provided to
+ * duplicate the key and value; otherwise it stores the pointers as-is.
+ * In arena mode the node (and, with key_len/val_len, the copies) come
+ * from the map's slab pages. MAP_STRING_KEYS maps always copy the key,
+ * into the node itself when it is shorter than MAP_STR_INLINE.
+ *
+ * @param m Pointer to the owning map_t.
+ * @param key Pointer to the key to store (may be NULL depending on usage).
+ * @param value Pointer to the value to store (may be NULL).
+ * @return map_node_t* Pointer to the newly allocated node, or NULL on OOM.
+ */
+static map_node_t *node_new(map_t *m, void *key, void *value)
+{
+    map_node_t *n;
+    int str = (m->flags & MAP_STRING_KEYS) != 0;
+    if (m->flags & MAP_ARENA)
+        n = str ? (map_node_t *)arena_get(&m->arena, ARENA_STR_NODE, sizeof(map_str_node_t), _Alignof(map_str_node_t))
+                : (map_node_t *)arena_get(&m->arena, ARENA_AVL_NODE, sizeof(map_node_t), sizeof(void *));
+    else
+        n = (map_node_t *)malloc(str ? sizeof(map_str_node_t) : sizeof(map_node_t));
+    if (!n)
+        return NULL;
+    n->left = n->right = n->parent = NULL;
+    n->height = 1;
+    atomic_init(&n->refs, 1);
+#ifdef MAP_ORDER_STATS
+    n->count = 1;
+#endif
+    if (str)
+    {
+        if (str_node_set_key(m, (map_str_node_t *)n, (const char *)key) < 0)
+        {
+            if (m->flags & MAP_ARENA)
+                arena_put(&m->arena, ARENA_STR_NODE, n);
+            else
+                free(n);
+            return NULL;
+        }
+    }
+    else
+    {
+        /* store duplicated key/value if dup functions provided, else store pointers as-is */
+        n->key = map_store_key(m, key);
+    }
+    n->value = map_store_value(m, value);
+    MAP_STAT_INC(m, allocs);
+    MAP_STAT_ADD(m, live_bytes, str ? sizeof(map_str_node_t) : sizeof(map_node_t));
+    return n;
+}
+
+/**
+ * @brief Free a node and its stored key/value resources (via callbacks).
+ *
+ * This frees the memory for the key and value using the map's key_free/val_free
+ * callbacks if they are non-NULL, then frees the node itself.
+ *
+ * @param m Pointer to owning map_t.
+ * @param n Pointer to node to free (non-NULL).
+ */
+static void node_release(map_t *m, map_node_t *n)
+{
+    int str = (m->flags & MAP_STRING_KEYS) != 0;
+    if (!str)
+        map_drop_key(m, n->key);
+    else if (n->key != ((map_str_node_t *)n)->text && !(m->flags & MAP_ARENA))
+        free(n->key);
+    map_drop_value(m, n->value);
+    MAP_STAT_INC(m, frees);
+    MAP_STAT_SUB(m, live_bytes, str ? sizeof(map_str_node_t) : sizeof(map_node_t));
+    if (m->flags & MAP_ARENA)
+        arena_put(&m->arena, str ? ARENA_STR_NODE : ARENA_AVL_NODE, n);
+    else
+        free(n);
+}
+
+/**
+ * @brief Dispose of a node that is no longer linked into the tree.
+ *
+ * MAP_CONCURRENT maps only retire the node, since a reader may still be
+ * standing on it; it is released after the next grace period.
+ *
+ * @param m Pointer to owning map_t.
+ * @param n Pointer to node to free (NULL safe).
+ */
+static void node_free(map_t *m, map_node_t *n)
+{
+    if (!n)
+        return;
+    if (m->sync)
+    {
+        n->parent = m->sync->retired;
+        m->sync->retired = n;
+        m->sync->nretired++;
+        return;
+    }
+    node_release(m, n);
+}
+
+/**
+ * @brief Free every retired node and value; a grace period must have passed.
+ *
+ * @param m Pointer to a MAP_CONCURRENT map_t.
+ */
+static void sync_free_retired(map_t *m)
+{
+    map_sync_t *s = m->sync;
+    map_node_t *n = s->retired;
+    map_retired_value_t *v = s->retired_vals;
+    s->retired = NULL;
+    s->retired_vals = NULL;
+    s->nretired = 0;
+    while (n)
+    {
+        map_node_t *next = n->parent;
+        node_release(m, n);
+        n = next;
+    }
+    while (v)
+    {
+        map_retired_value_t *next = v->next;
+        map_drop_value(m, v->value);
+        free(v);
+        v = next;
+    }
+}
+
+/**
+ * @brief Free every retired node and value once no reader can still see them.
+ *
+ * Caller holds write_lock with seq even.
+ *
+ * @param m Pointer to a MAP_CONCURRENT map_t.
+ */
+static void sync_reclaim(map_t *m)
+{
+    if (!m->sync->retired && !m->sync->retired_vals)
+        return;
+    sync_wait_readers(m->sync);
+    sync_free_retired(m);
+}
+
+/**
+ * @brief Leave a writer section: make seq even, reclaim a full batch, unlock.
+ */
+static void map_write_end(map_t *m)
+{
+    sync_publish(m->sync);
+    if (m->sync->nretired >= MAP_RETIRE_BATCH)
+        sync_reclaim(m);
+    pthread_mutex_unlock(&m->sync->write_lock);
+}
+
+/**
+ * @brief Dispose of a stored value that map_put has just replaced.
+ *
+ * MAP_CONCURRENT maps defer the free callback to the next grace period.
+ *
+ * @param m Pointer to map_t.
+ * @param value Replaced value.
+ */
+static void map_retire_value(map_t *m, void *value)
+{
+    map_sync_t *s = m->sync;
+    if (!s || !value || !m->val_free || map_arena_vals(m))
+    {
+        map_drop_value(m, value);
+        return;
+    }
+    map_retired_value_t *r = (map_retired_value_t *)malloc(sizeof(map_retired_value_t));
+    if (!r)
+    {
+        /* no record to queue it on: the tree is consistent, so wait here */
+        sync_publish(s);
+        sync_wait_readers(s);
+        map_drop_value(m, value);
+        sync_open(s);
+        return;
+    }
+    r->value = value;
+    r->next = s->retired_vals;
+    s->retired_vals = r;
+    s->nretired++;
+}
+
+/* Rotate helpers return new subtree root and maintain parent pointers */
+
+/**
+ * @brief Perform a right rotation on subtree rooted at y.
+ *
+ * After rotation this function returns the new root (x). Parent pointers
+ * and heights are adjusted appropriately.
+ *
+ * @param y Root of subtree to rotate (must be non-NULL and have left child).
+ * @return map_node_t* New root of the rotated subtree.
+ */
+static map_node_t *rotate_right(map_node_t *y)
+{
+    map_node_t *x = y->left;
+    map_node_t *T2 = x->right;
+
+    MAP_LINK_STORE(x->right, y);
+    MAP_LINK_STORE(y->left, T2);
+
+    if (T2)
+        T2->parent = y;
+
+    x->parent = y->parent;
+    y->parent = x;
+
+    update_height(y);
+    update_height(x);
+    return x;
+}
+
+/**
+ * @brief Perform a left rotation on subtree rooted at x.
+ *
+ * After rotation this function returns the new root (y). Parent pointers
+ * and heights are adjusted appropriately.
+ *
+ * @param x Root of subtree to rotate (must be non-NULL and have right child).
+ * @return map_node_t* New root of the rotated subtree.
+ */
+static map_node_t *rotate_left(map_node_t *x)
+{
+    map_node_t *y = x->right;
+    map_node_t *T2 = y->left;
+
+    MAP_LINK_STORE(y->left, x);
+    MAP_LINK_STORE(x->right, T2);
+
+    if (T2)
+        T2->parent = x;
+
+    y->parent = x->parent;
+    x->parent = y;
+
+    update_height(x);
+    update_height(y);
+    return y;
+}
+
+/* Helper to replace parent's child pointer with new child (or set root if parent NULL) */
+
+/**
+ * @brief Replace parent's pointer from old_child to new_child.
+ *
+ * If parent is NULL, new_child becomes the map root. Parent pointers are
+ * updated for new_child if non-NULL.
+ *
+ * @param m Pointer to the map owning the tree.
+ * @param parent Parent node whose child pointer should be updated (may be NULL).
+ * @param old_child The previous child pointer (used to decide left/right).
+ * @param new_child The new child to attach (may be NULL).
+ */
+static void set_child(map_t *m, map_node_t *parent, map_node_t *old_child, map_node_t *new_child)
+{
+    if (!parent)
+    {
+        MAP_LINK_STORE(m->root, new_child);
+        if (new_child)
+            new_child->parent = NULL;
+    }
+    else
+    {
+        if (parent->left == old_child)
+            MAP_LINK_STORE(parent->left, new_child);
+        else
+            MAP_LINK_STORE(parent->right, new_child);
+        if (new_child)
+            new_child->parent = parent;
+    }
+}
+
+/* Rebalance at node and return the node that occupies this position after rebalancing */
+
+/**
+ * @brief Rebalance the subtree rooted at node if needed and return new subroot.
+ *
+ * This function computes the AVL balance factor, performs the necessary
+ * single/double rotations (LL, LR, RR, RL), updates heights and parent
+ * pointers, and returns the node that should occupy the original node's
+ * position after rebalancing.
+ *
+ * @param m Pointer to the map (unused for logic but kept for symmetry).
+ * @param node Root of subtree to rebalance (must be non-NULL).
+ * @return map_node_t* New root of the rebalanced subtree (may be same as node).
+ */
+static map_node_t *rebalance_at(map_t *m, map_node_t *node)
+{
+    update_height(node);
+    int balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1)
+    {
+        /* left heavy */
+        if (node_height(node->left->left) >= node_height(node->left->right))
+        {
+            /* LL case */
+            MAP_STAT_INC(m, rotations);
+            map_node_t *new_root = rotate_right(node);
+            return new_root;
+        }
+        else
+        {
+            /* LR case */
+            MAP_STAT_ADD(m, rotations, 2);
+            MAP_LINK_STORE(node->left, rotate_left(node->left));
+            if (node->left)
+                node->left->parent = node;
+            map_node_t *new_root = rotate_right(node);
+            return new_root;
+        }
+    }
+    else if (balance < -1)
+    {
+        /* right heavy */
+        if (node_height(node->right->right) >= node_height(node->right->left))
+        {
+            /* RR case */
+            MAP_STAT_INC(m, rotations);
+            map_node_t *new_root = rotate_left(node);
+            return new_root;
+        }
+        else
+        {
+            /* RL case */
+            MAP_STAT_ADD(m, rotations, 2);
+            MAP_LINK_STORE(node->right, rotate_right(node->right));
+            if (node->right)
+                node->right->parent = node;
+            map_node_t *new_root = rotate_left(node);
+            return new_root;
+        }
+    }
+    return node;
+}
+
+/* ---- B+tree backend ----
+ *
+ * Leaves hold up to MAP_BTREE_KEYS sorted key/value pairs and are chained
+ * for in-order iteration. Inner nodes hold separators with the invariant
+ * child[i] < keys[i] <= child[i + 1]; every separator points at a key that
+ * is currently stored in some leaf, so no extra key copies are needed.
+ *
+ * An iterator into a leaf is the leaf address with the slot index packed
+ * into the low bits and bit 0 set. AVL nodes come from malloc and are
+ * always even, so the tag tells the two iterator kinds apart.
+ */
+
+#define BT_MIN_KEYS (MAP_BTREE_KEYS / 2)
+#define BT_MAX_LEVELS 32
+#define BT_ITER_TAG ((uintptr_t)1)
+
+typedef struct bt_leaf
+{
+    unsigned n;
+    struct bt_leaf *next;
+    struct bt_leaf *prev;
+    void *raw; /* block returned by malloc; the leaf itself is aligned inside */
+    void *keys[MAP_BTREE_KEYS];
+    void *vals[MAP_BTREE_KEYS];
+} bt_leaf_t;
+
+typedef struct bt_inner
+{
+    unsigned n; /* number of separators; n + 1 children */
+    void *keys[MAP_BTREE_KEYS];
+    void *child[MAP_BTREE_KEYS + 1];
+} bt_inner_t;
+
+/**
+ * @brief Build a tagged iterator for slot i of a leaf.
+ *
+ * @param leaf Aligned leaf.
+ * @param i Slot index (< MAP_BTREE_KEYS).
+ * @return map_iter_t Tagged iterator.
+ */
+static map_iter_t bt_iter_make(bt_leaf_t *leaf, unsigned i)
+{
+    return (map_iter_t)((uintptr_t)leaf | ((uintptr_t)i << 1) | BT_ITER_TAG);
+}
+
+/**
+ * @brief Return non-zero if the iterator points into a B+tree leaf.
+ *
+ * @param it Iterator (may be NULL).
+ * @return int Non-zero for B+tree iterators.
+ */
+static int bt_iter_is(map_iter_t it) { return ((uintptr_t)it & BT_ITER_TAG) != 0; }
+
+/**
+ * @brief Extract the leaf from a tagged iterator.
+ *
+ * @param it B+tree iterator.
+ * @return bt_leaf_t* Leaf the iterator points into.
+ */
+static bt_leaf_t *bt_iter_leaf(map_iter_t it)
+{
+    return (bt_leaf_t *)((uintptr_t)it & ~(uintptr_t)(BT_LEAF_ALIGN - 1));
+}
+
+/**
+ * @brief Extract the slot index from a tagged iterator.
+ *
+ * @param it B+tree iterator.
+ * @return unsigned Slot index inside the leaf.
+ */
+static unsigned bt_iter_slot(map_iter_t it)
+{
+    return (unsigned)(((uintptr_t)it & (BT_LEAF_ALIGN - 1)) >> 1);
+}
+
+/**
+ * @brief Allocate an empty, BT_LEAF_ALIGN-aligned leaf.
+ *
+ * @param m Owning map (arena mode allocates from its slab pages).
+ * @return bt_leaf_t* New leaf or NULL on OOM.
+ */
+static bt_leaf_t *bt_leaf_new(map_t *m)
+{
+    bt_leaf_t *leaf;
+    void *raw = NULL;
+    if (m->flags & MAP_ARENA)
+    {
+        leaf = (bt_leaf_t *)arena_get(&m->arena, ARENA_BT_LEAF, sizeof(bt_leaf_t), BT_LEAF_ALIGN);
+        if (!leaf)
+            return NULL;
+    }
+    else
+    {
+        raw = malloc(sizeof(bt_leaf_t) + BT_LEAF_ALIGN - 1);
+        if (!raw)
+            return NULL;
+        leaf = (bt_leaf_t *)(((uintptr_t)raw + BT_LEAF_ALIGN - 1) & ~(uintptr_t)(BT_LEAF_ALIGN - 1));
+    }
+    leaf->raw = raw;
+    leaf->n = 0;
+    leaf->next = leaf->prev = NULL;
+    MAP_STAT_INC(m, allocs);
+    MAP_STAT_ADD(m, live_bytes, sizeof(bt_leaf_t));
+    return leaf;
+}
+
+/**
+ * @brief Release a leaf allocated by bt_leaf_new.
+ *
+ * @param m Owning map.
+ * @param leaf Leaf to release.
+ */
+static void bt_leaf_delete(map_t *m, bt_leaf_t *leaf)
+{
+    MAP_STAT_INC(m, frees);
+    MAP_STAT_SUB(m, live_bytes, sizeof(bt_leaf_t));
+    if (m->flags & MAP_ARENA)
+        arena_put(&m->arena, ARENA_BT_LEAF, leaf);
+    else
+        free(leaf->raw);
+}
+
+/**
+ * @brief Allocate an empty inner node.
+ *
+ * @param m Owning map (arena mode allocates from its slab pages).
+ * @return bt_inner_t* New inner node or NULL on OOM.
+ */
+static bt_inner_t *bt_inner_new(map_t *m)
+{
+    bt_inner_t *in;
+    if (m->flags & MAP_ARENA)
+        in = (bt_inner_t *)arena_get(&m->arena, ARENA_BT_INNER, sizeof(bt_inner_t), sizeof(void *));
+    else
+        in = (bt_inner_t *)malloc(sizeof(bt_inner_t));
+    if (in)
+    {
+        in->n = 0;
+        MAP_STAT_INC(m, allocs);
+        MAP_STAT_ADD(m, live_bytes, sizeof(bt_inner_t));
+    }
+    return in;
+}
+
+/**
+ * @brief Release an inner node allocated by bt_inner_new.
+ *
+ * @param m Owning map.
+ * @param in Inner node to release.
+ */
+static void bt_inner_delete(map_t *m, bt_inner_t *in)
+{
+    MAP_STAT_INC(m, frees);
+    MAP_STAT_SUB(m, live_bytes, sizeof(bt_inner_t));
+    if (m->flags & MAP_ARENA)
+        arena_put(&m->arena, ARENA_BT_INNER, in);
+    else
+        free(in);
+}
+
+/**
+ * @brief Return the first slot whose key is >= key (binary search).
+ *
+ * @param m Pointer to map_t (for cmp).
+ * @param keys Sorted key array.
+ * @param n Number of keys.
+ * @param key Search key.
+ * @return unsigned Slot index in [0, n].
+ */
+static unsigned bt_lower(map_t *m, void *const *keys, unsigned n, const void *key)
+{
+    unsigned lo = 0, hi = n;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (MAP_CMP(m, key, keys[mid]) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Return the first slot whose key is > key (binary search).
+ *
+ * For inner nodes this is the index of the child to descend into.
+ *
+ * @param m Pointer to map_t (for cmp).
+ * @param keys Sorted key array.
+ * @param n Number of keys.
+ * @param key Search key.
+ * @return unsigned Slot index in [0, n].
+ */
+static unsigned bt_upper(map_t *m, void *const *keys, unsigned n, const void *key)
+{
+    unsigned lo = 0, hi = n;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (MAP_CMP(m, key, keys[mid]) >= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Return the smallest key stored in a subtree.
+ *
+ * @param node Subtree root.
+ * @param lvl Level of node (0 = leaf).
+ * @return void* Smallest key.
+ */
+static void *bt_min_key(void *node, int lvl)
+{
+    for (; lvl > 0; --lvl)
+        node = ((bt_inner_t *)node)->child[0];
+    return ((bt_leaf_t *)node)->keys[0];
+}
+
+/**
+ * @brief Find the iterator for key, or NULL if absent.
+ *
+ * @param m Pointer to map_t using the B+tree backend.
+ * @param key Search key.
+ * @return map_iter_t Tagged iterator or NULL.
+ */
+static map_iter_t bt_find(map_t *m, const void *key)
+{
+    void *node = m->bt_root;
+    if (!node)
+        return NULL;
+    for (int lvl = m->bt_levels; lvl > 0; --lvl)
+    {
+        bt_inner_t *in = (bt_inner_t *)node;
+        node = in->child[bt_upper(m, in->keys, in->n, key)];
+    }
+    bt_leaf_t *leaf = (bt_leaf_t *)node;
+    unsigned i = bt_lower(m, leaf->keys, leaf->n, key);
+    if (i < leaf->n && MAP_CMP(m, key, leaf->keys[i]) == 0)
+        return bt_iter_make(leaf, i);
+    return NULL;
+}
+
+/**
+ * @brief Insert slot i into a non-full leaf.
+ */
+static void bt_leaf_put_at(bt_leaf_t *leaf, unsigned i, void *key, void *value)
+{
+    memmove(&leaf->keys[i + 1], &leaf->keys[i], (leaf->n - i) * sizeof(void *));
+    memmove(&leaf->vals[i + 1], &leaf->vals[i], (leaf->n - i) * sizeof(void *));
+    leaf->keys[i] = key;
+    leaf->vals[i] = value;
+    leaf->n++;
+}
+
+/**
+ * @brief Insert separator key and right child at slot i of a non-full inner node.
+ */
+static void bt_inner_put_at(bt_inner_t *in, unsigned i, void *key, void *right)
+{
+    memmove(&in->keys[i + 1], &in->keys[i], (in->n - i) * sizeof(void *));
+    memmove(&in->child[i + 2], &in->child[i + 1], (in->n - i) * sizeof(void *));
+    in->keys[i] = key;
+    in->child[i + 1] = right;
+    in->n++;
+}
+
+/**
+ * @brief Remove separator i and child i + 1 from an inner node.
+ */
+static void bt_inner_remove(bt_inner_t *in, unsigned i)
+{
+    memmove(&in->keys[i], &in->keys[i + 1], (in->n - i - 1) * sizeof(void *));
+    memmove(&in->child[i + 1], &in->child[i + 2], (in->n - i - 1) * sizeof(void *));
+    in->n--;
+}
+
+/**
+ * @brief Insert or (if replace is set) assign a key in the B+tree.
+ *
+ * The root-to-leaf path is recorded, and every node a split will need is
+ * allocated before anything is modified, so OOM leaves the tree unchanged.
+ *
+ * @param m Pointer to map_t using the B+tree backend.
+ * @param key Key to insert.
+ * @param value Value to insert.
+ * @param replace Non-zero to replace the value of an existing key.
+ * @return int 1 if inserted, 2 if replaced, 0 if key existed, -1 on OOM.
+ */
+static int bt_insert(map_t *m, void *key, void *value, int replace)
+{
+    bt_inner_t *path[BT_MAX_LEVELS];
+    unsigned slot[BT_MAX_LEVELS];
+
+    if (!m->bt_root)
+    {
+        bt_leaf_t *leaf = bt_leaf_new(m);
+        if (!leaf)
+            return -1;
+        m->bt_root = leaf;
+        m->bt_levels = 0;
+    }
+
+    void *node = m->bt_root;
+    for (int d = 0; d < m->bt_levels; ++d)
+    {
+        path[d] = (bt_inner_t *)node;
+        slot[d] = bt_upper(m, path[d]->keys, path[d]->n, key);
+        node = path[d]->child[slot[d]];
+    }
+    bt_leaf_t *leaf = (bt_leaf_t *)node;
+    unsigned i = bt_lower(m, leaf->keys, leaf->n, key);
+    if (i < leaf->n && MAP_CMP(m, key, leaf->keys[i]) == 0)
+    {
+        if (!replace)
+            return 0;
+        map_drop_value(m, leaf->vals[i]);
+        leaf->vals[i] = map_store_value(m, value);
+        return 2;
+    }
+
+    /* reserve the nodes the splits will need: the leaf, every full inner
+       node above it, and a new root if the split reaches the top */
+    void *spare[BT_MAX_LEVELS + 2];
+    int nspare = 0;
+    if (leaf->n == MAP_BTREE_KEYS)
+    {
+        int need = 1, d = m->bt_levels - 1;
+        while (d >= 0 && path[d]->n == MAP_BTREE_KEYS)
+        {
+            need++;
+            d--;
+        }
+        if (d < 0)
+            need++; /* new root */
+        if (m->bt_levels + 1 >= BT_MAX_LEVELS)
+            return -1;
+        for (int s = 0; s < need; ++s)
+        {
+            spare[nspare] = (s == 0) ? (void *)bt_leaf_new(m) : (void *)bt_inner_new(m);
+            if (!spare[nspare])
+            {
+                if (nspare > 0)
+                    bt_leaf_delete(m, (bt_leaf_t *)spare[0]);
+                for (int t = 1; t < nspare; ++t)
+                    bt_inner_delete(m, (bt_inner_t *)spare[t]);
+                return -1;
+            }
+            nspare++;
+        }
+    }
+
+    void *k = map_store_key(m, key);
+    void *v = map_store_value(m, value);
+    m->size++;
+    MAP_STAT_INC(m, inserts);
+    if (leaf->n < MAP_BTREE_KEYS)
+    {
+        bt_leaf_put_at(leaf, i, k, v);
+        return 1;
+    }
+
+    /* split the leaf: left keeps h entries, right gets the rest */
+    MAP_STAT_INC(m, splits);
+    int used = 0;
+    bt_leaf_t *nl = (bt_leaf_t *)spare[used++];
+    unsigned h = (MAP_BTREE_KEYS + 1) / 2;
+    unsigned from = (i < h) ? h - 1 : h;
+    nl->n = MAP_BTREE_KEYS - from;
+    memcpy(nl->keys, &leaf->keys[from], nl->n * sizeof(void *));
+    memcpy(nl->vals, &leaf->vals[from], nl->n * sizeof(void *));
+    leaf->n = from;
+    if (i < h)
+        bt_leaf_put_at(leaf, i, k, v);
+    else
+        bt_leaf_put_at(nl, i - h, k, v);
+    nl->next = leaf->next;
+    if (nl->next)
+        nl->next->prev = nl;
+    nl->prev = leaf;
+    leaf->next = nl;
+
+    void *sep = nl->keys[0];
+    void *right = nl;
+    for (int d = m->bt_levels - 1; d >= 0; --d)
+    {
+        bt_inner_t *in = path[d];
+        unsigned at = slot[d];
+        if (in->n < MAP_BTREE_KEYS)
+        {
+            bt_inner_put_at(in, at, sep, right);
+            return 1;
+        }
+        /* split the inner node through temporaries holding n + 1 separators */
+        MAP_STAT_INC(m, splits);
+        void *tk[MAP_BTREE_KEYS + 1];
+        void *tc[MAP_BTREE_KEYS + 2];
+        memcpy(tk, in->keys, at * sizeof(void *));
+        tk[at] = sep;
+        memcpy(&tk[at + 1], &in->keys[at], (MAP_BTREE_KEYS - at) * sizeof(void *));
+        memcpy(tc, in->child, (at + 1) * sizeof(void *));
+        tc[at + 1] = right;
+        memcpy(&tc[at + 2], &in->child[at + 1], (MAP_BTREE_KEYS - at) * sizeof(void *));
+
+        unsigned mid = (MAP_BTREE_KEYS + 1) / 2;
+        bt_inner_t *ni = (bt_inner_t *)spare[used++];
+        in->n = mid;
+        memcpy(in->keys, tk, mid * sizeof(void *));
+        memcpy(in->child, tc, (mid + 1) * sizeof(void *));
+        ni->n = MAP_BTREE_KEYS - mid;
+        memcpy(ni->keys, &tk[mid + 1], ni->n * sizeof(void *));
+        memcpy(ni->child, &tc[mid + 1], (ni->n + 1) * sizeof(void *));
+        sep = tk[mid];
+        right = ni;
+    }
+
+    /* the split reached the root: grow the tree by one level */
+    bt_inner_t *root = (bt_inner_t *)spare[used++];
+    root->n = 1;
+    root->keys[0] = sep;
+    root->child[0] = m->bt_root;
+    root->child[1] = right;
+    m->bt_root = root;
+    m->bt_levels++;
+    return 1;
+}
+
+/**
+ * @brief Repair an underfull leaf child ci of p by borrowing or merging.
+ *
+ * @param m Owning map.
+ * @param p Parent inner node.
+ * @param ci Index of the underfull child.
+ */
+static void bt_fix_leaf(map_t *m, bt_inner_t *p, unsigned ci)
+{
+    bt_leaf_t *c = (bt_leaf_t *)p->child[ci];
+    bt_leaf_t *l = ci > 0 ? (bt_leaf_t *)p->child[ci - 1] : NULL;
+    bt_leaf_t *r = ci < p->n ? (bt_leaf_t *)p->child[ci + 1] : NULL;
+
+    if (l && l->n > BT_MIN_KEYS)
+    {
+        /* borrow the largest entry of the left sibling */
+        l->n--;
+        bt_leaf_put_at(c, 0, l->keys[l->n], l->vals[l->n]);
+        p->keys[ci - 1] = c->keys[0];
+    }
+    else if (r && r->n > BT_MIN_KEYS)
+    {
+        /* borrow the smallest entry of the right sibling */
+        c->keys[c->n] = r->keys[0];
+        c->vals[c->n] = r->vals[0];
+        c->n++;
+        r->n--;
+        memmove(r->keys, &r->keys[1], r->n * sizeof(void *));
+        memmove(r->vals, &r->vals[1], r->n * sizeof(void *));
+        p->keys[ci] = r->keys[0];
+    }
+    else
+    {
+        /* merge the right one of the pair into the left one */
+        unsigned li = r ? ci : ci - 1;
+        bt_leaf_t *a = (bt_leaf_t *)p->child[li];
+        bt_leaf_t *b = (bt_leaf_t *)p->child[li + 1];
+        memcpy(&a->keys[a->n], b->keys, b->n * sizeof(void *));
+        memcpy(&a->vals[a->n], b->vals, b->n * sizeof(void *));
+        a->n += b->n;
+        a->next = b->next;
+        if (a->next)
+            a->next->prev = a;
+        bt_inner_remove(p, li);
+        bt_leaf_delete(m, b);
+    }
+}
+
+/**
+ * @brief Repair an underfull inner child ci of p by rotating or merging.
+ *
+ * @param m Owning map.
+ * @param p Parent inner node.
+ * @param ci Index of the underfull child.
+ */
+static void bt_fix_inner(map_t *m, bt_inner_t *p, unsigned ci)
+{
+    bt_inner_t *c = (bt_inner_t *)p->child[ci];
+    bt_inner_t *l = ci > 0 ? (bt_inner_t *)p->child[ci - 1] : NULL;
+    bt_inner_t *r = ci < p->n ? (bt_inner_t *)p->child[ci + 1] : NULL;
+
+    if (l && l->n > BT_MIN_KEYS)
+    {
+        /* rotate right through the parent separator */
+        memmove(&c->keys[1], c->keys, c->n * sizeof(void *));
+        memmove(&c->child[1], c->child, (c->n + 1) * sizeof(void *));
+        c->keys[0] = p->keys[ci - 1];
+        c->child[0] = l->child[l->n];
+        c->n++;
+        p->keys[ci - 1] = l->keys[l->n - 1];
+        l->n--;
+    }
+    else if (r && r->n > BT_MIN_KEYS)
+    {
+        /* rotate left through the parent separator */
+        c->keys[c->n] = p->keys[ci];
+        c->child[c->n + 1] = r->child[0];
+        c->n++;
+        p->keys[ci] = r->keys[0];
+        memmove(r->keys, &r->keys[1], (r->n - 1) * sizeof(void *));
+        memmove(r->child, &r->child[1], r->n * sizeof(void *));
+        r->n--;
+    }
+    else
+    {
+        /* merge the pair, pulling the parent separator down between them */
+        unsigned li = r ? ci : ci - 1;
+        bt_inner_t *a = (bt_inner_t *)p->child[li];
+        bt_inner_t *b = (bt_inner_t *)p->child[li + 1];
+        a->keys[a->n] = p->keys[li];
+        memcpy(&a->keys[a->n + 1], b->keys, b->n * sizeof(void *));
+        memcpy(&a->child[a->n + 1], b->child, (b->n + 1) * sizeof(void *));
+        a->n += b->n + 1;
+        bt_inner_remove(p, li);
+        bt_inner_delete(m, b);
+    }
+}
+
+/**
+ * @brief Unlink key from the B+tree and hand back its stored key and value.
+ *
+ * Underfull nodes are repaired bottom-up along the recorded path. If the
+ * erased key was also used as a separator, those separators are redirected
+ * to the smallest key of their right subtree, so the caller may free it.
+ *
+ * @param m Pointer to map_t using the B+tree backend.
+ * @param key Key to erase.
+ * @param key_out Receives the stored key pointer.
+ * @param val_out Receives the stored value pointer.
+ * @return int 1 if removed, 0 if not found.
+ */
+static int bt_remove(map_t *m, const void *key, void **key_out, void **val_out)
+{
+    bt_inner_t *path[BT_MAX_LEVELS];
+    unsigned slot[BT_MAX_LEVELS];
+    int is_sep = 0;
+
+    void *node = m->bt_root;
+    if (!node)
+        return 0;
+    for (int d = 0; d < m->bt_levels; ++d)
+    {
+        path[d] = (bt_inner_t *)node;
+        slot[d] = bt_upper(m, path[d]->keys, path[d]->n, key);
+        if (slot[d] > 0 && MAP_CMP(m, key, path[d]->keys[slot[d] - 1]) == 0)
+            is_sep = 1;
+        node = path[d]->child[slot[d]];
+    }
+    bt_leaf_t *leaf = (bt_leaf_t *)node;
+    unsigned i = bt_lower(m, leaf->keys, leaf->n, key);
+    if (i >= leaf->n || MAP_CMP(m, key, leaf->keys[i]) != 0)
+        return 0;
+
+    void *ek = leaf->keys[i];
+    void *ev = leaf->vals[i];
+    leaf->n--;
+    memmove(&leaf->keys[i], &leaf->keys[i + 1], (leaf->n - i) * sizeof(void *));
+    memmove(&leaf->vals[i], &leaf->vals[i + 1], (leaf->n - i) * sizeof(void *));
+    m->size--;
+    MAP_STAT_INC(m, erases);
+
+    /* repair underflow walking up */
+    unsigned cnt = leaf->n;
+    for (int d = m->bt_levels - 1; d >= 0 && cnt < BT_MIN_KEYS; --d)
+    {
+        if (d == m->bt_levels - 1)
+            bt_fix_leaf(m, path[d], slot[d]);
+        else
+            bt_fix_inner(m, path[d], slot[d]);
+        cnt = path[d]->n;
+    }
+
+    /* shrink the root */
+    if (m->bt_levels > 0 && ((bt_inner_t *)m->bt_root)->n == 0)
+    {
+        bt_inner_t *old = (bt_inner_t *)m->bt_root;
+        m->bt_root = old->child[0];
+        m->bt_levels--;
+        bt_inner_delete(m, old);
+    }
+    else if (m->bt_levels == 0 && ((bt_leaf_t *)m->bt_root)->n == 0)
+    {
+        bt_leaf_delete(m, (bt_leaf_t *)m->bt_root);
+        m->bt_root = NULL;
+    }
+
+    /* separators must never point at freed keys */
+    if (is_sep && m->bt_root)
+    {
+        node = m->bt_root;
+        for (int lvl = m->bt_levels; lvl > 0; --lvl)
+        {
+            bt_inner_t *in = (bt_inner_t *)node;
+            unsigned j = bt_upper(m, in->keys, in->n, ek);
+            if (j > 0 && in->keys[j - 1] == ek)
+                in->keys[j - 1] = bt_min_key(in->child[j], lvl - 1);
+            node = in->child[j];
+        }
+    }
+
+    *key_out = ek;
+    *val_out = ev;
+    return 1;
+}
+
+/**
+ * @brief Remove key from the B+tree and release its stored key and value.
+ *
+ * @return int 1 if erased, 0 if not found.
+ */
+static int bt_erase(map_t *m, const void *key)
+{
+    void *ek;
+    void *ev;
+    if (!bt_remove(m, key, &ek, &ev))
+        return 0;
+    map_drop_key(m, ek);
+    map_drop_value(m, ev);
+    return 1;
+}
+
+/**
+ * @brief Free a B+tree subtree, applying key/value free callbacks in leaves.
+ *
+ * @param m Pointer to map_t owning the nodes.
+ * @param node Subtree root.
+ * @param lvl Level of node (0 = leaf).
+ */
+static void bt_free_subtree(map_t *m, void *node, int lvl)
+{
+    if (lvl > 0)
+    {
+        bt_inner_t *in = (bt_inner_t *)node;
+        for (unsigned i = 0; i <= in->n; ++i)
+            bt_free_subtree(m, in->child[i], lvl - 1);
+        bt_inner_delete(m, in);
+        return;
+    }
+    bt_leaf_t *leaf = (bt_leaf_t *)node;
+    for (unsigned i = 0; i < leaf->n; ++i)
+    {
+        map_drop_key(m, leaf->keys[i]);
+        map_drop_value(m, leaf->vals[i]);
+    }
+    bt_leaf_delete(m, leaf);
+}
+
+/**
+ * @brief Return iterator to the smallest entry of the B+tree.
+ *
+ * @param m Pointer to map_t using the B+tree backend.
+ * @return map_iter_t Tagged iterator or NULL if empty.
+ */
+static map_iter_t bt_begin(map_t *m)
+{
+    void *node = m->bt_root;
+    if (!node)
+        return NULL;
+    for (int lvl = m->bt_levels; lvl > 0; --lvl)
+        node = ((bt_inner_t *)node)->child[0];
+    return bt_iter_make((bt_leaf_t *)node, 0);
+}
+
+/**
+ * @brief Advance a B+tree iterator along the leaf chain.
+ *
+ * @param it Tagged iterator.
+ * @return map_iter_t Next iterator or NULL at end.
+ */
+static map_iter_t bt_next(map_iter_t it)
+{
+    bt_leaf_t *leaf = bt_iter_leaf(it);
+    unsigned i = bt_iter_slot(it) + 1;
+    if (i < leaf->n)
+        return bt_iter_make(leaf, i);
+    return leaf->next ? bt_iter_make(leaf->next, 0) : NULL;
+}
+
+/**
+ * @brief Move a B+tree iterator back along the leaf chain.
+ *
+ * @param it Tagged iterator.
+ * @return map_iter_t Previous iterator or NULL at begin.
+ */
+static map_iter_t bt_prev(map_iter_t it)
+{
+    bt_leaf_t *leaf = bt_iter_leaf(it);
+    unsigned i = bt_iter_slot(it);
+    if (i > 0)
+        return bt_iter_make(leaf, i - 1);
+    return leaf->prev ? bt_iter_make(leaf->prev, leaf->prev->n - 1) : NULL;
+}
+
+/* ---- Snapshot backend (map_save / map_open_mmap) ----
+ *
+ * A snapshot file is a header, an array of fixed-size entries and the key
+ * and value bytes. Entries are stored in Eytzinger (BFS) order: entry i
+ * has children 2i and 2i + 1, entry 0 is unused, so a lookup walks the
+ * array top-down and its first few levels share cache lines. Every offset
+ * in an entry is relative to the entry itself, which makes the file
+ * position-independent: once mmap'ed it is queried in place, read-only,
+ * with no deserialisation, and processes mapping the same file share one
+ * physical copy. next/prev link each entry to its in-order neighbours for
+ * iteration.
+ *
+ * An iterator is an entry address with bit 1 set (bit 0 clear, unlike
+ * B+tree iterators); entries are 32 bytes in a page-aligned mapping, so
+ * the low bits are free.
+ */
+
+#define SNAP_MAGIC "MAPSNAP"
+#define SNAP_VERSION 1u
+#define SNAP_ENDIAN 0x01020304u
+#define SNAP_ALIGN 16 /* key/value bytes are aligned like arena copies */
+#define SNAP_ITER_TAG ((uintptr_t)2)
+#define SNAP_STRING_KEYS 0x1u /* header flag: keys are C strings */
+
+typedef struct map_snap_header
+{
+    char magic[8];        /* SNAP_MAGIC, NUL padded */
+    uint32_t version;     /* SNAP_VERSION */
+    uint32_t endian;      /* SNAP_ENDIAN as written by this machine */
+    uint64_t count;       /* entries 1..count are used */
+    uint64_t entries_off; /* from the file start, 64-byte aligned */
+    uint64_t file_size;
+    uint32_t entry_size; /* sizeof(map_snap_entry_t) */
+    uint32_t flags;      /* SNAP_* */
+    uint64_t reserved[2];
+} map_snap_header_t;
+
+typedef struct map_snap_entry
+{
+    int64_t key_off; /* key bytes, from this entry */
+    int64_t val_off; /* value bytes, from this entry; 0 for a NULL value */
+    int32_t next;    /* in-order successor, in entries from this one; 0 at the end */
+    int32_t prev;    /* in-order predecessor; 0 at the start */
+    uint32_t key_len;
+    uint32_t val_len;
+} map_snap_entry_t;
+
+/**
+ * @brief Return non-zero if the iterator points at a snapshot entry.
+ */
+static int snap_iter_is(map_iter_t it) { return ((uintptr_t)it & 3u) == SNAP_ITER_TAG; }
+
+/**
+ * @brief Tagged iterator for a snapshot entry (NULL stays NULL).
+ */
+static map_iter_t snap_iter_make(const map_snap_entry_t *e)
+{
+    return e ? (map_iter_t)((uintptr_t)e | SNAP_ITER_TAG) : NULL;
+}
+
+/**
+ * @brief Entry behind a tagged snapshot iterator.
+ */
+static const map_snap_entry_t *snap_iter_entry(map_iter_t it)
+{
+    return (const map_snap_entry_t *)((uintptr_t)it & ~(uintptr_t)3);
+}
+
+/**
+ * @brief Key bytes of a snapshot entry.
+ */
+static void *snap_key(const map_snap_entry_t *e) { return (void *)((const char *)e + e->key_off); }
+
+/**
+ * @brief Value bytes of a snapshot entry, or NULL.
+ */
+static void *snap_value(const map_snap_entry_t *e)
+{
+    return e->val_off ? (void *)((const char *)e + e->val_off) : NULL;
+}
+
+/**
+ * @brief The entry array of a snapshot map (index 0 unused).
+ */
+static const map_snap_entry_t *snap_entries(const map_t *m)
+{
+    const map_snap_header_t *h = (const map_snap_header_t *)m->snap;
+    return (const map_snap_entry_t *)(m->snap + h->entries_off);
+}
+
+/**
+ * @brief Eytzinger index of the first key in order (leftmost), 0 if n == 0.
+ */
+static size_t eyt_first(size_t n)
+{
+    size_t i = n ? 1 : 0;
+    while (i && 2 * i <= n)
+        i *= 2;
+    return i;
+}
+
+/**
+ * @brief Eytzinger index of the in-order successor of i, 0 past the last.
+ */
+static size_t eyt_next(size_t i, size_t n)
+{
+    if (2 * i + 1 <= n)
+    {
+        i = 2 * i + 1;
+        while (2 * i <= n)
+            i *= 2;
+        return i;
+    }
+    while (i & 1) /* climb while i is a right child */
+        i >>= 1;
+    return i >> 1;
+}
+
+/**
+ * @brief Find key in a snapshot map by walking the Eytzinger array.
+ */
+static const map_snap_entry_t *snap_find(map_t *m, const void *key)
+{
+    const map_snap_entry_t *e = snap_entries(m);
+    size_t n = m->size;
+    size_t i = 1;
+    while (i <= n)
+    {
+        int c = MAP_CMP(m, key, snap_key(&e[i]));
+        if (c == 0)
+            return &e[i];
+        i = 2 * i + (c > 0);
+    }
+    return NULL;
+}
+
+/**
+ * @brief First snapshot entry whose key is >= key (upper: > key), or NULL.
+ */
+static const map_snap_entry_t *snap_bound(map_t *m, const void *key, int upper)
+{
+    const map_snap_entry_t *e = snap_entries(m);
+    size_t n = m->size;
+    size_t i = 1;
+    size_t best = 0;
+    while (i <= n)
+    {
+        int c = MAP_CMP(m, key, snap_key(&e[i]));
+        if (c < 0 || (c == 0 && !upper))
+        {
+            best = i;
+            i = 2 * i;
+        }
+        else
+            i = 2 * i + 1;
+    }
+    return best ? &e[best] : NULL;
+}
+
+/* Public API */
+
+/**
+ * @brief Create a new map instance with explicit options.
+ *
+ * Same as map_create, plus opts selecting the storage backend. All public
+ * functions (including the iterator functions) work with either backend.
+ *
+ * With MAP_ARENA in opts->flags, nodes are carved from slab pages owned by
+ * the map. If opts->key_len / opts->val_len are given, keys / values are
+ * copied into the pages too (key_dup/val_dup and key_free/val_free are then
+ * not used for them), and map_clear/map_destroy release everything in
+ * O(pages) without walking the tree. Erased nodes are recycled; bytes of
+ * erased or replaced arena copies are only reclaimed by map_clear, so the
+ * mode suits short-lived maps.
+ *
+ * MAP_HUGE_PAGES (implies MAP_ARENA) maps the arena pages as huge pages of
+ * opts->arena_page bytes (MAP_HUGE_PAGE, 2 MiB, by default; 1 GiB pages
+ * need a reserved pool), so a large tree is covered by few TLB entries.
+ * opts->numa with opts->numa_nodes binds or interleaves the mapped pages
+ * across NUMA nodes; it also makes plain MAP_ARENA pages come from mmap.
+ *
+ * With MAP_CONCURRENT (AVL backend only), map_find may run in any number
+ * of threads inside map_read_begin/map_read_end sections, concurrently with
+ * writers, and the values it returns stay valid until the section ends.
+ * Writers (insert/put/erase/clear/bulk load) serialise on an internal lock.
+ * Iteration must be bracketed by map_iter_lock/map_iter_unlock.
+ *
+ * With MAP_STRING_KEYS (AVL backend, not MAP_CONCURRENT), keys are C
+ * strings ordered like strcmp; cmp, key_dup, key_free and key_len are
+ * ignored (cmp may be NULL). The map always copies keys, into the node
+ * when shorter than MAP_STR_INLINE bytes, and stores their length and an
+ * 8-byte big-endian prefix next to the links, so most descent steps are
+ * decided by one integer compare without touching the key bytes.
+ *
+ * With opts->threads > 1, bulk loads, set operations, map_for_each and
+ * map_clear/map_destroy of AVL maps with at least MAP_PAR_MIN entries
+ * use up to that many threads (at most MAP_PAR_MAX_THREADS), so the
+ * callbacks must then be thread-safe.
+ *
+ * @param cmp Compare callback; must return negative/zero/positive like strcmp.
+ * @param key_dup Optional key duplication callback (may be NULL).
+ * @param key_free Optional key free callback (may be NULL).
+ * @param val_dup Optional value duplication callback (may be NULL).
+ * @param val_free Optional value free callback (may be NULL).
+ * @param opts Creation options or NULL for defaults (AVL backend).
+ * @return map_t* Newly allocated map or NULL on OOM, NULL cmp or bad options.
+ */
+map_t *map_create_ex(map_cmp_fn cmp,
+                     map_dup_fn key_dup, map_free_fn key_free,
+                     map_dup_fn val_dup, map_free_fn val_free,
+                     const map_opts_t *opts)
+{
+    map_backend_t backend = opts ? opts->backend : MAP_BACKEND_AVL;
+    if (backend != MAP_BACKEND_AVL && backend != MAP_BACKEND_BTREE)
+        return NULL;
+    unsigned flags = opts ? opts->flags : 0;
+    if ((flags & MAP_CONCURRENT) && backend != MAP_BACKEND_AVL)
+        return NULL;
+    size_t huge_page = opts && opts->arena_page ? opts->arena_page : MAP_HUGE_PAGE;
+    unsigned numa = opts ? opts->numa : MAP_NUMA_DEFAULT;
+    if ((huge_page & (huge_page - 1)) || huge_page < 4096 || numa > MAP_NUMA_INTERLEAVE)
+        return NULL;
+    if (flags & MAP_HUGE_PAGES)
+        flags |= MAP_ARENA;
+    if ((flags & MAP_STRING_KEYS) && (backend != MAP_BACKEND_AVL || (flags & MAP_CONCURRENT)))
+        return NULL;
+    if (flags & MAP_STRING_KEYS)
+    {
+        cmp = str_key_cmp;
+        key_dup = NULL;
+        key_free = NULL;
+    }
+    if (!cmp)
+        return NULL;
+    map_t *m = (map_t *)malloc(sizeof(map_t));
+    if (!m)
+        return NULL;
+    m->sync = NULL;
+    if ((flags & MAP_CONCURRENT) && !(m->sync = sync_new()))
+    {
+        free(m);
+        return NULL;
+    }
+    m->root = NULL;
+    m->size = 0;
+    m->cmp = cmp;
+    m->key_dup = key_dup;
+    m->key_free = key_free;
+    m->val_dup = val_dup;
+    m->val_free = val_free;
+    m->backend = backend;
+    m->bt_root = NULL;
+    m->bt_levels = 0;
+    m->flags = flags;
+    m->key_len = (opts && !(flags & MAP_STRING_KEYS)) ? opts->key_len : NULL;
+    m->val_len = opts ? opts->val_len : NULL;
+    m->threads = opts && opts->threads > 1 ? opts->threads : 1;
+    if (m->threads > MAP_PAR_MAX_THREADS)
+        m->threads = MAP_PAR_MAX_THREADS;
+    m->snap = NULL;
+    m->snap_len = 0;
+    m->versions = NULL;
+    m->taking = 0;
+    memset(&m->arena, 0, sizeof(m->arena));
+    m->arena.huge = MAP_ARENA_MMAP && (flags & MAP_HUGE_PAGES);
+    m->arena.mapped = MAP_ARENA_MMAP && (m->arena.huge || numa != MAP_NUMA_DEFAULT);
+    m->arena.page = m->arena.huge ? huge_page : MAP_ARENA_PAGE;
+    m->arena.numa = numa;
+    m->arena.numa_nodes = opts ? opts->numa_nodes : 0;
+#ifdef MAP_STATS
+    memset(&m->stats, 0, sizeof(m->stats));
+    m->stats_ops = 0;
+#endif
+    return m;
+}
+
+/**
+ * @brief Create a new map instance.
+ *
+ * The caller must provide a compare function. Optional key/value duplicate
+ * and free callbacks may be supplied; if NULL, keys/values are stored as
+ * provided and not freed by the map.
+ *
+ * @param cmp Compare callback; must return negative/zero/positive like strcmp.
+ * @param key_dup Optional key duplication callback (may be NULL).
+ * @param key_free Optional key free callback (may be NULL).
+ * @param val_dup Optional value duplication callback (may be NULL).
+ * @param val_free Optional value free callback (may be NULL).
+ * @return map_t* Newly allocated map or NULL on OOM or NULL cmp.
+ */
+map_t *map_create(map_cmp_fn cmp,
+                  map_dup_fn key_dup, map_free_fn key_free,
+                  map_dup_fn val_dup, map_free_fn val_free)
+{
+    return map_create_ex(cmp, key_dup, key_free, val_dup, val_free, NULL);
+}
+
+/* Internal: find node by key */
+
+/**
+ * @brief Find the node that contains the given key.
+ *
+ * Uses the map's compare callback for key ordering.
+ *
+ * @param m Pointer to map_t (must be non-NULL).
+ * @param key Pointer to key to search for.
+ * @return map_node_t* Node containing the key, or NULL if not found.
+ */
+static map_node_t *find_node(map_t *m, const void *key)
+{
+    map_node_t *cur = m->root;
+    unsigned depth = 0;
+    if (m->flags & MAP_STRING_KEYS)
+    {
+        map_str_probe_t k;
+        str_probe_init(&k, (const char *)key);
+        while (cur)
+        {
+            depth++;
+            MAP_STAT_INC(m, cmp_calls);
+            int c = str_cmp_node(&k, (const map_str_node_t *)cur);
+            if (c == 0)
+                break;
+            cur = (c < 0) ? cur->left : cur->right;
+        }
+    }
+    else
+    {
+        while (cur)
+        {
+            depth++;
+            int c = MAP_CMP(m, key, cur->key);
+            if (c == 0)
+                break;
+            cur = (c < 0) ? cur->left : cur->right;
+        }
+    }
+    MAP_STAT_DEPTH(m, depth);
+    return cur;
+}
+
+/**
+ * @brief Link a new node for key/value below parent and rebalance.
+ *
+ * @param m Pointer to map_t.
+ * @param parent Node the descent ended at, or NULL for an empty tree.
+ * @param cmpv Sign of cmp(key, parent key) (ignored without parent).
+ * @param key Key to store.
+ * @param value Value to store.
+ * @return int 1 if inserted, -1 on OOM.
+ */
+static int avl_attach(map_t *m, map_node_t *parent, int cmpv, void *key, void *value)
+{
+    map_node_t *n = node_new(m, key, value);
+    if (!n)
+        return -1;
+    n->parent = parent;
+    map_publish_fence(m);
+    m->size++;
+    MAP_STAT_INC(m, inserts);
+    if (!parent)
+    {
+        MAP_LINK_STORE(m->root, n);
+        return 1;
+    }
+    if (cmpv < 0)
+        MAP_LINK_STORE(parent->left, n);
+    else
+        MAP_LINK_STORE(parent->right, n);
+
+    /* Rebalance walking up */
+    map_node_t *p = n->parent;
+    while (p)
+    {
+        map_node_t *old_p = p;
+        map_node_t *new_subroot = rebalance_at(m, p);
+        /* update parent's child link to new_subroot */
+        set_child(m, new_subroot->parent, old_p, new_subroot);
+        p = new_subroot->parent;
+    }
+    /* ensure root parent is NULL */
+    if (m->root && m->root->parent)
+        m->root->parent = NULL;
+    return 1;
+}
+
+/* Versions (map_snapshot): path copying
+
+   map_snapshot hands out the current root as an immutable version in
+   O(1). Every node counts the links to it (refs): from the map's root,
+   from versions' roots and from parent nodes. While a version is alive,
+   insert, put and erase copy each node with refs > 1 on the path they
+   change, and the siblings a rotation moves, instead of writing to it;
+   an update costs O(log n) new nodes and the versions share the rest.
+   Copies take their own key_dup/val_dup copy of the entry, because a
+   node frees its entry when the last link to it goes.
+
+   Only the map's own nodes keep valid parent links: the map points the
+   parent field of shared children at its copies, and versions never read
+   it (they are walked with an explicit stack). Once no version is alive
+   every refs is 1 again and the ordinary in-place code runs. Operations
+   without a path-copying variant (set operations, batches, map_freeze)
+   first copy whatever the map still shares; typed maps take the generic
+   calls. */
+
+static void node_swap_entry(map_t *m, map_node_t *a, map_node_t *b);
+
+/**
+ * @brief Return non-zero while some map_snapshot version of m is alive.
+ */
+static int map_shared(const map_t *m)
+{
+    return m->versions && atomic_load_explicit(&m->versions->refs, memory_order_acquire) > 1;
+}
+
+/**
+ * @brief Drop one link to n; the last link frees n and drops n's child links.
+ *
+ * Versions may be released from other threads, so refs is atomic and
+ * whichever side drops the last link frees the node.
+ */
+static void pv_unref(map_t *m, map_node_t *n)
+{
+    while (n && atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) == 1)
+    {
+        map_node_t *r = n->right;
+        pv_unref(m, n->left);
+        node_release(m, n);
+        n = r;
+    }
+}
+
+/**
+ * @brief node_new with the given MAP_TAKE_* bits in effect.
+ */
+static map_node_t *pv_node(map_t *m, void *key, void *value, unsigned taking)
+{
+    unsigned saved = m->taking;
+    m->taking = taking;
+    map_node_t *n = node_new(m, key, value);
+    m->taking = saved;
+    return n;
+}
+
+/**
+ * @brief Put copy c of node n in n's place below parent.
+ *
+ * c takes n's links and shape; n's children gain a link, n loses the one
+ * from *slot.
+ */
+static void pv_replace(map_t *m, map_node_t **slot, map_node_t *parent, map_node_t *n, map_node_t *c)
+{
+    c->left = n->left;
+    c->right = n->right;
+    c->height = n->height;
+#ifdef MAP_ORDER_STATS
+    c->count = n->count;
+#endif
+    c->parent = parent;
+    if (c->left)
+    {
+        atomic_fetch_add_explicit(&c->left->refs, 1, memory_order_relaxed);
+        c->left->parent = c;
+    }
+    if (c->right)
+    {
+        atomic_fetch_add_explicit(&c->right->refs, 1, memory_order_relaxed);
+        c->right->parent = c;
+    }
+    *slot = c;
+    pv_unref(m, n);
+}
+
+/**
+ * @brief Make the node at *slot private to the map, copying it if shared.
+ *
+ * @param m Pointer to map_t.
+ * @param slot Link to the node, held by the map's root or a private node.
+ * @param parent Node owning slot, NULL for the root.
+ * @return map_node_t* The private node, or NULL on OOM (tree unchanged).
+ */
+static map_node_t *pv_own(map_t *m, map_node_t **slot, map_node_t *parent)
+{
+    map_node_t *n = *slot;
+    if (atomic_load_explicit(&n->refs, memory_order_acquire) == 1)
+        return n;
+    map_node_t *c = pv_node(m, n->key, n->value, 0);
+    if (!c)
+        return NULL;
+    pv_replace(m, slot, parent, n, c);
+    return c;
+}
+
+/**
+ * @brief rebalance_at for a private node whose children may be shared.
+ *
+ * The children a rotation rewrites are made private first. On OOM the
+ * subtree is left unrotated: still a valid search tree, one level out
+ * of balance.
+ */
+static map_node_t *pv_rebalance(map_t *m, map_node_t *t)
+{
+    update_height(t);
+    int balance = node_height(t->left) - node_height(t->right);
+    if (balance > 1)
+    {
+        map_node_t *l = pv_own(m, &t->left, t);
+        if (!l || (node_height(l->left) < node_height(l->right) && !pv_own(m, &l->right, l)))
+            return t;
+    }
+    else if (balance < -1)
+    {
+        map_node_t *r = pv_own(m, &t->right, t);
+        if (!r || (node_height(r->right) < node_height(r->left) && !pv_own(m, &r->left, r)))
+            return t;
+    }
+    return rebalance_at(m, t);
+}
+
+/**
+ * @brief Path-copying insert (or replace) below *slot.
+ *
+ * The caller's key and value are stored as usual, honouring m->taking;
+ * copies of shared nodes always duplicate their entry.
+ *
+ * @return int 1 inserted, 2 replaced, -1 on OOM.
+ */
+static int pv_insert(map_t *m, map_node_t **slot, map_node_t *parent, void *key, void *value)
+{
+    map_node_t *t = *slot;
+    if (!t)
+    {
+        map_node_t *n = node_new(m, key, value);
+        if (!n)
+            return -1;
+        n->parent = parent;
+        *slot = n;
+        m->size++;
+        MAP_STAT_INC(m, inserts);
+        return 1;
+    }
+    int c = MAP_CMP(m, key, t->key);
+    if (c == 0)
+    {
+        if (atomic_load_explicit(&t->refs, memory_order_acquire) == 1)
+        {
+            void *old = t->value;
+            t->value = map_store_value(m, value);
+            map_drop_value(m, old);
+            return 2;
+        }
+        map_node_t *cp = pv_node(m, t->key, value, m->taking & MAP_TAKE_VALUE);
+        if (!cp)
+            return -1;
+        pv_replace(m, slot, parent, t, cp);
+        return 2;
+    }
+    if (!(t = pv_own(m, slot, parent)))
+        return -1;
+    int r = pv_insert(m, c < 0 ? &t->left : &t->right, t, key, value);
+    if (r == 1)
+        *slot = pv_rebalance(m, t);
+    return r;
+}
+
+/**
+ * @brief Insert or put on a shared map.
+ *
+ * @param replace Non-zero to replace the value of an existing key.
+ * @return int As avl_insert/avl_put.
+ */
+static int pv_put(map_t *m, void *key, void *value, int replace)
+{
+    if (!replace && find_node(m, key))
+        return 0; /* nothing to copy */
+    return pv_insert(m, &m->root, NULL, key, value);
+}
+
+/**
+ * @brief Detach the smallest node below *slot into *gone.
+ */
+static int pv_erase_min(map_t *m, map_node_t **slot, map_node_t *parent, map_node_t **gone)
+{
+    map_node_t *t = pv_own(m, slot, parent);
+    if (!t)
+        return -1;
+    if (t->left)
+    {
+        int r = pv_erase_min(m, &t->left, t, gone);
+        if (r == 1)
+            *slot = pv_rebalance(m, t);
+        return r;
+    }
+    *slot = t->right;
+    if (t->right)
+        t->right->parent = parent;
+    t->right = NULL;
+    *gone = t;
+    return 1;
+}
+
+/**
+ * @brief Path-copying erase of key (which must be present) below *slot.
+ *
+ * @param gone Receives a private, detached node holding key's entry.
+ * @return int 1 on success, -1 on OOM (the tree keeps key).
+ */
+static int pv_erase(map_t *m, map_node_t **slot, map_node_t *parent, const void *key, map_node_t **gone)
+{
+    map_node_t *t = pv_own(m, slot, parent);
+    if (!t)
+        return -1;
+    int c = MAP_CMP(m, key, t->key);
+    int r;
+    if (c != 0)
+        r = pv_erase(m, c < 0 ? &t->left : &t->right, t, key, gone);
+    else if (t->left && t->right)
+    {
+        /* the successor's entry moves up, t's entry leaves in its node */
+        r = pv_erase_min(m, &t->right, t, gone);
+        if (r == 1)
+            node_swap_entry(m, t, *gone);
+    }
+    else
+    {
+        map_node_t *child = t->left ? t->left : t->right;
+        *slot = child;
+        if (child)
+            child->parent = parent;
+        t->left = t->right = NULL;
+        *gone = t;
+        r = 1;
+    }
+    if (r == 1 && *slot == t)
+        *slot = pv_rebalance(m, t);
+    return r;
+}
+
+/**
+ * @brief Unlink key from a shared map.
+ *
+ * @return map_node_t* Detached private node, or NULL on OOM.
+ */
+static map_node_t *pv_unlink(map_t *m, const void *key)
+{
+    map_node_t *gone = NULL;
+    if (pv_erase(m, &m->root, NULL, key, &gone) != 1)
+        return NULL;
+    m->size--;
+    MAP_STAT_INC(m, erases);
+    return gone;
+}
+
+/**
+ * @brief Make every node below *slot private to the map.
+ */
+static int pv_unshare(map_t *m, map_node_t **slot, map_node_t *parent)
+{
+    while (*slot)
+    {
+        map_node_t *t = pv_own(m, slot, parent);
+        if (!t || pv_unshare(m, &t->left, t) < 0)
+            return -1;
+        parent = t;
+        slot = &t->right;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy whatever the map still shares with its versions, so the
+ *        in-place AVL code may run.
+ *
+ * @return int 0 on success, -1 on OOM (the tree is valid, partly copied).
+ */
+static int map_unshare(map_t *m)
+{
+    return map_shared(m) ? pv_unshare(m, &m->root, NULL) : 0;
+}
+
+/**
+ * @brief AVL part of map_insert.
+ */
+static int avl_insert(map_t *m, void *key, void *value)
+{
+    if (map_shared(m))
+        return pv_put(m, key, value, 0);
+    /* Find insertion point (or existing) */
+    map_node_t *parent = NULL;
+    map_node_t *cur = m->root;
+    int cmpv = 0;
+    int str = (m->flags & MAP_STRING_KEYS) != 0;
+    map_str_probe_t probe = {0};
+    if (str)
+        str_probe_init(&probe, (const char *)key);
+    while (cur)
+    {
+        if (str)
+        {
+            MAP_STAT_INC(m, cmp_calls);
+            cmpv = str_cmp_node(&probe, (const map_str_node_t *)cur);
+        }
+        else
+            cmpv = MAP_CMP(m, key, cur->key);
+        if (cmpv == 0)
+        {
+            /* exists: do not overwrite */
+            return 0;
+        }
+        parent = cur;
+        cur = (cmpv < 0) ? cur->left : cur->right;
+    }
+    return avl_attach(m, parent, cmpv, key, value);
+}
+
+/**
+ * @brief Insert a new key/value pair into the map without overwriting.
+ *
+ * If the key already exists the function returns 0 and does not change the map.
+ * On success returns 1. Returns -1 on memory allocation failure or invalid map.
+ *
+ * @param m Pointer to map_t.
+ * @param key Pointer to key to insert.
+ * @param value Pointer to value to insert.
+ * @return int 1 if inserted, 0 if key existed, -1 on OOM or invalid map.
+ */
+int map_insert(map_t *m, void *key, void *value)
+{
+    if (!m)
+        return -1;
+    MAP_OP_BEGIN(m);
+    int r;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        r = -1; /* read-only */
+    else if (m->backend == MAP_BACKEND_BTREE)
+        r = bt_insert(m, key, value, 0);
+    else if (!m->sync)
+        r = avl_insert(m, key, value);
+    else
+    {
+        map_write_begin(m);
+        r = avl_insert(m, key, value);
+        map_write_end(m);
+    }
+    MAP_OP_END(m);
+    return r;
+}
+
+/**
+ * @brief AVL part of map_put.
+ */
+static int avl_put(map_t *m, void *key, void *value)
+{
+    if (map_shared(m))
+        return pv_put(m, key, value, 1);
+    map_node_t *existing = find_node(m, key);
+    if (existing)
+    {
+        /* replace value */
+        void *old = existing->value;
+        void *nv = map_store_value(m, value);
+        map_publish_fence(m);
+        MAP_LINK_STORE(existing->value, nv);
+        map_retire_value(m, old);
+        return 2;
+    }
+    return avl_insert(m, key, value);
+}
+
+/**
+ * @brief Insert or replace a key/value pair.
+ *
+ * If the key exists the stored value is replaced (old value freed if val_free
+ * callback present) and the function returns 2. If the key was inserted returns 1.
+ * Returns -1 on OOM or invalid map.
+ *
+ * @param m Pointer to map_t.
+ * @param key Pointer to key.
+ * @param value Pointer to value.
+ * @return int 1 if inserted, 2 if replaced, -1 on OOM or invalid map.
+ */
+int map_put(map_t *m, void *key, void *value)
+{
+    if (!m)
+        return -1;
+    MAP_OP_BEGIN(m);
+    int r;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        r = -1; /* read-only */
+    else if (m->backend == MAP_BACKEND_BTREE)
+        r = bt_insert(m, key, value, 1);
+    else if (!m->sync)
+        r = avl_put(m, key, value);
+    else
+    {
+        map_write_begin(m);
+        r = avl_put(m, key, value);
+        map_write_end(m);
+    }
+    MAP_OP_END(m);
+    return r;
+}
+
+/* Lock-free lookup (MAP_CONCURRENT) */
+
+/* Longest root-to-leaf walk a reader attempts before re-validating; deeper
+   than any AVL tree that fits in memory, so only a walk racing a writer
+   can reach it */
+#define MAP_SYNC_MAX_DEPTH 128
+
+/**
+ * @brief Single loads of link and payload pointers a writer may be changing.
+ *
+ * Acquire loads pairing with MAP_LINK_STORE, so whatever a loaded
+ * pointer leads to is initialised; the seq loads and the fence around
+ * the walk still decide whether the walk is kept.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+static map_node_t *sync_load_node(map_node_t *const *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void *sync_load_ptr(void *const *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+#else
+static map_node_t *sync_load_node(map_node_t *const *p) { return *(map_node_t *const volatile *)p; }
+static void *sync_load_ptr(void *const *p) { return *(void *const volatile *)p; }
+#endif
+
+/**
+ * @brief Optimistic seqlock lookup; retries until a walk saw no writer.
+ *
+ * @param m Pointer to a MAP_CONCURRENT map_t; caller is in a read section.
+ * @param key Search key.
+ * @param value Receives the stored value when found.
+ * @return int 1 if found, 0 otherwise.
+ */
+static int sync_find(map_t *m, const void *key, void **value)
+{
+    map_sync_t *s = m->sync;
+    for (unsigned spins = 0;; ++spins)
+    {
+        unsigned q = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (q & 1)
+        {
+            if (spins >= 64)
+                sched_yield();
+            continue;
+        }
+        int found = 0;
+        map_node_t *cur = sync_load_node(&m->root);
+        for (int depth = 0; cur && depth < MAP_SYNC_MAX_DEPTH; ++depth)
+        {
+            int c = m->cmp(key, sync_load_ptr(&cur->key));
+            if (c == 0)
+            {
+                *value = sync_load_ptr(&cur->value);
+                found = 1;
+                break;
+            }
+            cur = sync_load_node(c < 0 ? &cur->left : &cur->right);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) == q)
+            return found;
+    }
+}
+
+/**
+ * @brief Enter a read section on a MAP_CONCURRENT map.
+ *
+ * A section costs two uncontended atomic operations on a per-thread stripe.
+ * Sections on one map do not nest, and a thread must not call writers on
+ * the map from inside one. On other maps this is a no-op.
+ *
+ * @param m Pointer to map_t.
+ * @return unsigned Token to pass to map_read_end.
+ */
+unsigned map_read_begin(map_t *m)
+{
+    map_sync_t *s = m ? m->sync : NULL;
+    if (!s)
+        return 0;
+    map_read_stripe_t *st = sync_stripe(s);
+    for (;;)
+    {
+        unsigned e = atomic_load_explicit(&s->epoch, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->active[e & 1], 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&s->epoch, memory_order_seq_cst) == e)
+            return e;
+        /* a grace period started meanwhile: count against the new parity */
+        atomic_fetch_sub_explicit(&st->active[e & 1], 1, memory_order_release);
+    }
+}
+
+/**
+ * @brief Leave a read section; values found inside it may be freed afterwards.
+ *
+ * @param m Pointer to map_t.
+ * @param token Value returned by the matching map_read_begin.
+ */
+void map_read_end(map_t *m, unsigned token)
+{
+    map_sync_t *s = m ? m->sync : NULL;
+    if (s)
+        atomic_fetch_sub_explicit(&sync_stripe(s)->active[token & 1], 1, memory_order_release);
+}
+
+/**
+ * @brief Hold off writers so a MAP_CONCURRENT map can be iterated.
+ *
+ * Readers are not blocked. On other maps this is a no-op.
+ *
+ * @param m Pointer to map_t.
+ */
+void map_iter_lock(map_t *m)
+{
+    if (m && m->sync)
+        pthread_mutex_lock(&m->sync->write_lock);
+}
+
+/**
+ * @brief Release the lock taken by map_iter_lock.
+ *
+ * @param m Pointer to map_t.
+ */
+void map_iter_unlock(map_t *m)
+{
+    if (m && m->sync)
+        pthread_mutex_unlock(&m->sync->write_lock);
+}
+
+/**
+ * @brief Find the value pointer associated with a key.
+ *
+ * On a MAP_CONCURRENT map the caller must stay inside a read section
+ * (map_read_begin) for as long as it uses the returned value.
+ *
+ * @param m Pointer to map_t.
+ * @param key Pointer to search key.
+ * @return void* Stored value pointer if found, NULL if not found.
+ */
+void *map_find(map_t *m, const void *key)
+{
+    if (!m)
+        return NULL;
+    if (m->sync)
+    {
+        void *value;
+        return sync_find(m, key, &value) ? value : NULL;
+    }
+    MAP_OP_BEGIN(m);
+    void *value = NULL;
+    int hit;
+    if (m->backend == MAP_BACKEND_BTREE)
+    {
+        map_iter_t it = bt_find(m, key);
+        if ((hit = it != NULL))
+            value = bt_iter_leaf(it)->vals[bt_iter_slot(it)];
+    }
+    else if (m->backend == MAP_BACKEND_SNAPSHOT)
+    {
+        const map_snap_entry_t *e = snap_find(m, key);
+        if ((hit = e != NULL))
+            value = snap_value(e);
+    }
+    else
+    {
+        map_node_t *n = find_node(m, key);
+        if ((hit = n != NULL))
+            value = n->value;
+    }
+    MAP_STAT_INC(m, lookups);
+    if (!hit)
+        MAP_STAT_INC(m, misses);
+    MAP_OP_END(m);
+    return value;
+}
+
+/* Batched lookup */
+
+#ifndef MAP_FIND_GROUP
+#define MAP_FIND_GROUP 8 /* lookups walked in lock-step by map_find_many */
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define MAP_PREFETCH(p) ((void)(p))
+#endif
+
+/**
+ * @brief Look up n keys at once, overlapping their cache misses.
+ *
+ * Lookups are processed in groups of MAP_FIND_GROUP that advance in
+ * lock-step. Each step first prefetches a node, then (one round later) the
+ * key it points to, then compares, so while one lookup waits for memory the
+ * others make progress. With the B+tree backend this is a plain loop of
+ * single lookups.
+ *
+ * @param m Pointer to map_t.
+ * @param keys n search keys.
+ * @param n Number of keys.
+ * @param out_values Receives n value pointers (NULL for keys not found).
+ * @return size_t Number of keys found.
+ */
+size_t map_find_many(map_t *m, const void *const *keys, size_t n, void **out_values)
+{
+    size_t found = 0;
+    if (m->sync)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out_values[i] = NULL;
+            found += (size_t)sync_find(m, keys[i], &out_values[i]);
+        }
+        return found;
+    }
+    MAP_STAT_ADD(m, lookups, n);
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            const map_snap_entry_t *e = snap_find(m, keys[i]);
+            out_values[i] = e ? snap_value(e) : NULL;
+            found += e != NULL;
+        }
+        MAP_STAT_ADD(m, misses, n - found);
+        return found;
+    }
+    if (m->backend == MAP_BACKEND_BTREE)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            map_iter_t it = bt_find(m, keys[i]);
+            out_values[i] = it ? bt_iter_leaf(it)->vals[bt_iter_slot(it)] : NULL;
+            found += it != NULL;
+        }
+        MAP_STAT_ADD(m, misses, n - found);
+        return found;
+    }
+
+    for (size_t base = 0; base < n; base += MAP_FIND_GROUP)
+    {
+        map_node_t *cur[MAP_FIND_GROUP];
+        int key_ready[MAP_FIND_GROUP]; /* node loaded and its key prefetched */
+        size_t g = n - base < MAP_FIND_GROUP ? n - base : MAP_FIND_GROUP;
+        size_t active = 0;
+
+        for (size_t i = 0; i < g; ++i)
+        {
+            out_values[base + i] = NULL;
+            cur[i] = m->root;
+            key_ready[i] = 0;
+            if (cur[i])
+            {
+                MAP_PREFETCH(cur[i]);
+                active++;
+            }
+        }
+        while (active)
+        {
+            for (size_t i = 0; i < g; ++i)
+            {
+                map_node_t *nd = cur[i];
+                if (!nd)
+                    continue;
+                if (!key_ready[i])
+                {
+                    MAP_PREFETCH(nd->key);
+                    key_ready[i] = 1;
+                    continue;
+                }
+                int c = MAP_CMP(m, keys[base + i], nd->key);
+                if (c == 0)
+                {
+                    out_values[base + i] = nd->value;
+                    found++;
+                    cur[i] = NULL;
+                    active--;
+                    continue;
+                }
+                nd = (c < 0) ? nd->left : nd->right;
+                cur[i] = nd;
+                key_ready[i] = 0;
+                if (nd)
+                    MAP_PREFETCH(nd);
+                else
+                    active--;
+            }
+        }
+    }
+    MAP_STAT_ADD(m, misses, n - found);
+    return found;
+}
+
+/* Minimum node in subtree */
+
+/**
+ * @brief Return the node with minimum key in the subtree.
+ *
+ * @param n Subtree root (may be NULL).
+ * @return map_node_t* Node with minimum key or NULL if n is NULL.
+ */
+static map_node_t *subtree_min(map_node_t *n)
+{
+    if (!n)
+        return NULL;
+    while (n->left)
+        n = n->left;
+    return n;
+}
+
+/**
+ * @brief Exchange the key/value entries of two nodes (no free/dup calls).
+ *
+ * String-key nodes also exchange length, prefix and inline text, and a
+ * key pointing at inline text is re-aimed at its own node's buffer.
+ *
+ * @param m Pointer to map_t.
+ * @param a First node.
+ * @param b Second node.
+ */
+static void node_swap_entry(map_t *m, map_node_t *a, map_node_t *b)
+{
+    void *tkey = a->key;
+    MAP_LINK_STORE(a->key, b->key);
+    MAP_LINK_STORE(b->key, tkey);
+    void *tval = a->value;
+    MAP_LINK_STORE(a->value, b->value);
+    MAP_LINK_STORE(b->value, tval);
+    if (m->flags & MAP_STRING_KEYS)
+    {
+        map_str_node_t *sa = (map_str_node_t *)a;
+        map_str_node_t *sb = (map_str_node_t *)b;
+        uint64_t tp = sa->prefix;
+        sa->prefix = sb->prefix;
+        sb->prefix = tp;
+        size_t tl = sa->len;
+        sa->len = sb->len;
+        sb->len = tl;
+        char text[MAP_STR_INLINE];
+        memcpy(text, sa->text, MAP_STR_INLINE);
+        memcpy(sa->text, sb->text, MAP_STR_INLINE);
+        memcpy(sb->text, text, MAP_STR_INLINE);
+        if (a->key == sb->text)
+            MAP_LINK_STORE(a->key, sa->text);
+        if (b->key == sa->text)
+            MAP_LINK_STORE(b->key, sb->text);
+    }
+}
+
+/* Remove a node given pointer. Returns pointer to parent where balancing continues */
+
+/**
+ * @brief Unlink the given node's entry from the tree without freeing anything.
+ *
+ * If the node has two children it swaps with the inorder successor and unlinks
+ * that successor instead. Returns the parent node where balancing should continue.
+ *
+ * @param m Pointer to map_t.
+ * @param n Node to erase (must be non-NULL).
+ * @param gone Receives the unlinked node, which now holds n's original entry.
+ * @return map_node_t* Parent node to continue rebalancing from, or NULL.
+ */
+static map_node_t *erase_node(map_t *m, map_node_t *n, map_node_t **gone)
+{
+    if (!n)
+        return NULL;
+    map_node_t *parent = NULL;
+
+    if (n->left && n->right)
+    {
+        /* two children: swap with successor */
+        map_node_t *suc = subtree_min(n->right);
+        node_swap_entry(m, n, suc);
+        /* now unlink suc (which has at most right child) */
+        return erase_node(m, suc, gone);
+    }
+    else
+    {
+        map_node_t *child = n->left ? n->left : n->right;
+        parent = n->parent;
+        /* detach n and link child in its place */
+        if (parent == NULL)
+        {
+            /* deleting root */
+            MAP_LINK_STORE(m->root, child);
+            if (child)
+                child->parent = NULL;
+        }
+        else
+        {
+            if (parent->left == n)
+                MAP_LINK_STORE(parent->left, child);
+            else
+                MAP_LINK_STORE(parent->right, child);
+            if (child)
+                child->parent = parent;
+        }
+        *gone = n;
+        m->size--;
+        MAP_STAT_INC(m, erases);
+        return parent;
+    }
+}
+
+/**
+ * @brief Unlink node n's entry and rebalance.
+ *
+ * @param m Pointer to map_t.
+ * @param n Node to remove (must be in m).
+ * @return map_node_t* The detached node holding n's entry; the caller frees it.
+ */
+static map_node_t *avl_unlink(map_t *m, map_node_t *n)
+{
+    map_node_t *gone = NULL;
+    map_node_t *p = erase_node(m, n, &gone);
+    /* rebalance upwards */
+    while (p)
+    {
+        map_node_t *old_p = p;
+        map_node_t *new_subroot = rebalance_at(m, p);
+        set_child(m, new_subroot->parent, old_p, new_subroot);
+        p = new_subroot->parent;
+    }
+    if (m->root && m->root->parent)
+        m->root->parent = NULL;
+    return gone;
+}
+
+/**
+ * @brief Unlink node n, free it and rebalance.
+ *
+ * @param m Pointer to map_t.
+ * @param n Node to remove (must be in m).
+ */
+static void avl_remove(map_t *m, map_node_t *n) { node_free(m, avl_unlink(m, n)); }
+
+/**
+ * @brief AVL part of map_erase.
+ */
+static int avl_erase(map_t *m, const void *key)
+{
+    map_node_t *n = find_node(m, key);
+    if (!n)
+        return 0;
+    if (map_shared(m))
+    {
+        if (!(n = pv_unlink(m, key)))
+            return -1;
+        node_release(m, n);
+        return 1;
+    }
+    avl_remove(m, n);
+    return 1;
+}
+
+/**
+ * @brief Erase an entry by key.
+ *
+ * Finds the node with the given key, removes it if present, rebalances the tree,
+ * and returns 1 if an entry was erased or 0 if not found. While a
+ * map_snapshot version is alive the path is copied, which can run out of
+ * memory.
+ *
+ * @param m Pointer to map_t.
+ * @param key Key to erase.
+ * @return int 1 if erased, 0 if not found or invalid map, -1 on OOM (key kept).
+ */
+int map_erase(map_t *m, const void *key)
+{
+    if (!m)
+        return 0;
+    MAP_OP_BEGIN(m);
+    int r;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        r = 0; /* read-only */
+    else if (m->backend == MAP_BACKEND_BTREE)
+        r = bt_erase(m, key);
+    else if (!m->sync)
+        r = avl_erase(m, key);
+    else
+    {
+        map_write_begin(m);
+        r = avl_erase(m, key);
+        map_write_end(m);
+    }
+    MAP_OP_END(m);
+    return r;
+}
+
+/* Ownership transfer: insert/put without key_dup/val_dup, extract without
+   key_free/val_free */
+
+/**
+ * @brief Shared body of map_insert_take and map_put_take.
+ *
+ * Runs the ordinary insert/put with m->taking set, so the caller's
+ * pointers are stored as-is instead of through key_dup/val_dup and later
+ * released by key_free and val_free like any other stored entry.
+ *
+ * @param put Non-zero to replace the value of an existing key.
+ * @return int As map_insert/map_put; -1 on maps that always copy.
+ */
+static int map_take(map_t *m, void *key, void *value, int put)
+{
+    if (!m || m->backend == MAP_BACKEND_SNAPSHOT || (m->flags & MAP_STRING_KEYS) || map_arena_keys(m) ||
+        map_arena_vals(m))
+        return -1;
+    MAP_OP_BEGIN(m);
+    if (m->sync)
+        map_write_begin(m);
+    m->taking = MAP_TAKE_KEY | MAP_TAKE_VALUE;
+    int r;
+    if (m->backend == MAP_BACKEND_BTREE)
+        r = bt_insert(m, key, value, put);
+    else
+        r = put ? avl_put(m, key, value) : avl_insert(m, key, value);
+    m->taking = 0;
+    if (r == 2)
+        map_drop_key(m, key); /* the stored key stays; the caller's is ours now */
+    if (m->sync)
+        map_write_end(m);
+    MAP_OP_END(m);
+    return r;
+}
+
+/**
+ * @brief Insert a key/value pair, taking ownership of both without copying.
+ *
+ * Like map_insert, but key_dup and val_dup are not called: the map stores
+ * the caller's pointers and frees them with key_free/val_free on erase,
+ * clear or destroy. Only a return of 1 transfers ownership; on 0 or -1
+ * both pointers still belong to the caller. Maps that always copy
+ * (MAP_STRING_KEYS, and arena maps with key_len/val_len) and snapshots
+ * return -1.
+ *
+ * @param m Pointer to map_t.
+ * @param key Key allocated the way key_free expects.
+ * @param value Value allocated the way val_free expects.
+ * @return int 1 if inserted, 0 if key existed, -1 on OOM or unsupported map.
+ */
+int map_insert_take(map_t *m, void *key, void *value) { return map_take(m, key, value, 0); }
+
+/**
+ * @brief Insert or replace a key/value pair, taking ownership of both.
+ *
+ * Like map_put without key_dup/val_dup. On 1 or 2 the map owns key and
+ * value; when the key already existed the stored key is kept and the
+ * caller's key is released with key_free at once. On -1 nothing is taken.
+ *
+ * @param m Pointer to map_t.
+ * @param key Key allocated the way key_free expects.
+ * @param value Value allocated the way val_free expects.
+ * @return int 1 if inserted, 2 if replaced, -1 on OOM or unsupported map.
+ */
+int map_put_take(map_t *m, void *key, void *value) { return map_take(m, key, value, 1); }
+
+/**
+ * @brief AVL part of map_extract: unlink the entry and read out key/value.
+ *
+ * The detached node is returned in *gone, still holding its entry; free it
+ * with extract_release once no reader can see it.
+ */
+static int avl_extract(map_t *m, const void *key, void **key_out, void **value_out, map_node_t **gone)
+{
+    map_node_t *n = find_node(m, key);
+    if (!n)
+        return 0;
+    char *copy = NULL;
+    if (m->flags & MAP_STRING_KEYS)
+    {
+        /* inline and arena copies cannot be handed over: copy them before
+           the tree changes, so that OOM leaves the map as it was */
+        map_str_node_t *sn = (map_str_node_t *)n;
+        if (n->key == sn->text || (m->flags & MAP_ARENA))
+        {
+            if (!(copy = (char *)malloc(sn->len + 1)))
+                return -1;
+            memcpy(copy, n->key, sn->len + 1);
+        }
+    }
+    map_node_t *g = map_shared(m) ? pv_unlink(m, key) : avl_unlink(m, n);
+    if (!g)
+    {
+        free(copy);
+        return -1;
+    }
+    *key_out = copy ? copy : g->key;
+    *value_out = g->value;
+    *gone = g;
+    return 1;
+}
+
+/**
+ * @brief Free a node detached by avl_extract, leaving its key and value alone.
+ */
+static void extract_release(map_t *m, map_node_t *n)
+{
+    n->key = (m->flags & MAP_STRING_KEYS) ? ((map_str_node_t *)n)->text : NULL;
+    n->value = NULL;
+    node_release(m, n);
+}
+
+/**
+ * @brief Remove an entry and give its stored key and value to the caller.
+ *
+ * The node is unlinked as by map_erase but key_free and val_free are not
+ * called: *key_out and *value_out receive the stored pointers (the
+ * key_dup/val_dup copies, if any), which the caller now owns. On
+ * MAP_STRING_KEYS maps *key_out is a malloc'd copy of the string. Arena
+ * copies (key_len/val_len) come back as arena pointers that stay valid
+ * until map_clear or map_destroy. MAP_CONCURRENT maps wait for a grace
+ * period before returning, so no reader still sees the entry.
+ *
+ * @param m Pointer to map_t.
+ * @param key Key to extract.
+ * @param key_out Receives the stored key (untouched unless 1 is returned).
+ * @param value_out Receives the stored value (untouched unless 1 is returned).
+ * @return int 1 if extracted, 0 if not found or invalid map, -1 on OOM.
+ */
+int map_extract(map_t *m, const void *key, void **key_out, void **value_out)
+{
+    if (!m || m->backend == MAP_BACKEND_SNAPSHOT)
+        return 0;
+    MAP_OP_BEGIN(m);
+    int r;
+    if (m->backend == MAP_BACKEND_BTREE)
+        r = bt_remove(m, key, key_out, value_out);
+    else if (!m->sync)
+    {
+        map_node_t *gone = NULL;
+        r = avl_extract(m, key, key_out, value_out, &gone);
+        if (gone)
+            extract_release(m, gone);
+    }
+    else
+    {
+        /* readers may still compare against the unlinked key, so the
+           node's pointers are only cleared after a grace period */
+        map_node_t *gone = NULL;
+        void *k = NULL;
+        void *v = NULL;
+        map_write_begin(m);
+        r = avl_extract(m, key, &k, &v, &gone);
+        sync_publish(m->sync);
+        if (gone)
+        {
+            sync_wait_readers(m->sync);
+            sync_free_retired(m);
+            extract_release(m, gone);
+            *key_out = k;
+            *value_out = v;
+        }
+        pthread_mutex_unlock(&m->sync->write_lock);
+    }
+    MAP_OP_END(m);
+    return r;
+}
+
+/* Typed maps: the key comparison inlined into the descent
+
+   MAP_TYPED_DEFINE(P, K, CMP) generates P_create, P_create_ex, P_insert,
+   P_find and P_erase for maps whose keys point to K objects. CMP(a, b)
+   takes two const K pointers and returns negative/zero/positive; it is
+   expanded inline into every descent, so the hot loop makes no indirect
+   call. The result is an ordinary map_t, so every other map_* function
+   works on it. The typed functions fall back to the generic ones for
+   B+tree and MAP_CONCURRENT maps, for maps created with another compare
+   callback and while a map_snapshot version is alive. */
+
+#define MAP_CMP_NUM(a, b) ((*(a) > *(b)) - (*(a) < *(b)))
+#define MAP_CMP_STR(a, b) strcmp((a), (b))
+
+#define MAP_TYPED_DEFINE(P, K, CMP)                                                             \
+    static inline int P##_cmp(const void *a, const void *b)                                     \
+    {                                                                                           \
+        return CMP((const K *)a, (const K *)b);                                                 \
+    }                                                                                           \
+    static inline map_t *P##_create_ex(map_dup_fn key_dup, map_free_fn key_free,                \
+                                       map_dup_fn val_dup, map_free_fn val_free,                \
+                                       const map_opts_t *opts)                                  \
+    {                                                                                           \
+        return map_create_ex(P##_cmp, key_dup, key_free, val_dup, val_free, opts);              \
+    }                                                                                           \
+    static inline map_t *P##_create(map_dup_fn key_dup, map_free_fn key_free,                   \
+                                    map_dup_fn val_dup, map_free_fn val_free)                   \
+    {                                                                                           \
+        return map_create_ex(P##_cmp, key_dup, key_free, val_dup, val_free, NULL);              \
+    }                                                                                           \
+    static inline int P##_generic(const map_t *m)                                               \
+    {                                                                                           \
+        return m->backend != MAP_BACKEND_AVL || m->sync || m->cmp != P##_cmp || map_shared(m);  \
+    }                                                                                           \
+    static inline void *P##_find(map_t *m, const K *key)                                        \
+    {                                                                                           \
+        if (!m || P##_generic(m))                                                               \
+            return map_find(m, key);                                                            \
+        MAP_OP_BEGIN(m);                                                                        \
+        MAP_STAT_INC(m, lookups);                                                               \
+        map_node_t *cur = m->root;                                                              \
+        unsigned depth = 0;                                                                     \
+        while (cur)                                                                             \
+        {                                                                                       \
+            depth++;                                                                            \
+            MAP_STAT_INC(m, cmp_calls);                                                         \
+            int c = CMP(key, (const K *)cur->key);                                              \
+            if (c == 0)                                                                         \
+                break;                                                                          \
+            cur = (c < 0) ? cur->left : cur->right;                                             \
+        }                                                                                       \
+        MAP_STAT_DEPTH(m, depth);                                                               \
+        if (!cur)                                                                               \
+            MAP_STAT_INC(m, misses);                                                            \
+        MAP_OP_END(m);                                                                          \
+        return cur ? cur->value : NULL;                                                         \
+    }                                                                                           \
+    static inline int P##_insert(map_t *m, K *key, void *value)                                 \
+    {                                                                                           \
+        if (!m || P##_generic(m))                                                               \
+            return map_insert(m, key, value);                                                   \
+        MAP_OP_BEGIN(m);                                                                        \
+        map_node_t *parent = NULL;                                                              \
+        map_node_t *cur = m->root;                                                              \
+        int c = 0;                                                                              \
+        while (cur)                                                                             \
+        {                                                                                       \
+            MAP_STAT_INC(m, cmp_calls);                                                         \
+            c = CMP(key, (const K *)cur->key);                                                  \
+            if (c == 0)                                                                         \
+                break;                                                                          \
+            parent = cur;                                                                       \
+            cur = (c < 0) ? cur->left : cur->right;                                             \
+        }                                                                                       \
+        int r = cur ? 0 : avl_attach(m, parent, c, key, value);                                 \
+        MAP_OP_END(m);                                                                          \
+        return r;                                                                               \
+    }                                                                                           \
+    static inline int P##_erase(map_t *m, const K *key)                                         \
+    {                                                                                           \
+        if (!m || P##_generic(m))                                                               \
+            return map_erase(m, key);                                                           \
+        MAP_OP_BEGIN(m);                                                                        \
+        map_node_t *cur = m->root;                                                              \
+        while (cur)                                                                             \
+        {                                                                                       \
+            MAP_STAT_INC(m, cmp_calls);                                                         \
+            int c = CMP(key, (const K *)cur->key);                                              \
+            if (c == 0)                                                                         \
+                break;                                                                          \
+            cur = (c < 0) ? cur->left : cur->right;                                             \
+        }                                                                                       \
+        if (cur)                                                                                \
+            avl_remove(m, cur);                                                                 \
+        MAP_OP_END(m);                                                                          \
+        return cur != NULL;                                                                     \
+    }
+
+/* uint32_t keys (map_u32_*) and C string keys (map_str_*) */
+MAP_TYPED_DEFINE(map_u32, uint32_t, MAP_CMP_NUM)
+MAP_TYPED_DEFINE(map_str, char, MAP_CMP_STR)
+
+/* Size */
+
+/**
+ * @brief Return the number of elements stored in the map.
+ *
+ * @param m Pointer to map_t (may be NULL).
+ * @return size_t Number of stored elements (0 if m is NULL).
+ */
+size_t map_size(map_t *m) { return m ? m->size : 0; }
+
+/**
+ * @brief Copy the map's statistics counters.
+ *
+ * Counters accumulate from map_create_ex and survive map_clear; latency
+ * buckets hold log2(ns) of one in MAP_STATS_SAMPLE public operations.
+ *
+ * @param m Pointer to map_t.
+ * @param out Receives the counters (zeroed when unavailable).
+ * @return int 0 on success, -1 if m is NULL or built without MAP_STATS.
+ */
+int map_stats(const map_t *m, map_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+#ifdef MAP_STATS
+    if (!m)
+        return -1;
+    *out = m->stats;
+    return 0;
+#else
+    (void)m;
+    return -1;
+#endif
+}
+
+/* Parallel work (opts.threads > 1)
+
+   Bulk loads, map_for_each, set operations and clearing large AVL maps
+   cut the work into more tasks than threads (a few per thread) and let
+   the threads claim tasks from a shared counter until none are left, so
+   a thread that draws small subtrees simply takes more of them. The
+   calling thread works too; nothing is kept alive between calls. */
+
+/* Tasks handed out per thread; more balances uneven subtrees better */
+#define MAP_PAR_TASKS_PER_THREAD 4
+
+/* Subtrees an AVL cut can produce: the depth rounds the task count up to a power of two */
+#define MAP_PAR_MAX_TASKS 512
+
+#if 2 * MAP_PAR_MAX_THREADS * MAP_PAR_TASKS_PER_THREAD > MAP_PAR_MAX_TASKS
+#error "MAP_PAR_MAX_THREADS too large for MAP_PAR_MAX_TASKS"
+#endif
+
+typedef void (*map_par_fn)(void *task);
+
+/* An array of tasks shared by the threads of one map_par_run */
+typedef struct map_par_job
+{
+    map_par_fn fn;
+    char *tasks;
+    size_t stride;
+    size_t n;
+    atomic_size_t next;
+} map_par_job_t;
+
+/**
+ * @brief Threads an operation on n entries of m may use (1: stay serial).
+ *
+ * Node allocation and release go through the arena and the MAP_STATS
+ * counters, which have a single writer, so such maps stay serial when
+ * the work allocates or frees.
+ */
+static unsigned map_par_threads(const map_t *m, size_t n, int allocates)
+{
+    if (m->threads < 2 || n < MAP_PAR_MIN)
+        return 1;
+#ifdef MAP_STATS
+    if (allocates)
+        return 1;
+#endif
+    if (allocates && (m->flags & MAP_ARENA))
+        return 1;
+    return m->threads;
+}
+
+/**
+ * @brief Claim and run tasks until the job has none left.
+ */
+static void *map_par_worker(void *arg)
+{
+    map_par_job_t *j = (map_par_job_t *)arg;
+    for (;;)
+    {
+        size_t i = atomic_fetch_add_explicit(&j->next, 1, memory_order_relaxed);
+        if (i >= j->n)
+            break;
+        j->fn(j->tasks + i * j->stride);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run fn on each of n tasks (stride bytes apart) using up to threads threads.
+ *
+ * Returns after every task has finished. If threads cannot be started
+ * the remaining ones, and at worst the caller alone, do all the work.
+ */
+static void map_par_run(map_par_fn fn, void *tasks, size_t stride, size_t n, unsigned threads)
+{
+    map_par_job_t j;
+    j.fn = fn;
+    j.tasks = (char *)tasks;
+    j.stride = stride;
+    j.n = n;
+    atomic_init(&j.next, 0);
+    pthread_t th[MAP_PAR_MAX_THREADS];
+    unsigned started = 0;
+    if (threads > n)
+        threads = (unsigned)n;
+    while (started + 1 < threads && pthread_create(&th[started], NULL, map_par_worker, &j) == 0)
+        started++;
+    map_par_worker(&j);
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(th[i], NULL);
+}
+
+/**
+ * @brief Depth at which an AVL tree is cut into tasks for threads threads.
+ */
+static int map_par_depth(unsigned threads)
+{
+    int d = 0;
+    while ((1u << d) < threads * MAP_PAR_TASKS_PER_THREAD)
+        d++;
+    return d;
+}
+
+/**
+ * @brief Collect the subtrees rooted depth levels below n, and the nodes above them.
+ *
+ * @param n Subtree root (may be NULL).
+ * @param depth Levels left to descend.
+ * @param subs Receives the subtree roots at that depth.
+ * @param nsubs In/out: number of entries in subs.
+ * @param tops Receives the nodes above the cut (may be NULL).
+ * @param ntops In/out: number of entries in tops.
+ */
+static void avl_cut(map_node_t *n, int depth, map_node_t **subs, size_t *nsubs, map_node_t **tops, size_t *ntops)
+{
+    if (!n)
+        return;
+    if (depth == 0)
+    {
+        subs[(*nsubs)++] = n;
+        return;
+    }
+    if (tops)
+        tops[(*ntops)++] = n;
+    avl_cut(n->left, depth - 1, subs, nsubs, tops, ntops);
+    avl_cut(n->right, depth - 1, subs, nsubs, tops, ntops);
+}
+
+/* One subtree of a parallel free_subtree */
+typedef struct map_par_free
+{
+    map_t *m;
+    map_node_t *root;
+} map_par_free_t;
+
+static void free_subtree(map_t *m, map_node_t *n);
+
+/**
+ * @brief map_par_run task: free one subtree.
+ */
+static void par_free_task(void *task)
+{
+    map_par_free_t *t = (map_par_free_t *)task;
+    free_subtree(t->m, t->root);
+}
+
+/**
+ * @brief free_subtree on up to threads threads.
+ *
+ * The subtrees below a cut are freed in parallel, then the few nodes
+ * above the cut. The key/value free callbacks run on several threads.
+ *
+ * @param m Pointer to map_t owning the nodes (no arena, no MAP_STATS).
+ * @param root Subtree root to free (may be NULL).
+ * @param threads Threads to use.
+ */
+static void free_subtree_par(map_t *m, map_node_t *root, unsigned threads)
+{
+    map_node_t *subs[MAP_PAR_MAX_TASKS];
+    map_node_t *tops[MAP_PAR_MAX_TASKS];
+    map_par_free_t tasks[MAP_PAR_MAX_TASKS];
+    size_t nsubs = 0;
+    size_t ntops = 0;
+    avl_cut(root, map_par_depth(threads), subs, &nsubs, tops, &ntops);
+    for (size_t i = 0; i < nsubs; ++i)
+    {
+        tasks[i].m = m;
+        tasks[i].root = subs[i];
+    }
+    map_par_run(par_free_task, tasks, sizeof(tasks[0]), nsubs, threads);
+    for (size_t i = 0; i < ntops; ++i)
+        node_release(m, tops[i]);
+}
+
+/* Clear and destroy */
+
+/**
+ * @brief Recursively free all nodes in the subtree rooted at n.
+ *
+ * Invokes node_release for each node which will apply key/value free callbacks.
+ *
+ * @param m Pointer to map_t owning the nodes.
+ * @param n Subtree root to free (may be NULL).
+ */
+static void free_subtree(map_t *m, map_node_t *n)
+{
+    if (!n)
+        return;
+    free_subtree(m, n->left);
+    free_subtree(m, n->right);
+    node_release(m, n);
+}
+
+/**
+ * @brief Apply the key/value free callbacks to every AVL entry without freeing nodes.
+ *
+ * Used by arena-mode map_clear when some stored payload is not arena-owned.
+ *
+ * @param m Pointer to map_t owning the nodes.
+ * @param n Subtree root (may be NULL).
+ */
+static void drop_subtree_entries(map_t *m, map_node_t *n)
+{
+    while (n)
+    {
+        drop_subtree_entries(m, n->left);
+        map_drop_key(m, n->key);
+        map_drop_value(m, n->value);
+        n = n->right;
+    }
+}
+
+/**
+ * @brief Body of map_clear; on MAP_CONCURRENT maps the caller holds write_lock.
+ */
+static void clear_entries(map_t *m)
+{
+    unsigned threads = map_par_threads(m, m->size, 1);
+    if (m->snap)
+    {
+        munmap((void *)m->snap, m->snap_len);
+        m->snap = NULL;
+        m->snap_len = 0;
+        m->backend = MAP_BACKEND_AVL;
+        m->size = 0;
+        return;
+    }
+    map_node_t *root = m->root;
+    if (m->sync)
+    {
+        sync_open(m->sync);
+        MAP_LINK_STORE(m->root, NULL);
+        m->size = 0;
+        sync_publish(m->sync);
+        sync_wait_readers(m->sync);
+        sync_free_retired(m);
+    }
+    if (m->flags & MAP_ARENA)
+    {
+        if (map_needs_entry_walk(m))
+        {
+            for (map_iter_t it = bt_begin(m); it; it = bt_next(it))
+            {
+                bt_leaf_t *leaf = bt_iter_leaf(it);
+                map_drop_key(m, leaf->keys[bt_iter_slot(it)]);
+                map_drop_value(m, leaf->vals[bt_iter_slot(it)]);
+            }
+            drop_subtree_entries(m, root);
+        }
+        arena_release(&m->arena);
+#ifdef MAP_STATS
+        m->stats.live_bytes = 0; /* the whole arena went at once */
+#endif
+    }
+    else
+    {
+        if (m->bt_root)
+            bt_free_subtree(m, m->bt_root, m->bt_levels);
+        if (threads > 1)
+            free_subtree_par(m, root, threads);
+        else if (map_shared(m))
+            pv_unref(m, root); /* nodes a version still holds stay */
+        else
+            free_subtree(m, root);
+    }
+    m->bt_root = NULL;
+    m->bt_levels = 0;
+    MAP_LINK_STORE(m->root, NULL);
+    m->size = 0;
+}
+
+/**
+ * @brief Remove all entries from the map but keep the map structure.
+ *
+ * After this call the map is empty (size == 0, root == NULL). In arena
+ * mode the slab pages are released wholesale; the tree is only visited if
+ * some stored key/value still needs its free callback. A MAP_CONCURRENT
+ * map first unpublishes the tree and waits for readers still walking it.
+ *
+ * @param m Pointer to map_t.
+ */
+void map_clear(map_t *m)
+{
+    if (!m)
+        return;
+    map_iter_lock(m);
+    clear_entries(m);
+    map_iter_unlock(m);
+}
+
+/**
+ * @brief Destroy the map and free all associated resources.
+ *
+ * Calls map_clear and then frees the map structure itself. No other
+ * thread may be using a MAP_CONCURRENT map any more.
+ *
+ * @param m Pointer to map_t to destroy (NULL safe).
+ */
+void map_destroy(map_t *m)
+{
+    if (!m)
+        return;
+    map_clear(m);
+    if (m->sync)
+    {
+        pthread_mutex_destroy(&m->sync->write_lock);
+        free(m->sync);
+    }
+    if (m->versions && atomic_fetch_sub_explicit(&m->versions->refs, 1, memory_order_acq_rel) == 1)
+        free(m->versions);
+    free(m);
+}
+
+/* Bulk load */
+
+/**
+ * @brief Allocate nodes for n key/value pairs, linked through right in input order.
+ *
+ * @param m Pointer to map_t.
+ * @param keys Array of n keys.
+ * @param values Array of n values, or NULL for all-NULL values.
+ * @param n Number of pairs.
+ * @param head Receives the first node of the list.
+ * @return int 0 on success, -1 on OOM (nothing is left allocated).
+ */
+static int bulk_make_list(map_t *m, void *const *keys, void *const *values, size_t n, map_node_t **head)
+{
+    map_node_t **tail = head;
+    *head = NULL;
+    for (size_t i = 0; i < n; ++i)
+    {
+        map_node_t *nd = node_new(m, keys[i], values ? values[i] : NULL);
+        if (!nd)
+        {
+            while (*head)
+            {
+                map_node_t *next = (*head)->right;
+                node_free(m, *head);
+                *head = next;
+            }
+            return -1;
+        }
+        *tail = nd;
+        tail = &nd->right;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stable merge sort of a right-linked node list by key.
+ *
+ * @param m Pointer to map_t (for cmp).
+ * @param head First node of the list.
+ * @param n Number of nodes in the list.
+ * @return map_node_t* First node of the sorted list.
+ */
+static map_node_t *list_sort(map_t *m, map_node_t *head, size_t n)
+{
+    if (n < 2)
+        return head;
+    size_t nl = n / 2;
+    map_node_t *mid = head;
+    for (size_t i = 1; i < nl; ++i)
+        mid = mid->right;
+    map_node_t *b = mid->right;
+    mid->right = NULL;
+    map_node_t *a = list_sort(m, head, nl);
+    b = list_sort(m, b, n - nl);
+
+    map_node_t *out = NULL;
+    map_node_t **tail = &out;
+    while (a && b)
+    {
+        if (MAP_CMP(m, a->key, b->key) <= 0)
+        {
+            *tail = a;
+            a = a->right;
+        }
+        else
+        {
+            *tail = b;
+            b = b->right;
+        }
+        tail = &(*tail)->right;
+    }
+    *tail = a ? a : b;
+    return out;
+}
+
+/**
+ * @brief Build a height-balanced subtree from the first count nodes of a sorted list.
+ *
+ * Consumes nodes in order from *head (linked through right), so the whole
+ * build is O(count). Left subtrees are built before their root, which fixes
+ * parent pointers and heights bottom-up.
+ *
+ * @param head In/out: next unconsumed list node.
+ * @param count Number of nodes to place in this subtree.
+ * @param parent Parent of the subtree root (NULL at the top).
+ * @return map_node_t* Subtree root (NULL if count is 0).
+ */
+static map_node_t *build_from_list(map_node_t **head, size_t count, map_node_t *parent)
+{
+    if (count == 0)
+        return NULL;
+    size_t nleft = count / 2;
+    map_node_t *left = build_from_list(head, nleft, NULL);
+    map_node_t *root = *head;
+    *head = root->right;
+    root->parent = parent;
+    root->left = left;
+    if (left)
+        left->parent = root;
+    root->right = build_from_list(head, count - nleft - 1, root);
+    update_height(root);
+    return root;
+}
+
+/* Parallel bulk load: nodes are allocated in slices, sorted with a merge
+   sort whose runs and merges are tasks, and built into a tree whose top
+   levels are linked once the subtrees below them are done. */
+
+/* One slice of a parallel bulk load */
+typedef struct map_par_build
+{
+    map_t *m;
+    void *const *keys;
+    void *const *values;
+    map_node_t **nd;
+    size_t lo, hi;
+    map_node_t *root; /* subtree built from nd[lo, hi) */
+    int oom;
+} map_par_build_t;
+
+/* One run or one merge of the parallel sort */
+typedef struct map_par_sort
+{
+    map_t *m;
+    map_node_t **src;
+    map_node_t **dst;
+    size_t lo, mid, hi;
+} map_par_sort_t;
+
+/**
+ * @brief map_par_run task: allocate the nodes for pairs [lo, hi).
+ */
+static void par_alloc_task(void *task)
+{
+    map_par_build_t *t = (map_par_build_t *)task;
+    for (size_t i = t->lo; i < t->hi; ++i)
+    {
+        t->nd[i] = node_new(t->m, t->keys[i], t->values ? t->values[i] : NULL);
+        if (!t->nd[i])
+            t->oom = 1;
+    }
+}
+
+/**
+ * @brief Stable merge of sorted src[lo, mid) and src[mid, hi) into dst[lo, hi).
+ */
+static void nodes_merge(map_t *m, map_node_t *const *src, size_t lo, size_t mid, size_t hi, map_node_t **dst)
+{
+    size_t i = lo;
+    size_t j = mid;
+    size_t o = lo;
+    while (i < mid && j < hi)
+        dst[o++] = MAP_CMP(m, src[j]->key, src[i]->key) < 0 ? src[j++] : src[i++];
+    while (i < mid)
+        dst[o++] = src[i++];
+    while (j < hi)
+        dst[o++] = src[j++];
+}
+
+/**
+ * @brief Stable merge sort of a[lo, hi) by key, using tmp[lo, hi) as scratch.
+ */
+static void nodes_sort(map_t *m, map_node_t **a, map_node_t **tmp, size_t lo, size_t hi)
+{
+    if (hi - lo < 2)
+        return;
+    size_t mid = lo + (hi - lo) / 2;
+    nodes_sort(m, a, tmp, lo, mid);
+    nodes_sort(m, a, tmp, mid, hi);
+    nodes_merge(m, a, lo, mid, hi, tmp);
+    memcpy(a + lo, tmp + lo, (hi - lo) * sizeof(map_node_t *));
+}
+
+/**
+ * @brief map_par_run task: sort one run in place.
+ */
+static void par_sort_task(void *task)
+{
+    map_par_sort_t *t = (map_par_sort_t *)task;
+    nodes_sort(t->m, t->src, t->dst, t->lo, t->hi);
+}
+
+/**
+ * @brief map_par_run task: merge two adjacent runs.
+ */
+static void par_merge_task(void *task)
+{
+    map_par_sort_t *t = (map_par_sort_t *)task;
+    nodes_merge(t->m, t->src, t->lo, t->mid, t->hi, t->dst);
+}
+
+/**
+ * @brief Link nd[lo, hi) into a balanced subtree (middle element at the root).
+ *
+ * Half sizes differ by at most one, so sibling heights do too.
+ */
+static map_node_t *build_range(map_node_t **nd, size_t lo, size_t hi)
+{
+    if (lo == hi)
+        return NULL;
+    size_t mid = lo + (hi - lo) / 2;
+    map_node_t *root = nd[mid];
+    root->left = build_range(nd, lo, mid);
+    root->right = build_range(nd, mid + 1, hi);
+    if (root->left)
+        root->left->parent = root;
+    if (root->right)
+        root->right->parent = root;
+    update_height(root);
+    return root;
+}
+
+/**
+ * @brief map_par_run task: build one subtree below the cut.
+ */
+static void par_build_task(void *task)
+{
+    map_par_build_t *t = (map_par_build_t *)task;
+    t->root = build_range(t->nd, t->lo, t->hi);
+}
+
+/**
+ * @brief The top depth levels of build_range over nd[lo, hi).
+ *
+ * Called twice with the same arguments: first (link == 0) to record the
+ * ranges below the cut as tasks, then (link != 0) to link the top nodes
+ * to the subtrees those tasks built.
+ */
+static map_node_t *build_top(map_par_build_t *tasks, size_t *nt, map_node_t **nd, size_t lo, size_t hi,
+                             int depth, int link)
+{
+    if (lo == hi)
+        return NULL;
+    if (depth == 0)
+    {
+        map_par_build_t *t = &tasks[(*nt)++];
+        if (link)
+            return t->root;
+        t->lo = lo;
+        t->hi = hi;
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    map_node_t *l = build_top(tasks, nt, nd, lo, mid, depth - 1, link);
+    map_node_t *r = build_top(tasks, nt, nd, mid + 1, hi, depth - 1, link);
+    if (!link)
+        return NULL;
+    map_node_t *root = nd[mid];
+    root->left = l;
+    root->right = r;
+    if (l)
+        l->parent = root;
+    if (r)
+        r->parent = root;
+    update_height(root);
+    return root;
+}
+
+/**
+ * @brief AVL bulk load on up to threads threads.
+ *
+ * Unsorted input is stably sorted and keeps the first of equal keys, as
+ * bulk_from_unsorted does. The map must be empty.
+ *
+ * @return int 1 on success, -1 on OOM (nothing is left allocated).
+ */
+static int bulk_build_par(map_t *m, void *const *keys, void *const *values, size_t n, int sorted,
+                          unsigned threads)
+{
+    map_node_t **nd = (map_node_t **)malloc((sorted ? n : 2 * n) * sizeof(map_node_t *));
+    if (!nd)
+        return -1;
+    map_par_build_t tasks[MAP_PAR_MAX_TASKS];
+    int depth = map_par_depth(threads);
+    size_t k = (size_t)1 << depth;
+    int oom = 0;
+    for (size_t i = 0; i < k; ++i)
+    {
+        tasks[i].m = m;
+        tasks[i].keys = keys;
+        tasks[i].values = values;
+        tasks[i].nd = nd;
+        tasks[i].lo = i * n / k;
+        tasks[i].hi = (i + 1) * n / k;
+        tasks[i].root = NULL;
+        tasks[i].oom = 0;
+    }
+    map_par_run(par_alloc_task, tasks, sizeof(tasks[0]), k, threads);
+    for (size_t i = 0; i < k; ++i)
+        oom |= tasks[i].oom;
+    if (oom)
+    {
+        for (size_t i = 0; i < n; ++i)
+            if (nd[i])
+                node_free(m, nd[i]);
+        free(nd);
+        return -1;
+    }
+
+    map_node_t **v = nd;
+    size_t count = n;
+    if (!sorted)
+    {
+        map_par_sort_t st[MAP_PAR_MAX_TASKS];
+        map_node_t **src = nd;
+        map_node_t **dst = nd + n;
+        for (size_t i = 0; i < k; ++i)
+        {
+            st[i].m = m;
+            st[i].src = src;
+            st[i].dst = dst;
+            st[i].lo = tasks[i].lo;
+            st[i].hi = tasks[i].hi;
+        }
+        map_par_run(par_sort_task, st, sizeof(st[0]), k, threads);
+        for (size_t w = 1; w < k; w *= 2)
+        {
+            size_t nt = 0;
+            for (size_t i = 0; i < k; i += 2 * w)
+            {
+                st[nt].src = src;
+                st[nt].dst = dst;
+                st[nt].lo = tasks[i].lo;
+                st[nt].mid = tasks[i + w].lo;
+                st[nt].hi = tasks[i + 2 * w - 1].hi;
+                nt++;
+            }
+            map_par_run(par_merge_task, st, sizeof(st[0]), nt, threads);
+            map_node_t **t = src;
+            src = dst;
+            dst = t;
+        }
+        v = src;
+
+        /* drop duplicates, keeping the first (stable) occurrence */
+        count = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (count && MAP_CMP(m, v[count - 1]->key, v[i]->key) == 0)
+                node_free(m, v[i]);
+            else
+                v[count++] = v[i];
+        }
+    }
+
+    for (size_t i = 0; i < k; ++i)
+        tasks[i].nd = v;
+    size_t nt = 0;
+    build_top(tasks, &nt, v, 0, count, depth, 0);
+    map_par_run(par_build_task, tasks, sizeof(tasks[0]), nt, threads);
+    nt = 0;
+    map_node_t *root = build_top(tasks, &nt, v, 0, count, depth, 1);
+    free(nd);
+    root->parent = NULL;
+    map_publish_fence(m);
+    MAP_LINK_STORE(m->root, root);
+    m->size = count;
+    MAP_STAT_ADD(m, inserts, count);
+    return 1;
+}
+
+/**
+ * @brief Body of map_from_sorted; writers are excluded by the caller.
+ */
+static int bulk_from_sorted(map_t *m, void *const *keys, void *const *values, size_t n)
+{
+    if (m->size != 0 || (n && !keys))
+        return -1;
+    for (size_t i = 1; i < n; ++i)
+    {
+        if (MAP_CMP(m, keys[i - 1], keys[i]) >= 0)
+            return 0;
+    }
+    if (m->backend == MAP_BACKEND_BTREE)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (bt_insert(m, keys[i], values ? values[i] : NULL, 0) < 0)
+            {
+                map_clear(m);
+                return -1;
+            }
+        }
+        return 1;
+    }
+    unsigned threads = map_par_threads(m, n, 1);
+    if (threads > 1)
+        return bulk_build_par(m, keys, values, n, 1, threads);
+
+    map_node_t *head;
+    if (bulk_make_list(m, keys, values, n, &head) < 0)
+        return -1;
+    map_node_t *root = build_from_list(&head, n, NULL);
+    map_publish_fence(m);
+    MAP_LINK_STORE(m->root, root);
+    m->size = n;
+    MAP_STAT_ADD(m, inserts, n);
+    return 1;
+}
+
+/**
+ * @brief Fill an empty map from strictly ascending keys in O(n).
+ *
+ * Nodes are allocated in one pass and linked into a perfectly balanced AVL
+ * tree with correct parent and height fields; no per-key descent or
+ * rotation is performed. The B+tree backend falls back to ordered inserts.
+ * With opts.threads > 1, large inputs are allocated and built in parallel.
+ *
+ * @param m Pointer to an empty map_t.
+ * @param keys n keys in strictly ascending cmp order.
+ * @param values n values, or NULL to store NULL values.
+ * @param n Number of pairs.
+ * @return int 1 on success, 0 if keys are not strictly ascending (map
+ *         unchanged), -1 on OOM or if the map is not empty.
+ */
+int map_from_sorted(map_t *m, void *const *keys, void *const *values, size_t n)
+{
+    if (!m)
+        return -1;
+    if (!m->sync)
+        return bulk_from_sorted(m, keys, values, n);
+    map_write_begin(m);
+    int r = bulk_from_sorted(m, keys, values, n);
+    map_write_end(m);
+    return r;
+}
+
+/**
+ * @brief Body of map_from_unsorted; writers are excluded by the caller.
+ */
+static int bulk_from_unsorted(map_t *m, void *const *keys, void *const *values, size_t n)
+{
+    if (m->size != 0 || (n && !keys))
+        return -1;
+    if (m->backend == MAP_BACKEND_BTREE)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (bt_insert(m, keys[i], values ? values[i] : NULL, 0) < 0)
+            {
+                map_clear(m);
+                return -1;
+            }
+        }
+        return 1;
+    }
+    unsigned threads = map_par_threads(m, n, 1);
+    if (threads > 1)
+        return bulk_build_par(m, keys, values, n, 0, threads);
+
+    map_node_t *head;
+    if (bulk_make_list(m, keys, values, n, &head) < 0)
+        return -1;
+    head = list_sort(m, head, n);
+
+    /* drop duplicates, keeping the first (stable) occurrence */
+    size_t count = 0;
+    for (map_node_t *cur = head; cur; cur = cur->right)
+    {
+        count++;
+        while (cur->right && MAP_CMP(m, cur->key, cur->right->key) == 0)
+        {
+            map_node_t *dup = cur->right;
+            cur->right = dup->right;
+            node_free(m, dup);
+        }
+    }
+    map_node_t *root = build_from_list(&head, count, NULL);
+    map_publish_fence(m);
+    MAP_LINK_STORE(m->root, root);
+    m->size = count;
+    MAP_STAT_ADD(m, inserts, count);
+    return 1;
+}
+
+/**
+ * @brief Fill an empty map from keys in any order in O(n log n).
+ *
+ * The pairs are stably sorted by key (merge sort over the new nodes, no
+ * extra arrays), duplicates keep their first occurrence like map_insert,
+ * and the tree is then built as in map_from_sorted. With opts.threads > 1,
+ * large inputs are also sorted in parallel.
+ *
+ * @param m Pointer to an empty map_t.
+ * @param keys n keys in any order.
+ * @param values n values, or NULL to store NULL values.
+ * @param n Number of pairs.
+ * @return int 1 on success, -1 on OOM or if the map is not empty.
+ */
+int map_from_unsorted(map_t *m, void *const *keys, void *const *values, size_t n)
+{
+    if (!m)
+        return -1;
+    if (!m->sync)
+        return bulk_from_unsorted(m, keys, values, n);
+    map_write_begin(m);
+    int r = bulk_from_unsorted(m, keys, values, n);
+    map_write_end(m);
+    return r;
+}
+
+/* Iteration: begin is smallest; end is NULL. next/prev provide in-order traversal */
+
+/**
+ * @brief Return iterator to the smallest (leftmost) element in the map.
+ *
+ * @param m Pointer to map_t.
+ * @return map_iter_t Iterator (node pointer) to first element or NULL if map empty.
+ */
+map_iter_t map_begin(map_t *m)
+{
+    if (!m)
+        return NULL;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        return m->size ? snap_iter_make(snap_entries(m) + eyt_first(m->size)) : NULL;
+    return m->backend == MAP_BACKEND_BTREE ? bt_begin(m) : subtree_min(m->root);
+}
+
+/**
+ * @brief Return the end iterator for the map (always NULL).
+ *
+ * Provided for API symmetry with STL-like iteration.
+ *
+ * @param m Pointer to map_t (unused).
+ * @return map_iter_t Always NULL.
+ */
+map_iter_t map_end(map_t *m)
+{
+    (void)m;
+    return NULL;
+}
+
+/**
+ * @brief Advance iterator to the next in-order node.
+ *
+ * If it has a right subtree, returns the leftmost node in that subtree;
+ * otherwise walks up to the first ancestor where current is in left subtree.
+ *
+ * @param it Current iterator (may be NULL).
+ * @return map_iter_t Next iterator or NULL if at end.
+ */
+map_iter_t map_next(map_iter_t it)
+{
+    if (!it)
+        return NULL;
+    if (bt_iter_is(it))
+        return bt_next(it);
+    if (snap_iter_is(it))
+    {
+        const map_snap_entry_t *e = snap_iter_entry(it);
+        return e->next ? snap_iter_make(e + e->next) : NULL;
+    }
+    if (it->right)
+    {
+        map_node_t *n = it->right;
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+    else
+    {
+        map_node_t *p = it->parent;
+        map_node_t *cur = it;
+        while (p && p->right == cur)
+        {
+            cur = p;
+            p = p->parent;
+        }
+        return p;
+    }
+}
+
+/**
+ * @brief Move iterator to the previous in-order node.
+ *
+ * If it has a left subtree, returns the rightmost node in that subtree;
+ * otherwise walks up to the first ancestor where current is in right subtree.
+ *
+ * @param it Current iterator (may be NULL).
+ * @return map_iter_t Previous iterator or NULL if at begin.
+ */
+map_iter_t map_prev(map_iter_t it)
+{
+    if (!it)
+        return NULL;
+    if (bt_iter_is(it))
+        return bt_prev(it);
+    if (snap_iter_is(it))
+    {
+        const map_snap_entry_t *e = snap_iter_entry(it);
+        return e->prev ? snap_iter_make(e + e->prev) : NULL;
+    }
+    if (it->left)
+    {
+        map_node_t *n = it->left;
+        while (n->right)
+            n = n->right;
+        return n;
+    }
+    else
+    {
+        map_node_t *p = it->parent;
+        map_node_t *cur = it;
+        while (p && p->left == cur)
+        {
+            cur = p;
+            p = p->parent;
+        }
+        return p;
+    }
+}
+
+/* Access key/value from iterator */
+
+/**
+ * @brief Return pointer to key stored at iterator.
+ *
+ * @param it Iterator (node pointer).
+ * @return void* Key pointer or NULL if it is NULL.
+ */
+void *map_iter_key(map_iter_t it)
+{
+    if (!it)
+        return NULL;
+    if (snap_iter_is(it))
+        return snap_key(snap_iter_entry(it));
+    return bt_iter_is(it) ? bt_iter_leaf(it)->keys[bt_iter_slot(it)] : it->key;
+}
+
+/**
+ * @brief Return pointer to value stored at iterator.
+ *
+ * @param it Iterator (node pointer).
+ * @return void* Value pointer or NULL if it is NULL.
+ */
+void *map_iter_value(map_iter_t it)
+{
+    if (!it)
+        return NULL;
+    if (snap_iter_is(it))
+        return snap_value(snap_iter_entry(it));
+    return bt_iter_is(it) ? bt_iter_leaf(it)->vals[bt_iter_slot(it)] : it->value;
+}
+
+/* Ordered range queries */
+
+/* Callback for map_scan: return non-zero to stop the scan */
+typedef int (*map_scan_fn)(void *key, void *value, void *ctx);
+
+/* Explicit stack for map_scan; AVL height stays below 1.45 * log2(n + 2) */
+#define MAP_SCAN_STACK 96
+
+/**
+ * @brief First AVL node whose key is >= key (upper: > key), or NULL.
+ */
+static map_node_t *avl_bound(map_t *m, const void *key, int upper)
+{
+    map_node_t *cur = m->root;
+    map_node_t *best = NULL;
+    while (cur)
+    {
+        int c = MAP_CMP(m, key, cur->key);
+        if (c < 0 || (c == 0 && !upper))
+        {
+            best = cur;
+            cur = cur->left;
+        }
+        else
+            cur = cur->right;
+    }
+    return best;
+}
+
+/**
+ * @brief First B+tree entry whose key is >= key (upper: > key), or NULL.
+ */
+static map_iter_t bt_bound(map_t *m, const void *key, int upper)
+{
+    void *node = m->bt_root;
+    if (!node)
+        return NULL;
+    for (int lvl = m->bt_levels; lvl > 0; --lvl)
+    {
+        bt_inner_t *in = (bt_inner_t *)node;
+        node = in->child[bt_upper(m, in->keys, in->n, key)];
+    }
+    bt_leaf_t *leaf = (bt_leaf_t *)node;
+    unsigned i = upper ? bt_upper(m, leaf->keys, leaf->n, key) : bt_lower(m, leaf->keys, leaf->n, key);
+    if (i < leaf->n)
+        return bt_iter_make(leaf, i);
+    return leaf->next ? bt_iter_make(leaf->next, 0) : NULL;
+}
+
+/**
+ * @brief Return iterator to the first element whose key is not less than key.
+ *
+ * On a MAP_CONCURRENT map hold map_iter_lock while using the iterator.
+ *
+ * @param m Pointer to map_t.
+ * @param key Bound key.
+ * @return map_iter_t Iterator or NULL (end) if every key is less.
+ */
+map_iter_t map_lower_bound(map_t *m, const void *key)
+{
+    if (!m)
+        return NULL;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        return snap_iter_make(snap_bound(m, key, 0));
+    return m->backend == MAP_BACKEND_BTREE ? bt_bound(m, key, 0) : avl_bound(m, key, 0);
+}
+
+/**
+ * @brief Return iterator to the first element whose key is greater than key.
+ *
+ * On a MAP_CONCURRENT map hold map_iter_lock while using the iterator.
+ *
+ * @param m Pointer to map_t.
+ * @param key Bound key.
+ * @return map_iter_t Iterator or NULL (end) if no key is greater.
+ */
+map_iter_t map_upper_bound(map_t *m, const void *key)
+{
+    if (!m)
+        return NULL;
+    if (m->backend == MAP_BACKEND_SNAPSHOT)
+        return snap_iter_make(snap_bound(m, key, 1));
+    return m->backend == MAP_BACKEND_BTREE ? bt_bound(m, key, 1) : avl_bound(m, key, 1);
+}
+
+/**
+ * @brief In-order AVL scan of [lo, hi) with an explicit stack, no parent climbs.
+ */
+static size_t avl_scan(map_t *m, const void *lo, const void *hi, map_scan_fn fn, void *ctx)
+{
+    map_node_t *stack[MAP_SCAN_STACK];
+    int top = 0;
+    size_t visited = 0;
+
+    /* stack the nodes >= lo on the search path; each is followed by its right subtree */
+    for (map_node_t *cur = m->root; cur;)
+    {
+        if (lo && MAP_CMP(m, lo, cur->key) > 0)
+            cur = cur->right;
+        else
+        {
+            stack[top++] = cur;
+            cur = cur->left;
+        }
+    }
+    while (top > 0)
+    {
+        map_node_t *n = stack[--top];
+        if (hi && MAP_CMP(m, n->key, hi) >= 0)
+            break;
+        visited++;
+        if (fn(n->key, n->value, ctx))
+            break;
+        for (map_node_t *cur = n->right; cur; cur = cur->left)
+            stack[top++] = cur;
+    }
+    return visited;
+}
+
+/**
+ * @brief B+tree scan of [lo, hi) along the leaf chain.
+ */
+static size_t bt_scan(map_t *m, const void *lo, const void *hi, map_scan_fn fn, void *ctx)
+{
+    map_iter_t it = lo ? bt_bound(m, lo, 0) : bt_begin(m);
+    if (!it)
+        return 0;
+    size_t visited = 0;
+    unsigned i = bt_iter_slot(it);
+    for (bt_leaf_t *leaf = bt_iter_leaf(it); leaf; leaf = leaf->next, i = 0)
+    {
+        for (; i < leaf->n; ++i)
+        {
+            if (hi && MAP_CMP(m, leaf->keys[i], hi) >= 0)
+                return visited;
+            visited++;
+            if (fn(leaf->keys[i], leaf->vals[i], ctx))
+                return visited;
+        }
+    }
+    return visited;
+}
+
+/**
+ * @brief Snapshot scan of [lo, hi) along the in-order entry links.
+ */
+static size_t snap_scan(map_t *m, const void *lo, const void *hi, map_scan_fn fn, void *ctx)
+{
+    const map_snap_entry_t *e = lo ? snap_bound(m, lo, 0) : (m->size ? snap_entries(m) + eyt_first(m->size) : NULL);
+    size_t visited = 0;
+    for (; e; e = e->next ? e + e->next : NULL)
+    {
+        void *key = snap_key(e);
+        if (hi && MAP_CMP(m, key, hi) >= 0)
+            break;
+        visited++;
+        if (fn(key, snap_value(e), ctx))
+            break;
+    }
+    return visited;
+}
+
+/**
+ * @brief Visit the entries with lo <= key < hi in key order.
+ *
+ * Faster than a map_begin/map_next loop: the AVL walk keeps its path on
+ * a small explicit stack instead of climbing parent pointers, and the
+ * B+tree walk reads whole leaves. fn must not modify the map. A
+ * MAP_CONCURRENT map holds off writers for the duration of the scan.
+ *
+ * @param m Pointer to map_t.
+ * @param lo Inclusive lower bound, or NULL for the first key.
+ * @param hi Exclusive upper bound, or NULL for past the last key.
+ * @param fn Callback; a non-zero return ends the scan early.
+ * @param ctx Passed through to fn.
+ * @return size_t Number of entries passed to fn.
+ */
+size_t map_scan(map_t *m, const void *lo, const void *hi, map_scan_fn fn, void *ctx)
+{
+    if (!m || !fn)
+        return 0;
+    map_iter_lock(m);
+    size_t n = m->backend == MAP_BACKEND_SNAPSHOT ? snap_scan(m, lo, hi, fn, ctx)
+               : m->backend == MAP_BACKEND_BTREE  ? bt_scan(m, lo, hi, fn, ctx)
+                                                  : avl_scan(m, lo, hi, fn, ctx);
+    map_iter_unlock(m);
+    return n;
+}
+
+/* Order statistics: map_rank, map_select, map_count_range
+
+   Built with -DMAP_ORDER_STATS, every AVL node also counts the entries of
+   its subtree. update_height recomputes the count, so rotations,
+   rebalancing, bulk loads and the set-operation joins keep it exact
+   without an extra pass. On 64-bit targets it grows a map_node_t from 48
+   to 56 bytes (height and refs already fill the word after the links);
+   the pool map's node_t stays at 48. Counts are 32-bit, which caps such a map at UINT32_MAX
+   entries. Rank and select then take one descent, O(log n). Without the
+   flag, and on snapshot maps, they walk the entries in order; B+tree
+   maps skip whole leaves, O(n / MAP_BTREE_KEYS). */
+
+#ifdef MAP_ORDER_STATS
+/**
+ * @brief Number of AVL keys less than key, by one descent over subtree counts.
+ */
+static size_t avl_rank(map_t *m, const void *key)
+{
+    size_t r = 0;
+    for (map_node_t *cur = m->root; cur;)
+    {
+        if (MAP_CMP(m, key, cur->key) <= 0)
+            cur = cur->left;
+        else
+        {
+            r += node_count(cur->left) + 1;
+            cur = cur->right;
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief The AVL node of 0-based rank k, or NULL.
+ */
+static map_node_t *avl_select(map_node_t *cur, size_t k)
+{
+    while (cur)
+    {
+        size_t l = node_count(cur->left);
+        if (k == l)
+            return cur;
+        if (k < l)
+            cur = cur->left;
+        else
+        {
+            k -= l + 1;
+            cur = cur->right;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Number of B+tree keys less than key: whole leaves, then one slot index.
+ */
+static size_t bt_rank(map_t *m, const void *key)
+{
+    map_iter_t b = bt_bound(m, key, 0);
+    if (!b)
+        return m->size;
+    size_t r = 0;
+    for (bt_leaf_t *leaf = bt_iter_leaf(bt_begin(m)); leaf != bt_iter_leaf(b); leaf = leaf->next)
+        r += leaf->n;
+    return r + bt_iter_slot(b);
+}
+
+/**
+ * @brief The B+tree entry of 0-based rank k, or NULL.
+ */
+static map_iter_t bt_select(map_t *m, size_t k)
+{
+    map_iter_t first = bt_begin(m);
+    for (bt_leaf_t *leaf = first ? bt_iter_leaf(first) : NULL; leaf; leaf = leaf->next)
+    {
+        if (k < leaf->n)
+            return bt_iter_make(leaf, (unsigned)k);
+        k -= leaf->n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Number of keys less than key, for any backend (caller holds map_iter_lock).
+ */
+static size_t map_rank_locked(map_t *m, const void *key)
+{
+    if (m->backend == MAP_BACKEND_BTREE)
+        return bt_rank(m, key);
+#ifdef MAP_ORDER_STATS
+    if (m->backend == MAP_BACKEND_AVL)
+        return avl_rank(m, key);
+#endif
+    size_t r = 0;
+    for (map_iter_t it = map_begin(m); it && MAP_CMP(m, map_iter_key(it), key) < 0; it = map_next(it))
+        r++;
+    return r;
+}
+
+/**
+ * @brief Return the number of keys less than key.
+ *
+ * O(log n) on AVL maps built with MAP_ORDER_STATS. A MAP_CONCURRENT map
+ * holds off writers for the duration of the call.
+ *
+ * @param m Pointer to map_t.
+ * @param key Pointer to key (need not be in the map).
+ * @return size_t Rank of key: 0 if every key is >= key, map_size(m) if all are less.
+ */
+size_t map_rank(map_t *m, const void *key)
+{
+    if (!m || !key)
+        return 0;
+    map_iter_lock(m);
+    size_t r = map_rank_locked(m, key);
+    map_iter_unlock(m);
+    return r;
+}
+
+/**
+ * @brief Return iterator to the k-th smallest entry (0-based).
+ *
+ * map_next continues from there in key order. O(log n) on AVL maps built
+ * with MAP_ORDER_STATS. On a MAP_CONCURRENT map hold map_iter_lock while
+ * using the iterator.
+ *
+ * @param m Pointer to map_t.
+ * @param k Rank of the entry.
+ * @return map_iter_t Iterator or NULL (end) if k >= map_size(m).
+ */
+map_iter_t map_select(map_t *m, size_t k)
+{
+    if (!m || k >= m->size)
+        return NULL;
+    if (m->backend == MAP_BACKEND_BTREE)
+        return bt_select(m, k);
+#ifdef MAP_ORDER_STATS
+    if (m->backend == MAP_BACKEND_AVL)
+        return avl_select(m->root, k);
+#endif
+    map_iter_t it = map_begin(m);
+    while (it && k--)
+        it = map_next(it);
+    return it;
+}
+
+/**
+ * @brief Count the entries with lo <= key < hi.
+ *
+ * Two rank queries, so O(log n) on AVL maps built with MAP_ORDER_STATS
+ * however many keys are in range. Bounds follow map_scan.
+ *
+ * @param m Pointer to map_t.
+ * @param lo Inclusive lower bound, or NULL for the first key.
+ * @param hi Exclusive upper bound, or NULL for past the last key.
+ * @return size_t Number of keys in range (0 if hi <= lo).
+ */
+size_t map_count_range(map_t *m, const void *lo, const void *hi)
+{
+    if (!m)
+        return 0;
+    map_iter_lock(m);
+    size_t a = lo ? map_rank_locked(m, lo) : 0;
+    size_t b = hi ? map_rank_locked(m, hi) : m->size;
+    map_iter_unlock(m);
+    return b > a ? b - a : 0;
+}
+
+/* Parallel traversal */
+
+/* Callback for map_for_each */
+typedef void (*map_each_fn)(void *key, void *value, void *ctx);
+
+/* One part of a map_for_each: an AVL subtree, a run of leaves or of snapshot entries */
+typedef struct map_par_each
+{
+    map_t *m;
+    map_each_fn fn;
+    void *ctx;
+    map_node_t *root;
+    bt_leaf_t *leaf;
+    size_t lo, hi; /* leaves from leaf, or snapshot entry indexes */
+} map_par_each_t;
+
+/**
+ * @brief Call fn on every entry of an AVL subtree.
+ */
+static void each_subtree(map_node_t *n, map_each_fn fn, void *ctx)
+{
+    while (n)
+    {
+        each_subtree(n->left, fn, ctx);
+        fn(n->key, n->value, ctx);
+        n = n->right;
+    }
+}
+
+/**
+ * @brief map_par_run task: visit one part of the map.
+ */
+static void par_each_task(void *task)
+{
+    map_par_each_t *t = (map_par_each_t *)task;
+    if (t->m->backend == MAP_BACKEND_AVL)
+        each_subtree(t->root, t->fn, t->ctx);
+    else if (t->m->backend == MAP_BACKEND_BTREE)
+    {
+        bt_leaf_t *leaf = t->leaf;
+        for (size_t i = t->lo; i < t->hi; ++i, leaf = leaf->next)
+            for (unsigned j = 0; j < leaf->n; ++j)
+                t->fn(leaf->keys[j], leaf->vals[j], t->ctx);
+    }
+    else
+    {
+        const map_snap_entry_t *e = snap_entries(t->m);
+        for (size_t i = t->lo; i < t->hi; ++i)
+            t->fn(snap_key(&e[i]), snap_value(&e[i]), t->ctx);
+    }
+}
+
+/**
+ * @brief Call fn(key, value, ctx) once for every entry, in no particular order.
+ *
+ * On a map created with opts.threads > 1 and at least MAP_PAR_MIN
+ * entries, the map is split into parts (AVL subtrees, runs of B+tree
+ * leaves or of snapshot entries) and fn runs on several threads at once,
+ * so it must be thread-safe. fn must not change the map. A MAP_CONCURRENT
+ * map holds off writers for the duration, like map_iter_lock.
+ *
+ * @param m Pointer to map_t.
+ * @param fn Callback.
+ * @param ctx Passed through to fn.
+ * @return size_t Number of entries visited.
+ */
+size_t map_for_each(map_t *m, map_each_fn fn, void *ctx)
+{
+    if (!m || !fn)
+        return 0;
+    map_iter_lock(m);
+    size_t n = m->size;
+    unsigned threads = map_par_threads(m, n, 0);
+    map_par_each_t tasks[MAP_PAR_MAX_TASKS];
+    size_t k = 0;
+    int depth = threads > 1 ? map_par_depth(threads) : 0;
+    size_t parts = (size_t)1 << depth;
+    if (m->backend == MAP_BACKEND_AVL)
+    {
+        map_node_t *subs[MAP_PAR_MAX_TASKS];
+        map_node_t *tops[MAP_PAR_MAX_TASKS];
+        size_t ntops = 0;
+        avl_cut(m->root, depth, subs, &k, tops, &ntops);
+        for (size_t i = 0; i < ntops; ++i)
+            fn(tops[i]->key, tops[i]->value, ctx);
+        for (size_t i = 0; i < k; ++i)
+            tasks[i].root = subs[i];
+    }
+    else if (m->backend == MAP_BACKEND_BTREE)
+    {
+        size_t nleaves = 0;
+        bt_leaf_t *first = m->bt_root ? bt_iter_leaf(bt_begin(m)) : NULL;
+        for (bt_leaf_t *l = first; l; l = l->next)
+            nleaves++;
+        size_t per = (nleaves + parts - 1) / parts;
+        bt_leaf_t *l = first;
+        for (size_t i = 0; i < nleaves; i += per)
+        {
+            tasks[k].leaf = l;
+            tasks[k].lo = 0;
+            tasks[k].hi = per < nleaves - i ? per : nleaves - i;
+            for (size_t j = 0; j < tasks[k].hi; ++j)
+                l = l->next;
+            k++;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < parts; ++i)
+        {
+            tasks[k].lo = 1 + i * n / parts;
+            tasks[k].hi = 1 + (i + 1) * n / parts;
+            k++;
+        }
+    }
+    for (size_t i = 0; i < k; ++i)
+    {
+        tasks[i].m = m;
+        tasks[i].fn = fn;
+        tasks[i].ctx = ctx;
+    }
+    map_par_run(par_each_task, tasks, sizeof(tasks[0]), k, threads);
+    map_iter_unlock(m);
+    return n;
+}
+
+/* Set operations: map_union, map_intersect, map_difference
+
+   src's entries are read once, in key order, into an array. On the AVL
+   backend dst is then split at the middle src key, both halves recurse
+   on their half of the array, and the results are joined again, so
+   combining m entries into a map of n costs O(m log(n/m + 1)) and parts
+   of dst that src does not reach are never visited. Join and split keep
+   the AVL invariants (and parent/height fields) exact. B+tree maps fall
+   back to per-key inserts and erases. With opts.threads > 1, src ranges
+   of at least MAP_PAR_MIN entries fork their left half onto a new thread. */
+
+typedef enum map_setop
+{
+    MAP_SETOP_UNION,
+    MAP_SETOP_INTERSECT,
+    MAP_SETOP_DIFFERENCE,
+    MAP_SETOP_BATCH /* map_batch_commit: per-entry put or erase */
+} map_setop_t;
+
+/* src entries in key order */
+typedef struct map_setop_src
+{
+    void **keys;
+    void **vals;
+    size_t n;
+    map_node_t **nodes; /* MAP_SETOP_BATCH: prepared node per put, NULL per erase */
+} map_setop_src_t;
+
+/* One recursion step: dst subtree t against src entries [lo, hi) */
+typedef struct map_setop_task
+{
+    map_t *m;
+    const map_setop_src_t *src;
+    map_setop_t op;
+    map_node_t *t; /* in: subtree, out: result subtree */
+    size_t lo, hi;
+    size_t added, removed;
+    int oom;
+    int threads; /* threads this step may still use, itself included */
+} map_setop_task_t;
+
+/**
+ * @brief Join l, k and r into one AVL tree; every key of l < k < every key of r.
+ *
+ * Descends the spine of the taller tree to where the heights differ by at
+ * most one, links k there and rebalances on the way back, so the cost is
+ * O(|height(l) - height(r)| + 1). The returned root's parent is stale.
+ *
+ * @param m Pointer to map_t.
+ * @param l Left tree (may be NULL).
+ * @param k Detached node.
+ * @param r Right tree (may be NULL).
+ * @return map_node_t* Root of the joined tree.
+ */
+static map_node_t *avl_join(map_t *m, map_node_t *l, map_node_t *k, map_node_t *r)
+{
+    int hl = node_height(l);
+    int hr = node_height(r);
+    if (hl > hr + 1)
+    {
+        MAP_LINK_STORE(l->right, avl_join(m, l->right, k, r));
+        l->right->parent = l;
+        return rebalance_at(m, l);
+    }
+    if (hr > hl + 1)
+    {
+        MAP_LINK_STORE(r->left, avl_join(m, l, k, r->left));
+        r->left->parent = r;
+        return rebalance_at(m, r);
+    }
+    MAP_LINK_STORE(k->left, l);
+    MAP_LINK_STORE(k->right, r);
+    if (l)
+        l->parent = k;
+    if (r)
+        r->parent = k;
+    update_height(k);
+    return k;
+}
+
+/**
+ * @brief Detach the maximum node of t.
+ *
+ * @param m Pointer to map_t.
+ * @param t Non-empty tree.
+ * @param last Receives the detached node.
+ * @return map_node_t* Root of the remaining tree (parent stale).
+ */
+static map_node_t *avl_split_last(map_t *m, map_node_t *t, map_node_t **last)
+{
+    if (!t->right)
+    {
+        *last = t;
+        return t->left;
+    }
+    map_node_t *r = avl_split_last(m, t->right, last);
+    return avl_join(m, t->left, t, r);
+}
+
+/**
+ * @brief Join two trees without a middle node; every key of l < every key of r.
+ */
+static map_node_t *avl_join2(map_t *m, map_node_t *l, map_node_t *r)
+{
+    if (!l)
+        return r;
+    map_node_t *k;
+    l = avl_split_last(m, l, &k);
+    return avl_join(m, l, k, r);
+}
+
+/**
+ * @brief Split t into the keys below and above key.
+ *
+ * @param m Pointer to map_t.
+ * @param t Tree to split (consumed).
+ * @param key Split key.
+ * @param l Receives the tree of keys < key (parent stale).
+ * @param r Receives the tree of keys > key (parent stale).
+ * @return map_node_t* The node holding key, detached (its links stale), or NULL.
+ */
+static map_node_t *avl_split(map_t *m, map_node_t *t, const void *key, map_node_t **l, map_node_t **r)
+{
+    if (!t)
+    {
+        *l = *r = NULL;
+        return NULL;
+    }
+    int c = MAP_CMP(m, key, t->key);
+    if (c == 0)
+    {
+        *l = t->left;
+        *r = t->right;
+        return t;
+    }
+    map_node_t *mid;
+    map_node_t *f;
+    if (c < 0)
+    {
+        f = avl_split(m, t->left, key, l, &mid);
+        *r = avl_join(m, mid, t, t->right);
+    }
+    else
+    {
+        f = avl_split(m, t->right, key, &mid, r);
+        *l = avl_join(m, t->left, t, mid);
+    }
+    return f;
+}
+
+/**
+ * @brief Free every node of a detached subtree, counting them as removed.
+ */
+static void setop_drop(map_setop_task_t *k, map_node_t *n)
+{
+    while (n)
+    {
+        map_node_t *right = n->right;
+        setop_drop(k, n->left);
+        node_free(k->m, n);
+        k->removed++;
+        n = right;
+    }
+}
+
+/**
+ * @brief Null the pointers of an unlinked batch node that the caller still owns.
+ *
+ * Keys and values stored as-is (no dup, arena or string copy) only pass
+ * to the map once their node is linked; value is non-zero to clear the
+ * value pointer too.
+ */
+static void batch_disown(map_t *m, map_node_t *nd, int value)
+{
+    if (!m->key_dup && !map_arena_keys(m) && !(m->flags & MAP_STRING_KEYS))
+        nd->key = NULL;
+    if (value && !m->val_dup && !map_arena_vals(m))
+        nd->value = NULL;
+}
+
+static void setop_run(map_setop_task_t *k);
+
+/**
+ * @brief pthread entry point running one half of a split set operation.
+ */
+static void *setop_thread(void *arg)
+{
+    setop_run((map_setop_task_t *)arg);
+    return NULL;
+}
+
+/**
+ * @brief Apply k->op to subtree k->t and src entries [k->lo, k->hi).
+ *
+ * The two halves below the split touch disjoint subtrees and disjoint src
+ * ranges, so a large left half may run on its own thread while this one
+ * does the right half.
+ *
+ * @param k Task; k->t, k->added, k->removed and k->oom are updated.
+ */
+static void setop_run(map_setop_task_t *k)
+{
+    map_t *m = k->m;
+    const map_setop_src_t *s = k->src;
+    if (k->lo == k->hi)
+    {
+        if (k->op == MAP_SETOP_INTERSECT)
+        {
+            setop_drop(k, k->t);
+            k->t = NULL;
+        }
+        return;
+    }
+    if (!k->t && k->op != MAP_SETOP_UNION && k->op != MAP_SETOP_BATCH)
+        return;
+
+    size_t mid = k->lo + (k->hi - k->lo) / 2;
+    map_node_t *l;
+    map_node_t *r;
+    map_node_t *f = avl_split(m, k->t, s->keys[mid], &l, &r);
+    if (k->op == MAP_SETOP_UNION)
+    {
+        if (f)
+        {
+            /* replace the value, as map_put does */
+            void *old = f->value;
+            void *nv = map_store_value(m, s->vals[mid]);
+            map_publish_fence(m);
+            MAP_LINK_STORE(f->value, nv);
+            map_retire_value(m, old);
+        }
+        else if ((f = node_new(m, s->keys[mid], s->vals[mid])) != NULL)
+            k->added++;
+        else
+            k->oom = 1;
+    }
+    else if (k->op == MAP_SETOP_DIFFERENCE && f)
+    {
+        node_free(m, f);
+        k->removed++;
+        f = NULL;
+    }
+    else if (k->op == MAP_SETOP_BATCH)
+    {
+        map_node_t *p = s->nodes[mid];
+        if (!p && f)
+        {
+            node_free(m, f);
+            k->removed++;
+            f = NULL;
+        }
+        else if (p && f)
+        {
+            /* existing key: take the prepared value; p leaves with the old one */
+            void *old = f->value;
+            map_publish_fence(m);
+            MAP_LINK_STORE(f->value, p->value);
+            p->value = old;
+            batch_disown(m, p, 0);
+            node_free(m, p);
+        }
+        else if (p)
+        {
+            f = p;
+            k->added++;
+        }
+    }
+
+    map_setop_task_t a = *k;
+    map_setop_task_t b = *k;
+    a.t = l;
+    a.hi = mid;
+    a.added = a.removed = 0;
+    a.oom = 0;
+    b.t = r;
+    b.lo = mid + 1;
+    b.added = b.removed = 0;
+    b.oom = 0;
+    pthread_t th;
+    int forked = 0;
+    if (k->threads > 1 && mid - k->lo >= MAP_PAR_MIN)
+    {
+        a.threads = k->threads / 2;
+        b.threads = k->threads - a.threads;
+        forked = pthread_create(&th, NULL, setop_thread, &a) == 0;
+    }
+    if (!forked)
+    {
+        a.threads = b.threads = k->threads;
+        setop_run(&a);
+    }
+    setop_run(&b);
+    if (forked)
+        pthread_join(th, NULL);
+
+    k->t = f ? avl_join(m, a.t, f, b.t) : avl_join2(m, a.t, b.t);
+    k->added += a.added + b.added;
+    k->removed += a.removed + b.removed;
+    k->oom |= a.oom | b.oom;
+}
+
+/**
+ * @brief AVL body of the set operations; writers are excluded by the caller.
+ */
+static int avl_setop(map_t *m, const map_setop_src_t *s, map_setop_t op)
+{
+    map_setop_task_t k;
+    memset(&k, 0, sizeof(k));
+    k.m = m;
+    k.src = s;
+    k.op = op;
+    k.t = m->root;
+    k.hi = s->n;
+    /* the retire list has a single writer too */
+    k.threads = m->sync ? 1 : (int)map_par_threads(m, s->n, 1);
+    setop_run(&k);
+    map_publish_fence(m);
+    MAP_LINK_STORE(m->root, k.t);
+    if (k.t)
+        k.t->parent = NULL;
+    m->size = m->size + k.added - k.removed;
+    MAP_STAT_ADD(m, inserts, k.added);
+    MAP_STAT_ADD(m, erases, k.removed);
+    return k.oom ? -1 : 1;
+}
+
+/**
+ * @brief B+tree body of the set operations: per-key inserts and erases.
+ */
+static int bt_setop(map_t *m, const map_setop_src_t *s, map_setop_t op)
+{
+    int r = 1;
+    if (op == MAP_SETOP_UNION)
+    {
+        for (size_t i = 0; i < s->n; ++i)
+        {
+            if (bt_insert(m, s->keys[i], s->vals[i], 1) < 0)
+                r = -1;
+        }
+        return r;
+    }
+    if (op == MAP_SETOP_DIFFERENCE)
+    {
+        for (size_t i = 0; i < s->n; ++i)
+            bt_erase(m, s->keys[i]);
+        return r;
+    }
+
+    /* intersect: one merge walk finds the keys src lacks, then erase them */
+    void **gone = (void **)malloc((m->size ? m->size : 1) * sizeof(void *));
+    if (!gone)
+        return -1;
+    size_t ng = 0;
+    size_t j = 0;
+    for (map_iter_t it = bt_begin(m); it; it = bt_next(it))
+    {
+        void *key = bt_iter_leaf(it)->keys[bt_iter_slot(it)];
+        int c = 1;
+        while (j < s->n && (c = MAP_CMP(m, s->keys[j], key)) < 0)
+            j++;
+        if (j == s->n || c > 0)
+            gone[ng++] = key;
+    }
+    for (size_t i = 0; i < ng; ++i)
+        bt_erase(m, gone[i]);
+    free(gone);
+    return r;
+}
+
+/**
+ * @brief Shared driver of map_union, map_intersect and map_difference.
+ */
+static int map_setop(map_t *dst, map_t *src, map_setop_t op)
+{
+    if (!dst || !src || dst->backend == MAP_BACKEND_SNAPSHOT || dst->cmp != src->cmp)
+        return -1;
+    if (dst == src)
+    {
+        if (op == MAP_SETOP_DIFFERENCE)
+            map_clear(dst);
+        return 1;
+    }
+
+    map_setop_src_t s;
+    map_iter_lock(src);
+    s.nodes = NULL;
+    s.n = src->size;
+    s.keys = (void **)malloc((s.n ? 2 * s.n : 1) * sizeof(void *));
+    s.vals = s.keys ? s.keys + s.n : NULL;
+    size_t i = 0;
+    for (map_iter_t it = s.keys ? map_begin(src) : NULL; it; it = map_next(it))
+    {
+        s.keys[i] = map_iter_key(it);
+        s.vals[i] = map_iter_value(it);
+        i++;
+    }
+    map_iter_unlock(src);
+    if (!s.keys)
+        return -1;
+
+    if (dst->sync)
+        map_write_begin(dst);
+    int r = -1;
+    if (dst->backend == MAP_BACKEND_BTREE)
+        r = bt_setop(dst, &s, op);
+    else if (map_unshare(dst) == 0)
+        r = avl_setop(dst, &s, op);
+    if (dst->sync)
+        map_write_end(dst);
+    free(s.keys);
+    return r;
+}
+
+/**
+ * @brief Add every entry of src to dst; on a shared key src's value wins.
+ *
+ * The result matches calling map_put(dst, key, value) for each src entry
+ * (keys and values are stored through dst's dup callbacks), but on the
+ * AVL backend it costs O(m log(n/m + 1)) for m src and n dst entries.
+ * If dst was created with opts.threads > 1, large inputs run on several
+ * threads (arena, MAP_STATS and MAP_CONCURRENT maps always use one).
+ *
+ * @param dst Map to update (AVL or B+tree).
+ * @param src Map to read; it must use the same compare callback and must
+ *            not change during the call.
+ * @return int 1 on success, -1 on OOM (dst stays valid but may miss some
+ *         of src's keys) or if the maps are not compatible (dst unchanged).
+ */
+int map_union(map_t *dst, map_t *src) { return map_setop(dst, src, MAP_SETOP_UNION); }
+
+/**
+ * @brief Keep only the entries of dst whose key is also in src.
+ *
+ * dst's values are kept, src's are ignored. Costs O(m log(n/m + 1)) on the
+ * AVL backend plus the frees of the dropped entries; see map_union for
+ * threading and compatibility.
+ *
+ * @param dst Map to update (AVL or B+tree).
+ * @param src Map to read (same compare callback).
+ * @return int 1 on success, -1 on OOM or incompatible maps (dst unchanged).
+ */
+int map_intersect(map_t *dst, map_t *src) { return map_setop(dst, src, MAP_SETOP_INTERSECT); }
+
+/**
+ * @brief Remove from dst every key that is in src.
+ *
+ * Costs O(m log(n/m + 1)) on the AVL backend; see map_union for threading
+ * and compatibility.
+ *
+ * @param dst Map to update (AVL or B+tree).
+ * @param src Map to read (same compare callback).
+ * @return int 1 on success, -1 on OOM or incompatible maps (dst unchanged).
+ */
+int map_difference(map_t *dst, map_t *src) { return map_setop(dst, src, MAP_SETOP_DIFFERENCE); }
+
+/* Batched updates: map_batch_begin, map_batch_apply, map_batch_commit
+
+   A batch collects puts and erases and applies them in one go. Commit
+   sorts the operations by key (stably: the last operation on a key
+   wins), creates the nodes and stored values for the puts while the tree
+   is still untouched, and then runs them through the set-operation
+   recursion: split at the middle operation, recurse into both halves,
+   join. Each join rebalances only along its own seam, so k operations on
+   a map of n cost O(k log(n/k + 1)) instead of k full walks up the parent
+   chain. Because every allocation happens first, an AVL commit either
+   applies the whole batch or, on OOM, leaves the map unchanged. On a
+   MAP_CONCURRENT map readers keep using the old tree while the nodes are
+   prepared and see the new one once the relinking is done. B+tree maps
+   apply the sorted operations one by one. */
+
+typedef enum map_batch_kind
+{
+    MAP_BATCH_PUT,  /* insert or replace, like map_put */
+    MAP_BATCH_ERASE /* remove if present, like map_erase */
+} map_batch_kind_t;
+
+typedef struct map_batch_op
+{
+    map_batch_kind_t kind;
+    void *key;   /* caller key; must stay valid until commit or abort */
+    void *value; /* MAP_BATCH_PUT: stored through val_dup at commit */
+} map_batch_op_t;
+
+typedef struct map_batch
+{
+    map_t *m;
+    map_batch_op_t *ops; /* in the order applied */
+    size_t n;
+    size_t cap;
+} map_batch_t;
+
+/**
+ * @brief Start an empty batch of updates for m.
+ *
+ * @param m Pointer to map_t (AVL or B+tree).
+ * @return map_batch_t* Batch handle, or NULL on OOM or a snapshot map.
+ */
+map_batch_t *map_batch_begin(map_t *m)
+{
+    if (!m || m->backend == MAP_BACKEND_SNAPSHOT)
+        return NULL;
+    map_batch_t *b = (map_batch_t *)calloc(1, sizeof(map_batch_t));
+    if (b)
+        b->m = m;
+    return b;
+}
+
+/**
+ * @brief Append n operations to a batch; the map is not touched until commit.
+ *
+ * @param b Batch from map_batch_begin.
+ * @param ops n operations, applied after those already in the batch.
+ * @param n Number of operations.
+ * @return int 0 on success, -1 on OOM (the batch keeps its earlier operations).
+ */
+int map_batch_apply(map_batch_t *b, const map_batch_op_t *ops, size_t n)
+{
+    if (!b || (n && !ops))
+        return -1;
+    if (b->cap - b->n < n)
+    {
+        size_t cap = b->cap ? b->cap : 64;
+        while (cap - b->n < n)
+            cap *= 2;
+        map_batch_op_t *grown = (map_batch_op_t *)realloc(b->ops, cap * sizeof(map_batch_op_t));
+        if (!grown)
+            return -1;
+        b->ops = grown;
+        b->cap = cap;
+    }
+    memcpy(b->ops + b->n, ops, n * sizeof(map_batch_op_t));
+    b->n += n;
+    return 0;
+}
+
+/**
+ * @brief Stable merge sort of operation pointers a[lo, hi) by key.
+ */
+static void batch_sort(map_t *m, const map_batch_op_t **a, const map_batch_op_t **tmp, size_t lo, size_t hi)
+{
+    if (hi - lo < 2)
+        return;
+    size_t mid = lo + (hi - lo) / 2;
+    batch_sort(m, a, tmp, lo, mid);
+    batch_sort(m, a, tmp, mid, hi);
+    size_t i = lo;
+    size_t j = mid;
+    size_t o = lo;
+    while (i < mid && j < hi)
+        tmp[o++] = MAP_CMP(m, a[j]->key, a[i]->key) < 0 ? a[j++] : a[i++];
+    while (i < mid)
+        tmp[o++] = a[i++];
+    while (j < hi)
+        tmp[o++] = a[j++];
+    memcpy(a + lo, tmp + lo, (hi - lo) * sizeof(*a));
+}
+
+/**
+ * @brief Discard a batch without applying it.
+ *
+ * @param b Batch from map_batch_begin (NULL safe).
+ */
+void map_batch_abort(map_batch_t *b)
+{
+    if (!b)
+        return;
+    free(b->ops);
+    free(b);
+}
+
+/**
+ * @brief Apply every operation of a batch to its map and free the batch.
+ *
+ * The result is that of calling map_put / map_erase for each operation in
+ * order. See "Batched updates" for cost and visibility.
+ *
+ * @param b Batch from map_batch_begin; freed in every case.
+ * @return int 1 on success, -1 on OOM (an AVL map is then unchanged; a
+ *         B+tree map may hold part of the batch).
+ */
+int map_batch_commit(map_batch_t *b)
+{
+    if (!b)
+        return -1;
+    map_t *m = b->m;
+    size_t n = b->n;
+    const map_batch_op_t **ord = (const map_batch_op_t **)malloc((n ? 2 * n : 1) * sizeof(*ord));
+    map_setop_src_t s;
+    s.keys = (void **)malloc((n ? 2 * n : 1) * sizeof(void *));
+    s.vals = s.keys ? s.keys + n : NULL;
+    s.nodes = (map_node_t **)malloc((n ? n : 1) * sizeof(map_node_t *));
+    int r = ord && s.keys && s.nodes ? 1 : -1;
+
+    /* sort, keeping the last operation per key */
+    s.n = 0;
+    if (r > 0)
+    {
+        for (size_t i = 0; i < n; ++i)
+            ord[i] = &b->ops[i];
+        batch_sort(m, ord, ord + n, 0, n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i + 1 < n && MAP_CMP(m, ord[i]->key, ord[i + 1]->key) == 0)
+                continue;
+            ord[s.n++] = ord[i];
+        }
+    }
+
+    if (r > 0 && m->backend == MAP_BACKEND_BTREE)
+    {
+        for (size_t i = 0; i < s.n; ++i)
+        {
+            if (ord[i]->kind == MAP_BATCH_ERASE)
+                bt_erase(m, ord[i]->key);
+            else if (bt_insert(m, ord[i]->key, ord[i]->value, 1) < 0)
+                r = -1;
+        }
+    }
+    else if (r > 0 && map_unshare(m) < 0)
+        r = -1;
+    else if (r > 0)
+    {
+        /* allocate everything before the tree changes; readers see nothing yet */
+        map_iter_lock(m);
+        size_t made = 0;
+        for (; made < s.n; ++made)
+        {
+            const map_batch_op_t *op = ord[made];
+            map_node_t *nd = NULL;
+            if (op->kind != MAP_BATCH_ERASE && !(nd = node_new(m, op->key, op->value)))
+                break;
+            s.nodes[made] = nd;
+            s.keys[made] = nd ? nd->key : op->key;
+            s.vals[made] = NULL;
+        }
+        if (made < s.n)
+        {
+            while (made-- > 0)
+            {
+                if (s.nodes[made])
+                {
+                    batch_disown(m, s.nodes[made], 1);
+                    node_release(m, s.nodes[made]);
+                }
+            }
+            r = -1;
+            map_iter_unlock(m);
+        }
+        else if (m->sync)
+        {
+            sync_open(m->sync);
+            r = avl_setop(m, &s, MAP_SETOP_BATCH);
+            map_write_end(m);
+        }
+        else
+            r = avl_setop(m, &s, MAP_SETOP_BATCH);
+    }
+    free(s.nodes);
+    free(s.keys);
+    free(ord);
+    map_batch_abort(b);
+    return r;
+}
+
+/* Persistent snapshots */
+
+/**
+ * @brief Byte length map_save stores for a key, or SIZE_MAX if unknown.
+ */
+static size_t snap_key_bytes(map_t *m, map_iter_t it, const void *key)
+{
+    if (snap_iter_is(it))
+        return snap_iter_entry(it)->key_len;
+    if (m->flags & MAP_STRING_KEYS)
+        return strlen((const char *)key) + 1;
+    return m->key_len ? m->key_len(key) : SIZE_MAX;
+}
+
+/**
+ * @brief Byte length map_save stores for a non-NULL value, or SIZE_MAX if unknown.
+ */
+static size_t snap_val_bytes(map_t *m, map_iter_t it, const void *value)
+{
+    if (snap_iter_is(it))
+        return snap_iter_entry(it)->val_len;
+    return m->val_len ? m->val_len(value) : SIZE_MAX;
+}
+
+/**
+ * @brief Write len bytes and zero padding up to the next SNAP_ALIGN boundary.
+ *
+ * @return uint64_t Bytes written (len rounded up), or 0 on a write error.
+ */
+static uint64_t snap_write_padded(FILE *f, const void *p, size_t len)
+{
+    static const char zero[SNAP_ALIGN];
+    size_t pad = (SNAP_ALIGN - len % SNAP_ALIGN) % SNAP_ALIGN;
+    if (fwrite(p, 1, len, f) != len || fwrite(zero, 1, pad, f) != pad)
+        return 0;
+    return (uint64_t)(len + pad);
+}
+
+/**
+ * @brief Write the map to a snapshot file that map_open_mmap can map in place.
+ *
+ * Key and value bytes are copied, so their lengths must be known: C
+ * strings for MAP_STRING_KEYS keys, key_len / val_len from map_opts_t
+ * otherwise (NULL values need no length). Only the bytes are stored, so
+ * keys and values must not contain pointers. The file is written next to
+ * path and renamed over it, so a process mapping the old file keeps a
+ * consistent view. A MAP_CONCURRENT map holds off writers while saving.
+ *
+ * @param m Pointer to map_t (any backend, including a snapshot).
+ * @param path Destination file.
+ * @return int 0 on success, -1 on an unknown length, OOM or I/O error.
+ */
+int map_save(map_t *m, const char *path)
+{
+    if (!m || !path || m->size > INT32_MAX)
+        return -1;
+    size_t n = m->size;
+    size_t plen = strlen(path);
+    char *tmp = (char *)malloc(plen + 5);
+    map_snap_entry_t *e = (map_snap_entry_t *)calloc(n + 1, sizeof(map_snap_entry_t));
+    FILE *f = NULL;
+    if (tmp)
+    {
+        memcpy(tmp, path, plen);
+        memcpy(tmp + plen, ".tmp", 5);
+        f = fopen(tmp, "wb");
+    }
+    if (!tmp || !e || !f)
+    {
+        if (f)
+            fclose(f);
+        free(e);
+        free(tmp);
+        return -1;
+    }
+
+    /* key/value bytes first, after the space left for the header and entries */
+    uint64_t entries_off = (sizeof(map_snap_header_t) + 63) & ~(uint64_t)63;
+    uint64_t pos = entries_off + (uint64_t)(n + 1) * sizeof(map_snap_entry_t);
+    pos = (pos + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+    int ok = fseeko(f, (off_t)pos, SEEK_SET) == 0;
+    map_iter_lock(m);
+    size_t i = eyt_first(n);
+    size_t prev = 0;
+    for (map_iter_t it = map_begin(m); ok && it; it = map_next(it))
+    {
+        void *key = map_iter_key(it);
+        void *value = map_iter_value(it);
+        size_t kl = snap_key_bytes(m, it, key);
+        size_t vl = value ? snap_val_bytes(m, it, value) : 0;
+        uint64_t at = entries_off + (uint64_t)i * sizeof(map_snap_entry_t);
+        uint64_t w;
+        if (kl == SIZE_MAX || vl == SIZE_MAX || kl > UINT32_MAX || vl > UINT32_MAX || i == 0)
+        {
+            ok = 0;
+            break;
+        }
+        e[i].key_off = (int64_t)(pos - at);
+        e[i].key_len = (uint32_t)kl;
+        if (!(w = snap_write_padded(f, key, kl)) && kl)
+            ok = 0;
+        pos += w;
+        if (value)
+        {
+            e[i].val_off = (int64_t)(pos - at);
+            e[i].val_len = (uint32_t)vl;
+            if (!(w = snap_write_padded(f, value, vl)) && vl)
+                ok = 0;
+            pos += w;
+        }
+        if (prev)
+        {
+            e[prev].next = (int32_t)((int64_t)i - (int64_t)prev);
+            e[i].prev = (int32_t)((int64_t)prev - (int64_t)i);
+        }
+        prev = i;
+        i = eyt_next(i, n);
+    }
+    map_iter_unlock(m);
+
+    map_snap_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    h.version = SNAP_VERSION;
+    h.endian = SNAP_ENDIAN;
+    h.count = n;
+    h.entries_off = entries_off;
+    h.file_size = pos;
+    h.entry_size = sizeof(map_snap_entry_t);
+    h.flags = (m->flags & MAP_STRING_KEYS) ? SNAP_STRING_KEYS : 0;
+    static const char zero[64];
+    ok = ok && fseeko(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fwrite(zero, 1, entries_off - sizeof(h), f) == entries_off - sizeof(h) &&
+         fwrite(e, sizeof(map_snap_entry_t), n + 1, f) == n + 1;
+    if (fclose(f) != 0)
+        ok = 0;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok)
+        remove(tmp);
+    free(e);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Map a file written by map_save read-only and return it as a map.
+ *
+ * Nothing is copied or rebuilt: map_find, map_find_many, the iterator
+ * functions, bounds and map_scan read the mapping directly, touching only
+ * the pages a query needs. Keys and values returned point into the
+ * mapping and must not be written. Insert, put, erase and bulk load fail;
+ * map_clear unmaps the file and leaves an ordinary empty AVL map. The
+ * file is trusted: the header is checked, the entries are not.
+ *
+ * @param path File written by map_save.
+ * @param cmp Compare callback, the one the saved map used (ignored for
+ *            string-key snapshots).
+ * @return map_t* Snapshot map, or NULL if the file is not a valid snapshot,
+ *         cmp is missing, or on OOM.
+ */
+map_t *map_open_mmap(const char *path, map_cmp_fn cmp)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(map_snap_header_t))
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    size_t len = (size_t)st.st_size;
+    const map_snap_header_t *h = (const map_snap_header_t *)p;
+    int str = (h->flags & SNAP_STRING_KEYS) != 0;
+    int valid = memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) == 0 && h->version == SNAP_VERSION &&
+                h->endian == SNAP_ENDIAN && h->entry_size == sizeof(map_snap_entry_t) &&
+                h->file_size == len && h->entries_off % 64 == 0 && h->count <= INT32_MAX &&
+                h->entries_off + (h->count + 1) * sizeof(map_snap_entry_t) <= len;
+    map_t *m = valid && (str || cmp) ? map_create(str ? str_key_cmp : cmp, NULL, NULL, NULL, NULL) : NULL;
+    if (!m)
+    {
+        munmap(p, len);
+        return NULL;
+    }
+    m->backend = MAP_BACKEND_SNAPSHOT;
+    m->flags = str ? MAP_STRING_KEYS : 0;
+    m->size = (size_t)h->count;
+    m->snap = (const unsigned char *)p;
+    m->snap_len = len;
+    return m;
+}
+
+/* Frozen maps (map_freeze)
+
+   A read-only table that is built once and then only searched does not
+   need the pointer graph of the AVL tree. map_freeze moves the entries
+   into two arrays in Eytzinger (BFS) order, keys and values, 1-based
+   like the snapshot entries: slot i has children 2i and 2i + 1. That is
+   16 bytes per entry against 48 for a map_node_t, and keys the map kept
+   inside its nodes, arena or snapshot file are packed into one block in
+   the same BFS order.
+
+   A lookup descends without a data-dependent branch, i = 2i + (key[i] <
+   key), prefetching the pointers three levels below; the loop runs the
+   same number of rounds for every key, give or take one. Turning the
+   final index back into the lower bound takes one count-trailing-ones.
+   An iterator is a slot index (0 past the end) and walks keys in order. */
+
+typedef struct map_frozen
+{
+    map_cmp_fn cmp;
+    size_t n;
+    void **keys;          /* keys[1..n] in Eytzinger order; 64-byte aligned, keys[0] unused */
+    void **values;        /* values[i] belongs to keys[i] */
+    void *bytes;          /* key/value bytes copied out of the map, or NULL */
+    map_free_fn key_free; /* for keys moved out of the map; NULL if copied or borrowed */
+    map_free_fn val_free;
+} map_frozen_t;
+
+/**
+ * @brief Eytzinger index reached by climbing past the trailing right turns of i.
+ *
+ * After a lower-bound descent ends at i > n, this is the slot of the
+ * first key >= the search key, or 0 if there is none.
+ */
+static size_t eyt_climb(size_t i)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return i >> (__builtin_ctzll(~(unsigned long long)i) + 1);
+#else
+    while (i & 1)
+        i >>= 1;
+    return i >> 1;
+#endif
+}
+
+/**
+ * @brief Slot of the first frozen key >= key, or 0.
+ */
+static size_t frozen_lower(const map_frozen_t *f, const void *key)
+{
+    void *const *keys = f->keys;
+    size_t n = f->n;
+    size_t i = 1;
+    while (i <= n)
+    {
+        MAP_PREFETCH((const void *)((uintptr_t)keys + 64 * i)); /* slots 8i..8i+7 */
+        i = 2 * i + (f->cmp(keys[i], key) < 0);
+    }
+    return eyt_climb(i);
+}
+
+/**
+ * @brief Move every entry of a map into a new frozen map.
+ *
+ * On success the source map is left empty but usable. Keys and values
+ * whose bytes the map held itself (MAP_STRING_KEYS text, arena copies,
+ * snapshot bytes) are copied into the frozen map, which needs their
+ * lengths exactly as map_save does; all other pointers move, together
+ * with the map's key_free / val_free duty. On failure the map is
+ * unchanged. A MAP_CONCURRENT map may have readers, but no other writer,
+ * while it is frozen.
+ *
+ * @param m Pointer to map_t (any backend).
+ * @return map_frozen_t* Frozen map, release with frozen_destroy; NULL on
+ *         OOM or an unknown key/value length.
+ */
+map_frozen_t *map_freeze(map_t *m)
+{
+    if (!m || map_unshare(m) < 0) /* entries move out, so none may stay shared */
+        return NULL;
+    map_iter_lock(m); /* until the map is empty: the size must not change */
+    int copy_keys = (m->flags & MAP_STRING_KEYS) || map_arena_keys(m) || m->snap;
+    int copy_vals = map_arena_vals(m) || m->snap;
+    size_t n = m->size;
+    size_t kbytes = ((n + 1) * sizeof(void *) + 63) & ~(size_t)63;
+    map_frozen_t *f = (map_frozen_t *)calloc(1, sizeof(map_frozen_t));
+    void *slots = NULL;
+    size_t *len = (copy_keys || copy_vals) ? (size_t *)calloc(2 * (n + 1), sizeof(size_t)) : NULL;
+    if (!f || posix_memalign(&slots, 64, kbytes + (n + 1) * sizeof(void *)) != 0 ||
+        ((copy_keys || copy_vals) && !len))
+    {
+        map_iter_unlock(m);
+        free(slots);
+        free(len);
+        free(f);
+        return NULL;
+    }
+    f->cmp = m->cmp;
+    f->n = n;
+    f->keys = (void **)slots;
+    f->values = (void **)((char *)slots + kbytes);
+    f->keys[0] = f->values[0] = NULL;
+
+    /* place the entries in key order, noting the byte lengths to copy */
+    size_t total = 0;
+    int ok = 1;
+    size_t i = eyt_first(n);
+    for (map_iter_t it = map_begin(m); it; it = map_next(it), i = eyt_next(i, n))
+    {
+        f->keys[i] = map_iter_key(it);
+        f->values[i] = map_iter_value(it);
+        if (copy_keys)
+            len[2 * i] = snap_key_bytes(m, it, f->keys[i]);
+        if (copy_vals && f->values[i])
+            len[2 * i + 1] = snap_val_bytes(m, it, f->values[i]);
+        if (len && (len[2 * i] == SIZE_MAX || len[2 * i + 1] == SIZE_MAX))
+            ok = 0;
+        else if (len)
+            total += ((len[2 * i] + MAP_ARENA_ALIGN - 1) & ~(size_t)(MAP_ARENA_ALIGN - 1)) +
+                     ((len[2 * i + 1] + MAP_ARENA_ALIGN - 1) & ~(size_t)(MAP_ARENA_ALIGN - 1));
+    }
+    if (ok && total && !(f->bytes = malloc(total)))
+        ok = 0;
+    if (!ok)
+    {
+        map_iter_unlock(m);
+        free(len);
+        free(f->bytes);
+        free(f->keys);
+        free(f);
+        return NULL;
+    }
+
+    /* copies go in slot order too, so the top levels share cache lines */
+    char *p = (char *)f->bytes;
+    for (i = 1; len && i <= n; ++i)
+    {
+        for (int v = 0; v < 2; ++v)
+        {
+            void **slot = v ? &f->values[i] : &f->keys[i];
+            size_t l = len[2 * i + v];
+            if (!(v ? copy_vals : copy_keys) || !*slot)
+                continue;
+            memcpy(p, *slot, l);
+            *slot = p;
+            p += (l + MAP_ARENA_ALIGN - 1) & ~(size_t)(MAP_ARENA_ALIGN - 1);
+        }
+    }
+    free(len);
+
+    /* entries retired earlier are the map's own: free them with the callbacks */
+    if (m->sync)
+        sync_reclaim(m);
+
+    /* empty the map without releasing what moved; writers stay locked out */
+    map_free_fn key_free = m->key_free;
+    map_free_fn val_free = m->val_free;
+    f->key_free = copy_keys ? NULL : key_free;
+    f->val_free = copy_vals ? NULL : val_free;
+    m->key_free = NULL;
+    m->val_free = NULL;
+    clear_entries(m);
+    m->key_free = key_free;
+    m->val_free = val_free;
+    map_iter_unlock(m);
+    return f;
+}
+
+/**
+ * @brief Find the value stored for key in a frozen map.
+ *
+ * @param f Pointer to map_frozen_t.
+ * @param key Pointer to search key.
+ * @return void* Stored value pointer if found, NULL if not found.
+ */
+void *frozen_find(const map_frozen_t *f, const void *key)
+{
+    if (!f)
+        return NULL;
+    size_t i = frozen_lower(f, key);
+    return i && f->cmp(f->keys[i], key) == 0 ? f->values[i] : NULL;
+}
+
+/**
+ * @brief Iterator to the first frozen key >= key.
+ *
+ * @param f Pointer to map_frozen_t.
+ * @param key Pointer to search key.
+ * @return size_t Slot index, or 0 if every key is smaller.
+ */
+size_t frozen_lower_bound(const map_frozen_t *f, const void *key) { return f ? frozen_lower(f, key) : 0; }
+
+/**
+ * @brief Iterator to the smallest key of a frozen map.
+ *
+ * @param f Pointer to map_frozen_t.
+ * @return size_t Slot index, or 0 if the map is empty.
+ */
+size_t frozen_begin(const map_frozen_t *f) { return f ? eyt_first(f->n) : 0; }
+
+/**
+ * @brief Advance a frozen iterator in key order.
+ *
+ * @param f Pointer to map_frozen_t owning the iterator.
+ * @param it Current slot index (non-zero).
+ * @return size_t Next slot index, or 0 past the largest key.
+ */
+size_t frozen_next(const map_frozen_t *f, size_t it) { return it ? eyt_next(it, f->n) : 0; }
+
+/**
+ * @brief Key at a frozen iterator.
+ *
+ * @param f Pointer to map_frozen_t.
+ * @param it Slot index (may be 0).
+ * @return void* Stored key, or NULL if it is 0.
+ */
+void *frozen_key(const map_frozen_t *f, size_t it) { return it ? f->keys[it] : NULL; }
+
+/**
+ * @brief Value at a frozen iterator.
+ *
+ * @param f Pointer to map_frozen_t.
+ * @param it Slot index (may be 0).
+ * @return void* Stored value, or NULL if it is 0.
+ */
+void *frozen_value(const map_frozen_t *f, size_t it) { return it ? f->values[it] : NULL; }
+
+/**
+ * @brief Number of entries in a frozen map.
+ */
+size_t frozen_size(const map_frozen_t *f) { return f ? f->n : 0; }
+
+/**
+ * @brief Free a frozen map, applying the free callbacks moved from its source.
+ *
+ * @param f Pointer to map_frozen_t (NULL safe).
+ */
+void frozen_destroy(map_frozen_t *f)
+{
+    if (!f)
+        return;
+    for (size_t i = 1; i <= f->n && (f->key_free || f->val_free); ++i)
+    {
+        if (f->key_free && f->keys[i])
+            f->key_free(f->keys[i]);
+        if (f->val_free && f->values[i])
+            f->val_free(f->values[i]);
+    }
+    free(f->bytes);
+    free(f->keys);
+    free(f);
+}
+
+/* Versions (map_snapshot)
+
+   A version is a read-only view of the map as it was when map_snapshot
+   returned, kept alive by reference counts on the nodes it shares with
+   the map (see "Versions (map_snapshot): path copying"). Taking one is
+   O(1) and copies nothing; the map stays writable and pays O(log n) new
+   nodes per update while any version is alive. Versions outlive the
+   map if need be and are released in any order, from any thread.
+
+   A version is searched with its own calls, version_find and
+   version_scan, which never follow parent links. The map and each
+   version may be used by different threads at once; without MAP_STATS
+   one version may also be read by several threads together. */
+
+typedef struct map_version
+{
+    map_t view;       /* the map's settings with the root and size of that moment */
+    map_vctl_t *vctl; /* shared with the map and its other versions */
+} map_version_t;
+
+/**
+ * @brief Take an O(1) immutable version of the map's current contents.
+ *
+ * Needs an AVL map without MAP_CONCURRENT or MAP_ARENA. Copies of
+ * shared nodes duplicate their entries, so a map that frees its keys
+ * (values) must also duplicate them: key_free needs key_dup (unless
+ * MAP_STRING_KEYS) and val_free needs val_dup.
+ *
+ * @param m Pointer to map_t.
+ * @return map_version_t* Version, release with version_release; NULL on
+ *         OOM or an unsupported map.
+ */
+map_version_t *map_snapshot(map_t *m)
+{
+    if (!m || m->backend != MAP_BACKEND_AVL || m->sync || (m->flags & MAP_ARENA) ||
+        (m->key_free && !m->key_dup && !(m->flags & MAP_STRING_KEYS)) || (m->val_free && !m->val_dup))
+        return NULL;
+    map_version_t *v = (map_version_t *)malloc(sizeof(map_version_t));
+    if (!v)
+        return NULL;
+    if (!m->versions)
+    {
+        if (!(m->versions = (map_vctl_t *)malloc(sizeof(map_vctl_t))))
+        {
+            free(v);
+            return NULL;
+        }
+        atomic_init(&m->versions->refs, 1);
+    }
+    v->view = *m;
+    v->view.versions = NULL;
+    v->view.sync = NULL;
+    v->view.snap = NULL;
+    v->view.bt_root = NULL;
+    v->view.taking = 0;
+    v->view.threads = 1;
+#ifdef MAP_STATS
+    memset(&v->view.stats, 0, sizeof(v->view.stats));
+    v->view.stats_ops = 0;
+#endif
+    v->vctl = m->versions;
+    if (m->root)
+        atomic_fetch_add_explicit(&m->root->refs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&v->vctl->refs, 1, memory_order_release);
+    return v;
+}
+
+/**
+ * @brief Find the value stored for key in a version.
+ *
+ * @param v Pointer to map_version_t.
+ * @param key Pointer to search key.
+ * @return void* Stored value pointer if found, NULL if not found.
+ */
+void *version_find(map_version_t *v, const void *key)
+{
+    map_node_t *n = v ? find_node(&v->view, key) : NULL;
+    return n ? n->value : NULL;
+}
+
+/**
+ * @brief Number of entries in a version.
+ */
+size_t version_size(const map_version_t *v) { return v ? v->view.size : 0; }
+
+/**
+ * @brief Visit a version's entries with lo <= key < hi in key order.
+ *
+ * @param v Pointer to map_version_t.
+ * @param lo Inclusive lower bound, or NULL for the first key.
+ * @param hi Exclusive upper bound, or NULL for past the last key.
+ * @param fn Callback; a non-zero return ends the scan early.
+ * @param ctx Passed through to fn.
+ * @return size_t Number of entries passed to fn.
+ */
+size_t version_scan(map_version_t *v, const void *lo, const void *hi, map_scan_fn fn, void *ctx)
+{
+    return v && fn ? avl_scan(&v->view, lo, hi, fn, ctx) : 0;
+}
+
+/**
+ * @brief Release a version; nodes no longer shared with anything are freed.
+ *
+ * @param v Pointer to map_version_t (NULL safe).
+ */
+void version_release(map_version_t *v)
+{
+    if (!v)
+        return;
+    pv_unref(&v->view, v->view.root);
+    if (atomic_fetch_sub_explicit(&v->vctl->refs, 1, memory_order_acq_rel) == 1)
+        free(v->vctl); /* the map is gone too */
+    free(v);
+}
+
+/* Sharded maps (map_sharded_t)
+
+   One map_t serialises all writers on its root, MAP_CONCURRENT or not. A
+   sharded map spreads the keys over N independent maps, either by a
+   caller hash (hash partitioning) or by N - 1 ascending split keys
+   (range partitioning). Each shard has its own mutex and, with
+   MAP_ARENA, its own arena, and sits on cache lines of its own, so
+   writers to different shards share no memory at all. An operation on
+   one key locks one shard.
+
+   Ordered iteration holds every shard lock and merges the shards'
+   in-order streams: range shards are already in order and are chained,
+   hash shards are merged with a binary min-heap of shard cursors, one
+   compare per heap level per step. */
+
+typedef uint64_t (*map_hash_fn)(const void *key);
+
+/* Creation parameters for map_sharded_create */
+typedef struct map_shard_opts
+{
+    size_t shards;             /* number of shards, at least 1 */
+    map_hash_fn hash;          /* hash partitioning, or NULL to partition by bounds */
+    const void *const *bounds; /* range partitioning: shards - 1 ascending split keys, kept by reference */
+    const map_opts_t *map;     /* options for every shard map, or NULL (not MAP_CONCURRENT) */
+} map_shard_opts_t;
+
+typedef struct map_shard
+{
+    _Alignas(MAP_CACHE_LINE) pthread_mutex_t lock;
+    map_t *m;
+} map_shard_t;
+
+typedef struct map_sharded
+{
+    map_shard_t *shard;
+    size_t n;
+    map_hash_fn hash;
+    const void *const *bounds; /* shard i holds keys in [bounds[i - 1], bounds[i]) */
+    map_cmp_fn cmp;
+} map_sharded_t;
+
+/* Ordered iterator over a sharded map; see map_sharded_iter_open */
+typedef struct map_sharded_iter
+{
+    map_sharded_t *s;
+    map_iter_t *cur; /* per-shard position, NULL when a shard is done */
+    size_t *heap;    /* hash partitioning: live shards, smallest current key first */
+    size_t nheap;
+    size_t at; /* shard of the current entry, s->n past the end */
+} map_sharded_iter_t;
+
+/**
+ * @brief Free a sharded map's first k shards and the shard array.
+ */
+static void sharded_free(map_sharded_t *s, size_t k)
+{
+    for (size_t i = 0; i < k; ++i)
+    {
+        map_destroy(s->shard[i].m);
+        pthread_mutex_destroy(&s->shard[i].lock);
+    }
+    free(s->shard);
+    free(s);
+}
+
+/**
+ * @brief Create a map partitioned over opts->shards independent maps.
+ *
+ * The callbacks are those of map_create_ex and apply to every shard.
+ * With opts->hash, a key's shard comes from its hash (the hash is mixed
+ * first, so identity hashes of integer keys are fine). Without it, keys
+ * are partitioned by opts->bounds, which must stay valid for the life of
+ * the map. MAP_CONCURRENT is rejected: the shard locks replace it.
+ *
+ * @param cmp Compare callback (may be NULL with MAP_STRING_KEYS).
+ * @param key_dup Optional key duplication callback (may be NULL).
+ * @param key_free Optional key free callback (may be NULL).
+ * @param val_dup Optional value duplication callback (may be NULL).
+ * @param val_free Optional value free callback (may be NULL).
+ * @param opts Shard count, partitioning and per-shard map options.
+ * @return map_sharded_t* New sharded map or NULL on OOM or bad options.
+ */
+map_sharded_t *map_sharded_create(map_cmp_fn cmp,
+                                  map_dup_fn key_dup, map_free_fn key_free,
+                                  map_dup_fn val_dup, map_free_fn val_free,
+                                  const map_shard_opts_t *opts)
+{
+    if (!opts || opts->shards == 0 || (opts->shards > 1 && !opts->hash && !opts->bounds))
+        return NULL;
+    if (opts->map && (opts->map->flags & MAP_CONCURRENT))
+        return NULL;
+    map_sharded_t *s = (map_sharded_t *)malloc(sizeof(map_sharded_t));
+    if (!s)
+        return NULL;
+    s->n = opts->shards;
+    s->hash = opts->hash;
+    s->bounds = opts->hash ? NULL : opts->bounds;
+    s->shard = (map_shard_t *)aligned_alloc(MAP_CACHE_LINE, s->n * sizeof(map_shard_t));
+    if (!s->shard)
+    {
+        free(s);
+        return NULL;
+    }
+    for (size_t i = 0; i < s->n; ++i)
+    {
+        map_t *m = map_create_ex(cmp, key_dup, key_free, val_dup, val_free, opts->map);
+        if (!m || pthread_mutex_init(&s->shard[i].lock, NULL) != 0)
+        {
+            map_destroy(m);
+            sharded_free(s, i);
+            return NULL;
+        }
+        s->shard[i].m = m;
+    }
+    s->cmp = s->shard[0].m->cmp;
+    return s;
+}
+
+/**
+ * @brief Destroy a sharded map and every entry in it.
+ *
+ * @param s Pointer to map_sharded_t (NULL safe).
+ */
+void map_sharded_destroy(map_sharded_t *s)
+{
+    if (s)
+        sharded_free(s, s->n);
+}
+
+/**
+ * @brief Return the shard holding key.
+ */
+static map_shard_t *sharded_pick(const map_sharded_t *s, const void *key)
+{
+    size_t i = 0;
+    if (s->hash)
+    {
+        uint64_t h = s->hash(key);
+        h ^= h >> 33; /* murmur3 finaliser */
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        i = (size_t)(((h >> 32) * (uint64_t)s->n) >> 32);
+    }
+    else if (s->bounds)
+    {
+        size_t hi = s->n - 1; /* first bound greater than key */
+        while (i < hi)
+        {
+            size_t mid = i + (hi - i) / 2;
+            if (s->cmp(key, s->bounds[mid]) < 0)
+                hi = mid;
+            else
+                i = mid + 1;
+        }
+    }
+    return &s->shard[i];
+}
+
+/**
+ * @brief Insert without overwriting, locking only the key's shard.
+ *
+ * @return int As map_insert.
+ */
+int map_sharded_insert(map_sharded_t *s, void *key, void *value)
+{
+    if (!s)
+        return -1;
+    map_shard_t *sh = sharded_pick(s, key);
+    pthread_mutex_lock(&sh->lock);
+    int r = map_insert(sh->m, key, value);
+    pthread_mutex_unlock(&sh->lock);
+    return r;
+}
+
+/**
+ * @brief Insert or replace, locking only the key's shard.
+ *
+ * @return int As map_put.
+ */
+int map_sharded_put(map_sharded_t *s, void *key, void *value)
+{
+    if (!s)
+        return -1;
+    map_shard_t *sh = sharded_pick(s, key);
+    pthread_mutex_lock(&sh->lock);
+    int r = map_put(sh->m, key, value);
+    pthread_mutex_unlock(&sh->lock);
+    return r;
+}
+
+/**
+ * @brief Find a value by key, locking only the key's shard.
+ *
+ * The value is returned after the lock is released; it stays valid until
+ * some thread erases or replaces that key.
+ *
+ * @return void* Stored value or NULL if not found.
+ */
+void *map_sharded_find(map_sharded_t *s, const void *key)
+{
+    if (!s)
+        return NULL;
+    map_shard_t *sh = sharded_pick(s, key);
+    pthread_mutex_lock(&sh->lock);
+    void *v = map_find(sh->m, key);
+    pthread_mutex_unlock(&sh->lock);
+    return v;
+}
+
+/**
+ * @brief Erase a key, locking only its shard.
+ *
+ * @return int As map_erase.
+ */
+int map_sharded_erase(map_sharded_t *s, const void *key)
+{
+    if (!s)
+        return 0;
+    map_shard_t *sh = sharded_pick(s, key);
+    pthread_mutex_lock(&sh->lock);
+    int r = map_erase(sh->m, key);
+    pthread_mutex_unlock(&sh->lock);
+    return r;
+}
+
+/**
+ * @brief Total number of entries; each shard is counted under its lock.
+ */
+size_t map_sharded_size(map_sharded_t *s)
+{
+    size_t total = 0;
+    for (size_t i = 0; s && i < s->n; ++i)
+    {
+        pthread_mutex_lock(&s->shard[i].lock);
+        total += map_size(s->shard[i].m);
+        pthread_mutex_unlock(&s->shard[i].lock);
+    }
+    return total;
+}
+
+/**
+ * @brief Compare the current keys of shards a and b.
+ */
+static int sharded_iter_less(const map_sharded_iter_t *it, size_t a, size_t b)
+{
+    return it->s->cmp(map_iter_key(it->cur[a]), map_iter_key(it->cur[b])) < 0;
+}
+
+/**
+ * @brief Restore the heap property below slot i.
+ */
+static void sharded_sift_down(map_sharded_iter_t *it, size_t i)
+{
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= it->nheap)
+            return;
+        if (c + 1 < it->nheap && sharded_iter_less(it, it->heap[c + 1], it->heap[c]))
+            c++;
+        if (!sharded_iter_less(it, it->heap[c], it->heap[i]))
+            return;
+        size_t t = it->heap[i];
+        it->heap[i] = it->heap[c];
+        it->heap[c] = t;
+        i = c;
+    }
+}
+
+/**
+ * @brief Point it->at at the shard holding the smallest remaining key.
+ */
+static void sharded_iter_settle(map_sharded_iter_t *it)
+{
+    if (it->heap)
+        it->at = it->nheap ? it->heap[0] : it->s->n;
+    else
+        while (it->at < it->s->n && !it->cur[it->at])
+            it->at++;
+}
+
+/**
+ * @brief Open an ordered iterator over all shards, positioned at the smallest key.
+ *
+ * Takes every shard lock, in shard order, until map_sharded_iter_close,
+ * so the merged view is consistent; this thread must not modify the map
+ * meanwhile.
+ *
+ * @param s Pointer to map_sharded_t.
+ * @param it Iterator to initialise.
+ * @return int 0 on success, -1 on OOM (nothing is locked then).
+ */
+int map_sharded_iter_open(map_sharded_t *s, map_sharded_iter_t *it)
+{
+    it->s = s;
+    it->cur = (map_iter_t *)malloc(s->n * sizeof(map_iter_t));
+    it->heap = s->hash ? (size_t *)malloc(s->n * sizeof(size_t)) : NULL;
+    it->nheap = 0;
+    it->at = 0;
+    if (!it->cur || (s->hash && !it->heap))
+    {
+        free(it->cur);
+        free(it->heap);
+        return -1;
+    }
+    for (size_t i = 0; i < s->n; ++i)
+    {
+        pthread_mutex_lock(&s->shard[i].lock);
+        it->cur[i] = map_begin(s->shard[i].m);
+        if (it->heap && it->cur[i])
+            it->heap[it->nheap++] = i;
+    }
+    for (size_t i = it->nheap / 2; i-- > 0;)
+        sharded_sift_down(it, i);
+    sharded_iter_settle(it);
+    return 0;
+}
+
+/**
+ * @brief Return non-zero while the iterator is at an entry.
+ */
+int map_sharded_iter_valid(const map_sharded_iter_t *it) { return it->at < it->s->n; }
+
+/**
+ * @brief Key of the current entry (iterator must be valid).
+ */
+void *map_sharded_iter_key(const map_sharded_iter_t *it) { return map_iter_key(it->cur[it->at]); }
+
+/**
+ * @brief Value of the current entry (iterator must be valid).
+ */
+void *map_sharded_iter_value(const map_sharded_iter_t *it) { return map_iter_value(it->cur[it->at]); }
+
+/**
+ * @brief Advance to the next key in order across all shards.
+ */
+void map_sharded_iter_next(map_sharded_iter_t *it)
+{
+    if (!map_sharded_iter_valid(it))
+        return;
+    map_iter_t nx = map_next(it->cur[it->at]);
+    it->cur[it->at] = nx;
+    if (it->heap)
+    {
+        if (!nx)
+            it->heap[0] = it->heap[--it->nheap];
+        sharded_sift_down(it, 0);
+    }
+    sharded_iter_settle(it);
+}
+
+/**
+ * @brief Release the shard locks and the iterator's memory.
+ */
+void map_sharded_iter_close(map_sharded_iter_t *it)
+{
+    for (size_t i = it->s->n; i-- > 0;)
+        pthread_mutex_unlock(&it->s->shard[i].lock);
+    free(it->cur);
+    free(it->heap);
+    it->cur = NULL;
+    it->heap = NULL;
+}
+
+/* ---------------- Example usage ---------------- */
+
+/**
+ * @brief Compare two C-strings using strcmp for map ordering.
+ *
+ * @param a First C-string.
+ * @param b Second C-string.
+ * @return int <0, 0, >0 like strcmp.
+ */
+static int cstr_cmp(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/**
+ * @brief Duplicate a C-string using malloc.
  *
- * @param cmp Compare callback; must return negative/zero/positive like strcmp.
- * @param key_dup Optional key duplication callback (may be NULL).
- * @param key_free Optional key free callback (may be NULL).
- * @param val_dup Optional value duplication callback (may be NULL).
- * @param val_free Optional value free callback (may be NULL).
- * @return map_t* Newly allocated map or NULL on OOM or NULL cmp.
+ * Caller must free returned pointer; used as key_dup in example.
+ *
+ * @param s C-string to duplicate (may be NULL).
+ * @return void* Newly allocated string or NULL on OOM or NULL input.
  */
-map_t *map_create(map_cmp_fn cmp,
-                  map_dup_fn key_dup, map_free_fn key_free,
-                  map_dup_fn val_dup, map_free_fn val_free)
+static void *cstr_dup(const void *s)
 {
-    if (!cmp)
+    if (!s)
         return NULL;
-    map_t *m = (map_t *)malloc(sizeof(map_t));
+    size_t len = strlen((const char *)s);
+    char *d = (char *)malloc(len + 1);
+    if (!d)
+        return NULL;
+    memcpy(d, s, len + 1);
+    return d;
+}
+
+/**
+ * @brief Free a C-string allocated by cstr_dup.
+ *
+ * @param s Pointer returned by cstr_dup.
+ */
+static void cstr_free(void *s) { free(s); }
+
+/**
+ * @brief Duplicate an int value on the heap.
+ *
+ * Used as example val_dup; returns a newly allocated int containing *p.
+ *
+ * @param p Pointer to int to duplicate.
+ * @return void* Allocated int pointer or NULL on OOM.
+ */
+static void *int_dup(const void *p)
+{
+    int *d = malloc(sizeof(int));
+    if (!d)
+        return NULL;
+    *d = *(const int *)p;
+    return d;
+}
+
+/**
+ * @brief Free an int allocated by int_dup.
+ *
+ * @param p Pointer returned by int_dup.
+ */
+static void int_free(void *p) { free(p); }
+
+/**
+ * @brief Byte size of a C-string including its terminator (arena key_len).
+ *
+ * @param s C-string.
+ * @return size_t strlen(s) + 1.
+ */
+static size_t cstr_len(const void *s) { return strlen((const char *)s) + 1; }
+
+/**
+ * @brief Byte size of an int value (arena val_len).
+ *
+ * @param p Pointer to int (unused).
+ * @return size_t sizeof(int).
+ */
+static size_t int_len(const void *p)
+{
+    (void)p;
+    return sizeof(int);
+}
+
+int main(void)
+{
+    /* map from C string -> int (both copied) */
+    map_t *m = map_create(cstr_cmp, cstr_dup, cstr_free, int_dup, int_free);
+    if (!m)
+        return 1;
+
+    int v;
+
+    v = 42;
+    map_insert(m, "apple", &v);
+    v = 7;
+    map_insert(m, "orange", &v);
+    v = 13;
+    map_put(m, "banana", &v);
+    v = 100;
+    map_put(m, "apple", &v); /* replace apple's value */
+
+    printf("map size: %zu\n", map_size(m));
+
+    /* lookup */
+    int *pv = map_find(m, "apple");
+    if (pv)
+        printf("apple -> %d\n", *pv);
+
+    /* iterate in order */
+    printf("in-order traversal:\n");
+    for (map_iter_t it = map_begin(m); it != map_end(m); it = map_next(it))
+    {
+        printf("  %s -> %d\n", (char *)map_iter_key(it), *(int *)map_iter_value(it));
+    }
+
+    /* erase an element */
+    map_erase(m, "orange");
+    printf("after erase orange, size=%zu\n", map_size(m));
+
+    /* move a caller-built entry in, and take one back out, without copies */
+    char *key = cstr_dup("cherry");
+    int *val = malloc(sizeof(int));
+    if (key && val)
+    {
+        *val = 55;
+        if (map_insert_take(m, key, val) != 1)
+        {
+            free(key);
+            free(val);
+        }
+    }
+    else
+    {
+        free(key);
+        free(val);
+    }
+    void *ok;
+    void *ov;
+    if (map_extract(m, "banana", &ok, &ov) == 1)
+    {
+        printf("extracted %s -> %d, size=%zu\n", (char *)ok, *(int *)ov, map_size(m));
+        free(ok);
+        free(ov);
+    }
+
+    /* an O(1) version keeps seeing the map as it was, even after changes */
+    map_version_t *ver = map_snapshot(m);
+    v = 1;
+    map_put(m, "apple", &v);
+    map_erase(m, "cherry");
+    if (ver)
+    {
+        pv = version_find(ver, "apple");
+        printf("version: size %zu, apple -> %d; map: size %zu, apple -> %d\n", version_size(ver),
+               pv ? *pv : -1, map_size(m), *(int *)map_find(m, "apple"));
+    }
+
+    /* clear and destroy; the version keeps its nodes until released */
+    map_destroy(m);
+    version_release(ver);
+
+    /* same contract on the B+tree backend */
+    map_opts_t opts = {0};
+    opts.backend = MAP_BACKEND_BTREE;
+    m = map_create_ex(cstr_cmp, cstr_dup, cstr_free, int_dup, int_free, &opts);
+    if (!m)
+        return 1;
+    v = 1;
+    map_insert(m, "pear", &v);
+    v = 2;
+    map_insert(m, "fig", &v);
+    v = 3;
+    map_put(m, "kiwi", &v);
+    printf("b+tree in-order traversal:\n");
+    for (map_iter_t it = map_begin(m); it != map_end(m); it = map_next(it))
+    {
+        printf("  %s -> %d\n", (char *)map_iter_key(it), *(int *)map_iter_value(it));
+    }
+    map_destroy(m);
+
+    /* short-lived map: nodes and key/value copies live in its slab pages */
+    opts.backend = MAP_BACKEND_AVL;
+    opts.flags = MAP_ARENA;
+    opts.key_len = cstr_len;
+    opts.val_len = int_len;
+    m = map_create_ex(cstr_cmp, NULL, NULL, NULL, NULL, &opts);
+    if (!m)
+        return 1;
+    v = 5;
+    map_insert(m, "request-id", &v);
+    v = 6;
+    map_insert(m, "user", &v);
+    printf("arena map size: %zu\n", map_size(m));
+    map_destroy(m); /* releases whole pages, no per-node frees */
+
+    /* shared map: lookups need only a read section, never the writer lock */
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = MAP_CONCURRENT;
+    m = map_create_ex(cstr_cmp, cstr_dup, cstr_free, int_dup, int_free, &opts);
+    if (!m)
+        return 1;
+    v = 9;
+    map_put(m, "config", &v);
+    unsigned rs = map_read_begin(m);
+    pv = map_find(m, "config");
+    if (pv)
+        printf("concurrent config -> %d\n", *pv);
+    map_read_end(m, rs);
+    map_destroy(m);
+
+    /* typed string map: strcmp is called directly, not through m->cmp */
+    m = map_str_create(cstr_dup, cstr_free, int_dup, int_free);
+    if (!m)
+        return 1;
+    v = 11;
+    map_str_insert(m, "alpha", &v);
+    v = 12;
+    map_str_insert(m, "beta", &v);
+    map_str_erase(m, "alpha");
+    pv = map_str_find(m, "beta");
+    printf("typed map size: %zu, beta -> %d\n", map_size(m), pv ? *pv : -1);
+    map_destroy(m);
+
+    /* range-sharded map: three shards split at "g" and "p", each with its own lock */
+    static const char *const splits[] = {"g", "p"};
+    map_shard_opts_t so = {0};
+    so.shards = 3;
+    so.bounds = (const void *const *)splits;
+    map_sharded_t *sm = map_sharded_create(cstr_cmp, cstr_dup, cstr_free, int_dup, int_free, &so);
+    if (!sm)
+        return 1;
+    const char *words[] = {"zebra", "apple", "mango", "kiwi", "quince"};
+    for (int i = 0; i < 5; ++i)
+    {
+        v = i;
+        map_sharded_put(sm, (void *)words[i], &v);
+    }
+    map_sharded_erase(sm, "kiwi");
+    printf("sharded map size: %zu, in order:", map_sharded_size(sm));
+    map_sharded_iter_t sit;
+    if (map_sharded_iter_open(sm, &sit) == 0)
+    {
+        for (; map_sharded_iter_valid(&sit); map_sharded_iter_next(&sit))
+            printf(" %s", (char *)map_sharded_iter_key(&sit));
+        map_sharded_iter_close(&sit);
+    }
+    printf("\n");
+    map_sharded_destroy(sm);
+
+    /* string-key mode: the map copies keys, short ones into the node */
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = MAP_STRING_KEYS;
+    m = map_create_ex(NULL, NULL, NULL, int_dup, int_free, &opts);
     if (!m)
+        return 1;
+    v = 21;
+    map_insert(m, "grape", &v);
+    v = 22;
+    map_insert(m, "a-key-longer-than-the-inline-buffer", &v);
+    pv = map_find(m, "grape");
+    printf("string-key map size: %zu, grape -> %d\n", map_size(m), pv ? *pv : -1);
+
+    /* overlay a second map: shared keys take the overlay's value */
+    map_t *overlay = map_create_ex(NULL, NULL, NULL, int_dup, int_free, &opts);
+    if (!overlay)
+        return 1;
+    v = 31;
+    map_insert(overlay, "grape", &v);
+    v = 32;
+    map_insert(overlay, "kiwi", &v);
+    map_union(m, overlay);
+    map_destroy(overlay);
+    pv = map_find(m, "grape");
+    printf("after union size: %zu, grape -> %d\n", map_size(m), pv ? *pv : -1);
+
+    /* snapshot: save once, then map it and query in place */
+    m->val_len = int_len;
+    int saved = map_save(m, "map_demo.snap");
+    map_destroy(m);
+    m = saved == 0 ? map_open_mmap("map_demo.snap", NULL) : NULL;
+    if (m)
+    {
+        pv = map_find(m, "grape");
+        printf("snapshot size: %zu, grape -> %d, first key %s\n", map_size(m), pv ? *pv : -1,
+               (char *)map_iter_key(map_begin(m)));
+
+        /* freeze: the bytes leave the mapping for a compact Eytzinger array */
+        map_frozen_t *fz = map_freeze(m);
+        if (fz)
+        {
+            pv = frozen_find(fz, "kiwi");
+            printf("frozen size: %zu (map now %zu), kiwi -> %d, keys:", frozen_size(fz), map_size(m),
+                   pv ? *pv : -1);
+            for (size_t it = frozen_begin(fz); it; it = frozen_next(fz, it))
+                printf(" %s", (char *)frozen_key(fz, it));
+            printf("\n");
+            frozen_destroy(fz);
+        }
+        map_destroy(m);
+    }
+    remove("map_demo.snap");
+    return 0;
+}
+
+/* ---- Example usage changed: uint32_t keys, function-pointer values ---- */
+/* Build with -DMAP_BENCH (and -lm) to also run the generic map benchmarks
+   and the CSV workload suite; -DMAP_BENCH_MAX_N=100000000 for the largest size. */
+
+#include <inttypes.h> /* for PRIu32 if needed */
+#ifdef MAP_BENCH
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+typedef void (*fp_t)(void);
+
+/**
+ * @brief Compare two uint32_t keys.
+ *
+ * Expects pointers to uint32_t values.
+ *
+ * @param a Pointer to first uint32_t.
+ * @param b Pointer to second uint32_t.
+ * @return int -1 if *a < *b, 0 if equal, 1 if *a > *b.
+ */
+static int u32_cmp(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return (va > vb) ? 1 : (va < vb) ? -1
+                                     : 0;
+}
+
+/**
+ * @brief Duplicate a uint32_t on the heap.
+ *
+ * Allocates and returns a pointer to a copied uint32_t. Caller must free.
+ *
+ * @param x Pointer to source uint32_t.
+ * @return void* Allocated copy or NULL on OOM.
+ */
+static void *u32_dup(const void *x)
+{
+    if (!x)
         return NULL;
-    m->root = NULL;
-    m->size = 0;
-    m->cmp = cmp;
-    m->key_dup = key_dup;
-    m->key_free = key_free;
-    m->val_dup = val_dup;
-    m->val_free = val_free;
-    return m;
+    uint32_t *d = malloc(sizeof(uint32_t));
+    if (!d)
+        return NULL;
+    *d = *(const uint32_t *)x;
+    return d;
+}
+
+/**
+ * @brief Free a heap-allocated uint32_t.
+ *
+ * @param x Pointer returned by u32_dup.
+ */
+static void u32_free(void *x) { free(x); }
+
+/**
+ * @brief Duplicate a function pointer into heap storage.
+ *
+ * Stores the function pointer in a newly allocated slot so the generic map
+ * can manage it. The caller should cast function pointer to/from void* when
+ * calling map_insert/put.
+ *
+ * @param x Function pointer passed as void* (may be NULL).
+ * @return void* Pointer to allocated storage containing the function pointer or NULL on OOM.
+ */
+static void *fp_dup(const void *x)
+{
+    if (!x)
+        return NULL;
+    fp_t f = (fp_t)(uintptr_t)x; /* caller passes function pointer cast via (void*)(uintptr_t)f */
+    fp_t *d = malloc(sizeof(fp_t));
+    if (!d)
+        return NULL;
+    *d = f;
+    return d;
+}
+
+/**
+ * @brief Free storage allocated by fp_dup.
+ *
+ * @param x Pointer returned by fp_dup.
+ */
+static void fp_free(void *x) { free(x); }
+
+/* sample functions to store as values */
+
+/**
+ * @brief Example function to be stored as a value in the map.
+ */
+static void say_hello(void) { printf("hello\n"); }
+
+/**
+ * @brief Example function to be stored as a value in the map.
+ */
+static void say_goodbye(void) { printf("goodbye\n"); }
+
+/**
+ * @brief map_for_each callback: print the key and call the stored function.
+ */
+static void call_entry(void *key, void *value, void *ctx)
+{
+    (void)ctx;
+    printf("  %" PRIu32 " -> ", *(uint32_t *)key);
+    fp_t *valp = (fp_t *)value;
+    if (valp && *valp)
+        (*valp)();
+    else
+        printf("(null)\n");
 }
 
-/* Internal: find node by key */
+#ifdef MAP_BENCH
+/* ---- generic map benchmarks ---- */
+
+#ifndef MAP_BENCH_N
+#define MAP_BENCH_N 1000000
+#endif
 
 /**
- * @brief Find the node that contains the given key.
- *
- * Uses the map's compare callback for key ordering.
+ * @brief Seconds elapsed since t0 (processor time).
+ */
+static double bench_secs(clock_t t0) { return (double)(clock() - t0) / CLOCKS_PER_SEC; }
+
+/**
+ * @brief Compare warm-up cost: repeated map_insert vs map_from_sorted / map_from_unsorted.
  *
- * @param m Pointer to map_t (must be non-NULL).
- * @param key Pointer to key to search for.
- * @return map_node_t* Node containing the key, or NULL if not found.
+ * Keys point into a caller-owned array (no dup callbacks) so only the
+ * tree work and node allocation are measured.
  */
-static map_node_t *find_node(map_t *m, const void *key)
+static void bench_bulk_load(void)
 {
-    map_node_t *cur = m->root;
-    while (cur)
+    size_t n = MAP_BENCH_N;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    void **kp = malloc(n * sizeof(void *));
+    if (!keys || !kp)
     {
-        int c = m->cmp(key, cur->key);
-        if (c == 0)
-            return cur;
-        cur = (c < 0) ? cur->left : cur->right;
+        free(keys);
+        free(kp);
+        return;
     }
-    return NULL;
+    for (size_t i = 0; i < n; ++i)
+    {
+        keys[i] = (uint32_t)i;
+        kp[i] = &keys[i];
+    }
+
+    printf("bulk load benchmark (n=%zu, ns per key):\n", n);
+    map_t *m = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+    clock_t t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, kp[i], NULL);
+    printf("  %-22s %8.1f\n", "map_insert (sorted)", bench_secs(t0) * 1e9 / (double)n);
+    map_clear(m);
+
+    t0 = clock();
+    map_from_sorted(m, kp, NULL, n);
+    printf("  %-22s %8.1f\n", "map_from_sorted", bench_secs(t0) * 1e9 / (double)n);
+    map_clear(m);
+
+    /* shuffle the key pointers for the unsorted variants */
+    uint64_t x = 88172645463325252ull;
+    for (size_t i = n - 1; i > 0; --i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t j = (size_t)(x % (i + 1));
+        void *t = kp[i];
+        kp[i] = kp[j];
+        kp[j] = t;
+    }
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, kp[i], NULL);
+    printf("  %-22s %8.1f\n", "map_insert (random)", bench_secs(t0) * 1e9 / (double)n);
+    map_clear(m);
+
+    t0 = clock();
+    map_from_unsorted(m, kp, NULL, n);
+    printf("  %-22s %8.1f\n", "map_from_unsorted", bench_secs(t0) * 1e9 / (double)n);
+
+    map_destroy(m);
+    free(kp);
+    free(keys);
 }
 
+#ifndef MAP_BENCH_FIND_N
+#define MAP_BENCH_FIND_N (1u << 22) /* ~300 MB of nodes and keys: well past the LLC */
+#endif
+
 /**
- * @brief Insert a new key/value pair into the map without overwriting.
- *
- * If the key already exists the function returns 0 and does not change the map.
- * On success returns 1. Returns -1 on memory allocation failure or invalid map.
+ * @brief Compare a loop of map_find with map_find_many on a tree far bigger than the LLC.
  *
- * @param m Pointer to map_t.
- * @param key Pointer to key to insert.
- * @param value Pointer to value to insert.
- * @return int 1 if inserted, 0 if key existed, -1 on OOM or invalid map.
+ * Keys are inserted in random order so node addresses are uncorrelated
+ * with tree position; lookups come in packets of 32 random keys.
  */
-int map_insert(map_t *m, void *key, void *value)
+static void bench_find_many(void)
 {
-    if (!m)
-        return -1;
-    if (!m->root)
+    enum { PACKET = 32 };
+    size_t n = MAP_BENCH_FIND_N;
+    size_t q = n;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    const void **probe = malloc(q * sizeof(void *));
+    void *out[PACKET];
+    if (!keys || !probe)
     {
-        map_node_t *n = node_new(m, key, value);
-        if (!n)
-            return -1;
-        m->root = n;
-        m->size = 1;
-        return 1;
+        free(keys);
+        free(probe);
+        return;
     }
-
-    /* Find insertion point (or existing) */
-    map_node_t *parent = NULL;
-    map_node_t *cur = m->root;
-    int cmpv = 0;
-    while (cur)
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = (uint32_t)i;
+    for (size_t i = n - 1; i > 0; --i)
     {
-        cmpv = m->cmp(key, cur->key);
-        if (cmpv == 0)
-        {
-            /* exists: do not overwrite */
-            return 0;
-        }
-        parent = cur;
-        cur = (cmpv < 0) ? cur->left : cur->right;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t j = (size_t)(x % (i + 1));
+        uint32_t t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
     }
-
-    /* Attach new node */
-    map_node_t *n = node_new(m, key, value);
-    if (!n)
-        return -1;
-    n->parent = parent;
-    if (cmpv < 0)
-        parent->left = n;
-    else
-        parent->right = n;
-    m->size++;
-
-    /* Rebalance walking up */
-    map_node_t *p = n->parent;
-    while (p)
+    map_t *m = map_create(u32_cmp, u32_dup, u32_free, NULL, NULL);
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &keys[i], &keys[i]);
+    for (size_t i = 0; i < q; ++i)
     {
-        map_node_t *old_p = p;
-        map_node_t *new_subroot = rebalance_at(m, p);
-        /* update parent's child link to new_subroot */
-        set_child(m, new_subroot->parent, old_p, new_subroot);
-        p = new_subroot->parent;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        probe[i] = &keys[x % n];
     }
-    /* ensure root parent is NULL */
-    if (m->root && m->root->parent)
-        m->root->parent = NULL;
-    return 1;
+
+    printf("batched lookup benchmark (n=%zu, packets of %d, ns per key):\n", n, PACKET);
+    size_t hits = 0;
+    clock_t t0 = clock();
+    for (size_t i = 0; i + PACKET <= q; i += PACKET)
+        for (size_t j = 0; j < PACKET; ++j)
+            hits += map_find(m, probe[i + j]) != NULL;
+    printf("  %-22s %8.1f\n", "map_find loop", bench_secs(t0) * 1e9 / (double)q);
+    t0 = clock();
+    for (size_t i = 0; i + PACKET <= q; i += PACKET)
+        hits += map_find_many(m, &probe[i], PACKET, out);
+    printf("  %-22s %8.1f\n", "map_find_many", bench_secs(t0) * 1e9 / (double)q);
+    if (hits != 2 * (q / PACKET) * PACKET)
+        printf("  (unexpected misses)\n");
+
+    map_destroy(m);
+    free(probe);
+    free(keys);
 }
 
 /**
- * @brief Insert or replace a key/value pair.
+ * @brief Byte size of a uint32_t key (arena key_len).
+ */
+static size_t u32_len(const void *p)
+{
+    (void)p;
+    return sizeof(uint32_t);
+}
+
+/**
+ * @brief Open a counter of this thread's user-space dTLB load misses.
  *
- * If the key exists the stored value is replaced (old value freed if val_free
- * callback present) and the function returns 2. If the key was inserted returns 1.
- * Returns -1 on OOM or invalid map.
+ * @return int perf event fd, or -1 if perf events are unavailable.
+ */
+static int bench_dtlb_open(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Start (reset and enable) or stop a counter from bench_dtlb_open.
  *
- * @param m Pointer to map_t.
- * @param key Pointer to key.
- * @param value Pointer to value.
- * @return int 1 if inserted, 2 if replaced, -1 on OOM or invalid map.
+ * @return long long Count when stopping, -1 if fd is -1 or the read fails.
  */
-int map_put(map_t *m, void *key, void *value)
+static long long bench_dtlb(int fd, int start)
 {
-    if (!m)
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    if (fd < 0)
         return -1;
-    map_node_t *existing = find_node(m, key);
-    if (existing)
+    if (start)
     {
-        /* replace value */
-        if (m->val_free)
-            m->val_free(existing->value);
-        existing->value = (m->val_dup ? m->val_dup(value) : value);
-        return 2;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return 0;
     }
-    return map_insert(m, key, value);
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    return read(fd, &count, sizeof(count)) == (ssize_t)sizeof(count) ? count : -1;
+#else
+    (void)fd;
+    (void)start;
+    return -1;
+#endif
 }
 
 /**
- * @brief Find the value pointer associated with a key.
- *
- * @param m Pointer to map_t.
- * @param key Pointer to search key.
- * @return void* Stored value pointer if found, NULL if not found.
+ * @brief Transparent huge page memory of this process in kB, or -1 if unknown.
  */
-void *map_find(map_t *m, const void *key)
+static long bench_thp_kb(void)
 {
-    map_node_t *n = find_node(m, key);
-    return n ? n->value : NULL;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        return -1;
+    char line[128];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
 }
 
-/* Minimum node in subtree */
+/**
+ * @brief Mask of online NUMA nodes (from "0-1,3" style sysfs lists), 1 if unknown.
+ */
+static unsigned long bench_numa_online(void)
+{
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 1;
+    unsigned long mask = 0;
+    unsigned a, b;
+    int c;
+    while (fscanf(f, "%u", &a) == 1)
+    {
+        b = a;
+        if ((c = fgetc(f)) == '-' && fscanf(f, "%u", &b) == 1)
+            c = fgetc(f);
+        for (unsigned i = a; i <= b && i < 8 * sizeof(mask); ++i)
+            mask |= 1ul << i;
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return mask ? mask : 1;
+}
 
 /**
- * @brief Return the node with minimum key in the subtree.
+ * @brief Random lookups on a tree far bigger than the TLB reach of 4 KiB pages.
  *
- * @param n Subtree root (may be NULL).
- * @return map_node_t* Node with minimum key or NULL if n is NULL.
+ * The same MAP_BENCH_FIND_N keys, inserted in random order, are loaded
+ * into a malloc map, a MAP_ARENA map, a MAP_HUGE_PAGES map and, on
+ * multi-node hosts, a MAP_HUGE_PAGES map interleaved over all nodes.
+ * Each row reports ns and dTLB load misses per lookup (n/a without perf
+ * events) and how much of the process is in transparent huge pages.
  */
-static map_node_t *subtree_min(map_node_t *n)
+static void bench_huge_pages(void)
 {
-    if (!n)
-        return NULL;
-    while (n->left)
-        n = n->left;
-    return n;
+    size_t n = MAP_BENCH_FIND_N;
+    size_t q = n;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    uint32_t *probe = malloc(q * sizeof(uint32_t));
+    if (!keys || !probe)
+    {
+        free(keys);
+        free(probe);
+        return;
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = (uint32_t)i;
+    for (size_t i = n - 1; i > 0; --i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t j = (size_t)(x % (i + 1));
+        uint32_t t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+    for (size_t i = 0; i < q; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        probe[i] = (uint32_t)(x % n);
+    }
+    unsigned long nodes = bench_numa_online();
+    int fd = bench_dtlb_open();
+
+    printf("huge-page node storage (n=%zu, random lookups):\n", n);
+    printf("  %-22s %10s %14s %10s\n", "storage", "ns/lookup", "dTLB miss/op", "THP MB");
+    for (int cfg = 0; cfg < 4; ++cfg)
+    {
+        map_opts_t opts = {0};
+        const char *name = "malloc";
+        if (cfg > 0)
+        {
+            opts.flags = cfg == 1 ? MAP_ARENA : MAP_HUGE_PAGES;
+            opts.key_len = u32_len;
+            name = cfg == 1 ? "MAP_ARENA" : "MAP_HUGE_PAGES";
+        }
+        if (cfg == 3)
+        {
+            if (!(nodes & (nodes - 1)))
+                break; /* one node: nothing to interleave */
+            opts.numa = MAP_NUMA_INTERLEAVE;
+            opts.numa_nodes = nodes;
+            name = "huge + interleave";
+        }
+        map_t *m = cfg ? map_create_ex(u32_cmp, NULL, NULL, NULL, NULL, &opts)
+                       : map_create(u32_cmp, u32_dup, u32_free, NULL, NULL);
+        if (!m)
+            continue;
+        for (size_t i = 0; i < n; ++i)
+            map_insert(m, &keys[i], &keys[i]);
+        size_t hits = 0;
+        bench_dtlb(fd, 1);
+        clock_t t0 = clock();
+        for (size_t i = 0; i < q; ++i)
+            hits += map_find(m, &probe[i]) != NULL;
+        double ns = bench_secs(t0) * 1e9 / (double)q;
+        long long miss = bench_dtlb(fd, 0);
+        long thp = bench_thp_kb();
+        char missbuf[32];
+        char thpbuf[32];
+        if (miss >= 0)
+            snprintf(missbuf, sizeof(missbuf), "%.2f", (double)miss / (double)q);
+        else
+            snprintf(missbuf, sizeof(missbuf), "n/a");
+        if (thp >= 0)
+            snprintf(thpbuf, sizeof(thpbuf), "%ld", thp / 1024);
+        else
+            snprintf(thpbuf, sizeof(thpbuf), "n/a");
+        printf("  %-22s %10.1f %14s %10s\n", name, ns, missbuf, thpbuf);
+        if (hits != q)
+            printf("  (unexpected misses)\n");
+        map_destroy(m);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(probe);
+    free(keys);
 }
 
-/* Remove a node given pointer. Returns pointer to parent where balancing continues */
+#ifndef MAP_BENCH_BATCH_N
+#define MAP_BENCH_BATCH_N (1u << 20)
+#endif
 
 /**
- * @brief Erase the given node from the tree and free its resources.
- *
- * If the node has two children it swaps with the inorder successor and deletes
- * that successor instead. Returns the parent node where balancing should continue.
+ * @brief Compare per-call map_put / map_erase with one batch commit for the same updates.
  *
- * @param m Pointer to map_t.
- * @param n Node to erase (must be non-NULL).
- * @return map_node_t* Parent node to continue rebalancing from, or NULL.
+ * Each round applies k random updates (3 puts to 1 erase) to a map of
+ * MAP_BENCH_BATCH_N keys; the key range is twice the map, so half the
+ * puts insert and half replace.
  */
-static map_node_t *erase_node(map_t *m, map_node_t *n)
+static void bench_batch(void)
 {
-    if (!n)
-        return NULL;
-    map_node_t *parent = NULL;
-
-    if (n->left && n->right)
+    size_t n = MAP_BENCH_BATCH_N;
+    uint32_t *u = malloc(2 * n * sizeof(uint32_t));
+    map_batch_op_t *ops = malloc(n * sizeof(map_batch_op_t));
+    map_t *a = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+    map_t *b = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+    if (!u || !ops || !a || !b)
     {
-        /* two children: swap with successor */
-        map_node_t *suc = subtree_min(n->right);
-        /* swap key/value pointers (do not call free/dup) */
-        void *tkey = n->key;
-        n->key = suc->key;
-        suc->key = tkey;
-        void *tval = n->value;
-        n->value = suc->value;
-        suc->value = tval;
-        /* now delete suc (which has at most right child) */
-        return erase_node(m, suc);
+        free(u);
+        free(ops);
+        map_destroy(a);
+        map_destroy(b);
+        return;
     }
-    else
+    for (size_t i = 0; i < 2 * n; ++i)
+        u[i] = (uint32_t)i;
+    for (size_t i = 0; i < n; ++i)
     {
-        map_node_t *child = n->left ? n->left : n->right;
-        parent = n->parent;
-        /* detach n and link child in its place */
-        if (parent == NULL)
+        map_insert(a, &u[2 * i], NULL);
+        map_insert(b, &u[2 * i], NULL);
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    printf("batch update benchmark (n=%zu, ns per update):\n", n);
+    printf("  %-9s %12s %12s\n", "updates", "put/erase", "batch");
+    for (size_t k = 1024; k <= n; k *= 16)
+    {
+        for (size_t i = 0; i < k; ++i)
         {
-            /* deleting root */
-            m->root = child;
-            if (child)
-                child->parent = NULL;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            ops[i].kind = (x >> 40) % 4 == 0 ? MAP_BATCH_ERASE : MAP_BATCH_PUT;
+            ops[i].key = &u[x % (2 * n)];
+            ops[i].value = NULL;
         }
-        else
+        clock_t t0 = clock();
+        for (size_t i = 0; i < k; ++i)
         {
-            if (parent->left == n)
-                parent->left = child;
+            if (ops[i].kind == MAP_BATCH_ERASE)
+                map_erase(a, ops[i].key);
             else
-                parent->right = child;
-            if (child)
-                child->parent = parent;
+                map_put(a, ops[i].key, NULL);
         }
-        /* free resources */
-        node_free(m, n);
-        m->size--;
-        return parent;
+        double loop = bench_secs(t0);
+        t0 = clock();
+        map_batch_t *bt = map_batch_begin(b);
+        int ok = bt && map_batch_apply(bt, ops, k) == 0;
+        ok = bt && map_batch_commit(bt) == 1 && ok;
+        double batched = bench_secs(t0);
+        printf("  %-9zu %12.1f %12.1f%s\n", k, loop * 1e9 / (double)k, batched * 1e9 / (double)k,
+               ok && map_size(a) == map_size(b) ? "" : "  (mismatch)");
     }
+    map_destroy(a);
+    map_destroy(b);
+    free(ops);
+    free(u);
 }
 
+#ifndef MAP_BENCH_VERSION_N
+#define MAP_BENCH_VERSION_N (1u << 18)
+#endif
+
 /**
- * @brief Erase an entry by key.
- *
- * Finds the node with the given key, removes it if present, rebalances the tree,
- * and returns 1 if an entry was erased or 0 if not found.
+ * @brief Compare keeping old contents by map_snapshot with copying the map.
  *
- * @param m Pointer to map_t.
- * @param key Key to erase.
- * @return int 1 if erased, 0 if not found or invalid map.
+ * Each round keeps the current contents of a MAP_BENCH_VERSION_N map,
+ * then applies k random puts; the copy is rebuilt with map_from_sorted
+ * from an in-order walk.
  */
-int map_erase(map_t *m, const void *key)
+static void bench_versions(void)
 {
-    if (!m)
-        return 0;
-    map_node_t *n = find_node(m, key);
-    if (!n)
-        return 0;
-    map_node_t *p = erase_node(m, n);
-    /* rebalance upwards */
-    while (p)
+    size_t n = MAP_BENCH_VERSION_N;
+    uint32_t *u = malloc(2 * n * sizeof(uint32_t));
+    void **keys = malloc(2 * n * sizeof(void *)); /* up to 2n keys after the puts */
+    map_t *m = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+    if (!u || !keys || !m)
     {
-        map_node_t *old_p = p;
-        map_node_t *new_subroot = rebalance_at(m, p);
-        set_child(m, new_subroot->parent, old_p, new_subroot);
-        p = new_subroot->parent;
+        free(u);
+        free(keys);
+        map_destroy(m);
+        return;
     }
-    if (m->root && m->root->parent)
-        m->root->parent = NULL;
-    return 1;
+    for (size_t i = 0; i < 2 * n; ++i)
+        u[i] = (uint32_t)i;
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &u[2 * i], NULL);
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    printf("version benchmark (n=%zu, us per kept version):\n", n);
+    printf("  %-9s %12s %12s\n", "updates", "copy", "snapshot");
+    for (size_t k = 1; k <= 4096; k *= 16)
+    {
+        const int rounds = 16;
+        clock_t t0 = clock();
+        for (int r = 0; r < rounds; ++r)
+        {
+            size_t c = 0;
+            for (map_iter_t it = map_begin(m); it; it = map_next(it))
+                keys[c++] = map_iter_key(it);
+            map_t *copy = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+            if (copy)
+                map_from_sorted(copy, keys, NULL, c);
+            for (size_t i = 0; i < k; ++i)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                map_put(m, &u[x % (2 * n)], NULL);
+            }
+            map_destroy(copy);
+        }
+        double copied = bench_secs(t0);
+        t0 = clock();
+        for (int r = 0; r < rounds; ++r)
+        {
+            map_version_t *v = map_snapshot(m);
+            for (size_t i = 0; i < k; ++i)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                map_put(m, &u[x % (2 * n)], NULL);
+            }
+            version_release(v);
+        }
+        double versioned = bench_secs(t0);
+        printf("  %-9zu %12.1f %12.1f\n", k, copied * 1e6 / rounds, versioned * 1e6 / rounds);
+    }
+    map_destroy(m);
+    free(keys);
+    free(u);
 }
 
-/* Size */
+#ifndef MAP_BENCH_TYPED_N
+#define MAP_BENCH_TYPED_N (1u << 12) /* cache-resident, so call overhead shows */
+#endif
 
 /**
- * @brief Return the number of elements stored in the map.
- *
- * @param m Pointer to map_t (may be NULL).
- * @return size_t Number of stored elements (0 if m is NULL).
+ * @brief Compare map_find (indirect cmp calls) with map_u32_find (inlined compare).
  */
-size_t map_size(map_t *m) { return m ? m->size : 0; }
+static void bench_typed(void)
+{
+    size_t n = MAP_BENCH_TYPED_N;
+    size_t q = 16 * n;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    uint32_t *probe = malloc(q * sizeof(uint32_t));
+    map_t *m = map_u32_create(u32_dup, u32_free, NULL, NULL);
+    if (!keys || !probe || !m)
+    {
+        free(keys);
+        free(probe);
+        map_destroy(m);
+        return;
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i)
+    {
+        keys[i] = (uint32_t)(2 * i);
+        map_u32_insert(m, &keys[i], &keys[i]);
+    }
+    for (size_t i = 0; i < q; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        probe[i] = (uint32_t)(x % (2 * n)); /* half hits, half misses */
+    }
 
-/* Clear and destroy */
+    printf("typed lookup benchmark (n=%zu, ns per lookup):\n", n);
+    size_t hits = 0;
+    clock_t t0 = clock();
+    for (size_t i = 0; i < q; ++i)
+        hits += map_find(m, &probe[i]) != NULL;
+    printf("  %-22s %8.1f\n", "map_find", bench_secs(t0) * 1e9 / (double)q);
+    t0 = clock();
+    for (size_t i = 0; i < q; ++i)
+        hits -= map_u32_find(m, &probe[i]) != NULL;
+    printf("  %-22s %8.1f\n", "map_u32_find", bench_secs(t0) * 1e9 / (double)q);
+    if (hits != 0)
+        printf("  (lookups disagree)\n");
+
+    map_destroy(m);
+    free(probe);
+    free(keys);
+}
 
 /**
- * @brief Recursively free all nodes in the subtree rooted at n.
- *
- * Invokes node_free for each node which will apply key/value free callbacks.
- *
- * @param m Pointer to map_t owning the nodes.
- * @param n Subtree root to free (may be NULL).
+ * @brief map_scan callback summing uint32_t keys.
  */
-static void free_subtree(map_t *m, map_node_t *n)
+static int bench_sum_key(void *key, void *value, void *ctx)
 {
-    if (!n)
-        return;
-    free_subtree(m, n->left);
-    free_subtree(m, n->right);
-    node_free(m, n);
+    (void)value;
+    *(uint64_t *)ctx += *(const uint32_t *)key;
+    return 0;
 }
 
 /**
- * @brief Remove all entries from the map but keep the map structure.
+ * @brief Full ordered walk: map_begin/map_next loop vs map_scan, both backends.
  *
- * After this call the map is empty (size == 0, root == NULL).
- *
- * @param m Pointer to map_t.
+ * Keys are inserted in random order so in-order neighbours are scattered
+ * in memory.
  */
-void map_clear(map_t *m)
+static void bench_scan(void)
 {
-    if (!m)
+    size_t n = MAP_BENCH_N;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    if (!keys)
         return;
-    free_subtree(m, m->root);
-    m->root = NULL;
-    m->size = 0;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = (uint32_t)i;
+    for (size_t i = n - 1; i > 0; --i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t j = (size_t)(x % (i + 1));
+        uint32_t t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+    printf("ordered scan benchmark (n=%zu, ns per entry):\n", n);
+    for (int b = 0; b < 2; ++b)
+    {
+        map_opts_t opts = {0};
+        opts.backend = b ? MAP_BACKEND_BTREE : MAP_BACKEND_AVL;
+        map_t *m = map_create_ex(u32_cmp, u32_dup, u32_free, NULL, NULL, &opts);
+        if (!m)
+            break;
+        for (size_t i = 0; i < n; ++i)
+            map_insert(m, &keys[i], NULL);
+        uint64_t s1 = 0, s2 = 0;
+        clock_t t0 = clock();
+        for (map_iter_t it = map_begin(m); it != map_end(m); it = map_next(it))
+            s1 += *(const uint32_t *)map_iter_key(it);
+        double loop = bench_secs(t0);
+        t0 = clock();
+        map_scan(m, NULL, NULL, bench_sum_key, &s2);
+        double scan = bench_secs(t0);
+        printf("  %-6s %-16s %8.1f\n", b ? "b+tree" : "avl", "begin/next loop", loop * 1e9 / (double)n);
+        printf("  %-6s %-16s %8.1f%s\n", b ? "b+tree" : "avl", "map_scan", scan * 1e9 / (double)n,
+               s1 == s2 ? "" : "  (sums disagree)");
+        map_destroy(m);
+    }
+    free(keys);
+}
+
+#ifndef MAP_BENCH_STR_N
+#define MAP_BENCH_STR_N (1u << 18)
+#endif
+
+static int bench_strcmp(const void *a, const void *b) { return strcmp((const char *)a, (const char *)b); }
+
+static void *bench_strdup(const void *s)
+{
+    size_t len = strlen((const char *)s) + 1;
+    char *d = malloc(len);
+    if (d)
+        memcpy(d, s, len);
+    return d;
 }
 
 /**
- * @brief Destroy the map and free all associated resources.
- *
- * Calls map_clear and then frees the map structure itself.
+ * @brief Compare random string lookups: strcmp callback + heap keys vs MAP_STRING_KEYS.
  *
- * @param m Pointer to map_t to destroy (NULL safe).
+ * Keys are 16 hex digits plus a suffix, so most steps are decided in the
+ * first 8 bytes; half of them fit the inline buffer.
  */
-void map_destroy(map_t *m)
+static void bench_string_keys(void)
 {
-    if (!m)
+    enum { KEYLEN = 40 };
+    size_t n = MAP_BENCH_STR_N;
+    size_t q = 4 * n;
+    char *text = malloc(n * KEYLEN);
+    size_t *probe = malloc(q * sizeof(size_t));
+    map_opts_t opts = {0};
+    opts.flags = MAP_STRING_KEYS;
+    map_t *plain = map_create(bench_strcmp, bench_strdup, free, NULL, NULL);
+    map_t *str = map_create_ex(NULL, NULL, NULL, NULL, NULL, &opts);
+    if (!text || !probe || !plain || !str)
+    {
+        free(text);
+        free(probe);
+        map_destroy(plain);
+        map_destroy(str);
         return;
-    map_clear(m);
-    free(m);
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        snprintf(text + i * KEYLEN, KEYLEN, "%016llx%s", (unsigned long long)x, (i & 1) ? "/long-suffix" : "");
+        map_insert(plain, text + i * KEYLEN, text + i * KEYLEN);
+        map_insert(str, text + i * KEYLEN, text + i * KEYLEN);
+    }
+    for (size_t i = 0; i < q; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        probe[i] = (size_t)(x % n);
+    }
+
+    printf("string key benchmark (n=%zu, ns per lookup):\n", n);
+    size_t hits = 0;
+    clock_t t0 = clock();
+    for (size_t i = 0; i < q; ++i)
+        hits += map_find(plain, text + probe[i] * KEYLEN) != NULL;
+    printf("  %-22s %8.1f\n", "strcmp callback", bench_secs(t0) * 1e9 / (double)q);
+    t0 = clock();
+    for (size_t i = 0; i < q; ++i)
+        hits -= map_find(str, text + probe[i] * KEYLEN) != NULL;
+    printf("  %-22s %8.1f\n", "MAP_STRING_KEYS", bench_secs(t0) * 1e9 / (double)q);
+    if (hits != 0)
+        printf("  (lookups disagree)\n");
+
+    map_destroy(plain);
+    map_destroy(str);
+    free(probe);
+    free(text);
 }
 
-/* Iteration: begin is smallest; end is NULL. next/prev provide in-order traversal */
+#ifndef MAP_BENCH_THREADS
+#define MAP_BENCH_THREADS 8 /* largest reader/writer thread count measured */
+#endif
+#ifndef MAP_BENCH_CONC_N
+#define MAP_BENCH_CONC_N (1u << 20)
+#endif
+#define MAP_BENCH_CONC_OPS (1u << 20) /* operations per thread */
+
+typedef struct bench_worker
+{
+    map_t *m;
+    pthread_mutex_t *lock; /* NULL: MAP_CONCURRENT map, no lock around reads */
+    uint64_t seed;
+} bench_worker_t;
 
 /**
- * @brief Return iterator to the smallest (leftmost) element in the map.
- *
- * @param m Pointer to map_t.
- * @return map_iter_t Iterator (node pointer) to first element or NULL if map empty.
+ * @brief Wall-clock seconds from a monotonic clock (threads run in parallel).
  */
-map_iter_t map_begin(map_t *m) { return m ? subtree_min(m->root) : NULL; }
+static double bench_wall(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
 
 /**
- * @brief Return the end iterator for the map (always NULL).
- *
- * Provided for API symmetry with STL-like iteration.
- *
- * @param m Pointer to map_t (unused).
- * @return map_iter_t Always NULL.
+ * @brief 99% lookups / 1% insert-or-erase over keys [0, 2 * MAP_BENCH_CONC_N).
  */
-map_iter_t map_end(map_t *m)
+static void *bench_worker(void *arg)
 {
-    (void)m;
+    bench_worker_t *w = (bench_worker_t *)arg;
+    uint64_t x = w->seed;
+    for (size_t i = 0; i < MAP_BENCH_CONC_OPS; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint32_t k = (uint32_t)(x % (2u * MAP_BENCH_CONC_N));
+        int write = (x >> 40) % 100 == 0;
+        if (w->lock)
+            pthread_mutex_lock(w->lock);
+        if (write)
+        {
+            if ((x >> 50) & 1)
+                map_insert(w->m, &k, NULL);
+            else
+                map_erase(w->m, &k);
+        }
+        else if (w->lock)
+            map_find(w->m, &k);
+        else
+        {
+            unsigned rs = map_read_begin(w->m);
+            map_find(w->m, &k);
+            map_read_end(w->m, rs);
+        }
+        if (w->lock)
+            pthread_mutex_unlock(w->lock);
+    }
     return NULL;
 }
 
 /**
- * @brief Advance iterator to the next in-order node.
- *
- * If it has a right subtree, returns the leftmost node in that subtree;
- * otherwise walks up to the first ancestor where current is in left subtree.
- *
- * @param it Current iterator (may be NULL).
- * @return map_iter_t Next iterator or NULL if at end.
+ * @brief Run threads workers against m and return total Mops/s.
  */
-map_iter_t map_next(map_iter_t it)
+static double bench_run_workers(map_t *m, pthread_mutex_t *lock, int threads)
 {
-    if (!it)
-        return NULL;
-    if (it->right)
-    {
-        map_node_t *n = it->right;
-        while (n->left)
-            n = n->left;
-        return n;
-    }
-    else
+    pthread_t tid[MAP_BENCH_THREADS];
+    bench_worker_t w[MAP_BENCH_THREADS];
+    double t0 = bench_wall();
+    for (int i = 0; i < threads; ++i)
     {
-        map_node_t *p = it->parent;
-        map_node_t *cur = it;
-        while (p && p->right == cur)
-        {
-            cur = p;
-            p = p->parent;
-        }
-        return p;
+        w[i].m = m;
+        w[i].lock = lock;
+        w[i].seed = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1);
+        if (pthread_create(&tid[i], NULL, bench_worker, &w[i]) != 0)
+            threads = i;
     }
+    for (int i = 0; i < threads; ++i)
+        pthread_join(tid[i], NULL);
+    double secs = bench_wall() - t0;
+    return secs > 0 ? (double)threads * MAP_BENCH_CONC_OPS / secs * 1e-6 : 0.0;
 }
 
 /**
- * @brief Move iterator to the previous in-order node.
+ * @brief Read-mostly scaling: one mutex around a plain map vs MAP_CONCURRENT.
  *
- * If it has a left subtree, returns the rightmost node in that subtree;
- * otherwise walks up to the first ancestor where current is in right subtree.
- *
- * @param it Current iterator (may be NULL).
- * @return map_iter_t Previous iterator or NULL if at begin.
+ * Both maps start with the even keys of [0, 2 * MAP_BENCH_CONC_N) and
+ * keys are copied (u32_dup), so erased entries exercise deferred frees.
  */
-map_iter_t map_prev(map_iter_t it)
+static void bench_concurrent(void)
 {
-    if (!it)
-        return NULL;
-    if (it->left)
+    size_t n = MAP_BENCH_CONC_N;
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    void **kp = malloc(n * sizeof(void *));
+    if (!keys || !kp)
     {
-        map_node_t *n = it->left;
-        while (n->right)
-            n = n->right;
-        return n;
+        free(keys);
+        free(kp);
+        return;
     }
-    else
+    for (size_t i = 0; i < n; ++i)
     {
-        map_node_t *p = it->parent;
-        map_node_t *cur = it;
-        while (p && p->left == cur)
+        keys[i] = (uint32_t)(2 * i);
+        kp[i] = &keys[i];
+    }
+    map_opts_t opts = {0};
+    opts.flags = MAP_CONCURRENT;
+    map_t *plain = map_create(u32_cmp, u32_dup, u32_free, NULL, NULL);
+    map_t *conc = map_create_ex(u32_cmp, u32_dup, u32_free, NULL, NULL, &opts);
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    if (plain && conc && map_from_sorted(plain, kp, NULL, n) == 1 && map_from_sorted(conc, kp, NULL, n) == 1)
+    {
+        printf("read-mostly scaling (n=%zu, 99%% find / 1%% insert+erase, Mops/s):\n", n);
+        printf("  %-8s %12s %14s\n", "threads", "mutex", "MAP_CONCURRENT");
+        for (int t = 1; t <= MAP_BENCH_THREADS; t *= 2)
         {
-            cur = p;
-            p = p->parent;
+            double a = bench_run_workers(plain, &lock, t);
+            double b = bench_run_workers(conc, NULL, t);
+            printf("  %-8d %12.2f %14.2f\n", t, a, b);
         }
-        return p;
     }
+    pthread_mutex_destroy(&lock);
+    map_destroy(plain);
+    map_destroy(conc);
+    free(kp);
+    free(keys);
 }
 
-/* Access key/value from iterator */
+#ifndef MAP_BENCH_SHARDS
+#define MAP_BENCH_SHARDS 64
+#endif
+
+typedef struct bench_shard_worker
+{
+    map_t *m;              /* single map, or NULL for the sharded one */
+    pthread_mutex_t *lock; /* around m unless it is MAP_CONCURRENT */
+    map_sharded_t *s;
+    uint64_t seed;
+} bench_shard_worker_t;
 
 /**
- * @brief Return pointer to key stored at iterator.
- *
- * @param it Iterator (node pointer).
- * @return void* Key pointer or NULL if it is NULL.
+ * @brief Identity hash of a uint32_t key; map_sharded mixes it.
  */
-void *map_iter_key(map_iter_t it) { return it ? it->key : NULL; }
+static uint64_t u32_hash(const void *key) { return *(const uint32_t *)key; }
 
 /**
- * @brief Return pointer to value stored at iterator.
- *
- * @param it Iterator (node pointer).
- * @return void* Value pointer or NULL if it is NULL.
+ * @brief Write-heavy mix: 50% insert / 50% erase over keys [0, 2 * MAP_BENCH_CONC_N).
  */
-void *map_iter_value(map_iter_t it) { return it ? it->value : NULL; }
-
-/* ---------------- Example usage ---------------- */
+static void *bench_shard_worker(void *arg)
+{
+    bench_shard_worker_t *w = (bench_shard_worker_t *)arg;
+    uint64_t x = w->seed;
+    for (size_t i = 0; i < MAP_BENCH_CONC_OPS; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint32_t k = (uint32_t)(x % (2u * MAP_BENCH_CONC_N));
+        int ins = (x >> 50) & 1;
+        if (w->s)
+        {
+            if (ins)
+                map_sharded_insert(w->s, &k, NULL);
+            else
+                map_sharded_erase(w->s, &k);
+            continue;
+        }
+        if (w->lock)
+            pthread_mutex_lock(w->lock);
+        if (ins)
+            map_insert(w->m, &k, NULL);
+        else
+            map_erase(w->m, &k);
+        if (w->lock)
+            pthread_mutex_unlock(w->lock);
+    }
+    return NULL;
+}
 
 /**
- * @brief Compare two C-strings using strcmp for map ordering.
- *
- * @param a First C-string.
- * @param b Second C-string.
- * @return int <0, 0, >0 like strcmp.
+ * @brief Run threads write-heavy workers against m or s and return total Mops/s.
  */
-static int cstr_cmp(const void *a, const void *b)
+static double bench_run_shard_workers(map_t *m, pthread_mutex_t *lock, map_sharded_t *s, int threads)
 {
-    return strcmp((const char *)a, (const char *)b);
+    pthread_t tid[MAP_BENCH_THREADS];
+    bench_shard_worker_t w[MAP_BENCH_THREADS];
+    double t0 = bench_wall();
+    for (int i = 0; i < threads; ++i)
+    {
+        w[i].m = m;
+        w[i].lock = lock;
+        w[i].s = s;
+        w[i].seed = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1);
+        if (pthread_create(&tid[i], NULL, bench_shard_worker, &w[i]) != 0)
+            threads = i;
+    }
+    for (int i = 0; i < threads; ++i)
+        pthread_join(tid[i], NULL);
+    double secs = bench_wall() - t0;
+    return secs > 0 ? (double)threads * MAP_BENCH_CONC_OPS / secs * 1e-6 : 0.0;
 }
 
 /**
- * @brief Duplicate a C-string using malloc.
- *
- * Caller must free returned pointer; used as key_dup in example.
+ * @brief Write scaling: one locked map, MAP_CONCURRENT and a hash-sharded map.
  *
- * @param s C-string to duplicate (may be NULL).
- * @return void* Newly allocated string or NULL on OOM or NULL input.
+ * All three start with the even keys of [0, 2 * MAP_BENCH_CONC_N); the
+ * sharded map has MAP_BENCH_SHARDS shards, each with its own arena.
  */
-static void *cstr_dup(const void *s)
+static void bench_sharded(void)
 {
-    if (!s)
-        return NULL;
-    size_t len = strlen((const char *)s);
-    char *d = (char *)malloc(len + 1);
-    if (!d)
-        return NULL;
-    memcpy(d, s, len + 1);
-    return d;
+    size_t n = MAP_BENCH_CONC_N;
+    map_opts_t opts = {0};
+    opts.flags = MAP_CONCURRENT;
+    map_opts_t arena = {0};
+    arena.flags = MAP_ARENA;
+    map_shard_opts_t so = {0};
+    so.shards = MAP_BENCH_SHARDS;
+    so.hash = u32_hash;
+    so.map = &arena;
+    map_t *plain = map_create(u32_cmp, u32_dup, u32_free, NULL, NULL);
+    map_t *conc = map_create_ex(u32_cmp, u32_dup, u32_free, NULL, NULL, &opts);
+    map_sharded_t *sh = map_sharded_create(u32_cmp, u32_dup, u32_free, NULL, NULL, &so);
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    int ok = plain && conc && sh;
+    for (size_t i = 0; ok && i < n; ++i)
+    {
+        uint32_t k = (uint32_t)(2 * i);
+        ok = map_insert(plain, &k, NULL) == 1 && map_insert(conc, &k, NULL) == 1 &&
+             map_sharded_insert(sh, &k, NULL) == 1;
+    }
+    if (ok)
+    {
+        printf("write scaling (n=%zu, 50%% insert / 50%% erase, Mops/s):\n", n);
+        printf("  %-8s %12s %14s %12s\n", "threads", "mutex", "MAP_CONCURRENT", "sharded");
+        for (int t = 1; t <= MAP_BENCH_THREADS; t *= 2)
+        {
+            double a = bench_run_shard_workers(plain, &lock, NULL, t);
+            double b = bench_run_shard_workers(conc, NULL, NULL, t);
+            double c = bench_run_shard_workers(NULL, NULL, sh, t);
+            printf("  %-8d %12.2f %14.2f %12.2f\n", t, a, b, c);
+        }
+    }
+    pthread_mutex_destroy(&lock);
+    map_destroy(plain);
+    map_destroy(conc);
+    map_sharded_destroy(sh);
 }
 
+/* ---- workload suite: one CSV row per (implementation, workload, n) ---- */
+
+#ifndef MAP_BENCH_MIN_N
+#define MAP_BENCH_MIN_N 1000
+#endif
+#ifndef MAP_BENCH_MAX_N
+#define MAP_BENCH_MAX_N 1000000 /* 1e8 needs about 7 GB for the AVL map */
+#endif
+#ifndef MAP_BENCH_MIN_OPS
+#define MAP_BENCH_MIN_OPS 1000000 /* lookup/mixed/iterate rows repeat to at least this */
+#endif
+#define MAP_BENCH_SEED 0x2545F4914F6CDD1Dull
+#define MAP_BENCH_ZIPF_THETA 0.99
+
 /**
- * @brief Free a C-string allocated by cstr_dup.
- *
- * @param s Pointer returned by cstr_dup.
+ * @brief Advance a xorshift64 state and return it (never 0 for a non-zero seed).
  */
-static void cstr_free(void *s) { free(s); }
+static uint64_t bench_rand(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* Zipf(theta) over ranks [0, n), rank 0 the most popular (Gray et al.) */
+typedef struct bench_zipf
+{
+    size_t n;
+    double zetan, alpha, eta, half_pow;
+} bench_zipf_t;
 
 /**
- * @brief Duplicate an int value on the heap.
- *
- * Used as example val_dup; returns a newly allocated int containing *p.
- *
- * @param p Pointer to int to duplicate.
- * @return void* Allocated int pointer or NULL on OOM.
+ * @brief Precompute the Zipf constants for n ranks (O(n) once per size).
  */
-static void *int_dup(const void *p)
+static void bench_zipf_init(bench_zipf_t *z, size_t n)
 {
-    int *d = malloc(sizeof(int));
-    if (!d)
-        return NULL;
-    *d = *(const int *)p;
-    return d;
+    double zetan = 0.0;
+    for (size_t i = 1; i <= n; ++i)
+        zetan += pow((double)i, -MAP_BENCH_ZIPF_THETA);
+    z->n = n;
+    z->zetan = zetan;
+    z->half_pow = pow(0.5, MAP_BENCH_ZIPF_THETA);
+    z->alpha = 1.0 / (1.0 - MAP_BENCH_ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - MAP_BENCH_ZIPF_THETA)) / (1.0 - (1.0 + z->half_pow) / zetan);
 }
 
 /**
- * @brief Free an int allocated by int_dup.
- *
- * @param p Pointer returned by int_dup.
+ * @brief Draw one Zipf-distributed rank.
  */
-static void int_free(void *p) { free(p); }
-
-int main(void)
+static size_t bench_zipf_next(const bench_zipf_t *z, uint64_t *x)
 {
-    /* map from C string -> int (both copied) */
-    map_t *m = map_create(cstr_cmp, cstr_dup, cstr_free, int_dup, int_free);
-    if (!m)
+    double u = (double)(bench_rand(x) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + z->half_pow)
         return 1;
-
-    int v;
-
-    v = 42;
-    map_insert(m, "apple", &v);
-    v = 7;
-    map_insert(m, "orange", &v);
-    v = 13;
-    map_put(m, "banana", &v);
-    v = 100;
-    map_put(m, "apple", &v); /* replace apple's value */
-
-    printf("map size: %zu\n", map_size(m));
-
-    /* lookup */
-    int *pv = map_find(m, "apple");
-    if (pv)
-        printf("apple -> %d\n", *pv);
-
-    /* iterate in order */
-    printf("in-order traversal:\n");
-    for (map_iter_t it = map_begin(m); it != map_end(m); it = map_next(it))
-    {
-        printf("  %s -> %d\n", (char *)map_iter_key(it), *(int *)map_iter_value(it));
-    }
-
-    /* erase an element */
-    map_erase(m, "orange");
-    printf("after erase orange, size=%zu\n", map_size(m));
-
-    /* clear and destroy */
-    map_destroy(m);
-    return 0;
+    size_t r = (size_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
 }
 
-/* ---- Example usage changed: uint32_t keys, function-pointer values ---- */
-
-#include <inttypes.h> /* for PRIu32 if needed */
-typedef void (*fp_t)(void);
-
 /**
- * @brief Compare two uint32_t keys.
- *
- * Expects pointers to uint32_t values.
- *
- * @param a Pointer to first uint32_t.
- * @param b Pointer to second uint32_t.
- * @return int -1 if *a < *b, 0 if equal, 1 if *a > *b.
+ * @brief Peak resident set size of the process in KiB.
  */
-static int u32_cmp(const void *a, const void *b)
+static long bench_peak_rss_kb(void)
 {
-    uint32_t va = *(const uint32_t *)a;
-    uint32_t vb = *(const uint32_t *)b;
-    return (va > vb) ? 1 : (va < vb) ? -1
-                                     : 0;
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
 }
 
 /**
- * @brief Duplicate a uint32_t on the heap.
- *
- * Allocates and returns a pointer to a copied uint32_t. Caller must free.
- *
- * @param x Pointer to source uint32_t.
- * @return void* Allocated copy or NULL on OOM.
+ * @brief Node allocations made by m so far, or -1 without MAP_STATS.
  */
-static void *u32_dup(const void *x)
+static long long bench_allocs(const map_t *m)
 {
-    if (!x)
-        return NULL;
-    uint32_t *d = malloc(sizeof(uint32_t));
-    if (!d)
-        return NULL;
-    *d = *(const uint32_t *)x;
-    return d;
+    map_stats_t st;
+    return map_stats(m, &st) == 0 ? (long long)st.allocs : -1;
+}
+
+/**
+ * @brief Write one CSV row; an unknown allocation count is left empty.
+ */
+static void bench_row(FILE *out, const char *impl, const char *workload, size_t n,
+                      size_t ops, double secs, long long allocs)
+{
+    fprintf(out, "%s,%s,%zu,%.1f,", impl, workload, n, ops ? secs * 1e9 / (double)ops : 0.0);
+    if (allocs >= 0)
+        fprintf(out, "%lld", allocs);
+    fprintf(out, ",%ld\n", bench_peak_rss_kb());
 }
 
 /**
- * @brief Free a heap-allocated uint32_t.
+ * @brief Run every workload against one map backend at size n.
  *
- * @param x Pointer returned by u32_dup.
+ * Keys point into u, which holds 0..2n-1: the n even keys are the
+ * loaded set, odd keys are guaranteed misses. ord is the even keys in
+ * random order. Each row reports ns per operation of that workload;
+ * inserts run n operations, the other workloads at least MAP_BENCH_MIN_OPS.
  */
-static void u32_free(void *x) { free(x); }
+static void bench_suite_map(FILE *out, const char *impl, map_backend_t backend,
+                            uint32_t *u, const uint32_t *ord, const bench_zipf_t *z, size_t n)
+{
+    map_opts_t opts = {0};
+    opts.backend = backend;
+    map_t *m = map_create_ex(u32_cmp, NULL, NULL, NULL, NULL, &opts);
+    if (!m)
+        return;
+    uint64_t x = MAP_BENCH_SEED;
+    size_t ops = n < MAP_BENCH_MIN_OPS ? MAP_BENCH_MIN_OPS : n;
+    volatile size_t sink = 0;
+    long long a0;
+    clock_t t0;
+
+#define BENCH_START() (a0 = bench_allocs(m), t0 = clock())
+#define BENCH_ROW(name, ops) \
+    bench_row(out, impl, name, n, ops, bench_secs(t0), a0 < 0 ? -1 : bench_allocs(m) - a0)
+
+    BENCH_START();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &u[2 * i], NULL);
+    BENCH_ROW("seq_insert", n);
+    map_clear(m);
+
+    BENCH_START();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &u[ord[i]], NULL);
+    BENCH_ROW("rand_insert", n);
+
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_find(m, &u[2 * (bench_rand(&x) % n)]) == NULL;
+    BENCH_ROW("find_hit", ops);
+
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_find(m, &u[2 * (bench_rand(&x) % n) + 1]) == NULL;
+    BENCH_ROW("find_miss", ops);
+
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_rank(m, &u[bench_rand(&x) % (2 * n)]);
+    BENCH_ROW("rank", ops);
+
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_select(m, bench_rand(&x) % n) == NULL;
+    BENCH_ROW("select", ops);
+
+    BENCH_START();
+    size_t seen = 0;
+    while (seen < ops)
+        for (map_iter_t it = map_begin(m); it; it = map_next(it), ++seen)
+            sink += *(const uint32_t *)map_iter_key(it);
+    BENCH_ROW("iterate", seen);
+
+    /* 90% find / 10% insert-or-assign over [0, 2n) */
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        uint32_t *k = &u[r % (2 * n)];
+        if ((r >> 40) % 10 == 0)
+            map_put(m, k, NULL);
+        else
+            sink += map_find(m, k) == NULL;
+    }
+    BENCH_ROW("mixed", ops);
+
+    /* 75% erase / 25% insert over [0, 2n) */
+    BENCH_START();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        uint32_t *k = &u[r % (2 * n)];
+        if ((r >> 40) % 4 == 0)
+            map_insert(m, k, NULL);
+        else
+            map_erase(m, k);
+    }
+    BENCH_ROW("erase_heavy", ops);
+    map_clear(m);
+
+    /* n insert attempts of Zipf-popular keys; repeats are rejected */
+    BENCH_START();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &u[ord[bench_zipf_next(z, &x)]], NULL);
+    BENCH_ROW("zipf_insert", n);
+
+#undef BENCH_ROW
+#undef BENCH_START
+    (void)sink;
+    map_destroy(m);
+}
+
+static _Thread_local uint64_t bench_each_sink;
 
 /**
- * @brief Duplicate a function pointer into heap storage.
- *
- * Stores the function pointer in a newly allocated slot so the generic map
- * can manage it. The caller should cast function pointer to/from void* when
- * calling map_insert/put.
- *
- * @param x Function pointer passed as void* (may be NULL).
- * @return void* Pointer to allocated storage containing the function pointer or NULL on OOM.
+ * @brief map_for_each callback for the bulk rows: read every key.
  */
-static void *fp_dup(const void *x)
+static void bench_each(void *key, void *value, void *ctx)
 {
-    if (!x)
-        return NULL;
-    fp_t f = (fp_t)(uintptr_t)x; /* caller passes function pointer cast via (void*)(uintptr_t)f */
-    fp_t *d = malloc(sizeof(fp_t));
-    if (!d)
-        return NULL;
-    *d = f;
-    return d;
+    (void)value;
+    (void)ctx;
+    bench_each_sink += *(const uint32_t *)key;
 }
 
 /**
- * @brief Free storage allocated by fp_dup.
+ * @brief Bulk rows for the AVL map: load n unsorted keys, visit them, destroy.
  *
- * @param x Pointer returned by fp_dup.
+ * Runs once on one thread (impl "map_avl") and once with opts.threads =
+ * MAP_BENCH_THREADS ("map_avl_par"). Times are wall clock, in ns per
+ * entry; sizes below MAP_PAR_MIN run serially in both.
  */
-static void fp_free(void *x) { free(x); }
-
-/* sample functions to store as values */
+static void bench_suite_bulk(FILE *out, uint32_t *u, const uint32_t *ord, size_t n)
+{
+    void **kp = malloc(n * sizeof(void *));
+    if (!kp)
+        return;
+    for (size_t i = 0; i < n; ++i)
+        kp[i] = &u[ord[i]];
+    for (int par = 0; par < 2; ++par)
+    {
+        const char *impl = par ? "map_avl_par" : "map_avl";
+        map_opts_t opts = {0};
+        opts.threads = par ? MAP_BENCH_THREADS : 1;
+        map_t *m = map_create_ex(u32_cmp, NULL, NULL, NULL, NULL, &opts);
+        if (!m)
+            break;
+        double t0 = bench_wall();
+        if (map_from_unsorted(m, kp, NULL, n) != 1)
+        {
+            map_destroy(m);
+            break;
+        }
+        bench_row(out, impl, "bulk_unsorted", n, n, bench_wall() - t0, bench_allocs(m));
+        t0 = bench_wall();
+        map_for_each(m, bench_each, NULL);
+        bench_row(out, impl, "for_each", n, n, bench_wall() - t0, -1);
+        t0 = bench_wall();
+        map_destroy(m);
+        bench_row(out, impl, "destroy", n, n, bench_wall() - t0, -1);
+    }
+    free(kp);
+}
 
 /**
- * @brief Example function to be stored as a value in the map.
+ * @brief Frozen-map rows: freeze an AVL map of n keys, then look up and iterate.
+ *
+ * Uses the keys and miss pattern of bench_suite_map, so find_hit and
+ * find_miss compare directly with the map_avl rows.
  */
-static void say_hello(void) { printf("hello\n"); }
+static void bench_suite_frozen(FILE *out, uint32_t *u, const uint32_t *ord, size_t n)
+{
+    map_t *m = map_create(u32_cmp, NULL, NULL, NULL, NULL);
+    if (!m)
+        return;
+    for (size_t i = 0; i < n; ++i)
+        map_insert(m, &u[ord[i]], NULL);
+    uint64_t x = MAP_BENCH_SEED;
+    size_t ops = n < MAP_BENCH_MIN_OPS ? MAP_BENCH_MIN_OPS : n;
+    volatile size_t sink = 0;
+    clock_t t0 = clock();
+    map_frozen_t *f = map_freeze(m);
+    bench_row(out, "map_frozen", "freeze", n, n, bench_secs(t0), -1);
+    map_destroy(m);
+    if (!f)
+        return;
+
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += frozen_find(f, &u[2 * (bench_rand(&x) % n)]) == NULL;
+    bench_row(out, "map_frozen", "find_hit", n, ops, bench_secs(t0), -1);
+
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += frozen_find(f, &u[2 * (bench_rand(&x) % n) + 1]) == NULL;
+    bench_row(out, "map_frozen", "find_miss", n, ops, bench_secs(t0), -1);
+
+    t0 = clock();
+    size_t seen = 0;
+    while (seen < ops)
+        for (size_t it = frozen_begin(f); it; it = frozen_next(f, it), ++seen)
+            sink += *(const uint32_t *)frozen_key(f, it);
+    bench_row(out, "map_frozen", "iterate", n, seen, bench_secs(t0), -1);
+    (void)sink;
+    frozen_destroy(f);
+}
 
 /**
- * @brief Example function to be stored as a value in the map.
+ * @brief Run the workload suite for sizes MAP_BENCH_MIN_N..MAP_BENCH_MAX_N (x10 steps).
+ *
+ * Rows are appended to the file named by $MAP_BENCH_CSV (the header only
+ * when it is empty), else written to stdout. Seeds are
+ * fixed, so two builds see the same key sequences. Allocation counts need
+ * -DMAP_STATS; the RSS column is the process peak so far.
  */
-static void say_goodbye(void) { printf("goodbye\n"); }
+static void bench_suite(void)
+{
+    const char *path = getenv("MAP_BENCH_CSV");
+    FILE *out = path ? fopen(path, "a") : stdout;
+    if (!out)
+        return;
+    if (!path || (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0))
+        fprintf(out, "impl,workload,n,ns_per_op,allocs,peak_rss_kb\n");
+    for (size_t n = MAP_BENCH_MIN_N; n <= MAP_BENCH_MAX_N; n *= 10)
+    {
+        uint32_t *u = malloc(2 * n * sizeof(uint32_t));
+        uint32_t *ord = malloc(n * sizeof(uint32_t));
+        if (!u || !ord)
+        {
+            free(u);
+            free(ord);
+            break;
+        }
+        for (size_t i = 0; i < 2 * n; ++i)
+            u[i] = (uint32_t)i;
+        for (size_t i = 0; i < n; ++i)
+            ord[i] = (uint32_t)(2 * i);
+        uint64_t x = MAP_BENCH_SEED ^ n;
+        for (size_t i = n - 1; i > 0; --i)
+        {
+            size_t j = (size_t)(bench_rand(&x) % (i + 1));
+            uint32_t t = ord[i];
+            ord[i] = ord[j];
+            ord[j] = t;
+        }
+        bench_zipf_t z;
+        bench_zipf_init(&z, n);
+        bench_suite_map(out, "map_avl", MAP_BACKEND_AVL, u, ord, &z, n);
+        bench_suite_map(out, "map_btree", MAP_BACKEND_BTREE, u, ord, &z, n);
+        bench_suite_bulk(out, u, ord, n);
+        bench_suite_frozen(out, u, ord, n);
+        fflush(out);
+        free(ord);
+        free(u);
+    }
+    if (out != stdout)
+        fclose(out);
+}
+#endif
 
 int main(void)
 {
@@ -947,43 +8266,155 @@ int main(void)
             printf("(null)\n");
     }
 
+    /* the same through a callback; with opts.threads > 1 large maps are split across threads */
+    printf("for_each (unordered):\n");
+    map_for_each(m, call_entry, NULL);
+
     /* erase an element */
     uint32_t rem = 20;
     map_erase(m, &rem);
     printf("after erase 20, size=%zu\n", map_size(m));
 
+    /* a reload: several updates applied as one batch */
+    uint32_t reload[] = {60, 70, 10};
+    map_batch_op_t ops[] = {
+        {MAP_BATCH_PUT, &reload[0], (void *)(uintptr_t)say_goodbye},
+        {MAP_BATCH_PUT, &reload[1], (void *)(uintptr_t)say_hello},
+        {MAP_BATCH_ERASE, &reload[0], NULL},
+        {MAP_BATCH_PUT, &reload[2], (void *)(uintptr_t)say_goodbye},
+    };
+    map_batch_t *batch = map_batch_begin(m);
+    if (batch && map_batch_apply(batch, ops, sizeof(ops) / sizeof(ops[0])) < 0)
+    {
+        map_batch_abort(batch);
+        batch = NULL;
+    }
+    if (batch && map_batch_commit(batch) == 1) /* commit frees the batch */
+    {
+        pv = map_find(m, &reload[2]);
+        printf("after batch size=%zu, 10 -> ", map_size(m));
+        if (pv && *pv)
+            (*pv)();
+    }
+
+    /* rank and select; O(log n) on AVL maps built with -DMAP_ORDER_STATS */
+    for (k = 40; k < 100; k += 10)
+        map_insert(m, &k, (void *)(uintptr_t)say_hello);
+    uint32_t lo = 15, hi = 60;
+    map_iter_t third = map_select(m, 2);
+    printf("rank of 55: %zu, third key: %" PRIu32 ", keys in [15, 60): %zu\n", map_rank(m, &(uint32_t){55}),
+           third ? *(uint32_t *)map_iter_key(third) : 0, map_count_range(m, &lo, &hi));
+
+    /* read-only from here: freeze the table, the heap keys/values move along */
+    k = 30;
+    map_insert(m, &k, (void *)(uintptr_t)say_goodbye);
+    map_frozen_t *fz = map_freeze(m);
+    if (fz)
+    {
+        printf("frozen table, %zu entries:\n", frozen_size(fz));
+        for (size_t it = frozen_begin(fz); it; it = frozen_next(fz, it))
+            call_entry(frozen_key(fz, it), frozen_value(fz, it), NULL);
+        q = 30;
+        pv = frozen_find(fz, &q);
+        if (pv && *pv)
+            (*pv)();
+        frozen_destroy(fz);
+    }
+
+#ifdef MAP_STATS
+    map_stats_t st;
+    if (map_stats(m, &st) == 0)
+        printf("stats: %" PRIu64 " lookups, %" PRIu64 " cmps, %" PRIu64 " rotations, %zu live bytes\n",
+               st.lookups, st.cmp_calls, st.rotations, st.live_bytes);
+#endif
+
     /* clear and destroy */
     map_destroy(m);
+
+#ifdef MAP_BENCH
+    bench_suite(); /* first, so its peak RSS column is not the other benchmarks' */
+    bench_bulk_load();
+    bench_find_many();
+    bench_huge_pages();
+    bench_batch();
+    bench_versions();
+    bench_scan();
+    bench_typed();
+    bench_string_keys();
+    bench_concurrent();
+    bench_sharded();
+#endif
     return 0;
 }
 
 /*
-  Specialized, statically allocated map: uint32_t -> function pointer (fp_t).
-  No malloc/free used. Fixed capacity pool.
+  Specialized, pool-allocated map: uint32_t -> function pointer (fp_t).
+  The first MAX_NODES nodes live inline in the map, so small tables never
+  call malloc. Past that the pool grows by whole segments, each as large
+  as everything before it; nodes never move, so node_t pointers stay
+  valid. A segment whose nodes are all free is released once the map is
+  below a quarter of its capacity, and map_compact moves nodes down so
+  sparse high segments can go too. map_freeze turns a finished table into
+  a u32frozen_t: keys alone in Eytzinger order, searched branch-free.
+  -DMAP_ORDER_STATS adds subtree counts for O(log n) map_rank/map_select.
+
+  Build with -DMAP_BENCH (and -lm) to also run the pool occupancy
+  benchmark and the CSV workload suite.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#ifdef MAP_BENCH
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#endif
 
 typedef void (*fp_t)(void);
 
-#define MAX_NODES 256
+#ifndef MAX_NODES
+#define MAX_NODES 256 /* nodes in the inline segment */
+#endif
+
+/* Segment 0 is the inline pool; segment s > 0 holds MAX_NODES << (s - 1) nodes */
+#ifndef MAP_POOL_SEGMENTS
+#define MAP_POOL_SEGMENTS 24
+#endif
+
+#if MAP_POOL_SEGMENTS < 1 || MAP_POOL_SEGMENTS > 255
+#error "MAP_POOL_SEGMENTS must be in [1, 255]"
+#endif
 
 typedef struct node
 {
     uint32_t key;
+#ifdef MAP_ORDER_STATS
+    uint32_t count; /* nodes in this subtree; fills the padding after key */
+#endif
     fp_t value;
     struct node *left, *right, *parent;
     int height;
-    int in_use; /* 0 = free, 1 = used */
+    uint8_t in_use; /* 0 = free, 1 = used */
+    uint8_t seg;    /* pool segment holding this slot */
 } node_t;
 
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && UINTPTR_MAX == UINT64_MAX
+_Static_assert(sizeof(node_t) == 48, "node_t: 48 bytes with or without MAP_ORDER_STATS");
+#endif
+
 typedef struct
 {
-    node_t pool[MAX_NODES];
+    node_t pool[MAX_NODES]; /* segment 0 */
     size_t size;
     node_t *root;
+    node_t *seg[MAP_POOL_SEGMENTS];      /* seg[0] == pool; NULL past nseg */
+    node_t *seg_free[MAP_POOL_SEGMENTS]; /* free slots per segment, linked through left */
+    size_t seg_live[MAP_POOL_SEGMENTS];  /* slots in use per segment */
+    size_t used;                         /* slots in use in all segments */
+    unsigned nseg;                       /* segments allocated, inline one included */
+    size_t grows;                        /* segments ever added (pool malloc calls) */
 } u32map_t;
 
 /* helpers */
@@ -996,8 +8427,15 @@ typedef struct
  */
 static int node_height(node_t *n) { return n ? n->height : 0; }
 
+#ifdef MAP_ORDER_STATS
 /**
- * @brief Update height for static node based on its children.
+ * @brief Return the number of nodes in a static subtree (0 if NULL).
+ */
+static uint32_t node_count(node_t *n) { return n ? n->count : 0; }
+#endif
+
+/**
+ * @brief Update height (and with MAP_ORDER_STATS the subtree count) for static node.
  *
  * @param n Pointer to node_t (may be NULL).
  */
@@ -1008,13 +8446,49 @@ static void update_height(node_t *n)
         int hl = node_height(n->left);
         int hr = node_height(n->right);
         n->height = (hl > hr ? hl : hr) + 1;
+#ifdef MAP_ORDER_STATS
+        n->count = node_count(n->left) + node_count(n->right) + 1;
+#endif
     }
 }
 
-/* pool management (no malloc/free) */
+/* pool management: malloc only when a segment is added or released */
+
+/**
+ * @brief Number of nodes in pool segment s.
+ */
+static size_t seg_nodes(unsigned s) { return s == 0 ? (size_t)MAX_NODES : (size_t)MAX_NODES << (s - 1); }
+
+/**
+ * @brief Total nodes in segments [0, nseg).
+ */
+static size_t pool_capacity(unsigned nseg) { return nseg == 0 ? 0 : (size_t)MAX_NODES << (nseg - 1); }
+
+/**
+ * @brief Mark count slots of segment s free and thread them onto its free list.
+ *
+ * Slots are linked in index order so the lowest address is handed out first.
+ */
+static void seg_init(u32map_t *m, unsigned s, node_t *slots, size_t count)
+{
+    m->seg[s] = slots;
+    m->seg_free[s] = NULL;
+    m->seg_live[s] = 0;
+    for (size_t i = count; i-- > 0;)
+    {
+        slots[i].in_use = 0;
+        slots[i].seg = (uint8_t)s;
+        slots[i].right = slots[i].parent = NULL;
+        slots[i].height = 0;
+        slots[i].key = 0;
+        slots[i].value = NULL;
+        slots[i].left = m->seg_free[s];
+        m->seg_free[s] = &slots[i];
+    }
+}
 
 /**
- * @brief Initialize the static pool map, marking all slots free.
+ * @brief Initialize the pool map with only the inline segment, all slots free.
  *
  * @param m Pointer to u32map_t to initialize.
  */
@@ -1022,58 +8496,125 @@ static void pool_init(u32map_t *m)
 {
     m->size = 0;
     m->root = NULL;
-    for (int i = 0; i < MAX_NODES; ++i)
+    m->used = 0;
+    m->nseg = 1;
+    for (unsigned s = 1; s < MAP_POOL_SEGMENTS; ++s)
+    {
+        m->seg[s] = m->seg_free[s] = NULL;
+        m->seg_live[s] = 0;
+    }
+    seg_init(m, 0, m->pool, MAX_NODES);
+}
+
+/**
+ * @brief Add the next segment, doubling the pool's capacity.
+ *
+ * @param m Pointer to u32map_t.
+ * @return int 0 on success, -1 if MAP_POOL_SEGMENTS are in use or malloc fails.
+ */
+static int pool_grow(u32map_t *m)
+{
+    if (m->nseg >= MAP_POOL_SEGMENTS)
+        return -1;
+    unsigned s = m->nseg;
+    node_t *slots = (node_t *)malloc(seg_nodes(s) * sizeof(node_t));
+    if (!slots)
+        return -1;
+    seg_init(m, s, slots, seg_nodes(s));
+    m->nseg++;
+    m->grows++;
+    return 0;
+}
+
+/**
+ * @brief Grow the pool until at least n more slots are free.
+ *
+ * @return int 0 on success, -1 if the pool cannot grow that far.
+ */
+static int pool_reserve(u32map_t *m, size_t n)
+{
+    while (pool_capacity(m->nseg) - m->used < n)
     {
-        m->pool[i].in_use = 0;
-        m->pool[i].left = m->pool[i].right = m->pool[i].parent = NULL;
-        m->pool[i].height = 0;
-        m->pool[i].key = 0;
-        m->pool[i].value = NULL;
+        if (pool_grow(m) < 0)
+            return -1;
     }
+    return 0;
+}
+
+/**
+ * @brief Free the highest segment; all of its slots must be free.
+ */
+static void pool_release_top(u32map_t *m)
+{
+    unsigned s = --m->nseg;
+    free(m->seg[s]);
+    m->seg[s] = m->seg_free[s] = NULL;
+}
+
+/**
+ * @brief Release empty high segments while the pool is under 1/4 utilised.
+ *
+ * The gap between the grow point (full) and this point keeps an
+ * insert/erase pattern at a boundary from calling malloc every step.
+ */
+static void pool_shrink(u32map_t *m)
+{
+    while (m->nseg > 1 && m->seg_live[m->nseg - 1] == 0 && m->used <= pool_capacity(m->nseg - 1) / 2)
+        pool_release_top(m);
 }
 
 /**
- * @brief Allocate a node from the static pool.
+ * @brief Allocate a node from the pool, adding a segment when all are full.
  *
+ * Takes a slot from the lowest segment with one free, so live nodes
+ * gather at the bottom and high segments drain.
  * Returns pointer to a free node initialized for use or NULL if pool exhausted.
  *
  * @param m Pointer to u32map_t.
- * @return node_t* Allocated node or NULL if none available.
+ * @return node_t* Allocated node or NULL if the pool cannot grow.
  */
 static node_t *node_alloc(u32map_t *m)
 {
-    for (int i = 0; i < MAX_NODES; ++i)
-    {
-        if (!m->pool[i].in_use)
-        {
-            node_t *n = &m->pool[i];
-            n->in_use = 1;
-            n->left = n->right = n->parent = NULL;
-            n->height = 1;
-            n->value = NULL;
-            return n;
-        }
-    }
-    return NULL; /* pool exhausted */
+    unsigned s = 0;
+    while (s < m->nseg && !m->seg_free[s])
+        s++;
+    if (s == m->nseg && pool_grow(m) < 0)
+        return NULL; /* pool exhausted */
+    node_t *n = m->seg_free[s];
+    m->seg_free[s] = n->left;
+    m->seg_live[s]++;
+    m->used++;
+    n->in_use = 1;
+    n->left = n->right = n->parent = NULL;
+    n->height = 1;
+#ifdef MAP_ORDER_STATS
+    n->count = 1;
+#endif
+    n->value = NULL;
+    return n;
 }
 
 /**
- * @brief Return a node to the static pool (mark free).
+ * @brief Return a node to its segment's free list (mark free).
  *
- * Does not call any user callbacks since values are plain function pointers.
+ * O(1); never releases a segment itself (see pool_shrink). Does not call
+ * any user callbacks since values are plain function pointers.
  *
- * @param m Pointer to u32map_t (unused but kept for symmetry).
+ * @param m Pointer to u32map_t owning the pool.
  * @param n Node to free.
  */
 static void node_free(u32map_t *m, node_t *n)
 {
-    (void)m;
     if (!n)
         return;
     n->in_use = 0;
-    n->left = n->right = n->parent = NULL;
+    n->right = n->parent = NULL;
     n->height = 0;
     n->value = NULL;
+    n->left = m->seg_free[n->seg];
+    m->seg_free[n->seg] = n;
+    m->seg_live[n->seg]--;
+    m->used--;
 }
 
 /* rotations */
@@ -1207,15 +8748,28 @@ static node_t *rebalance_at(u32map_t *m, node_t *node)
 /* API */
 
 /**
- * @brief Initialize a statically allocated uint32_t->fp_t map.
+ * @brief Initialize a pool-allocated uint32_t->fp_t map.
  *
- * Must be called before using the map.
+ * Must be called before using the map; does not allocate.
  *
  * @param m Pointer to u32map_t to initialize.
  */
 static void map_init(u32map_t *m)
 {
     pool_init(m);
+    m->grows = 0;
+}
+
+/**
+ * @brief Release every grown segment, leaving an empty, initialized map.
+ *
+ * @param m Pointer to u32map_t.
+ */
+static void map_destroy(u32map_t *m)
+{
+    while (m->nseg > 1)
+        pool_release_top(m);
+    pool_init(m);
 }
 
 /**
@@ -1243,7 +8797,7 @@ static node_t *find_node(u32map_t *m, uint32_t key)
  * @param m Pointer to u32map_t.
  * @param key Key to insert.
  * @param value Function pointer value to store.
- * @return int 1 if inserted, 0 if existed, -1 if pool exhausted.
+ * @return int 1 if inserted, 0 if existed, -1 if the pool cannot grow.
  */
 static int map_insert(u32map_t *m, uint32_t key, fp_t value)
 {
@@ -1310,7 +8864,7 @@ static int map_insert(u32map_t *m, uint32_t key, fp_t value)
  * @param m Pointer to u32map_t.
  * @param key Key to insert or replace.
  * @param value Function pointer value.
- * @return int 1 if inserted, 2 if replaced, -1 if pool exhausted.
+ * @return int 1 if inserted, 2 if replaced, -1 if the pool cannot grow.
  */
 static int map_put(u32map_t *m, uint32_t key, fp_t value)
 {
@@ -1336,6 +8890,71 @@ static fp_t map_find(u32map_t *m, uint32_t key)
     return n ? n->value : NULL;
 }
 
+#ifndef MAP_FIND_GROUP
+#define MAP_FIND_GROUP 8 /* lookups walked in lock-step by map_find_many */
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define MAP_PREFETCH(p) ((void)(p))
+#endif
+
+/**
+ * @brief Look up n keys at once in the static map, overlapping cache misses.
+ *
+ * Keys are stored inline, so each lock-step round compares against the
+ * current node of every lookup in the group and prefetches its child.
+ *
+ * @param m Pointer to u32map_t.
+ * @param keys n search keys.
+ * @param n Number of keys.
+ * @param out_values Receives n function pointers (NULL for keys not found).
+ * @return size_t Number of keys found.
+ */
+static size_t map_find_many(u32map_t *m, const uint32_t *keys, size_t n, fp_t *out_values)
+{
+    size_t found = 0;
+    for (size_t base = 0; base < n; base += MAP_FIND_GROUP)
+    {
+        node_t *cur[MAP_FIND_GROUP];
+        size_t g = n - base < MAP_FIND_GROUP ? n - base : MAP_FIND_GROUP;
+        size_t active = 0;
+
+        for (size_t i = 0; i < g; ++i)
+        {
+            out_values[base + i] = NULL;
+            cur[i] = m->root;
+            active += cur[i] != NULL;
+        }
+        while (active)
+        {
+            for (size_t i = 0; i < g; ++i)
+            {
+                node_t *nd = cur[i];
+                if (!nd)
+                    continue;
+                uint32_t key = keys[base + i];
+                if (key == nd->key)
+                {
+                    out_values[base + i] = nd->value;
+                    found++;
+                    cur[i] = NULL;
+                    active--;
+                    continue;
+                }
+                nd = (key < nd->key) ? nd->left : nd->right;
+                cur[i] = nd;
+                if (nd)
+                    MAP_PREFETCH(nd);
+                else
+                    active--;
+            }
+        }
+    }
+    return found;
+}
+
 /**
  * @brief Return leftmost node in a subtree (static pool).
  *
@@ -1377,52 +8996,256 @@ static node_t *erase_node(u32map_t *m, node_t *n)
     }
     else
     {
-        node_t *child = n->left ? n->left : n->right;
-        parent = n->parent;
-        if (parent == NULL)
+        node_t *child = n->left ? n->left : n->right;
+        parent = n->parent;
+        if (parent == NULL)
+        {
+            m->root = child;
+            if (child)
+                child->parent = NULL;
+        }
+        else
+        {
+            if (parent->left == n)
+                parent->left = child;
+            else
+                parent->right = child;
+            if (child)
+                child->parent = parent;
+        }
+        node_free(m, n);
+        if (m->size > 0)
+            m->size--;
+        return parent;
+    }
+}
+
+/**
+ * @brief Erase a key from the static map.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key to erase.
+ * @return int 1 if erased, 0 if not found.
+ */
+static int map_erase(u32map_t *m, uint32_t key)
+{
+    node_t *n = find_node(m, key);
+    if (!n)
+        return 0;
+    node_t *p = erase_node(m, n);
+    while (p)
+    {
+        node_t *old_p = p;
+        node_t *new_subroot = rebalance_at(m, p);
+        set_child(m, new_subroot->parent, old_p, new_subroot);
+        p = new_subroot->parent;
+    }
+    if (m->root && m->root->parent)
+        m->root->parent = NULL;
+    pool_shrink(m);
+    return 1;
+}
+
+/**
+ * @brief Move a live node into a free slot of a lower segment.
+ *
+ * @param m Pointer to u32map_t.
+ * @param old Node to move; its slot is freed.
+ */
+static void node_move(u32map_t *m, node_t *old)
+{
+    node_t *n = node_alloc(m);
+    n->key = old->key;
+    n->value = old->value;
+    n->height = old->height;
+#ifdef MAP_ORDER_STATS
+    n->count = old->count;
+#endif
+    n->left = old->left;
+    n->right = old->right;
+    if (n->left)
+        n->left->parent = n;
+    if (n->right)
+        n->right->parent = n;
+    set_child(m, old->parent, old, n);
+    node_free(m, old);
+}
+
+/**
+ * @brief Move nodes out of high segments and release them.
+ *
+ * Segments are emptied from the top while the rest of the pool can hold
+ * every entry. Unlike the rest of the API this moves nodes, so node_t
+ * pointers (iterators) taken before the call are invalid after it.
+ *
+ * @param m Pointer to u32map_t.
+ * @return unsigned Number of segments released.
+ */
+static unsigned map_compact(u32map_t *m)
+{
+    unsigned released = 0;
+    while (m->nseg > 1 && m->used <= pool_capacity(m->nseg - 1))
+    {
+        unsigned top = m->nseg - 1;
+        node_t *slots = m->seg[top];
+        for (size_t i = 0; i < seg_nodes(top) && m->seg_live[top] > 0; ++i)
+        {
+            if (slots[i].in_use)
+                node_move(m, &slots[i]);
+        }
+        pool_release_top(m);
+        released++;
+    }
+    return released;
+}
+
+/* bulk load */
+
+/**
+ * @brief Take n nodes off the free list, filled from keys/values and linked through right.
+ *
+ * @param m Pointer to u32map_t.
+ * @param keys n keys.
+ * @param values n values, or NULL for all-NULL values.
+ * @param n Number of pairs (pool_reserve must have made room for them).
+ * @return node_t* First node of the list.
+ */
+static node_t *bulk_make_list(u32map_t *m, const uint32_t *keys, const fp_t *values, size_t n)
+{
+    node_t *head = NULL;
+    node_t **tail = &head;
+    for (size_t i = 0; i < n; ++i)
+    {
+        node_t *nd = node_alloc(m);
+        nd->key = keys[i];
+        nd->value = values ? values[i] : NULL;
+        *tail = nd;
+        tail = &nd->right;
+    }
+    return head;
+}
+
+/**
+ * @brief Stable merge sort of a right-linked static node list by key.
+ *
+ * @param head First node of the list.
+ * @param n Number of nodes.
+ * @return node_t* First node of the sorted list.
+ */
+static node_t *list_sort(node_t *head, size_t n)
+{
+    if (n < 2)
+        return head;
+    size_t nl = n / 2;
+    node_t *mid = head;
+    for (size_t i = 1; i < nl; ++i)
+        mid = mid->right;
+    node_t *b = mid->right;
+    mid->right = NULL;
+    node_t *a = list_sort(head, nl);
+    b = list_sort(b, n - nl);
+
+    node_t *out = NULL;
+    node_t **tail = &out;
+    while (a && b)
+    {
+        if (a->key <= b->key)
         {
-            m->root = child;
-            if (child)
-                child->parent = NULL;
+            *tail = a;
+            a = a->right;
         }
         else
         {
-            if (parent->left == n)
-                parent->left = child;
-            else
-                parent->right = child;
-            if (child)
-                child->parent = parent;
+            *tail = b;
+            b = b->right;
         }
-        node_free(m, n);
-        if (m->size > 0)
-            m->size--;
-        return parent;
+        tail = &(*tail)->right;
     }
+    *tail = a ? a : b;
+    return out;
 }
 
 /**
- * @brief Erase a key from the static map.
+ * @brief Build a balanced static subtree from the first count nodes of a sorted list.
  *
- * @param m Pointer to u32map_t.
- * @param key Key to erase.
- * @return int 1 if erased, 0 if not found.
+ * @param head In/out: next unconsumed list node.
+ * @param count Number of nodes in this subtree.
+ * @param parent Parent of the subtree root.
+ * @return node_t* Subtree root or NULL.
  */
-static int map_erase(u32map_t *m, uint32_t key)
+static node_t *build_from_list(node_t **head, size_t count, node_t *parent)
 {
-    node_t *n = find_node(m, key);
-    if (!n)
-        return 0;
-    node_t *p = erase_node(m, n);
-    while (p)
+    if (count == 0)
+        return NULL;
+    size_t nleft = count / 2;
+    node_t *left = build_from_list(head, nleft, NULL);
+    node_t *root = *head;
+    *head = root->right;
+    root->parent = parent;
+    root->left = left;
+    if (left)
+        left->parent = root;
+    root->right = build_from_list(head, count - nleft - 1, root);
+    update_height(root);
+    return root;
+}
+
+/**
+ * @brief Fill an empty static map from strictly ascending keys in O(n).
+ *
+ * @param m Pointer to an initialized, empty u32map_t.
+ * @param keys n keys in strictly ascending order.
+ * @param values n function pointers, or NULL.
+ * @param n Number of pairs.
+ * @return int 1 on success, 0 if keys are not strictly ascending,
+ *         -1 if the map is not empty or the pool cannot grow to n.
+ */
+static int map_from_sorted(u32map_t *m, const uint32_t *keys, const fp_t *values, size_t n)
+{
+    if (m->size != 0)
+        return -1;
+    for (size_t i = 1; i < n; ++i)
     {
-        node_t *old_p = p;
-        node_t *new_subroot = rebalance_at(m, p);
-        set_child(m, new_subroot->parent, old_p, new_subroot);
-        p = new_subroot->parent;
+        if (keys[i - 1] >= keys[i])
+            return 0;
     }
-    if (m->root && m->root->parent)
-        m->root->parent = NULL;
+    if (pool_reserve(m, n) < 0)
+        return -1;
+    node_t *head = bulk_make_list(m, keys, values, n);
+    m->root = build_from_list(&head, n, NULL);
+    m->size = n;
+    return 1;
+}
+
+/**
+ * @brief Fill an empty static map from keys in any order in O(n log n).
+ *
+ * Duplicates keep their first occurrence; the surplus nodes go back to the pool.
+ *
+ * @param m Pointer to an initialized, empty u32map_t.
+ * @param keys n keys in any order.
+ * @param values n function pointers, or NULL.
+ * @param n Number of pairs.
+ * @return int 1 on success, -1 if the map is not empty or the pool cannot grow to n.
+ */
+static int map_from_unsorted(u32map_t *m, const uint32_t *keys, const fp_t *values, size_t n)
+{
+    if (m->size != 0 || pool_reserve(m, n) < 0)
+        return -1;
+    node_t *head = list_sort(bulk_make_list(m, keys, values, n), n);
+    size_t count = 0;
+    for (node_t *cur = head; cur; cur = cur->right)
+    {
+        count++;
+        while (cur->right && cur->key == cur->right->key)
+        {
+            node_t *dup = cur->right;
+            cur->right = dup->right;
+            node_free(m, dup);
+        }
+    }
+    m->root = build_from_list(&head, count, NULL);
+    m->size = count;
     return 1;
 }
 
@@ -1472,6 +9295,224 @@ static node_t *map_next(node_t *it)
     }
 }
 
+/* order statistics: O(log n) with -DMAP_ORDER_STATS, an in-order walk without */
+
+/**
+ * @brief Return the number of keys less than key.
+ *
+ * @param m Pointer to u32map_t.
+ * @param key Key (need not be in the map).
+ * @return size_t Rank of key in [0, map_size(m)].
+ */
+static size_t map_rank(u32map_t *m, uint32_t key)
+{
+    size_t r = 0;
+#ifdef MAP_ORDER_STATS
+    for (node_t *cur = m->root; cur;)
+    {
+        if (key <= cur->key)
+            cur = cur->left;
+        else
+        {
+            r += node_count(cur->left) + 1;
+            cur = cur->right;
+        }
+    }
+#else
+    for (node_t *it = map_begin(m); it && it->key < key; it = map_next(it))
+        r++;
+#endif
+    return r;
+}
+
+/**
+ * @brief Return the node of the k-th smallest key (0-based); map_next continues in order.
+ *
+ * @param m Pointer to u32map_t.
+ * @param k Rank of the entry.
+ * @return node_t* Node or NULL if k >= map_size(m).
+ */
+static node_t *map_select(u32map_t *m, size_t k)
+{
+    if (k >= m->size)
+        return NULL;
+#ifdef MAP_ORDER_STATS
+    node_t *cur = m->root;
+    while (cur)
+    {
+        size_t l = node_count(cur->left);
+        if (k == l)
+            return cur;
+        if (k < l)
+            cur = cur->left;
+        else
+        {
+            k -= l + 1;
+            cur = cur->right;
+        }
+    }
+    return NULL;
+#else
+    node_t *it = map_begin(m);
+    while (it && k--)
+        it = map_next(it);
+    return it;
+#endif
+}
+
+/**
+ * @brief Count the keys with lo <= key < hi.
+ *
+ * @param m Pointer to u32map_t.
+ * @param lo Inclusive lower bound.
+ * @param hi Exclusive upper bound.
+ * @return size_t Number of keys in range (0 if hi <= lo).
+ */
+static size_t map_count_range(u32map_t *m, uint32_t lo, uint32_t hi)
+{
+    return hi > lo ? map_rank(m, hi) - map_rank(m, lo) : 0;
+}
+
+/* frozen table: the keys in Eytzinger order, no pointers */
+
+/* keys[1..n] in Eytzinger (BFS) order, slot i has children 2i and 2i + 1;
+   a lookup reads only keys[], 4 bytes per level against a 48-byte node_t */
+typedef struct
+{
+    uint32_t *keys; /* keys[0] unused */
+    fp_t *values;   /* values[i] belongs to keys[i] */
+    size_t n;
+} u32frozen_t;
+
+/**
+ * @brief Eytzinger slot of the smallest key, 0 if n == 0.
+ */
+static size_t eyt_first(size_t n)
+{
+    size_t i = n ? 1 : 0;
+    while (i && 2 * i <= n)
+        i *= 2;
+    return i;
+}
+
+/**
+ * @brief Eytzinger slot of the in-order successor of i, 0 past the last.
+ */
+static size_t eyt_next(size_t i, size_t n)
+{
+    if (2 * i + 1 <= n)
+    {
+        i = 2 * i + 1;
+        while (2 * i <= n)
+            i *= 2;
+        return i;
+    }
+    while (i & 1) /* climb while i is a right child */
+        i >>= 1;
+    return i >> 1;
+}
+
+/**
+ * @brief Move every entry of the static map into a frozen table.
+ *
+ * On success the map is destroyed (empty, pool released, still usable)
+ * and f owns two malloc'd arrays; on OOM both are left untouched.
+ *
+ * @param m Pointer to u32map_t.
+ * @param f Receives the frozen table; release with frozen_destroy.
+ * @return int 0 on success, -1 on OOM.
+ */
+static int map_freeze(u32map_t *m, u32frozen_t *f)
+{
+    size_t n = m->size;
+    uint32_t *keys = malloc((n + 1) * sizeof(uint32_t));
+    fp_t *values = malloc((n + 1) * sizeof(fp_t));
+    if (!keys || !values)
+    {
+        free(keys);
+        free(values);
+        return -1;
+    }
+    keys[0] = 0;
+    values[0] = NULL;
+    size_t i = eyt_first(n);
+    for (node_t *it = map_begin(m); it; it = map_next(it), i = eyt_next(i, n))
+    {
+        keys[i] = it->key;
+        values[i] = it->value;
+    }
+    f->keys = keys;
+    f->values = values;
+    f->n = n;
+    map_destroy(m);
+    return 0;
+}
+
+/**
+ * @brief Slot of the first frozen key >= key, or 0.
+ *
+ * The descent has no data-dependent branch and prefetches the 16 keys
+ * four levels down; the trailing right turns are undone at the end.
+ */
+static size_t frozen_lower_bound(const u32frozen_t *f, uint32_t key)
+{
+    const uint32_t *keys = f->keys;
+    size_t n = f->n;
+    size_t i = 1;
+    while (i <= n)
+    {
+        MAP_PREFETCH((const void *)((uintptr_t)keys + 64 * i)); /* slots 16i..16i+15 */
+        i = 2 * i + (keys[i] < key);
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    return i >> (__builtin_ctzll(~(unsigned long long)i) + 1);
+#else
+    while (i & 1)
+        i >>= 1;
+    return i >> 1;
+#endif
+}
+
+/**
+ * @brief Find a function pointer value by key in a frozen table.
+ *
+ * @param f Pointer to u32frozen_t.
+ * @param key Key to find.
+ * @return fp_t Function pointer stored or NULL if not found.
+ */
+static fp_t frozen_find(const u32frozen_t *f, uint32_t key)
+{
+    size_t i = frozen_lower_bound(f, key);
+    return i && f->keys[i] == key ? f->values[i] : NULL;
+}
+
+/**
+ * @brief Return iterator (slot) of the smallest key, 0 if the table is empty.
+ */
+static size_t frozen_begin(const u32frozen_t *f) { return eyt_first(f->n); }
+
+/**
+ * @brief Return the next slot in key order, 0 past the largest key.
+ */
+static size_t frozen_next(const u32frozen_t *f, size_t it) { return it ? eyt_next(it, f->n) : 0; }
+
+/**
+ * @brief Return number of entries in a frozen table.
+ */
+static size_t frozen_size(const u32frozen_t *f) { return f->n; }
+
+/**
+ * @brief Free the arrays of a frozen table and leave it empty.
+ */
+static void frozen_destroy(u32frozen_t *f)
+{
+    free(f->keys);
+    free(f->values);
+    f->keys = NULL;
+    f->values = NULL;
+    f->n = 0;
+}
+
 /* sample functions */
 
 /**
@@ -1484,11 +9525,338 @@ static void say_hello(void) { puts("hello"); }
  */
 static void say_goodbye(void) { puts("goodbye"); }
 
+#ifdef MAP_BENCH
+/* ---- pool occupancy benchmark ---- */
+
+/**
+ * @brief Reference copy of the former allocator's linear slot search.
+ *
+ * Used only by the benchmark to show what every allocation used to cost
+ * before the free list: a scan for the first slot with in_use == 0.
+ *
+ * @param m Pointer to u32map_t.
+ * @return int Index of the first free slot or -1 if the pool is full.
+ */
+static int bench_linear_scan(u32map_t *m)
+{
+    for (int i = 0; i < MAX_NODES; ++i)
+    {
+        if (!m->pool[i].in_use)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Measure insert throughput at a given pool occupancy.
+ *
+ * Fills the pool to the requested percentage, then repeatedly inserts and
+ * erases one extra key so the occupancy stays constant. When linear is
+ * non-zero the former O(MAX_NODES) slot search is added to every insert.
+ *
+ * @param percent Target occupancy in percent of MAX_NODES.
+ * @param linear Non-zero to include the linear slot search.
+ * @return double Nanoseconds per insert/erase pair.
+ */
+static double bench_occupancy(int percent, int linear)
+{
+    static u32map_t bm;
+    const long reps = MAX_NODES <= 256 ? 2000000 : 512000000L / MAX_NODES; /* the scan is O(MAX_NODES) */
+    volatile int sink = 0;
+    int fill = MAX_NODES * percent / 100;
+
+    if (fill >= MAX_NODES)
+        fill = MAX_NODES - 1; /* keep one slot for the probe key */
+    map_init(&bm);
+    for (int i = 0; i < fill; ++i)
+        map_insert(&bm, (uint32_t)i * 2u, say_hello);
+
+    clock_t t0 = clock();
+    for (long r = 0; r < reps; ++r)
+    {
+        if (linear)
+            sink += bench_linear_scan(&bm);
+        map_insert(&bm, (uint32_t)fill, say_hello);
+        map_erase(&bm, (uint32_t)fill);
+    }
+    clock_t t1 = clock();
+    (void)sink;
+    return (double)(t1 - t0) / CLOCKS_PER_SEC * 1e9 / (double)reps;
+}
+
+/**
+ * @brief Print insert cost at 10%, 50% and 99% occupancy, before and after.
+ */
+static void bench_pool(void)
+{
+    static const int pct[] = {10, 50, 99};
+    printf("pool occupancy benchmark (MAX_NODES=%d, ns per insert+erase):\n", MAX_NODES);
+    printf("  %-9s %14s %10s\n", "occupancy", "linear scan", "free list");
+    for (size_t i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i)
+    {
+        double before = bench_occupancy(pct[i], 1);
+        double after = bench_occupancy(pct[i], 0);
+        printf("  %8d%% %14.1f %10.1f\n", pct[i], before, after);
+    }
+}
+
+/* ---- workload suite: same workloads and CSV columns as the generic map ---- */
+
+#ifndef MAP_BENCH_MIN_N
+#define MAP_BENCH_MIN_N 1000
+#endif
+#ifndef MAP_BENCH_MAX_N
+#define MAP_BENCH_MAX_N 1000000
+#endif
+#ifndef MAP_BENCH_MIN_OPS
+#define MAP_BENCH_MIN_OPS 1000000 /* lookup/mixed/iterate rows repeat to at least this */
+#endif
+#define MAP_BENCH_SEED 0x2545F4914F6CDD1Dull
+#define MAP_BENCH_ZIPF_THETA 0.99
+
+/**
+ * @brief Advance a xorshift64 state and return it.
+ */
+static uint64_t bench_rand(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* Zipf(theta) over ranks [0, n), rank 0 the most popular (Gray et al.) */
+typedef struct bench_zipf
+{
+    size_t n;
+    double zetan, alpha, eta, half_pow;
+} bench_zipf_t;
+
+/**
+ * @brief Precompute the Zipf constants for n ranks.
+ */
+static void bench_zipf_init(bench_zipf_t *z, size_t n)
+{
+    double zetan = 0.0;
+    for (size_t i = 1; i <= n; ++i)
+        zetan += pow((double)i, -MAP_BENCH_ZIPF_THETA);
+    z->n = n;
+    z->zetan = zetan;
+    z->half_pow = pow(0.5, MAP_BENCH_ZIPF_THETA);
+    z->alpha = 1.0 / (1.0 - MAP_BENCH_ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - MAP_BENCH_ZIPF_THETA)) / (1.0 - (1.0 + z->half_pow) / zetan);
+}
+
+/**
+ * @brief Draw one Zipf-distributed rank.
+ */
+static size_t bench_zipf_next(const bench_zipf_t *z, uint64_t *x)
+{
+    double u = (double)(bench_rand(x) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + z->half_pow)
+        return 1;
+    size_t r = (size_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+/**
+ * @brief Write one CSV row; allocs counts pool segments added by the workload.
+ */
+static void bench_row(FILE *out, const char *impl, const char *workload, size_t n, size_t ops, clock_t t0,
+                      size_t allocs)
+{
+    struct rusage ru;
+    double secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+    fprintf(out, "%s,%s,%zu,%.1f,%zu,%ld\n", impl, workload, n, ops ? secs * 1e9 / (double)ops : 0.0,
+            allocs, getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1L);
+}
+
+/**
+ * @brief Run every workload against the pool map at size n.
+ *
+ * The loaded set is the even keys of [0, 2n), inserted in ord order; odd
+ * keys are misses.
+ */
+static void bench_suite_pool(FILE *out, const uint32_t *ord, const bench_zipf_t *z, size_t n)
+{
+    static u32map_t bm;
+    uint64_t x = MAP_BENCH_SEED;
+    size_t ops = n < MAP_BENCH_MIN_OPS ? MAP_BENCH_MIN_OPS : n;
+    volatile size_t sink = 0;
+    size_t g0 = 0;
+    clock_t t0;
+
+    map_init(&bm);
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(&bm, (uint32_t)(2 * i), say_hello);
+    bench_row(out, "u32map_pool", "seq_insert", n, n, t0, bm.grows - g0);
+    map_destroy(&bm);
+
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(&bm, ord[i], say_hello);
+    bench_row(out, "u32map_pool", "rand_insert", n, n, t0, bm.grows - g0);
+
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_find(&bm, (uint32_t)(2 * (bench_rand(&x) % n))) == NULL;
+    bench_row(out, "u32map_pool", "find_hit", n, ops, t0, bm.grows - g0);
+
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_find(&bm, (uint32_t)(2 * (bench_rand(&x) % n) + 1)) == NULL;
+    bench_row(out, "u32map_pool", "find_miss", n, ops, t0, bm.grows - g0);
+
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_rank(&bm, (uint32_t)(bench_rand(&x) % (2 * n)));
+    bench_row(out, "u32map_pool", "rank", n, ops, t0, bm.grows - g0);
+
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+        sink += map_select(&bm, (size_t)(bench_rand(&x) % n)) == NULL;
+    bench_row(out, "u32map_pool", "select", n, ops, t0, bm.grows - g0);
+
+    g0 = bm.grows;
+    t0 = clock();
+    size_t seen = 0;
+    while (seen < ops)
+        for (node_t *it = map_begin(&bm); it; it = map_next(it), ++seen)
+            sink += it->key;
+    bench_row(out, "u32map_pool", "iterate", n, seen, t0, bm.grows - g0);
+
+    /* 90% find / 10% insert-or-assign over [0, 2n) */
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        uint32_t k = (uint32_t)(r % (2 * n));
+        if ((r >> 40) % 10 == 0)
+            map_put(&bm, k, say_goodbye);
+        else
+            sink += map_find(&bm, k) == NULL;
+    }
+    bench_row(out, "u32map_pool", "mixed", n, ops, t0, bm.grows - g0);
+
+    /* 75% erase / 25% insert over [0, 2n) */
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t r = bench_rand(&x);
+        uint32_t k = (uint32_t)(r % (2 * n));
+        if ((r >> 40) % 4 == 0)
+            map_insert(&bm, k, say_hello);
+        else
+            map_erase(&bm, k);
+    }
+    bench_row(out, "u32map_pool", "erase_heavy", n, ops, t0, bm.grows - g0);
+    map_destroy(&bm);
+
+    /* the loaded set again, frozen; same hit/miss keys as above */
+    u32frozen_t fz;
+    for (size_t i = 0; i < n; ++i)
+        map_insert(&bm, ord[i], say_hello);
+    t0 = clock();
+    if (map_freeze(&bm, &fz) == 0)
+    {
+        bench_row(out, "u32map_frozen", "freeze", n, n, t0, 0);
+        t0 = clock();
+        for (size_t i = 0; i < ops; ++i)
+            sink += frozen_find(&fz, (uint32_t)(2 * (bench_rand(&x) % n))) == NULL;
+        bench_row(out, "u32map_frozen", "find_hit", n, ops, t0, 0);
+        t0 = clock();
+        for (size_t i = 0; i < ops; ++i)
+            sink += frozen_find(&fz, (uint32_t)(2 * (bench_rand(&x) % n) + 1)) == NULL;
+        bench_row(out, "u32map_frozen", "find_miss", n, ops, t0, 0);
+        t0 = clock();
+        seen = 0;
+        while (seen < ops)
+            for (size_t it = frozen_begin(&fz); it; it = frozen_next(&fz, it), ++seen)
+                sink += fz.keys[it];
+        bench_row(out, "u32map_frozen", "iterate", n, seen, t0, 0);
+        frozen_destroy(&fz);
+    }
+    map_destroy(&bm);
+
+    /* n insert attempts of Zipf-popular keys; repeats are rejected */
+    g0 = bm.grows;
+    t0 = clock();
+    for (size_t i = 0; i < n; ++i)
+        map_insert(&bm, ord[bench_zipf_next(z, &x)], say_hello);
+    bench_row(out, "u32map_pool", "zipf_insert", n, n, t0, bm.grows - g0);
+    map_destroy(&bm);
+    (void)sink;
+}
+
+/**
+ * @brief Run the workload suite for sizes MAP_BENCH_MIN_N..MAP_BENCH_MAX_N (x10 steps).
+ *
+ * Sizes past MAX_NODES run on grown segments. Rows go to $MAP_BENCH_CSV
+ * (appended) or stdout.
+ */
+static void bench_suite(void)
+{
+    const char *path = getenv("MAP_BENCH_CSV");
+    FILE *out = path ? fopen(path, "a") : stdout;
+    if (!out)
+        return;
+    if (!path || (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0))
+        fprintf(out, "impl,workload,n,ns_per_op,allocs,peak_rss_kb\n");
+    for (size_t n = MAP_BENCH_MIN_N; n <= MAP_BENCH_MAX_N; n *= 10)
+    {
+        uint32_t *ord = malloc(n * sizeof(uint32_t));
+        if (!ord)
+            break;
+        for (size_t i = 0; i < n; ++i)
+            ord[i] = (uint32_t)(2 * i);
+        uint64_t x = MAP_BENCH_SEED ^ n;
+        for (size_t i = n - 1; i > 0; --i)
+        {
+            size_t j = (size_t)(bench_rand(&x) % (i + 1));
+            uint32_t t = ord[i];
+            ord[i] = ord[j];
+            ord[j] = t;
+        }
+        bench_zipf_t z;
+        bench_zipf_init(&z, n);
+        bench_suite_pool(out, ord, &z, n);
+        fflush(out);
+        free(ord);
+    }
+    if (out != stdout)
+        fclose(out);
+}
+#endif
+
 int main(void)
 {
-    u32map_t map;
+    static u32map_t map; /* static: the inline segment may be large */
     map_init(&map);
 
+    /* fixed command table: build balanced in one pass, then reset */
+    static const uint32_t cmd_ids[] = {1, 2, 3, 5, 8, 13};
+    map_from_sorted(&map, cmd_ids, NULL, sizeof(cmd_ids) / sizeof(cmd_ids[0]));
+    printf("bulk loaded %zu commands, root key %" PRIu32 "\n", map_size(&map), map.root->key);
+    map_destroy(&map);
+
+    /* the same ids in any order, one repeated: sorted and de-duplicated first */
+    static const uint32_t cmd_any[] = {8, 1, 13, 3, 2, 5, 8};
+    map_from_unsorted(&map, cmd_any, NULL, sizeof(cmd_any) / sizeof(cmd_any[0]));
+    printf("unsorted load: %zu commands, root key %" PRIu32 "\n", map_size(&map), map.root->key);
+    map_destroy(&map);
+
     /* insert two entries */
     if (map_insert(&map, 10, say_hello) < 0)
     {
@@ -1508,6 +9876,13 @@ int main(void)
     if (f)
         f();
 
+    /* several lookups in one pass, their cache misses overlapped */
+    static const uint32_t want[] = {20, 15, 10};
+    fp_t got[sizeof(want) / sizeof(want[0])];
+    size_t hits = map_find_many(&map, want, sizeof(want) / sizeof(want[0]), got);
+    printf("find_many: %zu of %zu found, 15 -> %s\n", hits, sizeof(want) / sizeof(want[0]),
+           got[1] ? "found" : "(null)");
+
     /* iterate in order and call each function */
     printf("in-order traversal (key -> call value):\n");
     for (node_t *it = map_begin(&map); it != NULL; it = map_next(it))
@@ -1523,5 +9898,49 @@ int main(void)
     map_erase(&map, 20);
     printf("after erase 20, size=%zu\n", map_size(&map));
 
+    /* grow past the inline segment, then thin out and compact */
+    for (uint32_t k = 100; k < 100 + 4 * MAX_NODES; ++k)
+    {
+        if (map_insert(&map, k, say_hello) < 0)
+        {
+            puts("pool full");
+            return 1;
+        }
+    }
+    printf("grown to %zu entries in %u segments\n", map_size(&map), map.nseg);
+    for (uint32_t k = 100; k < 100 + 4 * MAX_NODES; ++k)
+    {
+        if (k % 8 != 0)
+            map_erase(&map, k);
+    }
+    unsigned released = map_compact(&map);
+    printf("after erasing 7/8: %zu entries, compact released %u, %u segment(s) left\n",
+           map_size(&map), released, map.nseg);
+
+    /* order statistics: O(log n) each when built with -DMAP_ORDER_STATS */
+    node_t *tenth = map_select(&map, 10);
+    printf("rank of 500: %zu, 11th key: %" PRIu32 ", keys in [200, 600): %zu\n", map_rank(&map, 500),
+           tenth ? tenth->key : 0, map_count_range(&map, 200, 600));
+
+    /* the command table is fixed from here on: freeze it */
+    u32frozen_t table;
+    if (map_freeze(&map, &table) == 0)
+    {
+        fp_t g = frozen_find(&table, 104);
+        printf("frozen %zu entries (map now %zu), find 104: %s, find 105: %s, first keys:",
+               frozen_size(&table), map_size(&map), g ? "found" : "(null)",
+               frozen_find(&table, 105) ? "found" : "(null)");
+        size_t it = frozen_begin(&table);
+        for (int shown = 0; it && shown < 4; it = frozen_next(&table, it), ++shown)
+            printf(" %" PRIu32, table.keys[it]);
+        printf("\n");
+        frozen_destroy(&table);
+    }
+    map_destroy(&map);
+
+#ifdef MAP_BENCH
+    bench_pool();
+    bench_suite();
+#endif
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,48 @@
+/*
+  Sine by Taylor series.
+
+    - my_sin: one double at a time, the series summed to x^19
+    - my_sin_batch / my_sinf_batch: sine of a whole buffer. Each lane
+      reduces x to r = x - k*pi with |r| <= pi/2 (three-part Cody-Waite
+      constants), evaluates a fixed odd polynomial in r by Horner's rule
+      and flips the sign for odd k; there are no branches within a block,
+      so AVX2, SSE2 or NEON lanes run it side by side and the scalar tail
+      uses the same steps. The lanes' domain is |x| < 1e9 (double) and
+      |x| < 8192 (float): a block with any lane outside it goes through
+      my_sin_acc(x, SIN_ACC_FULL) element by element. Inside it the error
+      is within 2.5 ulp (double; under 2 with FMA) and 1.5e-7 (float), as
+      the SIN_ULP mode checks. NaN and infinities give NaN, -0.0 gives -0.0.
+    - my_sin_acc / my_cos_acc: sin and cos at a chosen accuracy level for
+      any double. x is reduced to |r| <= pi/4 and a quadrant (Cody-Waite
+      below 2^19, Payne-Hanek with exact integer arithmetic above), then
+      the quadrant picks the sin or cos kernel of the level: 3-term or
+      4-term minimax polynomials for 1e-4 and 1e-7 budgets, or the fdlibm
+      kernels for < 1 ulp. The SIN_ULP mode checks every level against
+      long double sinl/cosl and exits 1 if one misses its bound.
+    - my_sin_tab / my_sincos: table lookup for modest precision. An L1-sized
+      table of sin (SIN_TABLE_BITS, 1024 doubles by default) filled once by
+      my_sin_table_init, read with linear interpolation (~5e-6) or at the
+      nearest entry with a cubic angle-addition step (~4e-12); my_sincos
+      returns both values from one reduction.
+
+  Compile:
+      gcc -std=c99 -O2 my_sine.c -o my_sine -lm
+      gcc -std=c99 -O2 -mavx2 -mfma my_sine.c -o my_sine -lm     (AVX2 lanes)
+      gcc -std=c99 -O2 -DSIN_BENCH my_sine.c -o sin_bench -lm    (benchmark)
+      gcc -std=c99 -O2 -DSIN_ULP my_sine.c -o sin_ulp -lm        (error harness)
+*/
+
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define PI 3.141592653589793
 
@@ -18,9 +61,1026 @@ double my_sin(double x)
     return result;
 }
 
+// Batch evaluation
+
+#define INV_PI 0.3183098861837907
+#define ROUND_D 6755399441055744.0 // 1.5 * 2^52: t = x + ROUND_D rounds x to an integer in t's low bits
+#define ROUND_F 12582912.0f        // 1.5 * 2^23
+
+// pi split so that k * PI_A and k * PI_B are exact for the k that occur
+#define PI_A 3.141592502593994
+#define PI_B 1.5099578831723193e-07
+#define PI_C 1.0780605716316238e-14
+#define PI_AF 3.140625f
+#define PI_BF 9.67502593994140625e-4f
+#define PI_CF 1.509957990978376432e-7f
+
+// sin(r) = r + r^3 * P(r^2): Taylor coefficients 1/3! .. 1/21!, highest first
+#define SIN_DEG 10
+static const double sin_coef[SIN_DEG] = {
+    1.9572941063391263e-20, -8.22063524662433e-18, 2.8114572543455206e-15, -7.647163731819816e-13,
+    1.6059043836821613e-10, -2.505210838544172e-08, 2.7557319223985893e-06, -0.0001984126984126984,
+    0.008333333333333333, -0.16666666666666666};
+
+// float: 1/3! .. 1/13!
+#define SINF_DEG 6
+static const float sinf_coef[SINF_DEG] = {
+    1.605904384e-10f, -2.505210839e-08f, 2.755731922e-06f, -1.984126984e-04f, 8.333333333e-03f, -1.666666667e-01f};
+
+// Hard domain of the lane steps: past it k * PI_A is no longer exact and the
+// reduction falls apart, so larger |x| and infinities take the scalar path
+#define SIN_BATCH_MAX 1e9
+#define SINF_BATCH_MAX 8192.0f
+#define SIGN_D 0x8000000000000000ull
+#define SIGN_F 0x80000000u
+
+static double sin_wide(double x); // my_sin_acc(x, SIN_ACC_FULL), defined after it
+
+// One lane of my_sin_batch; the vector loops below do exactly these steps
+static double sin_lane(double x)
+{
+    if (fabs(x) >= SIN_BATCH_MAX)
+        return sin_wide(x);
+    double t = x * INV_PI + ROUND_D;
+    double k = t - ROUND_D;
+    double r = x - k * PI_A;
+    r -= k * PI_B;
+    r -= k * PI_C;
+    double r2 = r * r;
+    double p = sin_coef[0];
+    for (int i = 1; i < SIN_DEG; ++i)
+        p = p * r2 + sin_coef[i];
+    double y = r + r * r2 * p;
+    uint64_t tb, yb, rb;
+    memcpy(&tb, &t, sizeof(tb));
+    memcpy(&yb, &y, sizeof(yb));
+    memcpy(&rb, &r, sizeof(rb));
+    yb = (yb & ~SIGN_D) | (rb & SIGN_D); // sin(r) has the sign of r; the sum loses it for r = -0.0
+    yb ^= tb << 63;                      // odd k: sin(x) = -sin(r)
+    memcpy(&y, &yb, sizeof(y));
+    return y;
+}
+
+static float sinf_lane(float x)
+{
+    if (fabsf(x) >= SINF_BATCH_MAX)
+        return (float)sin_wide(x);
+    float t = x * (float)INV_PI + ROUND_F;
+    float k = t - ROUND_F;
+    float r = x - k * PI_AF;
+    r -= k * PI_BF;
+    r -= k * PI_CF;
+    float r2 = r * r;
+    float p = sinf_coef[0];
+    for (int i = 1; i < SINF_DEG; ++i)
+        p = p * r2 + sinf_coef[i];
+    float y = r + r * r2 * p;
+    uint32_t tb, yb, rb;
+    memcpy(&tb, &t, sizeof(tb));
+    memcpy(&yb, &y, sizeof(yb));
+    memcpy(&rb, &r, sizeof(rb));
+    yb = (yb & ~SIGN_F) | (rb & SIGN_F);
+    yb ^= tb << 31;
+    memcpy(&y, &yb, sizeof(y));
+    return y;
+}
+
+#if defined(__AVX2__)
+#ifdef __FMA__
+#define MADD_PD(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define MADD_PS(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define NMADD_PD(a, b, c) _mm256_fnmadd_pd(a, b, c)
+#define NMADD_PS(a, b, c) _mm256_fnmadd_ps(a, b, c)
+#else
+#define MADD_PD(a, b, c) _mm256_add_pd(_mm256_mul_pd(a, b), c)
+#define MADD_PS(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#define NMADD_PD(a, b, c) _mm256_sub_pd(c, _mm256_mul_pd(a, b))
+#define NMADD_PS(a, b, c) _mm256_sub_ps(c, _mm256_mul_ps(a, b))
+#endif
+
+// sine of 4 doubles in[0..3]; returns 0 and stores nothing if a lane is
+// outside the domain (NaN stays in the lanes and gives NaN)
+static int sin_vec(const double *in, double *out)
+{
+    __m256d x = _mm256_loadu_pd(in);
+    __m256d sgn = _mm256_set1_pd(-0.0);
+    if (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(sgn, x), _mm256_set1_pd(SIN_BATCH_MAX), _CMP_GE_OQ)))
+        return 0;
+    __m256d t = MADD_PD(x, _mm256_set1_pd(INV_PI), _mm256_set1_pd(ROUND_D));
+    __m256d k = _mm256_sub_pd(t, _mm256_set1_pd(ROUND_D));
+    __m256d r = NMADD_PD(k, _mm256_set1_pd(PI_A), x);
+    r = NMADD_PD(k, _mm256_set1_pd(PI_B), r);
+    r = NMADD_PD(k, _mm256_set1_pd(PI_C), r);
+    __m256d r2 = _mm256_mul_pd(r, r);
+    __m256d p = _mm256_set1_pd(sin_coef[0]);
+    for (int i = 1; i < SIN_DEG; ++i)
+        p = MADD_PD(p, r2, _mm256_set1_pd(sin_coef[i]));
+    __m256d y = MADD_PD(_mm256_mul_pd(r, r2), p, r);
+    y = _mm256_or_pd(_mm256_andnot_pd(sgn, y), _mm256_and_pd(sgn, r));
+    __m256d sign = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(t), 63));
+    _mm256_storeu_pd(out, _mm256_xor_pd(y, sign));
+    return 1;
+}
+#define SIN_LANES 4
+
+// sine of 8 floats in[0..7]
+static int sinf_vec(const float *in, float *out)
+{
+    __m256 x = _mm256_loadu_ps(in);
+    __m256 sgn = _mm256_set1_ps(-0.0f);
+    if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sgn, x), _mm256_set1_ps(SINF_BATCH_MAX), _CMP_GE_OQ)))
+        return 0;
+    __m256 t = MADD_PS(x, _mm256_set1_ps((float)INV_PI), _mm256_set1_ps(ROUND_F));
+    __m256 k = _mm256_sub_ps(t, _mm256_set1_ps(ROUND_F));
+    __m256 r = NMADD_PS(k, _mm256_set1_ps(PI_AF), x);
+    r = NMADD_PS(k, _mm256_set1_ps(PI_BF), r);
+    r = NMADD_PS(k, _mm256_set1_ps(PI_CF), r);
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 p = _mm256_set1_ps(sinf_coef[0]);
+    for (int i = 1; i < SINF_DEG; ++i)
+        p = MADD_PS(p, r2, _mm256_set1_ps(sinf_coef[i]));
+    __m256 y = MADD_PS(_mm256_mul_ps(r, r2), p, r);
+    y = _mm256_or_ps(_mm256_andnot_ps(sgn, y), _mm256_and_ps(sgn, r));
+    __m256 sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_castps_si256(t), 31));
+    _mm256_storeu_ps(out, _mm256_xor_ps(y, sign));
+    return 1;
+}
+#define SINF_LANES 8
+
+#elif defined(__SSE2__)
+
+// sine of 2 doubles in[0..1]; returns 0 and stores nothing if a lane is
+// outside the domain
+static int sin_vec(const double *in, double *out)
+{
+    __m128d x = _mm_loadu_pd(in);
+    __m128d sgn = _mm_set1_pd(-0.0);
+    if (_mm_movemask_pd(_mm_cmpge_pd(_mm_andnot_pd(sgn, x), _mm_set1_pd(SIN_BATCH_MAX))))
+        return 0;
+    __m128d t = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(INV_PI)), _mm_set1_pd(ROUND_D));
+    __m128d k = _mm_sub_pd(t, _mm_set1_pd(ROUND_D));
+    __m128d r = _mm_sub_pd(x, _mm_mul_pd(k, _mm_set1_pd(PI_A)));
+    r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(PI_B)));
+    r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(PI_C)));
+    __m128d r2 = _mm_mul_pd(r, r);
+    __m128d p = _mm_set1_pd(sin_coef[0]);
+    for (int i = 1; i < SIN_DEG; ++i)
+        p = _mm_add_pd(_mm_mul_pd(p, r2), _mm_set1_pd(sin_coef[i]));
+    __m128d y = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(r, r2), p));
+    y = _mm_or_pd(_mm_andnot_pd(sgn, y), _mm_and_pd(sgn, r));
+    __m128d sign = _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(t), 63));
+    _mm_storeu_pd(out, _mm_xor_pd(y, sign));
+    return 1;
+}
+#define SIN_LANES 2
+
+// sine of 4 floats in[0..3]
+static int sinf_vec(const float *in, float *out)
+{
+    __m128 x = _mm_loadu_ps(in);
+    __m128 sgn = _mm_set1_ps(-0.0f);
+    if (_mm_movemask_ps(_mm_cmpge_ps(_mm_andnot_ps(sgn, x), _mm_set1_ps(SINF_BATCH_MAX))))
+        return 0;
+    __m128 t = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps((float)INV_PI)), _mm_set1_ps(ROUND_F));
+    __m128 k = _mm_sub_ps(t, _mm_set1_ps(ROUND_F));
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(PI_AF)));
+    r = _mm_sub_ps(r, _mm_mul_ps(k, _mm_set1_ps(PI_BF)));
+    r = _mm_sub_ps(r, _mm_mul_ps(k, _mm_set1_ps(PI_CF)));
+    __m128 r2 = _mm_mul_ps(r, r);
+    __m128 p = _mm_set1_ps(sinf_coef[0]);
+    for (int i = 1; i < SINF_DEG; ++i)
+        p = _mm_add_ps(_mm_mul_ps(p, r2), _mm_set1_ps(sinf_coef[i]));
+    __m128 y = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), p));
+    y = _mm_or_ps(_mm_andnot_ps(sgn, y), _mm_and_ps(sgn, r));
+    __m128 sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(t), 31));
+    _mm_storeu_ps(out, _mm_xor_ps(y, sign));
+    return 1;
+}
+#define SINF_LANES 4
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+// sine of 2 doubles in[0..1]; returns 0 and stores nothing if a lane is
+// outside the domain
+static int sin_vec(const double *in, double *out)
+{
+    float64x2_t x = vld1q_f64(in);
+    if (vmaxvq_u32(vreinterpretq_u32_u64(vcageq_f64(x, vdupq_n_f64(SIN_BATCH_MAX)))))
+        return 0;
+    float64x2_t t = vfmaq_f64(vdupq_n_f64(ROUND_D), x, vdupq_n_f64(INV_PI));
+    float64x2_t k = vsubq_f64(t, vdupq_n_f64(ROUND_D));
+    float64x2_t r = vfmsq_f64(x, k, vdupq_n_f64(PI_A));
+    r = vfmsq_f64(r, k, vdupq_n_f64(PI_B));
+    r = vfmsq_f64(r, k, vdupq_n_f64(PI_C));
+    float64x2_t r2 = vmulq_f64(r, r);
+    float64x2_t p = vdupq_n_f64(sin_coef[0]);
+    for (int i = 1; i < SIN_DEG; ++i)
+        p = vfmaq_f64(vdupq_n_f64(sin_coef[i]), p, r2);
+    float64x2_t y = vfmaq_f64(r, vmulq_f64(r, r2), p);
+    y = vbslq_f64(vdupq_n_u64(SIGN_D), r, y);
+    uint64x2_t sign = vshlq_n_u64(vreinterpretq_u64_f64(t), 63);
+    vst1q_f64(out, vreinterpretq_f64_u64(veorq_u64(vreinterpretq_u64_f64(y), sign)));
+    return 1;
+}
+#define SIN_LANES 2
+
+// sine of 4 floats in[0..3]
+static int sinf_vec(const float *in, float *out)
+{
+    float32x4_t x = vld1q_f32(in);
+    if (vmaxvq_u32(vcageq_f32(x, vdupq_n_f32(SINF_BATCH_MAX))))
+        return 0;
+    float32x4_t t = vfmaq_f32(vdupq_n_f32(ROUND_F), x, vdupq_n_f32((float)INV_PI));
+    float32x4_t k = vsubq_f32(t, vdupq_n_f32(ROUND_F));
+    float32x4_t r = vfmsq_f32(x, k, vdupq_n_f32(PI_AF));
+    r = vfmsq_f32(r, k, vdupq_n_f32(PI_BF));
+    r = vfmsq_f32(r, k, vdupq_n_f32(PI_CF));
+    float32x4_t r2 = vmulq_f32(r, r);
+    float32x4_t p = vdupq_n_f32(sinf_coef[0]);
+    for (int i = 1; i < SINF_DEG; ++i)
+        p = vfmaq_f32(vdupq_n_f32(sinf_coef[i]), p, r2);
+    float32x4_t y = vfmaq_f32(r, vmulq_f32(r, r2), p);
+    y = vbslq_f32(vdupq_n_u32(SIGN_F), r, y);
+    uint32x4_t sign = vshlq_n_u32(vreinterpretq_u32_f32(t), 31);
+    vst1q_f32(out, vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(y), sign)));
+    return 1;
+}
+#define SINF_LANES 4
+
+#else
+#define SIN_LANES 1
+#define SINF_LANES 1
+#endif
+
+// out[i] = sin(in[i]) for i < n; in and out may be the same buffer
+void my_sin_batch(const double *in, double *out, size_t n)
+{
+    size_t i = 0;
+#if SIN_LANES > 1
+    for (; i + SIN_LANES <= n; i += SIN_LANES)
+        if (!sin_vec(in + i, out + i))
+            for (size_t j = i; j < i + SIN_LANES; ++j)
+                out[j] = sin_lane(in[j]);
+#endif
+    for (; i < n; ++i)
+        out[i] = sin_lane(in[i]);
+}
+
+// float variant of my_sin_batch
+void my_sinf_batch(const float *in, float *out, size_t n)
+{
+    size_t i = 0;
+#if SINF_LANES > 1
+    for (; i + SINF_LANES <= n; i += SINF_LANES)
+        if (!sinf_vec(in + i, out + i))
+            for (size_t j = i; j < i + SINF_LANES; ++j)
+                out[j] = sinf_lane(in[j]);
+#endif
+    for (; i < n; ++i)
+        out[i] = sinf_lane(in[i]);
+}
+
+// Accuracy-selectable sin/cos
+//
+// x is reduced to r = x - n*pi/2 with |r| <= pi/4 (held as y[0] + y[1]) and
+// the quadrant n & 3 picks sin(r), cos(r), -sin(r) or -cos(r). The reduction
+// is good far past double precision at every finite x, so the error bound of
+// a level holds over the whole double range, not just near zero.
+
+typedef enum
+{
+    SIN_ACC_1E4,  // |error| < 1e-4: 3-term minimax kernels
+    SIN_ACC_1E7,  // |error| < 1e-7: 4-term minimax kernels
+    SIN_ACC_FULL, // < 1 ulp: fdlibm kernels, using the low part y[1]
+} sin_acc_t;
+
+#define PIO4 0.7853981633974483
+#define INVPIO2 6.36619772367581382433e-01
+// pi/2 in 33-bit pieces: n * PIO2_k is exact for n < 2^20 (fdlibm)
+#define PIO2_1 1.57079632673412561417e+00  // 0x3FF921FB54400000
+#define PIO2_1T 6.07710050650619224932e-11 // pi/2 - PIO2_1
+#define PIO2_2 6.07710050630396597660e-11  // 0x3DD0B4611A600000
+#define PIO2_2T 2.02226624879595063154e-21 // pi/2 - PIO2_1 - PIO2_2
+#define PIO2_3 2.02226624871116645580e-21  // 0x3BA3198A2E000000
+#define PIO2_3T 8.47842766036889956997e-32 // pi/2 - PIO2_1 - PIO2_2 - PIO2_3
+#define CODY_WAITE_MAX 524288.0            // 2^19: Payne-Hanek from here on
+
+// Bits of 2/pi = 0.b1 b2 b3 ..., 32 per word, first word first; enough for
+// the largest double exponent
+static const uint32_t two_over_pi[40] = {
+    0xA2F9836E, 0x4E441529, 0xFC2757D1, 0xF534DDC0, 0xDB629599, 0x3C439041, 0xFE5163AB, 0xDEBBC561,
+    0xB7246E3A, 0x424DD2E0, 0x06492EEA, 0x09D1921C, 0xFE1DEB1C, 0xB129A73E, 0xE88235F5, 0x2EBB4484,
+    0xE99C7026, 0xB45F7E41, 0x3991D639, 0x835339F4, 0x9C845F8B, 0xBDF9283B, 0x1FF897FF, 0xDE05980F,
+    0xEF2F118B, 0x5A0A6D1F, 0x6D367ECF, 0x27CB09B7, 0x4F463F66, 0x9E5FEA2D, 0x7527BAC7, 0xEBE5F17B,
+    0x3D0739F7, 0x8A5292EA, 0x6BFB5FB1, 0x1F8D5D08, 0x56033046, 0xFC7B6BAB, 0xF0CFBC20, 0x9AF4361D};
+
+// floor(pi/2 * 2^127), least significant limb first
+static const uint32_t pio2_fixed[4] = {0x80DC1CD1, 0xC4C6628B, 0x2168C234, 0xC90FDAA2};
+
+// out[0 .. na+nb) = a * b; limbs least significant first
+static void mul_limbs(const uint32_t *a, int na, const uint32_t *b, int nb, uint32_t *out)
+{
+    memset(out, 0, (size_t)(na + nb) * sizeof(uint32_t));
+    for (int i = 0; i < na; ++i)
+    {
+        uint64_t carry = 0;
+        for (int j = 0; j < nb; ++j)
+        {
+            uint64_t t = (uint64_t)a[i] * b[j] + out[i + j] + carry;
+            out[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        out[i + nb] = (uint32_t)carry;
+    }
+}
+
+// 32 bits of the limb array a starting at bit pos (a must have a limb past them)
+static uint32_t limb_bits(const uint32_t *a, int pos)
+{
+    int w = pos / 32, sh = pos % 32;
+    return sh ? a[w] >> sh | a[w + 1] << (32 - sh) : a[w];
+}
+
+static int biased_exp(double x)
+{
+    uint64_t b;
+    memcpy(&b, &x, sizeof(b));
+    return (int)(b >> 52 & 0x7FF);
+}
+
+// Payne-Hanek for finite ax >= 2^19: ax * 2/pi mod 4 in exact integer
+// arithmetic, using only the 192 bits of 2/pi that can reach the quadrant
+// and the first 128 bits of the fraction
+static int rem_pio2_large(double ax, double *y)
+{
+    uint64_t b;
+    memcpy(&b, &ax, sizeof(b));
+    int s = (int)(b >> 52) - 1075; // ax = mant * 2^s
+    uint64_t mant = (b & 0xFFFFFFFFFFFFFull) | 1ull << 52;
+    uint32_t m[2] = {(uint32_t)mant, (uint32_t)(mant >> 32)};
+
+    // bits b_j .. b_{j+191}; the ones before b_{s-1} only add multiples of 4
+    int j = s >= 2 ? s - 1 : 1;
+    uint32_t w[6];
+    for (int i = 0; i < 6; ++i)
+    {
+        int o = j - 1 + 32 * i, k = o / 32, sh = o % 32;
+        w[5 - i] = sh ? two_over_pi[k] << sh | two_over_pi[k + 1] >> (32 - sh) : two_over_pi[k];
+    }
+    uint32_t p[9];
+    mul_limbs(m, 2, w, 6, p);
+    p[8] = 0;
+    int point = j + 191 - s; // ax * 2/pi = p / 2^point (mod 4)
+    int n = (int)(limb_bits(p, point) & 3);
+    uint32_t f[4];
+    for (int i = 0; i < 4; ++i)
+        f[i] = limb_bits(p, point - 128 + 32 * i);
+
+    // fraction >= 1/2: next quadrant, and r = (f - 1) * pi/2
+    int neg = (int)(f[3] >> 31);
+    if (neg)
+    {
+        n++;
+        uint32_t carry = 1;
+        for (int i = 0; i < 4; ++i)
+        {
+            f[i] = ~f[i] + carry;
+            carry = carry && f[i] == 0;
+        }
+    }
+
+    // normalize f to its top bit, then r = f * pi/2 from the top 128 bits
+    int sh = 0;
+    while (f[3] == 0 && sh < 128)
+    {
+        f[3] = f[2], f[2] = f[1], f[1] = f[0], f[0] = 0;
+        sh += 32;
+    }
+    if (sh == 128)
+    {
+        y[0] = y[1] = 0;
+        return n;
+    }
+    while (!(f[3] & 0x80000000u))
+    {
+        for (int i = 3; i > 0; --i)
+            f[i] = f[i] << 1 | f[i - 1] >> 31;
+        f[0] <<= 1;
+        sh++;
+    }
+    uint32_t q[8];
+    mul_limbs(f, 4, pio2_fixed, 4, q); // r = q[4..7] * 2^(-127-sh)
+    uint64_t hi = (uint64_t)q[7] << 32 | q[6], lo = (uint64_t)q[5] << 32 | q[4];
+    double rh = ldexp((double)(hi & ~0x7FFull), -63 - sh);
+    double rl = ldexp((double)(hi & 0x7FF), -63 - sh) + ldexp((double)lo, -127 - sh);
+    y[0] = rh + rl;
+    y[1] = rl - (y[0] - rh);
+    if (neg)
+    {
+        y[0] = -y[0];
+        y[1] = -y[1];
+    }
+    return n;
+}
+
+// x = n * pi/2 + y[0] + y[1] with |y[0]| <= ~pi/4; returns n & 3. NaN and
+// infinities give y = NaN.
+static int rem_pio2(double x, double *y)
+{
+    double ax = fabs(x);
+    if (ax <= PIO4)
+    {
+        y[0] = x;
+        y[1] = 0;
+        return 0;
+    }
+    if (!isfinite(x))
+    {
+        y[0] = y[1] = x - x;
+        return 0;
+    }
+    if (ax < CODY_WAITE_MAX)
+    {
+        // Cody-Waite on x itself, so there is no branch on its sign; a second
+        // and third piece only when r lost that many bits
+        double t = x * INVPIO2 + ROUND_D;
+        double fn = t - ROUND_D;
+        double r = x - fn * PIO2_1;
+        double w = fn * PIO2_1T;
+        y[0] = r - w;
+        int e = biased_exp(x);
+        if (e - biased_exp(y[0]) > 16)
+        {
+            double u = r;
+            w = fn * PIO2_2;
+            r = u - w;
+            w = fn * PIO2_2T - ((u - r) - w);
+            y[0] = r - w;
+            if (e - biased_exp(y[0]) > 49)
+            {
+                u = r;
+                w = fn * PIO2_3;
+                r = u - w;
+                w = fn * PIO2_3T - ((u - r) - w);
+                y[0] = r - w;
+            }
+        }
+        y[1] = (r - y[0]) - w;
+        uint64_t tb;
+        memcpy(&tb, &t, sizeof(tb));
+        return (int)(tb & 3);
+    }
+    int n = rem_pio2_large(ax, y);
+    if (x < 0)
+    {
+        y[0] = -y[0];
+        y[1] = -y[1];
+        n = -n;
+    }
+    return n & 3;
+}
+
+// Reduction for the short kernels, whose budgets do not need the extra
+// pieces: below 2^19 one Cody-Waite step is off by less than 1e-20.
+static int rem_pio2_short(double x, double *y)
+{
+    if (!(fabs(x) < CODY_WAITE_MAX))
+        return rem_pio2(x, y);
+    double t = x * INVPIO2 + ROUND_D;
+    double fn = t - ROUND_D;
+    y[0] = (x - fn * PIO2_1) - fn * PIO2_1T;
+    y[1] = 0;
+    uint64_t tb;
+    memcpy(&tb, &t, sizeof(tb));
+    return (int)(tb & 3);
+}
+
+// fdlibm __kernel_sin: sin(x + y) for |x| <= ~pi/4, |y| tiny
+static double kernel_sin(double x, double y)
+{
+    static const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03,
+                        S3 = -1.98412698298579493134e-04, S4 = 2.75573137070700676789e-06,
+                        S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+    if (fabs(x) < 0x1p-27)
+        return x;
+    double z = x * x;
+    double v = z * x;
+    double r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+    return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+// fdlibm __kernel_cos: cos(x + y) for |x| <= ~pi/4, |y| tiny
+static double kernel_cos(double x, double y)
+{
+    static const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03,
+                        C3 = 2.48015872894767294178e-05, C4 = -2.75573143513906633035e-07,
+                        C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+    double z = x * x;
+    double w = z * z;
+    double r = z * (C1 + z * (C2 + z * C3)) + w * w * (C4 + z * (C5 + z * C6));
+    double hz = 0.5 * z;
+    w = 1.0 - hz;
+    return w + (((1.0 - w) - hz) + (z * r - x * y));
+}
+
+// Minimax (Remez) fits on |r| <= pi/4, relative error, highest power first:
+// sin(r) = r * P(r^2), cos(r) = Q(r^2). Max |error| of the fit alone:
+// 1e-4 set: sin 1.1e-6, cos 1.2e-5; 1e-7 set: sin 2.3e-9, cos 3.3e-8
+static const double sin_1e4[3] = {0.0081500565568164741, -0.16662382309042026, 0.99999849288729037};
+static const double cos_1e4[3] = {0.040362293944205326, -0.49968548473154045, 0.99998821692153639};
+static const double sin_1e7[4] = {-0.00019501822013114509, 0.0083320164530594244, -0.16666650224239543,
+                                  0.99999999676179807};
+static const double cos_1e7[4] = {-0.0013579404079716163, 0.041654419561762614, -0.49999842434212977,
+                                  0.99999996738628671};
+
+#define HORNER3(c, z) (((c)[0] * (z) + (c)[1]) * (z) + (c)[2])
+#define HORNER4(c, z) ((((c)[0] * (z) + (c)[1]) * (z) + (c)[2]) * (z) + (c)[3])
+
+// Quadrant q of sin: s, c, -s or -c. Random inputs make q unpredictable, so
+// both kernels run and the result is selected instead of branching on q.
+static double quadrant_select(double s, double c, int q)
+{
+    uint64_t sb, cb, mask = 0 - (uint64_t)(q & 1);
+    memcpy(&sb, &s, sizeof(sb));
+    memcpy(&cb, &c, sizeof(cb));
+    sb = (sb & ~mask) | (cb & mask);
+    sb ^= (uint64_t)(q & 2) << 62;
+    memcpy(&s, &sb, sizeof(s));
+    return s;
+}
+
+// Reduce x and evaluate both kernels of level acc; returns the quadrant
+static int sincos_reduced(double x, sin_acc_t acc, double *s, double *c)
+{
+    double y[2];
+    int n;
+    if (acc == SIN_ACC_FULL)
+    {
+        n = rem_pio2(x, y);
+        *s = kernel_sin(y[0], y[1]);
+        *c = kernel_cos(y[0], y[1]);
+    }
+    else
+    {
+        n = rem_pio2_short(x, y);
+        double z = y[0] * y[0];
+        if (acc == SIN_ACC_1E4)
+        {
+            *s = y[0] * HORNER3(sin_1e4, z);
+            *c = HORNER3(cos_1e4, z);
+        }
+        else
+        {
+            *s = y[0] * HORNER4(sin_1e7, z);
+            *c = HORNER4(cos_1e7, z);
+        }
+    }
+    return n;
+}
+
+// sin(x) to the error bound of acc, for any double x
+double my_sin_acc(double x, sin_acc_t acc)
+{
+    double s, c;
+    int n = sincos_reduced(x, acc, &s, &c);
+    return quadrant_select(s, c, n);
+}
+
+// the batch lanes' fallback outside their domain
+static double sin_wide(double x)
+{
+    return my_sin_acc(x, SIN_ACC_FULL);
+}
+
+// cos(x) to the error bound of acc: cos(x) = sin(x + pi/2), one quadrant on
+
+double my_cos_acc(double x, sin_acc_t acc)
+{
+    double s, c;
+    int n = sincos_reduced(x, acc, &s, &c);
+    return quadrant_select(s, c, n + 1);
+}
+
+// Table-driven sin/cos
+//
+// sin_table[k] = sin(k * h) with h = 2*pi / SIN_TABLE_SIZE, filled once by
+// my_sin_table_init; cos reads the same table a quarter period on. x is
+// reduced to a node i and the offset d = x - i*h with the Cody-Waite pieces
+// of pi scaled by the power of two 2/SIN_TABLE_SIZE, which stays exact for
+// i < 2^30 (|x| up to about 6e6 with the default 1024 entries).
+
+#ifndef SIN_TABLE_BITS
+#define SIN_TABLE_BITS 10 // 1024 doubles: 8 KiB, a quarter of a typical L1d
+#endif
+#if SIN_TABLE_BITS < 2 || SIN_TABLE_BITS > 20
+#error "SIN_TABLE_BITS must be in [2, 20]"
+#endif
+#define SIN_TABLE_SIZE (1u << SIN_TABLE_BITS)
+#define SIN_TABLE_MASK (SIN_TABLE_SIZE - 1u)
+#define SIN_TABLE_QUARTER (SIN_TABLE_SIZE / 4u)
+#define SIN_TABLE_STEP (2.0 * PI / SIN_TABLE_SIZE)
+#define SIN_TABLE_INV_STEP (SIN_TABLE_SIZE * INV_PI / 2.0)
+
+typedef enum
+{
+    SIN_TAB_LINEAR, // a straight line between neighbouring entries: |error| <= h^2/8 (4.7e-6 at 1024)
+    SIN_TAB_CUBIC,  // nearest entry, angle addition with sin(d) and cos(d) to d^3: |error| <= (h/2)^4/24 (3.7e-12)
+} sin_tab_t;
+
+static double sin_table[SIN_TABLE_SIZE];
+
+// Fill the table; call once before my_sin_tab or my_sincos
+void my_sin_table_init(void)
+{
+    for (unsigned k = 0; k < SIN_TABLE_SIZE; ++k)
+        sin_table[k] = my_sin_acc(SIN_TABLE_STEP * k, SIN_ACC_FULL);
+}
+
+// Node index (mod SIN_TABLE_SIZE) and offset *d = x - i*h. bias 0 picks the
+// nearest node, 0.5 the one at or below x.
+static unsigned tab_reduce(double x, double bias, double *d)
+{
+    double t = x * SIN_TABLE_INV_STEP - bias + ROUND_D;
+    double s = (t - ROUND_D) * (2.0 / SIN_TABLE_SIZE); // i*h = s*pi, s exact
+    *d = ((x - s * PI_A) - s * PI_B) - s * PI_C;
+    uint64_t tb;
+    memcpy(&tb, &t, sizeof(tb));
+    return (unsigned)tb & SIN_TABLE_MASK;
+}
+
+// sin(x) and cos(x) from one reduction and at most four table reads
+void my_sincos(double x, double *s, double *c, sin_tab_t mode)
+{
+    double d;
+    if (mode == SIN_TAB_LINEAR)
+    {
+        unsigned i = tab_reduce(x, 0.5, &d);
+        unsigned j = (i + SIN_TABLE_QUARTER) & SIN_TABLE_MASK;
+        double f = d * SIN_TABLE_INV_STEP;
+        double s0 = sin_table[i], s1 = sin_table[(i + 1) & SIN_TABLE_MASK];
+        double c0 = sin_table[j], c1 = sin_table[(j + 1) & SIN_TABLE_MASK];
+        *s = s0 + f * (s1 - s0);
+        *c = c0 + f * (c1 - c0);
+        return;
+    }
+    unsigned i = tab_reduce(x, 0, &d);
+    double s0 = sin_table[i], c0 = sin_table[(i + SIN_TABLE_QUARTER) & SIN_TABLE_MASK];
+    double d2 = d * d;
+    double sd = d - d * d2 * (1.0 / 6.0);
+    double cd = 1.0 - 0.5 * d2;
+    *s = s0 * cd + c0 * sd;
+    *c = c0 * cd - s0 * sd;
+}
+
+// sin(x) from the table; |x| up to about 2^30 table steps
+double my_sin_tab(double x, sin_tab_t mode)
+{
+    double d;
+    if (mode == SIN_TAB_LINEAR)
+    {
+        unsigned i = tab_reduce(x, 0.5, &d);
+        double s0 = sin_table[i], s1 = sin_table[(i + 1) & SIN_TABLE_MASK];
+        return s0 + d * SIN_TABLE_INV_STEP * (s1 - s0);
+    }
+    unsigned i = tab_reduce(x, 0, &d);
+    double s0 = sin_table[i], c0 = sin_table[(i + SIN_TABLE_QUARTER) & SIN_TABLE_MASK];
+    double d2 = d * d;
+    return s0 * (1.0 - 0.5 * d2) + c0 * (d - d * d2 * (1.0 / 6.0));
+}
+
+#ifdef SIN_BENCH
+#include <stdlib.h>
+#include <time.h>
+
+#define SIN_BENCH_N (1u << 20) // samples per buffer
+#define SIN_BENCH_REPS 20
+#define SIN_BENCH_RANGE 100.0 // inputs uniform in [-RANGE, RANGE]
+
+static double bench_now(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// ns per element of one of the evaluation loops, and max |error| against libm
+static void bench_report(const char *name, double secs, const double *ref, const double *got, const float *gotf)
+{
+    double err = 0;
+    for (size_t i = 0; i < SIN_BENCH_N; ++i)
+    {
+        double e = fabs((gotf ? (double)gotf[i] : got[i]) - ref[i]);
+        if (e > err)
+            err = e;
+    }
+    printf("%-16s %7.2f ns/elem   max |err| %.3g\n", name, secs * 1e9 / ((double)SIN_BENCH_N * SIN_BENCH_REPS), err);
+}
+
+int main()
+{
+    double *in = malloc(SIN_BENCH_N * sizeof(double));
+    double *ref = malloc(SIN_BENCH_N * sizeof(double));
+    double *reff = malloc(SIN_BENCH_N * sizeof(double));
+    double *out = malloc(SIN_BENCH_N * sizeof(double));
+    float *inf = malloc(SIN_BENCH_N * sizeof(float));
+    float *outf = malloc(SIN_BENCH_N * sizeof(float));
+    if (!in || !ref || !reff || !out || !inf || !outf)
+        return 1;
+    uint64_t s = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < SIN_BENCH_N; ++i)
+    {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        in[i] = ((double)(s >> 11) / 9007199254740992.0 * 2.0 - 1.0) * SIN_BENCH_RANGE;
+        inf[i] = (float)in[i];
+        reff[i] = sin((double)inf[i]); // float input, double reference
+    }
+    printf("%u samples in [-%g, %g], %d lanes (double), %d lanes (float)\n", SIN_BENCH_N, SIN_BENCH_RANGE,
+           SIN_BENCH_RANGE, SIN_LANES, SINF_LANES);
+
+    double t0 = bench_now();
+    for (int r = 0; r < SIN_BENCH_REPS; ++r)
+        for (size_t i = 0; i < SIN_BENCH_N; ++i)
+            ref[i] = sin(in[i]);
+    bench_report("libm sin", bench_now() - t0, ref, ref, NULL);
+
+    t0 = bench_now();
+    for (int r = 0; r < SIN_BENCH_REPS; ++r)
+        for (size_t i = 0; i < SIN_BENCH_N; ++i)
+            out[i] = my_sin(in[i]);
+    bench_report("my_sin loop", bench_now() - t0, ref, out, NULL); // no range reduction: error grows with |x|
+
+    t0 = bench_now();
+    for (int r = 0; r < SIN_BENCH_REPS; ++r)
+        for (size_t i = 0; i < SIN_BENCH_N; ++i)
+            out[i] = sin_lane(in[i]);
+    bench_report("scalar lane loop", bench_now() - t0, ref, out, NULL);
+
+    t0 = bench_now();
+    for (int r = 0; r < SIN_BENCH_REPS; ++r)
+        my_sin_batch(in, out, SIN_BENCH_N);
+    bench_report("my_sin_batch", bench_now() - t0, ref, out, NULL);
+
+    t0 = bench_now();
+    for (int r = 0; r < SIN_BENCH_REPS; ++r)
+        my_sinf_batch(inf, outf, SIN_BENCH_N);
+    bench_report("my_sinf_batch", bench_now() - t0, reff, NULL, outf);
+
+    static const char *const acc_names[] = {"my_sin_acc 1e-4", "my_sin_acc 1e-7", "my_sin_acc full"};
+    for (int a = SIN_ACC_1E4; a <= SIN_ACC_FULL; ++a)
+    {
+        t0 = bench_now();
+        for (int r = 0; r < SIN_BENCH_REPS; ++r)
+            for (size_t i = 0; i < SIN_BENCH_N; ++i)
+                out[i] = my_sin_acc(in[i], (sin_acc_t)a);
+        bench_report(acc_names[a], bench_now() - t0, ref, out, NULL);
+    }
+
+    my_sin_table_init();
+    static const char *const tab_names[] = {"my_sin_tab lin", "my_sin_tab cubic"};
+    for (int m = SIN_TAB_LINEAR; m <= SIN_TAB_CUBIC; ++m)
+    {
+        t0 = bench_now();
+        for (int r = 0; r < SIN_BENCH_REPS; ++r)
+            for (size_t i = 0; i < SIN_BENCH_N; ++i)
+                out[i] = my_sin_tab(in[i], (sin_tab_t)m);
+        bench_report(tab_names[m], bench_now() - t0, ref, out, NULL);
+    }
+
+    // my_sincos: sin goes to out, cos to reff (the float reference is done with)
+    static const char *const sincos_names[] = {"my_sincos lin", "my_sincos cubic"};
+    for (int m = SIN_TAB_LINEAR; m <= SIN_TAB_CUBIC; ++m)
+    {
+        t0 = bench_now();
+        for (int r = 0; r < SIN_BENCH_REPS; ++r)
+            for (size_t i = 0; i < SIN_BENCH_N; ++i)
+                my_sincos(in[i], &out[i], &reff[i], (sin_tab_t)m);
+        double secs = bench_now() - t0, cerr = 0;
+        for (size_t i = 0; i < SIN_BENCH_N; ++i)
+            if (fabs(reff[i] - cos(in[i])) > cerr)
+                cerr = fabs(reff[i] - cos(in[i]));
+        bench_report(sincos_names[m], secs, ref, out, NULL);
+        printf("%-16s %7s           max |err| %.3g (cos)\n", "", "", cerr);
+    }
+
+    free(in);
+    free(ref);
+    free(reff);
+    free(out);
+    free(inf);
+    free(outf);
+    return 0;
+}
+#elif defined(SIN_ULP)
+#include <stdlib.h>
+
+// Error of my_sin_acc / my_cos_acc and of the table modes against long
+// double sinl / cosl, per level and input range; exits 1 if one misses its
+// bound.
+
+#define SIN_ULP_N 200000 // samples per level, function and range
+
+static uint64_t ulp_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t ulp_next(void)
+{
+    ulp_rng ^= ulp_rng << 13;
+    ulp_rng ^= ulp_rng >> 7;
+    ulp_rng ^= ulp_rng << 17;
+    return ulp_rng;
+}
+
+// uniform in [-range, range]; range 0: any finite double (uniform bits)
+static double ulp_sample(double range)
+{
+    if (range > 0)
+        return ((double)(ulp_next() >> 11) / 9007199254740992.0 * 2.0 - 1.0) * range;
+    for (;;)
+    {
+        uint64_t b = ulp_next();
+        double x;
+        memcpy(&x, &b, sizeof(x));
+        if (isfinite(x))
+            return x;
+    }
+}
+
+typedef struct
+{
+    double max_ulp, sum_ulp, max_abs;
+    size_t n;
+} ulp_stats_t;
+
+static void ulp_add(ulp_stats_t *st, double got, long double ref)
+{
+    double r = (double)ref;
+    int e = r == 0 ? -1074 : ilogb(r) - 52;
+    double ulp = ldexp(1.0, e < -1074 ? -1074 : e);
+    double abs_err = (double)fabsl((long double)got - ref);
+    double u = abs_err / ulp;
+    if (u > st->max_ulp)
+        st->max_ulp = u;
+    if (abs_err > st->max_abs)
+        st->max_abs = abs_err;
+    st->sum_ulp += u;
+    st->n++;
+}
+
+// Within the level's bound: < 1 ulp for full, else max |error| below 1e-4 / 1e-7
+static int ulp_ok(const ulp_stats_t *st, sin_acc_t acc)
+{
+    return acc == SIN_ACC_FULL ? st->max_ulp < 1.0 : st->max_abs < (acc == SIN_ACC_1E4 ? 1e-4 : 1e-7);
+}
+
+static int ulp_print(const char *level, const char *fn, const char *range, const ulp_stats_t *st, sin_acc_t acc)
+{
+    int ok = ulp_ok(st, acc);
+    printf("%-5s %-3s %-12s max %12.4g ulp  mean %10.4g ulp  max |err| %.3g  %s\n", level, fn, range, st->max_ulp,
+           st->sum_ulp / (double)st->n, st->max_abs, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main()
+{
+    static const char *const level_names[] = {"1e-4", "1e-7", "full"};
+    static const struct
+    {
+        const char *name;
+        double range;
+    } ranges[] = {{"|x|<=pi/4", PIO4}, {"|x|<=100", 100.0}, {"|x|<=2^19", CODY_WAITE_MAX},
+                  {"|x|<=1e9", 1e9}, {"any finite", 0}};
+    // inputs that come closest to a multiple of pi/2, and quadrant edges
+    static const double hard[] = {0x1.6ac5b262ca1ffp+849, 6381956970095103.0 * 0x1p797, 0x1.921fb54442d18p+0,
+                                  0x1.921fb54442d18p+1, 0x1.921fb54442d18p-1, 1e22, 0x1.fffffffffffffp+1023,
+                                  CODY_WAITE_MAX, -CODY_WAITE_MAX, 0x1p-1074, -0.0};
+    int ok = 1;
+
+    for (int a = SIN_ACC_1E4; a <= SIN_ACC_FULL; ++a)
+    {
+        for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r)
+        {
+            ulp_stats_t ss = {0}, cs = {0};
+            for (int i = 0; i < SIN_ULP_N; ++i)
+            {
+                double x = ulp_sample(ranges[r].range);
+                ulp_add(&ss, my_sin_acc(x, (sin_acc_t)a), sinl((long double)x));
+                ulp_add(&cs, my_cos_acc(x, (sin_acc_t)a), cosl((long double)x));
+            }
+            ok &= ulp_print(level_names[a], "sin", ranges[r].name, &ss, (sin_acc_t)a);
+            ok &= ulp_print(level_names[a], "cos", ranges[r].name, &cs, (sin_acc_t)a);
+        }
+        ulp_stats_t ss = {0}, cs = {0};
+        for (size_t i = 0; i < sizeof(hard) / sizeof(hard[0]); ++i)
+        {
+            ulp_add(&ss, my_sin_acc(hard[i], (sin_acc_t)a), sinl((long double)hard[i]));
+            ulp_add(&cs, my_cos_acc(hard[i], (sin_acc_t)a), cosl((long double)hard[i]));
+        }
+        ok &= ulp_print(level_names[a], "sin", "hard cases", &ss, (sin_acc_t)a);
+        ok &= ulp_print(level_names[a], "cos", "hard cases", &cs, (sin_acc_t)a);
+    }
+
+    // table modes over the ranges up to 2^19, where their reduction is exact
+    my_sin_table_init();
+    double h = SIN_TABLE_STEP;
+    static const char *const tab_names[] = {"lin", "cubic"};
+    const double tab_bound[] = {h * h / 8 + 2e-15, pow(h / 2, 4) / 24 + 2e-15};
+    for (int m = SIN_TAB_LINEAR; m <= SIN_TAB_CUBIC; ++m)
+        for (size_t r = 0; r < 3; ++r)
+        {
+            ulp_stats_t ts = {0}, ss = {0}, cs = {0};
+            for (int i = 0; i < SIN_ULP_N; ++i)
+            {
+                double x = ulp_sample(ranges[r].range), s, c;
+                my_sincos(x, &s, &c, (sin_tab_t)m);
+                ulp_add(&ts, my_sin_tab(x, (sin_tab_t)m), sinl((long double)x));
+                ulp_add(&ss, s, sinl((long double)x));
+                ulp_add(&cs, c, cosl((long double)x));
+            }
+            const ulp_stats_t *all[] = {&ts, &ss, &cs};
+            static const char *const fns[] = {"tab", "sin", "cos"};
+            for (int f = 0; f < 3; ++f)
+            {
+                int within = all[f]->max_abs <= tab_bound[m];
+                printf("%-5s %-3s %-12s max %12.4g ulp  mean %10.4g ulp  max |err| %.3g  %s\n", tab_names[m], fns[f],
+                       ranges[r].name, all[f]->max_ulp, all[f]->sum_ulp / (double)all[f]->n, all[f]->max_abs,
+                       within ? "ok" : "FAIL");
+                ok &= within;
+            }
+        }
+
+    // batch: <= 2.5 ulp (double) and |error| <= 1.5e-7 (float) in the lanes'
+    // domain, the my_sin_acc bound past it; whole buffers so the vector
+    // blocks run, and a mixed buffer so some blocks fall back
+    static double xb[SIN_ULP_N], yb[SIN_ULP_N];
+    static float xf[SIN_ULP_N], yf[SIN_ULP_N];
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r)
+    {
+        ulp_stats_t bs = {0}, fs = {0};
+        for (int i = 0; i < SIN_ULP_N; ++i)
+        {
+            xb[i] = ulp_sample(ranges[r].range);
+            do
+                xf[i] = (float)ulp_sample(ranges[r].range);
+            while (isinf(xf[i]));
+        }
+        my_sin_batch(xb, yb, SIN_ULP_N);
+        my_sinf_batch(xf, yf, SIN_ULP_N);
+        for (int i = 0; i < SIN_ULP_N; ++i)
+        {
+            ulp_add(&bs, yb[i], sinl((long double)xb[i]));
+            ulp_add(&fs, yf[i], sinl((long double)xf[i]));
+        }
+        int within = bs.max_ulp <= 2.5;
+        printf("%-5s %-3s %-12s max %12.4g ulp  mean %10.4g ulp  max |err| %.3g  %s\n", "batch", "sin",
+               ranges[r].name, bs.max_ulp, bs.sum_ulp / (double)bs.n, bs.max_abs, within ? "ok" : "FAIL");
+        ok &= within;
+        within = fs.max_abs <= 1.5e-7;
+        printf("%-5s %-3s %-12s %22s  max |err| %.3g  %s\n", "batch", "sinf", ranges[r].name, "", fs.max_abs,
+               within ? "ok" : "FAIL");
+        ok &= within;
+    }
+    static const double wide[] = {1e17, 1e18, 1e20, -1e12, 0.5, SIN_BATCH_MAX, -0x1.dcd64fffffffp+29, 1e22, 2.0,
+                                  -3.0, 0x1.fffffffffffffp+1023, 100.0, 0x1.6ac5b262ca1ffp+849, -1e9, 7.0, 1e300};
+    ulp_stats_t ws = {0};
+    my_sin_batch(wide, yb, sizeof(wide) / sizeof(wide[0]));
+    for (size_t i = 0; i < sizeof(wide) / sizeof(wide[0]); ++i)
+        ulp_add(&ws, yb[i], sinl((long double)wide[i]));
+    ok &= ulp_print("batch", "sin", "mixed |x|", &ws, SIN_ACC_FULL);
+
+    // signed zero and non-finite inputs, through the vector blocks and the tail
+    static const double zd[] = {-0.0, 0.0, -0.0, INFINITY, NAN};
+    static const float zf[] = {-0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, -INFINITY, NAN};
+    double zdy[5];
+    float zfy[11];
+    my_sin_batch(zd, zdy, 5);
+    my_sinf_batch(zf, zfy, 11);
+    for (int i = 0; i < 3; ++i)
+        ok &= zdy[i] == 0 && !signbit(zdy[i]) == !signbit(zd[i]);
+    for (int i = 0; i < 9; ++i)
+        ok &= zfy[i] == 0 && !signbit(zfy[i]) == !signbit(zf[i]);
+    ok &= isnan(zdy[3]) && isnan(zdy[4]) && isnan(zfy[9]) && isnan(zfy[10]);
+    ok &= signbit(my_sin_acc(-0.0, SIN_ACC_FULL)) && isnan(my_sin_acc(INFINITY, SIN_ACC_FULL)) &&
+          isnan(my_cos_acc(NAN, SIN_ACC_1E4));
+    puts(ok ? "all levels within bounds" : "FAILED");
+    return ok ? 0 : 1;
+}
+#else
 int main()
 {
     double angle = PI / 6; // 30 degrees in radians
     printf("sin(%f) = %f\n", angle, my_sin(angle));
+
+    double buf[5] = {0, PI / 6, PI / 2, 3 * PI / 2, 100.0};
+    my_sin_batch(buf, buf, 5);
+    printf("batch: %f %f %f %f %f\n", buf[0], buf[1], buf[2], buf[3], buf[4]);
+
+    double big = 1e22; // far past where the Taylor series is any use
+    printf("sin(1e22): 1e-4 %f, 1e-7 %f, full %.17g (libm %.17g)\n", my_sin_acc(big, SIN_ACC_1E4),
+           my_sin_acc(big, SIN_ACC_1E7), my_sin_acc(big, SIN_ACC_FULL), sin(big));
+
+    double s, c;
+    my_sin_table_init();
+    my_sincos(PI / 3, &s, &c, SIN_TAB_CUBIC);
+    printf("table sincos(pi/3) = %f, %f\n", s, c);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,208 @@
+/*
+  Compile-time perfect-hash dispatch: uint32_t -> function pointer (fp_t)
+  for key sets fixed at build time (e.g. command IDs), as a read-only
+  replacement for a u32map_t filled at startup and never changed again.
+
+    - the key set is one X-macro list, DISPATCH_TABLE(X), of X(key, fn)
+    - slot(key) = (key * DISPATCH_MULT mod 2^32) >> (32 - DISPATCH_BITS)
+    - the table is a static const array built with designated
+      initializers, so it lives in .rodata and needs no map_insert calls
+    - map_find is one multiply, one shift, one load and one compare
+    - a collision (or a duplicate key) is a compile error: every slot
+      becomes a case label of one switch, and C forbids duplicates
+
+  DISPATCH_MULT/DISPATCH_BITS come from the generator mode of this file,
+  which searches for the smallest collision-free table:
+
+      gcc -std=c99 -O2 -DDISPATCH_GEN perfect_dispatch.c -o dispatch_gen
+      ./dispatch_gen          (prints the -D flags, e.g. for a Makefile)
+
+  Compile:
+      gcc -std=c99 -O2 perfect_dispatch.c -o perfect_dispatch
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef void (*fp_t)(void);
+
+#ifndef DISPATCH_GEN
+/* sample functions */
+
+/**
+ * @brief Example function for map values: prints "hello".
+ */
+static void say_hello(void) { puts("hello"); }
+
+/**
+ * @brief Example function for map values: prints "goodbye".
+ */
+static void say_goodbye(void) { puts("goodbye"); }
+
+/**
+ * @brief Example function for map values: prints "status".
+ */
+static void say_status(void) { puts("status"); }
+
+/**
+ * @brief Example function for map values: prints "reset".
+ */
+static void say_reset(void) { puts("reset"); }
+#endif
+
+/* The static key set: X(key, function) */
+#define DISPATCH_TABLE(X) \
+    X(10, say_hello)      \
+    X(20, say_goodbye)    \
+    X(30, say_status)     \
+    X(40, say_reset)      \
+    X(1001, say_status)   \
+    X(0xBEEF, say_hello)
+
+/* Keep in sync with DISPATCH_TABLE by re-running the generator */
+#ifndef DISPATCH_MULT
+#define DISPATCH_MULT 0xB8E8AB15u
+#endif
+#ifndef DISPATCH_BITS
+#define DISPATCH_BITS 3
+#endif
+
+#define DISPATCH_MAX_BITS 16 /* largest table the generator considers */
+
+#if DISPATCH_BITS < 1 || DISPATCH_BITS > DISPATCH_MAX_BITS
+#error "DISPATCH_BITS must be in [1, DISPATCH_MAX_BITS]"
+#endif
+
+#define DISPATCH_SIZE (1u << DISPATCH_BITS)
+#define DISPATCH_SLOT(k) ((uint32_t)((uint32_t)(k) * (uint32_t)(DISPATCH_MULT)) >> (32 - DISPATCH_BITS))
+
+#ifndef DISPATCH_GEN
+
+typedef struct
+{
+    uint32_t key;
+    fp_t fn; /* NULL for an empty slot */
+} dispatch_slot_t;
+
+#define DISPATCH_ENTRY(k, f) [DISPATCH_SLOT(k)] = {(uint32_t)(k), f},
+static const dispatch_slot_t dispatch_table[DISPATCH_SIZE] = {DISPATCH_TABLE(DISPATCH_ENTRY)};
+#undef DISPATCH_ENTRY
+
+/**
+ * @brief Never called: fails to compile if two keys share a slot.
+ *
+ * A collision would make two case labels equal, which is a constraint
+ * violation; re-run the generator after changing DISPATCH_TABLE.
+ */
+#define DISPATCH_CASE(k, f) case DISPATCH_SLOT(k):
+static inline int dispatch_collision_check(uint32_t slot)
+{
+    switch (slot)
+    {
+        DISPATCH_TABLE(DISPATCH_CASE)
+        return 1;
+    default:
+        return 0;
+    }
+}
+#undef DISPATCH_CASE
+
+/**
+ * @brief Find a function pointer value by key.
+ *
+ * @param key Key to find.
+ * @return fp_t Function pointer stored or NULL if key is not in the set.
+ */
+static inline fp_t map_find(uint32_t key)
+{
+    const dispatch_slot_t *s = &dispatch_table[DISPATCH_SLOT(key)];
+    return s->key == key ? s->fn : NULL;
+}
+
+/**
+ * @brief Return number of keys in the set.
+ */
+#define DISPATCH_ONE(k, f) +1
+static size_t map_size(void) { return 0 DISPATCH_TABLE(DISPATCH_ONE); }
+#undef DISPATCH_ONE
+
+int main(void)
+{
+    printf("map size: %zu, %u slots in read-only data\n", map_size(), DISPATCH_SIZE);
+
+    /* lookup and call */
+    fp_t f = map_find(10);
+    if (f)
+        f();
+    f = map_find(0xBEEF);
+    if (f)
+        f();
+    printf("find 11: %s\n", map_find(11) ? "found" : "(null)");
+
+    /* iterate in slot order and call each function */
+    printf("slot-order traversal (key -> call value):\n");
+    for (uint32_t i = 0; i < DISPATCH_SIZE; ++i)
+    {
+        if (!dispatch_table[i].fn)
+            continue;
+        printf("  %" PRIu32 " -> ", dispatch_table[i].key);
+        dispatch_table[i].fn();
+    }
+    return 0;
+}
+
+#else /* DISPATCH_GEN: search DISPATCH_MULT/DISPATCH_BITS for DISPATCH_TABLE */
+
+#define DISPATCH_KEY(k, f) (uint32_t)(k),
+static const uint32_t gen_keys[] = {DISPATCH_TABLE(DISPATCH_KEY)};
+#undef DISPATCH_KEY
+#define GEN_N (sizeof(gen_keys) / sizeof(gen_keys[0]))
+#define GEN_TRIES 1000000 /* multipliers tried per table size */
+
+/**
+ * @brief Return non-zero if mult/bits map every key to its own slot.
+ */
+static int gen_collision_free(uint32_t mult, int bits)
+{
+    static uint32_t seen[1u << DISPATCH_MAX_BITS];
+    static uint32_t stamp;
+    stamp++;
+    for (size_t i = 0; i < GEN_N; ++i)
+    {
+        uint32_t s = (uint32_t)(gen_keys[i] * mult) >> (32 - bits);
+        if (seen[s] == stamp)
+            return 0;
+        seen[s] = stamp;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    int bits = 1;
+    while ((1u << bits) < GEN_N)
+        bits++;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (; bits <= DISPATCH_MAX_BITS; ++bits)
+    {
+        uint32_t mult = 0x9E3779B1u; /* golden-ratio multiplier first, then odd random ones */
+        for (long t = 0; t < GEN_TRIES; ++t)
+        {
+            if (gen_collision_free(mult, bits))
+            {
+                printf("-DDISPATCH_MULT=0x%08" PRIX32 "u -DDISPATCH_BITS=%d\n", mult, bits);
+                fprintf(stderr, "%zu keys in %u slots\n", (size_t)GEN_N, 1u << bits);
+                return 0;
+            }
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            mult = (uint32_t)x | 1u;
+        }
+    }
+    fprintf(stderr, "no collision-free multiplier up to 2^%d slots\n", DISPATCH_MAX_BITS);
+    return 1;
+}
+
+#endif /* DISPATCH_GEN */